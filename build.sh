@@ -1,7 +1,11 @@
 cd src
 # gcc main.c smoothing.c gdalShortcut.c -o ../main $(gdal-config --cflags) $(gdal-config --libs) -lm -lopen
-gcc main.c transformation.c smoothing.c gdalShortcut.c -o ../main $(gdal-config --cflags) $(gdal-config --libs) -lm
+gcc -O2 -fopenmp -fno-trapping-math -pthread main.c simulation.c worker.c ensemble.c checkpoint.c snapshot.c json.c flowKernel.c pumping.c telemetry.c outOfCore.c multigrid.c depression.c stats.c gauges.c rainGrid.c domain.c terrainFile.c tileRenderer.c transformation.c smoothing.c gdalShortcut.c -o ../main $(gdal-config --cflags) $(gdal-config --libs) -lm
+gcc -O2 -fopenmp -fno-trapping-math -pthread bench.c flowKernel.c pumping.c smoothing.c gdalShortcut.c json.c -o ../bench $(gdal-config --cflags) $(gdal-config --libs) -lm
+gcc -O2 -fopenmp -pthread pumpLogToCsv.c telemetry.c pumping.c -o ../pumplog2csv $(gdal-config --cflags) $(gdal-config --libs) -lm
+gcc -O2 -fno-trapping-math depressionCheck.c depression.c -o ../depression_check $(gdal-config --cflags) $(gdal-config --libs) -lm
 cd ../
+./depression_check || exit 1
 mkdir -p result
-time ./main data/dem.tif data/lahan.tif result/result_build_test.tif result/pump_log_build_test.csv 0,2.5,0,5.0 15,15,15,15 5,5,5,5 -7.5200680748355 112.70477092805535 -7.520508553989 112.70464135101226 4000 0.5 5
+time ./main --threads 0 data/dem.tif data/lahan.tif result/result_build_test.tif result/pump_log_build_test.csv 0,2.5,0,5.0 15,15,15,15 5,5,5,5 -7.5200680748355 112.70477092805535 -7.520508553989 112.70464135101226 4000 0.5 5
 # time ./main data/tess5.tif data/lahan.tif 300
@@ -0,0 +1,201 @@
+import { createHash } from "crypto";
+import { copyFile, link, mkdir, readdir, readFile, rename, rm, stat, utimes, writeFile } from "fs/promises";
+import path from "path";
+
+// JSON dengan key object terurut, jadi urutan field di body tidak mengubah hash
+export function canonicalJson(value) {
+    if (Array.isArray(value)) {
+        return `[${value.map((v) => canonicalJson(v ?? null)).join(",")}]`;
+    }
+    if (value !== null && typeof value === "object") {
+        const fields = Object.keys(value).sort()
+            .filter((k) => value[k] !== undefined)
+            .map((k) => `${JSON.stringify(k)}:${canonicalJson(value[k])}`);
+        return `{${fields.join(",")}}`;
+    }
+    return JSON.stringify(value);
+}
+
+async function treeBytes(dir) {
+    let bytes = 0;
+    for (const entry of await readdir(dir, { withFileTypes: true })) {
+        const p = path.join(dir, entry.name);
+        bytes += entry.isDirectory() ? await treeBytes(p) : (await stat(p)).size;
+    }
+    return bytes;
+}
+
+// Hard link src ke dst (copy kalau beda filesystem). dst lama di-unlink dulu,
+// jangan ditimpa isinya: bisa jadi link ke entry cache lain.
+export async function linkFile(src, dst) {
+    await mkdir(path.dirname(dst), { recursive: true });
+    await rm(dst, { force: true });
+    try {
+        await link(src, dst);
+    } catch {
+        await copyFile(src, dst);
+    }
+}
+
+export async function linkTree(src, dst) {
+    await mkdir(dst, { recursive: true });
+    for (const entry of await readdir(src, { withFileTypes: true })) {
+        const from = path.join(src, entry.name), to = path.join(dst, entry.name);
+        if (entry.isDirectory()) await linkTree(from, to);
+        else await linkFile(from, to);
+    }
+}
+
+// Ganti seluruh isi dst dengan link ke src. Dirakit di direktori sementara
+// lalu di-rename, jadi file lama di dst (mis. tile basah dari skenario
+// sebelumnya yang tidak ditulis ulang karena kering) tidak tertinggal.
+export async function replaceTree(src, dst) {
+    const tmp = `${dst}.tmp-${process.pid}-${Math.random().toString(36).slice(2)}`;
+    try {
+        await linkTree(src, tmp);
+        await rm(dst, { recursive: true, force: true });
+        await rename(tmp, dst);
+    } catch (e) {
+        await rm(tmp, { recursive: true, force: true });
+        throw e;
+    }
+}
+
+// Cache hasil simulasi di disk, dialamati hash skenario + identitas input
+// (DEM, landuse dan binary yang dimuat worker, file yang dibaca per run).
+// Satu direktori per key berisi output run dan
+// meta.json; total ukurannya dibatasi maxBytes, entry yang paling lama tidak
+// dipakai dibuang lebih dulu. Request yang key-nya sedang dijalankan
+// menunggu run yang sama (coalescing), bukan menjalankan ulang.
+export class ResultCache {
+    constructor({ dir, maxBytes, inputs }) {
+        this.dir = dir;
+        this.maxBytes = maxBytes;
+        this.inputs = inputs; // file yang dibaca ulang tiap run
+        this.entries = new Map(); // key -> { bytes, meta }, urutan = LRU
+        this.pending = new Map(); // key -> Promise run yang sedang jalan
+        this.pins = new Map(); // key -> jumlah response yang sedang memakai
+        this.bytes = 0;
+        this.ready = this.load();
+    }
+
+    // entry dari run sebelumnya; sisa run yang terputus (*.tmp-*) dibuang
+    async load() {
+        await mkdir(this.dir, { recursive: true });
+        const found = [];
+        for (const entry of await readdir(this.dir, { withFileTypes: true })) {
+            const p = path.join(this.dir, entry.name);
+            if (!entry.isDirectory()) continue;
+            if (entry.name.includes(".tmp-")) {
+                await rm(p, { recursive: true, force: true });
+                continue;
+            }
+            try {
+                const metaFile = path.join(p, "meta.json");
+                const meta = JSON.parse(await readFile(metaFile, "utf8"));
+                found.push({ key: entry.name, meta, used: (await stat(metaFile)).mtimeMs });
+            } catch {
+                await rm(p, { recursive: true, force: true });
+            }
+        }
+        found.sort((a, b) => a.used - b.used);
+        for (const { key, meta } of found) {
+            this.entries.set(key, { bytes: meta.bytes, meta });
+            this.bytes += meta.bytes;
+        }
+        await this.evict();
+        console.log(`Result cache: ${this.entries.size} entries, ${(this.bytes / 1048576).toFixed(1)} MB`);
+    }
+
+    // loaded: identitas yang dimuat worker yang akan menjalankan skenario
+    // (WorkerPool.identity), bukan file di disk saat ini: worker lama tetap
+    // memakai binary dan terrain lama sampai di-restart. Input per run
+    // (ukuran + mtime) dibaca ulang per request.
+    async key(scenario, loaded) {
+        const inputs = [];
+        for (const file of this.inputs) {
+            try {
+                const s = await stat(file);
+                inputs.push([file, s.size, s.mtimeMs]);
+            } catch {
+                inputs.push([file, null]);
+            }
+        }
+        return createHash("sha256").update(canonicalJson({ scenario, loaded, inputs })).digest("hex");
+    }
+
+    path(key, ...parts) {
+        return path.join(this.dir, key, ...parts);
+    }
+
+    // Entry untuk key, dijalankan lewat produce(tmpDir) kalau belum ada.
+    // produce menulis output ke tmpDir dan mengembalikan meta; meta dengan
+    // status selain "success" dikembalikan tapi tidak disimpan. Hasilnya
+    // { meta, source: "hit" | "miss" | "coalesced" }. Key di-pin sampai
+    // release(key), juga kalau get gagal, supaya entry tidak dibuang selagi
+    // dipakai.
+    async get(key, produce) {
+        await this.ready;
+        this.pin(key);
+        const hit = this.entries.get(key);
+        if (hit) {
+            this.entries.delete(key);
+            this.entries.set(key, hit);
+            const now = new Date();
+            utimes(this.path(key, "meta.json"), now, now).catch(() => {});
+            return { meta: hit.meta, source: "hit" };
+        }
+        let run = this.pending.get(key);
+        const source = run ? "coalesced" : "miss";
+        if (!run) {
+            run = this.fill(key, produce).finally(() => this.pending.delete(key));
+            this.pending.set(key, run);
+        }
+        return { meta: await run, source };
+    }
+
+    async fill(key, produce) {
+        const tmp = path.join(this.dir, `${key}.tmp-${process.pid}-${Math.random().toString(36).slice(2)}`);
+        await mkdir(tmp, { recursive: true });
+        let meta;
+        try {
+            meta = await produce(tmp);
+            if (meta.status !== "success") {
+                await rm(tmp, { recursive: true, force: true });
+                return meta;
+            }
+            meta.bytes = await treeBytes(tmp);
+            await writeFile(path.join(tmp, "meta.json"), JSON.stringify(meta));
+            await rm(this.path(key), { recursive: true, force: true });
+            await rename(tmp, this.path(key));
+        } catch (e) {
+            await rm(tmp, { recursive: true, force: true });
+            throw e;
+        }
+        this.entries.set(key, { bytes: meta.bytes, meta });
+        this.bytes += meta.bytes;
+        await this.evict();
+        return meta;
+    }
+
+    pin(key) {
+        this.pins.set(key, (this.pins.get(key) || 0) + 1);
+    }
+
+    release(key) {
+        const n = (this.pins.get(key) || 0) - 1;
+        if (n > 0) this.pins.set(key, n);
+        else this.pins.delete(key);
+        this.evict().catch((e) => console.error(`Result cache: ${e.message}`));
+    }
+
+    async evict() {
+        for (const [key, entry] of this.entries) {
+            if (this.bytes <= this.maxBytes) break;
+            if (this.pins.has(key)) continue;
+            this.entries.delete(key);
+            this.bytes -= entry.bytes;
+            await rm(this.path(key), { recursive: true, force: true });
+        }
+    }
+}
@@ -52,11 +52,11 @@ echo "Mulai simulasi dengan curah hujan $RAIN_MM mm"
 
 # Mempersiapkan argumen pumpradius hanya jika diisi
 if [ -z "$PUMP_RADIUS" ]; then
-    $PROGRAM_TO_RUN "$DEM" "$LANDUSE" "$OUTPUT_TIF" "$OUTPUT_PUMP" \
+    $PROGRAM_TO_RUN --tiles "$OUTPUT_TILES" "$DEM" "$LANDUSE" "$OUTPUT_TIF" "$OUTPUT_PUMP" \
         "$RAIN_MM" "$INTERVAL_MIN" "$ITER" "$PUMP_IN_LAT" "$PUMP_IN_LON" \
         "$PUMP_OUT_LAT" "$PUMP_OUT_LON" "$PUMP_CAPACITY" "$PUMP_THRESHOLD"
 else
-    $PROGRAM_TO_RUN "$DEM" "$LANDUSE" "$OUTPUT_TIF" "$OUTPUT_PUMP" \
+    $PROGRAM_TO_RUN --tiles "$OUTPUT_TILES" "$DEM" "$LANDUSE" "$OUTPUT_TIF" "$OUTPUT_PUMP" \
         "$RAIN_MM" "$INTERVAL_MIN" "$ITER" "$PUMP_IN_LAT" "$PUMP_IN_LON" \
         "$PUMP_OUT_LAT" "$PUMP_OUT_LON" "$PUMP_CAPACITY" "$PUMP_THRESHOLD" "$PUMP_RADIUS"
 fi
@@ -66,16 +66,6 @@ if [ $? -ne 0 ]; then
     exit 1
 fi
 
+# tiles dibuat langsung oleh ./main (--tiles); ./tiles.sh masih bisa dipakai
+# sebagai alternatif berbasis GDAL
 echo "Simulasi selesai"
-echo "Mulai Tiling"
-
-gdal_translate -of VRT -ot Byte -scale 0 3 "$OUTPUT_TIF" result/result.vrt
-gdaldem color-relief result/result.vrt colormap/jet.clr result/output.tif -alpha
-
-rm -rf "$OUTPUT_TILES"
-gdal2tiles.py -z 12-17 --resampling=bilinear --xyz result/output.tif "$OUTPUT_TILES"
-
-rm -rf result/output.tif
-rm -rf result/result.vrt
-
-echo "Selesai"
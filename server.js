@@ -1,10 +1,53 @@
 import express from "express";
-import { execFile } from "child_process";
+import { readFile } from "fs/promises";
+import os from "os";
 import path from "path";
 import cors from "cors";
+import { WorkerPool } from "./workerPool.js";
+import { ResultCache, linkFile, replaceTree } from "./resultCache.js";
 
 const app = express();
 
+// Worker simulasi: DEM & landuse dimuat sekali per worker, bukan per request
+const WORKERS = Number(process.env.FLOODSIM_WORKERS) || 2;
+const THREADS = Number(process.env.FLOODSIM_THREADS) ||
+    Math.max(1, Math.floor(os.cpus().length / WORKERS));
+// terrain hasil --compile-terrain: worker memetakan file yang sama, jadi
+// halamannya dipakai bersama lewat page cache, bukan disalin per worker
+const TERRAIN = process.env.FLOODSIM_TERRAIN;
+const TERRAIN_ARGS = TERRAIN ? [TERRAIN, "-"] : ["data/dem.tif", "data/lahan.tif"];
+const pool = new WorkerPool({
+    size: WORKERS,
+    command: "./main",
+    args: ["--worker", "--threads", String(THREADS), ...TERRAIN_ARGS],
+    cwd: process.cwd(),
+    // dimuat sekali per worker; worker di-restart kalau file ini berubah
+    inputs: [...TERRAIN_ARGS.filter((f) => f !== "-"), "main"],
+    // request di atas ini ditolak 503, bukan antre tanpa batas
+    maxQueue: Number(process.env.FLOODSIM_MAX_QUEUE) || 32,
+});
+
+// Cache hasil: skenario yang sama (termasuk DEM, landuse dan binary yang
+// sama) langsung dijawab dari result/cache tanpa simulasi ulang
+const cache = new ResultCache({
+    dir: process.env.FLOODSIM_CACHE_DIR || "result/cache",
+    maxBytes: (process.env.FLOODSIM_CACHE_MB !== undefined ? Number(process.env.FLOODSIM_CACHE_MB) : 2048) * 1048576,
+    // colour map default worker, dibaca tiap render: warna tile ikut hasil
+    inputs: ["colormap/jet.clr"],
+});
+
+// statistik run (NDJSON dari --stats): satu objek "step" per step + satu "run"
+function parseStats(text) {
+    const stats = { run: null, steps: [] };
+    for (const line of text.split("\n")) {
+        if (!line.trim()) continue;
+        const obj = JSON.parse(line);
+        if (obj.type === "run") stats.run = obj;
+        else if (obj.type === "step") stats.steps.push(obj);
+    }
+    return stats;
+}
+
 const corsOptions = {
     origin: function (origin, callback) {
         if (process.env.NODE_ENV != "production") {
@@ -35,7 +78,7 @@ app.use("/result", express.static(path.join(process.cwd(), "result"), {
 }))
 
 app.post("/simulate", (req, res) => {
-    const { output_tif, pump_log, tiles_dir, rain_timeseries, pumps } = req.body;
+    const { output_tif, pump_log, tiles_dir, rain_timeseries, pumps, gauges, estimate } = req.body;
 
     // Validasi field wajib
     if (!pump_log || !tiles_dir) {
@@ -75,91 +118,115 @@ app.post("/simulate", (req, res) => {
         }
     }
 
-    // Konversi rain_timeseries ke format string lama
-    const rain_mm = rain_timeseries.map(r => r.mm).join(",");
-    const interval_min = rain_timeseries.map(r => r.interval).join(",");
-    const iter = rain_timeseries.map(r => r.iter).join(",");
-
-    // Safety pump set to 0 is no pump
-    let pump_in_lat = 0;
-    let pump_in_lon = 0;
-    let pump_out_lat = 0;
-    let pump_out_lon = 0;
-    let pump_capacity = 0;
-    let pump_threshold = 0;
-    let pump_radius = undefined;
-    // Konversi pumps ke format string lama
-    if (pumps.length > 0) {
-        pump_in_lat = pumps.map(p => p.in_lat).join(",");
-        pump_in_lon = pumps.map(p => p.in_lon).join(",");
-        pump_out_lat = pumps.map(p => p.out_lat).join(",");
-        pump_out_lon = pumps.map(p => p.out_lon).join(",");
-        pump_capacity = pumps.map(p => p.capacity).join(",");
-        pump_threshold = pumps.map(p => p.threshold).join(",");
-        pump_radius = pumps.map(p => p.radius).join(",");
-    }
-
-    const args = [
-        "data/dem.tif",
-        "data/lahan.tif",
-        output_tif || "result/delete_after_this.tif",
-        pump_log,
-        tiles_dir,
-        rain_mm,
-        interval_min,
-        iter,
-        pump_in_lat,
-        pump_in_lon,
-        pump_out_lat,
-        pump_out_lon,
-        pump_capacity,
-        pump_threshold
-    ];
-
-    if (pump_radius) {
-        args.push(pump_radius);
+    // Validasi gauges (opsional)
+    if (gauges !== undefined) {
+        if (!Array.isArray(gauges) || gauges.length === 0) {
+            return res.status(400).json({ status: "error", message: "gauges must be a non-empty array" });
+        }
+        for (let i = 0; i < gauges.length; i++) {
+            const g = gauges[i];
+            if (typeof g.lat !== "number" || typeof g.lon !== "number") {
+                return res.status(400).json({
+                    status: "error",
+                    message: `gauges[${i}] must have numeric lat and lon`
+                });
+            }
+        }
     }
 
-    execFile("./run.sh", args, { cwd: process.cwd() }, (error, stdout, stderr) => {
-        // delete tif if not set
-        if (!output_tif) {
-            execFile("rm", ["result/delete_after_this.tif"], { cwd: process.cwd() });
-        }
+    // estimate: genangan langsung dari peta cekungan (preview), tanpa step
+    const quick = estimate === true;
+
+    // statistik run ditulis di samping pump log (estimate tidak punya step)
+    const statsFile = quick ? undefined : pump_log.replace(/\.[^./]*$/, "") + ".stats.ndjson";
+    // kedalaman tiap gauge per step, satu kolom per gauge
+    const gaugeFile = gauges ? pump_log.replace(/\.[^./]*$/, "") + ".gauges.csv" : undefined;
+
+    // Hanya field yang menentukan hasil yang masuk key; path output tidak.
+    // Worker menulis ke direktori entry cache, lalu output di-hard link ke
+    // path yang diminta (tif hanya kalau output_tif diisi).
+    const scenario = { rain_timeseries, pumps, gauges, estimate: quick };
+    let key = null;
+    let loaded = null;
+    pool.identity()
+        .then((id) => {
+            loaded = id;
+            return cache.key(scenario, loaded);
+        })
+        .then((k) => {
+            key = k;
+            // tiles dirender langsung oleh worker dari hasil smoothing
+            return cache.get(key, async (dir) => {
+                const files = {
+                    output_tif: path.join(dir, "output.tif"),
+                    pump_log: path.join(dir, "pump_log.csv"),
+                    tiles_dir: path.join(dir, "tiles"),
+                    stats: quick ? undefined : path.join(dir, "stats.ndjson"),
+                    gauge_output: gauges ? path.join(dir, "gauges.csv") : undefined,
+                };
+                const result = await pool.run({ ...files, rain_timeseries, pumps, gauges, estimate: quick }, loaded);
+                return { status: result.status, message: result.message, timings_ms: result.timings_ms };
+            });
+        })
+        .then(async ({ meta, source }) => {
+            // Kalau ada 'Failed:' dari simulasi
+            if (meta.status !== "success") {
+                return res.status(400).json({
+                    status: "error",
+                    message: meta.message,
+                    data: null,
+                });
+            }
 
-        // Kalau error exit code
+            await replaceTree(cache.path(key, "tiles"), tiles_dir);
+            await linkFile(cache.path(key, "pump_log.csv"), pump_log);
+            if (output_tif) await linkFile(cache.path(key, "output.tif"), output_tif);
+            if (statsFile) await linkFile(cache.path(key, "stats.ndjson"), statsFile);
+            if (gaugeFile) await linkFile(cache.path(key, "gauges.csv"), gaugeFile);
+
+            let stats = null;
+            try {
+                if (statsFile) stats = parseStats(await readFile(statsFile, "utf8"));
+            } catch (e) {
+                stats = null; // statistik tidak wajib ada
+            }
 
-        // Kalau ada 'Failed:' di stdout/stderr
-        if (/Failed:/i.test(stderr)) {
-            const failedMatches = stderr.match(/Failed:.*/gi);
-            return res.status(400).json({
-                status: "error",
-                message: failedMatches[0],
-                data: null,
+            // Success
+            const protocol = process.env.NODE_ENV === "production" ? "https://" : "http://";
+            return res.json({
+                status: "success",
+                message: source === "hit" ? "Simulation result served from cache" : "Simulation completed successfully",
+                data: {
+                    tiles: `${protocol}${req.get("host")}/${tiles_dir}/{z}/{x}/{y}.png`,
+                    leaflet: `${protocol}${req.get("host")}/${tiles_dir}/leaflet.html`,
+                    openlayers: `${protocol}${req.get("host")}/${tiles_dir}/openlayers.html`,
+                    output_tif: `${protocol}${req.get("host")}/${output_tif}`,
+                    output_pump: `${protocol}${req.get("host")}/${pump_log}`,
+                    output_stats: statsFile ? `${protocol}${req.get("host")}/${statsFile}` : null,
+                    output_gauges: gaugeFile ? `${protocol}${req.get("host")}/${gaugeFile}` : null,
+                    // hit: dari cache; coalesced: menunggu run identik yang sedang jalan
+                    cache: source,
+                    cache_key: key,
+                    // timing run yang menghasilkan entry ini
+                    timings_ms: meta.timings_ms,
+                    stats,
+                }
             });
-        }
-
-        if (error) {
+        })
+        .catch((error) => {
+            if (error.code === "EQUEUEFULL" || error.code === "EINPUTSCHANGED") {
+                res.set("Retry-After", "10");
+                return res.status(503).json({ status: "error", message: error.message, data: null });
+            }
             return res.status(500).json({
                 status: "error",
                 message: error.message,
                 data: null,
             });
-        }
-
-        // Success
-        const protocol = process.env.NODE_ENV === "production" ? "https://" : "http://";
-        return res.json({
-            status: "success",
-            message: "Simulation completed successfully",
-            data: {
-                tiles: `${protocol}${req.get("host")}/${tiles_dir}/{z}/{x}/{y}.png`,
-                leaflet: `${protocol}${req.get("host")}/${tiles_dir}/leaflet.html`,
-                openlayers: `${protocol}${req.get("host")}/${tiles_dir}/openlayers.html`,
-                output_tif: `${protocol}${req.get("host")}/${output_tif}`,
-                output_pump: `${protocol}${req.get("host")}/${pump_log}`,
-            }
+        })
+        .finally(() => {
+            if (key) cache.release(key);
         });
-    });
 
 });
 
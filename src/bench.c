@@ -0,0 +1,516 @@
+// bench.c - throughput benchmark of the simulation kernels on synthetic
+// terrain, with JSON baselines to catch regressions
+//
+// Every kernel runs on the same generated DEM / landuse grid and is timed
+// on its own; the best of --repeat runs is reported. "bytes" is the
+// compulsory memory traffic of one pass (every array read or written
+// once), not a hardware counter, so GB/s compares runs, not machines.
+#include "cpl_conv.h"
+#include "flowKernel.h"
+#include "gdal.h"
+#include "gdalShortcut.h"
+#include "json.h"
+#include "pumping.h"
+#include "smoothing.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define BENCH_NODATA -32767.0f
+#define BENCH_MAX_KERNELS 8
+
+typedef struct {
+  int nXSize, nYSize;
+  const char *shape; // slope, bowl, channel, mixed
+  float holes;       // fraction of cells that are no-data
+  unsigned seed;
+  int nThreads;
+  int repeat;
+  int sweeps; // flow sweeps / pump sub-iterations per run
+  int nPumps;
+  const char *dir; // temporary GeoTIFFs
+  const char *save;
+  const char *baseline;
+  float tolerance; // allowed throughput drop against the baseline (%)
+} BenchOptions;
+
+typedef struct {
+  const char *name;
+  double cells;   // cells processed per run
+  double bytes;   // per run
+  double seconds; // best run
+} KernelResult;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// deterministic noise in [0, 1) for a cell, independent of thread count
+static float Hash01(unsigned seed, unsigned x, unsigned y) {
+  uint32_t h = seed * 0x9E3779B9u ^ x * 0x85EBCA6Bu ^ y * 0xC2B2AE35u;
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+static int ShapeKnown(const char *s) {
+  return !strcmp(s, "slope") || !strcmp(s, "bowl") ||
+         !strcmp(s, "channel") || !strcmp(s, "mixed");
+}
+
+// Elevation in metres on 1 m pixels: a tilted plane, a bowl around the
+// centre, a meandering V channel, or all three with bumps. Landuse comes
+// in 32 x 32 patches of the four classes. No-data holes are discs of
+// radius 4..16 px until `holes` of the grid is covered (approximately).
+static void GenerateTerrain(const BenchOptions *o, float *elev,
+                            unsigned char *lahan) {
+  int w = o->nXSize, h = o->nYSize;
+  int slope = !strcmp(o->shape, "slope"), bowl = !strcmp(o->shape, "bowl");
+  int channel = !strcmp(o->shape, "channel");
+  int mixed = !strcmp(o->shape, "mixed");
+  float cx = 0.5f * (float)w, cy = 0.5f * (float)h;
+  float rMax = 0.5f * (float)(w < h ? w : h);
+  float period = (float)(h > 64 ? h : 64) / 3.0f;
+#pragma omp parallel for schedule(static) num_threads(o->nThreads)
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      float z = 100.0f;
+      if (slope || mixed)
+        z += 0.02f * (float)x + 0.01f * (float)y;
+      if (bowl || mixed) {
+        float r = hypotf((float)x - cx, (float)y - cy) / rMax;
+        z += 20.0f * r * r;
+      }
+      if (channel || mixed) {
+        float mid =
+            cx + 0.15f * (float)w * sinf(6.2831853f * (float)y / period);
+        z += 0.005f * (float)y + 0.05f * fabsf((float)x - mid);
+      }
+      if (mixed)
+        z += 0.5f * sinf(0.11f * (float)x) * cosf(0.07f * (float)y);
+      size_t i = (size_t)y * w + x;
+      elev[i] = z + 0.1f * Hash01(o->seed, x, y);
+      lahan[i] = (unsigned char)(4.0f * Hash01(o->seed + 1, x / 32, y / 32));
+    }
+  }
+  double covered = 0.0, target = (double)o->holes * w * h;
+  for (unsigned k = 0; covered < target; k++) {
+    int r = 4 + (int)(12.0f * Hash01(o->seed + 2, k, 0));
+    int hx = (int)((float)w * Hash01(o->seed + 2, k, 1));
+    int hy = (int)((float)h * Hash01(o->seed + 2, k, 2));
+    for (int y = hy - r; y <= hy + r; y++)
+      for (int x = hx - r; x <= hx + r; x++)
+        if (x >= 0 && y >= 0 && x < w && y < h &&
+            (x - hx) * (x - hx) + (y - hy) * (y - hy) <= r * r)
+          elev[(size_t)y * w + x] = BENCH_NODATA;
+    covered += 3.14159265 * r * r;
+  }
+}
+
+static void Report(const KernelResult *k) {
+  double cps = k->cells / k->seconds;
+  printf("%-12s %12.0f %12.3e %9.2f %12.0f %8.2f\n", k->name, k->cells, cps,
+         1e9 * k->seconds / k->cells, k->bytes, k->bytes / k->seconds / 1e9);
+}
+
+static int SaveJson(const char *path, const BenchOptions *o,
+                    const KernelResult *k, int nKernels, int nThreads) {
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    return -1;
+  fprintf(fp, "{\n  \"version\": 1,\n  \"config\": {\"width\": %d, "
+              "\"height\": %d, \"shape\": ",
+          o->nXSize, o->nYSize);
+  JsonWriteString(fp, o->shape);
+  fprintf(fp, ", \"holes\": %g, \"seed\": %u, \"threads\": %d, "
+              "\"sweeps\": %d, \"pumps\": %d, \"simd\": ",
+          o->holes, o->seed, nThreads, o->sweeps, o->nPumps);
+  JsonWriteString(fp, FlowSimdName());
+  fprintf(fp, "},\n  \"kernels\": [\n");
+  for (int i = 0; i < nKernels; i++)
+    fprintf(fp,
+            "    {\"name\": \"%s\", \"cells\": %.0f, \"seconds\": %.9g, "
+            "\"cells_per_sec\": %.6g, \"ns_per_cell\": %.6g, "
+            "\"bytes\": %.0f, \"gb_per_sec\": %.6g}%s\n",
+            k[i].name, k[i].cells, k[i].seconds, k[i].cells / k[i].seconds,
+            1e9 * k[i].seconds / k[i].cells, k[i].bytes,
+            k[i].bytes / k[i].seconds / 1e9, i + 1 < nKernels ? "," : "");
+  fprintf(fp, "  ]\n}\n");
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+static char *ReadFile(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  long n = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *text = (char *)malloc(n > 0 ? (size_t)n + 1 : 1);
+  if (text && fread(text, 1, (size_t)n, fp) != (size_t)n) {
+    free(text);
+    text = NULL;
+  }
+  if (text)
+    text[n] = '\0';
+  fclose(fp);
+  return text;
+}
+
+// 0 when every kernel in the baseline is within tolerance, 2 on a
+// regression, 1 when the baseline cannot be read
+static int CompareBaseline(const BenchOptions *o, const KernelResult *k,
+                           int nKernels, int nThreads) {
+  char err[256];
+  char *text = ReadFile(o->baseline);
+  if (!text) {
+    fprintf(stderr, "Failed: to read baseline %s\n", o->baseline);
+    return 1;
+  }
+  JsonValue *doc = JsonParse(text, err, sizeof(err));
+  free(text);
+  const JsonValue *kernels = doc ? JsonGet(doc, "kernels") : NULL;
+  if (!kernels || kernels->type != JSON_ARRAY) {
+    fprintf(stderr, "Failed: %s is not a benchmark baseline%s%s\n",
+            o->baseline, doc ? "" : ": ", doc ? "" : err);
+    JsonFree(doc);
+    return 1;
+  }
+  const JsonValue *cfg = JsonGet(doc, "config");
+  const char *shape = JsonString(JsonGet(cfg, "shape"));
+  if ((int)JsonNumber(JsonGet(cfg, "width"), 0) != o->nXSize ||
+      (int)JsonNumber(JsonGet(cfg, "height"), 0) != o->nYSize ||
+      (int)JsonNumber(JsonGet(cfg, "threads"), 0) != nThreads ||
+      !shape || strcmp(shape, o->shape))
+    printf("# Warning: baseline was recorded with a different size, shape "
+           "or thread count\n");
+
+  int rc = 0;
+  printf("# Baseline %s (tolerance %.1f%%)\n", o->baseline, o->tolerance);
+  for (int i = 0; i < nKernels; i++) {
+    const JsonValue *base = NULL;
+    for (int j = 0; j < kernels->count && !base; j++) {
+      const char *name = JsonString(JsonGet(&kernels->items[j], "name"));
+      if (name && !strcmp(name, k[i].name))
+        base = &kernels->items[j];
+    }
+    double ref = JsonNumber(JsonGet(base, "cells_per_sec"), 0);
+    if (ref <= 0.0) {
+      printf("%-12s not in baseline\n", k[i].name);
+      continue;
+    }
+    double now = k[i].cells / k[i].seconds;
+    double change = 100.0 * (now - ref) / ref;
+    int slow = change < -o->tolerance;
+    printf("%-12s %+7.1f%%%s\n", k[i].name, change,
+           slow ? "  REGRESSION" : "");
+    if (slow)
+      rc = 2;
+  }
+  JsonFree(doc);
+  return rc;
+}
+
+// 1 if argv[*i] is option `name`; its value is consumed into val
+static int TakeValue(int argc, const char *argv[], int *i, const char *name,
+                     const char **val) {
+  if (strcmp(argv[*i], name))
+    return 0;
+  if (*i + 1 >= argc) {
+    fprintf(stderr, "Failed: %s needs a value\n", name);
+    exit(1);
+  }
+  *val = argv[++*i];
+  return 1;
+}
+
+static void Usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--size WxH] [--shape slope|bowl|channel|mixed] "
+          "[--holes FRACTION] [--seed N] [--threads N] [--repeat N] "
+          "[--sweeps N] [--pumps N] [--dir DIR] [--save FILE] "
+          "[--baseline FILE [--tolerance PCT]]\n",
+          prog);
+}
+
+int main(int argc, const char *argv[]) {
+  BenchOptions o = {2048, 2048, "mixed", 0.02f, 1, 0, 5, 20, 256, "/tmp",
+                    NULL, NULL, 10.0f};
+  for (int i = 1; i < argc; i++) {
+    const char *v;
+    if (TakeValue(argc, argv, &i, "--size", &v)) {
+      if (sscanf(v, "%dx%d", &o.nXSize, &o.nYSize) != 2 || o.nXSize < 16 ||
+          o.nYSize < 16) {
+        fprintf(stderr, "Failed: --size must be WxH, at least 16x16\n");
+        return 1;
+      }
+    } else if (TakeValue(argc, argv, &i, "--shape", &v)) {
+      o.shape = v;
+      if (!ShapeKnown(v)) {
+        fprintf(stderr, "Failed: unknown --shape %s\n", v);
+        return 1;
+      }
+    } else if (TakeValue(argc, argv, &i, "--holes", &v)) {
+      o.holes = (float)atof(v);
+      if (o.holes < 0.0f || o.holes > 0.9f) {
+        fprintf(stderr, "Failed: --holes must be between 0 and 0.9\n");
+        return 1;
+      }
+    } else if (TakeValue(argc, argv, &i, "--seed", &v)) {
+      o.seed = (unsigned)strtoul(v, NULL, 10);
+    } else if (TakeValue(argc, argv, &i, "--threads", &v)) {
+      o.nThreads = atoi(v);
+    } else if (TakeValue(argc, argv, &i, "--repeat", &v)) {
+      o.repeat = atoi(v) > 0 ? atoi(v) : 1;
+    } else if (TakeValue(argc, argv, &i, "--sweeps", &v)) {
+      o.sweeps = atoi(v) > 0 ? atoi(v) : 1;
+    } else if (TakeValue(argc, argv, &i, "--pumps", &v)) {
+      o.nPumps = atoi(v) >= 0 ? atoi(v) : 0;
+    } else if (TakeValue(argc, argv, &i, "--dir", &v)) {
+      o.dir = v;
+    } else if (TakeValue(argc, argv, &i, "--save", &v)) {
+      o.save = v;
+    } else if (TakeValue(argc, argv, &i, "--baseline", &v)) {
+      o.baseline = v;
+    } else if (TakeValue(argc, argv, &i, "--tolerance", &v)) {
+      o.tolerance = (float)atof(v);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+#ifdef _OPENMP
+  if (o.nThreads <= 0)
+    o.nThreads = omp_get_max_threads();
+#else
+  o.nThreads = 1;
+#endif
+  GDALAllRegister();
+
+  int w = o.nXSize, h = o.nYSize;
+  size_t npix = (size_t)w * (size_t)h;
+  float *elev = (float *)CPLMalloc(npix * sizeof(float));
+  unsigned char *lahan = (unsigned char *)CPLMalloc(npix);
+  float *water = (float *)CPLMalloc(npix * sizeof(float));
+  float *res = (float *)CPLMalloc(npix * sizeof(float));
+  double t0 = Now();
+  GenerateTerrain(&o, elev, lahan);
+  unsigned char *mask = FlowBuildMask(w, h, elev, 1, BENCH_NODATA);
+  size_t nValid = 0;
+  for (size_t i = 0; i < npix; i++)
+    nValid += mask[i] & FLOW_VALID;
+  printf("# Terrain: %d x %d %s, %.1f%% no-data, generated in %.3f s\n", w,
+         h, o.shape, 100.0 * (double)(npix - nValid) / (double)npix,
+         Now() - t0);
+
+  FlowGrid grid = {w, h, elev, lahan, mask};
+  FlowContext *flow = FlowCreate(&grid, o.nThreads);
+  if (!flow) {
+    fprintf(stderr, "Failed: Memory allocation failed\n");
+    return 1;
+  }
+  int nThreads = FlowThreadCount(flow);
+  printf("# Threads: %d, SIMD: %s, best of %d runs\n", nThreads,
+         FlowSimdName(), o.repeat);
+  printf("%-12s %12s %12s %9s %12s %8s\n", "kernel", "cells", "cells/s",
+         "ns/cell", "bytes", "GB/s");
+
+  KernelResult k[BENCH_MAX_KERNELS];
+  int nk = 0;
+  const float infil_m[4] = {0.0f, 10e-6f, 5e-6f, 30e-6f};
+  for (int i = 0; i < BENCH_MAX_KERNELS; i++)
+    k[i].seconds = 1e30;
+
+  // flow: dense in-place sweeps over 5 cm of water on every valid cell;
+  // per cell elev, lahan, mask and water are read, water written back
+  k[nk] = (KernelResult){"flow", (double)o.sweeps * npix,
+                         (double)o.sweeps * npix * 14.0, 1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    for (size_t i = 0; i < npix; i++)
+      water[i] = (mask[i] & FLOW_VALID) ? 0.05f : 0.0f;
+    t0 = Now();
+    for (int s = 0; s < o.sweeps; s++)
+      FlowSweepInPlace(flow, water, infil_m);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  Report(&k[nk++]);
+
+  // flow_fp16: the same sweeps on the compact state (--compact fp16);
+  // elev and water are 2 bytes each
+  float elevBase, elevStep;
+  uint16_t *elev16 = FlowCompactElevation(&grid, &elevBase, &elevStep);
+  uint16_t *water16 = (uint16_t *)CPLMalloc(npix * sizeof(uint16_t));
+  FlowSetCompact(flow, FLOW_STATE_FLOAT16, elev16, elevStep, 1e-4f);
+  k[nk] = (KernelResult){"flow_fp16", (double)o.sweeps * npix,
+                         (double)o.sweeps * npix * 8.0, 1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    for (size_t i = 0; i < npix; i++)
+      res[i] = (mask[i] & FLOW_VALID) ? 0.05f : 0.0f;
+    FlowEncodeDepth(flow, res, water16, 0, npix);
+    t0 = Now();
+    for (int s = 0; s < o.sweeps; s++)
+      FlowSweepCompact(flow, water16, infil_m);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  Report(&k[nk++]);
+  CPLFree(water16);
+  CPLFree(elev16);
+
+  // flow_sparse: the same water after it settled a little, tiles that
+  // still change are swept (the sparse mode of the simulation). Every
+  // repeat starts from that state again, the sweeps settle it further.
+  float *settled = (float *)CPLMalloc(npix * sizeof(float));
+  memcpy(settled, water, npix * sizeof(float));
+  k[nk] = (KernelResult){"flow_sparse", 0.0, 0.0, 1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    memcpy(water, settled, npix * sizeof(float));
+    FlowMarkAllDirty(flow);
+    long long tiles = 0;
+    t0 = Now();
+    for (int s = 0; s < o.sweeps; s++)
+      tiles += FlowSweepSparse(flow, water, res, infil_m);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+    // cells counts the whole grid per sweep, so sparse cells/s is the
+    // effective rate; bytes counts the tiles actually swept
+    k[nk].cells = (double)o.sweeps * npix;
+    k[nk].bytes = (double)tiles * FLOW_TILE_X * FLOW_TILE_Y * 14.0;
+  }
+  Report(&k[nk++]);
+  CPLFree(settled);
+
+  // pumps: nPumps pumps of radius 4..20 px, switched on from the start;
+  // cells are footprint cells, each read and written once per step
+  Pump *pumpList = (Pump *)CPLCalloc(o.nPumps > 0 ? o.nPumps : 1,
+                                     sizeof(Pump));
+  for (int p = 0; p < o.nPumps; p++) {
+    pumpList[p].px = (int)((float)w * Hash01(o.seed + 3, p, 0));
+    pumpList[p].py = (int)((float)h * Hash01(o.seed + 3, p, 1));
+    pumpList[p].ox = (int)((float)w * Hash01(o.seed + 3, p, 2));
+    pumpList[p].oy = (int)((float)h * Hash01(o.seed + 3, p, 3));
+    pumpList[p].radius_px = 4 + (int)(16.0f * Hash01(o.seed + 3, p, 4));
+    pumpList[p].capacity_m3hr = 4000.0f;
+    pumpList[p].threshold = 0.0f;
+  }
+  PumpSet pumpSet;
+  PumpSetCreate(&pumpSet, pumpList, o.nPumps, w, h, mask, 0.2f);
+  double footprint = 0.0;
+  for (int p = 0; p < o.nPumps; p++)
+    if (PumpEnabled(&pumpSet, p))
+      footprint += pumpSet.nCells[p];
+  k[nk] = (KernelResult){"pumps", (double)o.sweeps * footprint,
+                         (double)o.sweeps * footprint * 8.0, 1e30};
+  for (int r = 0; r < o.repeat && footprint > 0.0; r++) {
+    for (size_t i = 0; i < npix; i++)
+      water[i] = (mask[i] & FLOW_VALID) ? 0.5f : 0.0f;
+    t0 = Now();
+    for (int s = 0; s < o.sweeps; s++)
+      PumpStep(&pumpSet, water, 1.0f / 60.0f, 1.0f, 3, nThreads);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  if (footprint > 0.0)
+    Report(&k[nk++]);
+  PumpSetDestroy(&pumpSet);
+  CPLFree(pumpList);
+
+  // smoothing: the output filter over the swept water; elev and water
+  // read, the result written
+  int dx[4] = {-1, 1, 0, 0};
+  int dy[4] = {0, 0, -1, 1};
+  for (size_t i = 0; i < npix; i++)
+    water[i] = (mask[i] & FLOW_VALID) ? 0.05f : 0.0f;
+  for (int s = 0; s < 4; s++)
+    FlowSweepInPlace(flow, water, infil_m);
+  k[nk] = (KernelResult){"smoothing", (double)npix, (double)npix * 12.0,
+                         1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    memset(res, 0, npix * sizeof(float));
+    t0 = Now();
+    Smoothing(h, w, dx, dy, 4, elev, water, res, BENCH_NODATA);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  Report(&k[nk++]);
+
+  // GeoTIFF write / read of a Float32 grid through gdalShortcut
+  char demPath[1024], outPath[1024];
+  snprintf(demPath, sizeof(demPath), "%s/bench_dem_%d.tif", o.dir,
+           (int)getpid());
+  snprintf(outPath, sizeof(outPath), "%s/bench_out_%d.tif", o.dir,
+           (int)getpid());
+  GDALDriverH driver = GDALGetDriverByName("GTiff");
+  GDALDatasetH dem =
+      driver ? GDALCreate(driver, demPath, w, h, 1, GDT_Float32, NULL) : NULL;
+  if (!dem) {
+    fprintf(stderr, "Failed: to create %s\n", demPath);
+    return 1;
+  }
+  double gt[6] = {0.0, 1.0, 0.0, (double)h, 0.0, -1.0};
+  GDALSetGeoTransform(dem, gt);
+  GDALSetRasterNoDataValue(GDALGetRasterBand(dem, 1), BENCH_NODATA);
+  WriteTiffRows(dem, elev, w, 0, h);
+
+  k[nk] = (KernelResult){"write_tiff", (double)npix, (double)npix * 4.0,
+                         1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    t0 = Now();
+    WriteTiff(dem, res, w, h, outPath);
+    double dt = Now() - t0;
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  Report(&k[nk++]);
+  GDALClose(dem);
+
+  k[nk] = (KernelResult){"open_tiff", (double)npix, (double)npix * 4.0,
+                         1e30};
+  for (int r = 0; r < o.repeat; r++) {
+    t0 = Now();
+    Raster in = OpenTiff(outPath, 0, -32767);
+    double dt = Now() - t0;
+    if (!in.pixelArray) {
+      fprintf(stderr, "Failed: to read %s back\n", outPath);
+      return 1;
+    }
+    CPLFree(in.pixelArray);
+    GDALClose(in.dataset);
+    k[nk].seconds = dt < k[nk].seconds ? dt : k[nk].seconds;
+  }
+  Report(&k[nk++]);
+  unlink(demPath);
+  unlink(outPath);
+
+  int rc = 0;
+  if (o.save) {
+    if (SaveJson(o.save, &o, k, nk, nThreads) != 0) {
+      fprintf(stderr, "Failed: to write %s\n", o.save);
+      rc = 1;
+    } else {
+      printf("# Saved %s\n", o.save);
+    }
+  }
+  if (o.baseline && rc == 0)
+    rc = CompareBaseline(&o, k, nk, nThreads);
+
+  FlowDestroy(flow);
+  CPLFree(mask);
+  CPLFree(elev);
+  CPLFree(lahan);
+  CPLFree(water);
+  CPLFree(res);
+  return rc;
+}
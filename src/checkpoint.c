@@ -0,0 +1,244 @@
+// checkpoint.c - compact simulation state for restarting a run
+#include "checkpoint.h"
+#include "cpl_conv.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECKPOINT_CHUNK_ROWS 256
+// deflate level 1: checkpoints are written while the simulation waits
+#define CHECKPOINT_ZLEVEL 1
+
+typedef struct {
+  char magic[8];
+  int32_t nXSize, nYSize;
+  int32_t step;
+  int32_t decaySteps;
+  int32_t nPumps, chunkRows;
+} CheckpointHeader;
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return -1;
+}
+
+// byte k of float i goes to plane k: the sign/exponent bytes of nearby
+// depths are mostly equal and deflate much better grouped together
+static void Shuffle(const float *src, unsigned char *dst, size_t n) {
+  const unsigned char *b = (const unsigned char *)src;
+  for (size_t i = 0; i < n; i++)
+    for (int k = 0; k < 4; k++)
+      dst[k * n + i] = b[4 * i + k];
+}
+
+static void Unshuffle(const unsigned char *src, float *dst, size_t n) {
+  unsigned char *b = (unsigned char *)dst;
+  for (size_t i = 0; i < n; i++)
+    for (int k = 0; k < 4; k++)
+      b[4 * i + k] = src[k * n + i];
+}
+
+int CheckpointWrite(const char *path, int nXSize, int nYSize, int step,
+                    int decaySteps, const float *rain_mm,
+                    const float *interval_min, const float *iter,
+                    const PumpSet *ps, const float *water, OutOfCore *ooc) {
+  size_t w = (size_t)nXSize;
+  int chunkRows = ooc ? ooc->bandRows : CHECKPOINT_CHUNK_ROWS;
+  size_t rawCap = (size_t)chunkRows * w * sizeof(float);
+  size_t zCap = rawCap + rawCap / 100 + 1024;
+  unsigned char *raw = (unsigned char *)malloc(rawCap);
+  unsigned char *zbuf = (unsigned char *)malloc(zCap);
+  char *tmpPath = (char *)malloc(strlen(path) + 5);
+  FILE *fp = NULL;
+  if (raw && zbuf && tmpPath) {
+    sprintf(tmpPath, "%s.tmp", path);
+    fp = fopen(tmpPath, "wb");
+  }
+  if (!fp) {
+    free(raw);
+    free(zbuf);
+    free(tmpPath);
+    return -1;
+  }
+
+  CheckpointHeader hdr;
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, 8);
+  hdr.nXSize = nXSize;
+  hdr.nYSize = nYSize;
+  hdr.step = step;
+  hdr.decaySteps = decaySteps;
+  hdr.nPumps = ps->nPumps;
+  hdr.chunkRows = chunkRows;
+  int failed = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  size_t nStep = (size_t)step;
+  failed |= fwrite(rain_mm, sizeof(float), nStep, fp) != nStep;
+  failed |= fwrite(interval_min, sizeof(float), nStep, fp) != nStep;
+  failed |= fwrite(iter, sizeof(float), nStep, fp) != nStep;
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    uint64_t cell = ps->intake[pid];
+    failed |= fwrite(&cell, sizeof(cell), 1, fp) != 1;
+  }
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    uint64_t cell = ps->outlet[pid];
+    failed |= fwrite(&cell, sizeof(cell), 1, fp) != 1;
+  }
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    int32_t cooldown = ps->cooldown[pid];
+    failed |= fwrite(&cooldown, sizeof(cooldown), 1, fp) != 1;
+  }
+  size_t nPumps = (size_t)ps->nPumps;
+  failed |= fwrite(ps->state, 1, nPumps, fp) != nPumps;
+
+  for (int y0 = 0; y0 < nYSize && !failed; y0 += chunkRows) {
+    int y1 = y0 + chunkRows < nYSize ? y0 + chunkRows : nYSize;
+    size_t n = (size_t)(y1 - y0) * w;
+    size_t bytes = n * sizeof(float);
+    Shuffle(water + (size_t)y0 * w, raw, n);
+    size_t zBytes = 0;
+    CheckpointChunk chunk = {bytes, 0, 0};
+    if (CPLZLibDeflate(raw, bytes, CHECKPOINT_ZLEVEL, zbuf, zCap, &zBytes) &&
+        zBytes < bytes) {
+      chunk.storedBytes = zBytes;
+      chunk.deflated = 1;
+    }
+    failed |= fwrite(&chunk, sizeof(chunk), 1, fp) != 1;
+    failed |= fwrite(chunk.deflated ? zbuf : raw, 1, chunk.storedBytes, fp) !=
+              chunk.storedBytes;
+    if (ooc)
+      ScratchDrop(&ooc->water, (size_t)y0 * w * sizeof(float),
+                  (size_t)y1 * w * sizeof(float));
+  }
+  failed |= fclose(fp) != 0;
+  if (!failed)
+    failed = rename(tmpPath, path) != 0;
+  if (failed)
+    remove(tmpPath);
+  free(raw);
+  free(zbuf);
+  free(tmpPath);
+  return failed ? -1 : 0;
+}
+
+// reads the arrays that follow the header and checks them against this run
+static int ReadPumps(FILE *fp, PumpSet *ps, char *err, size_t errSize) {
+  for (int pass = 0; pass < 2; pass++) {
+    const size_t *cells = pass == 0 ? ps->intake : ps->outlet;
+    for (int pid = 0; pid < ps->nPumps; pid++) {
+      uint64_t cell;
+      if (fread(&cell, sizeof(cell), 1, fp) != 1)
+        return Fail(err, errSize, "Failed: checkpoint is truncated");
+      if (cell != (uint64_t)cells[pid])
+        return Fail(err, errSize,
+                    "Failed: pump %d is not where it was in the checkpoint "
+                    "run",
+                    pid);
+    }
+  }
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    int32_t cooldown;
+    if (fread(&cooldown, sizeof(cooldown), 1, fp) != 1)
+      return Fail(err, errSize, "Failed: checkpoint is truncated");
+    ps->cooldown[pid] = cooldown;
+  }
+  size_t nPumps = (size_t)ps->nPumps;
+  if (fread(ps->state, 1, nPumps, fp) != nPumps)
+    return Fail(err, errSize, "Failed: checkpoint is truncated");
+  return 0;
+}
+
+int CheckpointRead(const char *path, int nXSize, int nYSize, int nSteps,
+                   const float *rain_mm, const float *interval_min,
+                   const float *iter, int decaySteps, PumpSet *ps,
+                   float *water, OutOfCore *ooc, int *step, char *err,
+                   size_t errSize) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return Fail(err, errSize, "Failed: to open checkpoint %s", path);
+  CheckpointHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, CHECKPOINT_MAGIC, 8) != 0) {
+    fclose(fp);
+    return Fail(err, errSize, "Failed: %s is not a checkpoint", path);
+  }
+  if (hdr.nXSize != nXSize || hdr.nYSize != nYSize) {
+    fclose(fp);
+    return Fail(err, errSize,
+                "Failed: checkpoint grid %dx%d differs from the DEM (%dx%d)",
+                hdr.nXSize, hdr.nYSize, nXSize, nYSize);
+  }
+  if (hdr.nPumps != ps->nPumps) {
+    fclose(fp);
+    return Fail(err, errSize,
+                "Failed: checkpoint has %d pumps, this run has %d",
+                hdr.nPumps, ps->nPumps);
+  }
+  if (hdr.step < 0 || hdr.step > nSteps || hdr.chunkRows < 1) {
+    fclose(fp);
+    return Fail(err, errSize,
+                "Failed: checkpoint at step %d is past the end of the %d "
+                "step rain series",
+                hdr.step, nSteps);
+  }
+
+  size_t nStep = (size_t)hdr.step;
+  float *series = (float *)malloc(sizeof(float) * 3 * (nStep ? nStep : 1));
+  int rc = series ? 0 : Fail(err, errSize, "Failed: Memory allocation failed");
+  if (rc == 0 && fread(series, sizeof(float), 3 * nStep, fp) != 3 * nStep)
+    rc = Fail(err, errSize, "Failed: checkpoint is truncated");
+  if (rc == 0 && (memcmp(series, rain_mm, nStep * sizeof(float)) != 0 ||
+                  memcmp(series + nStep, interval_min,
+                         nStep * sizeof(float)) != 0 ||
+                  memcmp(series + 2 * nStep, iter, nStep * sizeof(float)) != 0))
+    printf("# Warning: the first %d rain steps differ from the checkpoint "
+           "run; they are not simulated again\n",
+           hdr.step);
+  free(series);
+  if (rc == 0 && hdr.decaySteps != decaySteps)
+    printf("# Warning: checkpoint used an infiltration decay horizon of %d "
+           "steps, this run uses %d (--decay-steps %d continues it exactly)\n",
+           hdr.decaySteps, decaySteps, hdr.decaySteps);
+  if (rc == 0)
+    rc = ReadPumps(fp, ps, err, errSize);
+
+  size_t w = (size_t)nXSize;
+  size_t rawCap = (size_t)hdr.chunkRows * w * sizeof(float);
+  unsigned char *raw = rc == 0 ? (unsigned char *)malloc(rawCap) : NULL;
+  unsigned char *zbuf = rc == 0 ? (unsigned char *)malloc(rawCap) : NULL;
+  if (rc == 0 && (!raw || !zbuf))
+    rc = Fail(err, errSize, "Failed: Memory allocation failed");
+  for (int y0 = 0; y0 < nYSize && rc == 0; y0 += hdr.chunkRows) {
+    int y1 = y0 + hdr.chunkRows < nYSize ? y0 + hdr.chunkRows : nYSize;
+    size_t n = (size_t)(y1 - y0) * w;
+    size_t bytes = n * sizeof(float);
+    CheckpointChunk chunk;
+    size_t outBytes = 0;
+    if (fread(&chunk, sizeof(chunk), 1, fp) != 1 ||
+        chunk.storedBytes > bytes ||
+        fread(chunk.deflated ? zbuf : raw, 1, chunk.storedBytes, fp) !=
+            chunk.storedBytes) {
+      rc = Fail(err, errSize, "Failed: checkpoint is truncated");
+    } else if (chunk.deflated
+                   ? !CPLZLibInflate(zbuf, chunk.storedBytes, raw, bytes,
+                                     &outBytes) ||
+                         outBytes != bytes
+                   : chunk.storedBytes != bytes) {
+      rc = Fail(err, errSize, "Failed: checkpoint water rows %d..%d corrupt",
+                y0, y1 - 1);
+    } else {
+      Unshuffle(raw, water + (size_t)y0 * w, n);
+      if (ooc)
+        ScratchDrop(&ooc->water, (size_t)y0 * w * sizeof(float),
+                    (size_t)y1 * w * sizeof(float));
+    }
+  }
+  free(raw);
+  free(zbuf);
+  fclose(fp);
+  if (rc == 0)
+    *step = hdr.step;
+  return rc;
+}
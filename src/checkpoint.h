@@ -0,0 +1,50 @@
+#ifndef checkpoint
+#define checkpoint
+
+#include "outOfCore.h"
+#include "pumping.h"
+#include <stdint.h>
+
+// Simulation state at a step boundary, enough to continue the run with
+// more rain steps appended instead of re-simulating the whole event:
+//
+//   char    magic[8]            "FSCKPTv1"
+//   int32   nXSize, nYSize
+//   int32   step                steps already simulated
+//   int32   decaySteps          infiltration decay horizon of the run
+//   int32   nPumps, chunkRows
+//   float   rain_mm[step], interval_min[step], iter[step]
+//   uint64  intake[nPumps], outlet[nPumps]
+//   int32   cooldown[nPumps]
+//   uint8   state[nPumps]
+//   water, chunkRows rows per chunk:
+//     CheckpointChunk header, then storedBytes bytes
+//
+// Each water chunk is byte-shuffled (all first bytes of the floats, then
+// all second bytes, ...) and deflated, which packs dry and no-data areas
+// to almost nothing; a chunk that does not shrink is stored raw.
+#define CHECKPOINT_MAGIC "FSCKPTv1"
+
+typedef struct {
+  uint64_t storedBytes;
+  int32_t deflated;
+  int32_t pad;
+} CheckpointChunk;
+
+// written to path.tmp and renamed, so an interrupted write never replaces
+// a good checkpoint. ooc: water lives in scratch files (pages are released
+// chunk by chunk). Returns 0 on success.
+int CheckpointWrite(const char *path, int nXSize, int nYSize, int step,
+                    int decaySteps, const float *rain_mm,
+                    const float *interval_min, const float *iter,
+                    const PumpSet *ps, const float *water, OutOfCore *ooc);
+// Restores water and pump state and returns the step to continue from in
+// *step. The grid size and the pump intakes/outlets must match this run;
+// a different decay horizon or rain history is only reported, since the
+// new series may legitimately revise it.
+int CheckpointRead(const char *path, int nXSize, int nYSize, int nSteps,
+                   const float *rain_mm, const float *interval_min,
+                   const float *iter, int decaySteps, PumpSet *ps,
+                   float *water, OutOfCore *ooc, int *step, char *err,
+                   size_t errSize);
+#endif
@@ -0,0 +1,540 @@
+// depression.c - priority-flood depression map and the bathtub estimate
+#include "depression.h"
+#include "cpl_conv.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// D4, the flow kernel's default neighbourhood
+static const int dx4[4] = {-1, 1, 0, 0};
+static const int dy4[4] = {0, 0, -1, 1};
+
+typedef struct {
+  char magic[8];
+  int32_t nXSize, nYSize;
+  int64_t demBytes, demMtime;
+  int64_t nOrder, nDepressions, nCells;
+} DepressionHeader;
+
+typedef struct {
+  float z;
+  int64_t cell;
+} HeapItem;
+
+// lowest elevation first, ties by cell index so the map does not depend on
+// the order cells were pushed in
+static int HeapLess(const HeapItem *a, const HeapItem *b) {
+  return a->z < b->z || (a->z == b->z && a->cell < b->cell);
+}
+
+static void HeapPush(HeapItem *heap, int64_t *n, HeapItem item) {
+  int64_t i = (*n)++;
+  while (i > 0) {
+    int64_t up = (i - 1) / 2;
+    if (!HeapLess(&item, &heap[up]))
+      break;
+    heap[i] = heap[up];
+    i = up;
+  }
+  heap[i] = item;
+}
+
+static HeapItem HeapPop(HeapItem *heap, int64_t *n) {
+  HeapItem top = heap[0];
+  HeapItem last = heap[--(*n)];
+  int64_t i = 0;
+  for (;;) {
+    int64_t c = 2 * i + 1;
+    if (c >= *n)
+      break;
+    if (c + 1 < *n && HeapLess(&heap[c + 1], &heap[c]))
+      c++;
+    if (!HeapLess(&heap[c], &last))
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+static double Seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static DepressionMap *MapAlloc(int nXSize, int nYSize) {
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  DepressionMap *dm = (DepressionMap *)CPLCalloc(1, sizeof(DepressionMap));
+  dm->nXSize = nXSize;
+  dm->nYSize = nYSize;
+  dm->order = (int64_t *)CPLMalloc(npix * sizeof(int64_t));
+  dm->parent = (signed char *)CPLMalloc(npix);
+  dm->label = (int32_t *)CPLCalloc(npix, sizeof(int32_t));
+  if (!dm->order || !dm->parent || !dm->label) {
+    DepressionMapFree(dm);
+    return NULL;
+  }
+  return dm;
+}
+
+void DepressionMapFree(DepressionMap *dm) {
+  if (!dm)
+    return;
+  if (!dm->mapped) {
+    CPLFree(dm->order);
+    CPLFree(dm->parent);
+    CPLFree(dm->label);
+    CPLFree(dm->dep);
+    CPLFree(dm->cells);
+  }
+  CPLFree(dm);
+}
+
+typedef struct {
+  int32_t label;
+  float z;
+  int64_t cell;
+} DepCell;
+
+static int CompareDepCell(const void *pa, const void *pb) {
+  const DepCell *a = (const DepCell *)pa, *b = (const DepCell *)pb;
+  if (a->label != b->label)
+    return a->label < b->label ? -1 : 1;
+  if (a->z != b->z)
+    return a->z < b->z ? -1 : 1;
+  return a->cell < b->cell ? -1 : (a->cell > b->cell);
+}
+
+// Priority-flood (Barnes et al. 2014): cells at or below the spill level of
+// the cell they are reached from go through a plain FIFO at that level, the
+// rest through the heap.
+static DepressionMap *Analyse(const FlowGrid *grid) {
+  int nX = grid->nXSize, nY = grid->nYSize;
+  size_t npix = (size_t)nX * (size_t)nY;
+  const float *elev = grid->elev;
+  const unsigned char *mask = grid->mask;
+  DepressionMap *dm = MapAlloc(nX, nY);
+  float *filled = (float *)CPLMalloc(npix * sizeof(float));
+  HeapItem *heap = (HeapItem *)CPLMalloc(npix * sizeof(HeapItem));
+  int64_t *pit = (int64_t *)CPLMalloc(npix * sizeof(int64_t));
+  if (!dm || !filled || !heap || !pit) {
+    DepressionMapFree(dm);
+    CPLFree(filled);
+    CPLFree(heap);
+    CPLFree(pit);
+    return NULL;
+  }
+  memset(dm->parent, -1, npix);
+
+  // outlets: valid cells on the border or next to no-data; filled stays
+  // NaN until a cell is queued
+  int64_t nHeap = 0;
+  for (size_t i = 0; i < npix; i++)
+    filled[i] = NAN;
+  for (int y = 0; y < nY; y++)
+    for (int x = 0; x < nX; x++) {
+      size_t c = (size_t)y * nX + x;
+      if (!(mask[c] & FLOW_VALID))
+        continue;
+      int outlet = 0;
+      for (int d = 0; d < 4 && !outlet; d++) {
+        int nx = x + dx4[d], ny = y + dy4[d];
+        outlet = nx < 0 || nx >= nX || ny < 0 || ny >= nY ||
+                 !(mask[(size_t)ny * nX + nx] & FLOW_VALID);
+      }
+      if (outlet) {
+        filled[c] = elev[c];
+        HeapItem item = {elev[c], (int64_t)c};
+        HeapPush(heap, &nHeap, item);
+      }
+    }
+
+  int64_t pitHead = 0, pitTail = 0;
+  while (nHeap > 0 || pitHead < pitTail) {
+    int64_t c =
+        pitHead < pitTail ? pit[pitHead++] : HeapPop(heap, &nHeap).cell;
+    dm->order[dm->nOrder++] = c;
+    int x = (int)(c % nX), y = (int)(c / nX);
+    for (int d = 0; d < 4; d++) {
+      int nx = x + dx4[d], ny = y + dy4[d];
+      if (nx < 0 || nx >= nX || ny < 0 || ny >= nY)
+        continue;
+      size_t n = (size_t)ny * nX + nx;
+      if (!(mask[n] & FLOW_VALID) || !isnan(filled[n]))
+        continue;
+      dm->parent[n] = (signed char)(d ^ 1); // the way back to c
+      if (elev[n] <= filled[c]) {
+        filled[n] = filled[c];
+        pit[pitTail++] = (int64_t)n;
+      } else {
+        filled[n] = elev[n];
+        HeapItem item = {elev[n], (int64_t)n};
+        HeapPush(heap, &nHeap, item);
+      }
+    }
+  }
+  CPLFree(heap);
+
+  // depressions in flood order: the raised cells connected (D4) at one
+  // filled level. Not the parent tree: a pit reached over several cells at
+  // its spill level (a flat rim) hangs off the tree in several branches.
+  // pit is reused as the search stack.
+  int64_t nDep = 0, nCells = 0;
+  for (int64_t k = 0; k < dm->nOrder; k++) {
+    int64_t c = dm->order[k];
+    if (dm->label[c] || !(filled[c] > elev[c]))
+      continue;
+    int32_t l = (int32_t)++nDep;
+    int64_t top = 0;
+    dm->label[c] = l;
+    pit[top++] = c;
+    while (top > 0) {
+      int64_t q = pit[--top];
+      nCells++;
+      int x = (int)(q % nX), y = (int)(q / nX);
+      for (int d = 0; d < 4; d++) {
+        int nx = x + dx4[d], ny = y + dy4[d];
+        if (nx < 0 || nx >= nX || ny < 0 || ny >= nY)
+          continue;
+        size_t n = (size_t)ny * nX + nx;
+        if (dm->label[n] || !(mask[n] & FLOW_VALID) ||
+            filled[n] != filled[q] || !(filled[n] > elev[n]))
+          continue;
+        dm->label[n] = l;
+        pit[top++] = (int64_t)n;
+      }
+    }
+  }
+  CPLFree(pit);
+  dm->nDepressions = nDep;
+  dm->nCells = nCells;
+  dm->dep = (Depression *)CPLCalloc((size_t)nDep + 1, sizeof(Depression));
+  dm->cells = (int64_t *)CPLMalloc(
+      (size_t)(nCells > 0 ? nCells : 1) * sizeof(int64_t));
+  DepCell *sorted = (DepCell *)CPLMalloc(
+      (size_t)(nCells > 0 ? nCells : 1) * sizeof(DepCell));
+  int64_t *acc = (int64_t *)CPLCalloc(npix, sizeof(int64_t));
+  if (!dm->dep || !dm->cells || !sorted || !acc) {
+    DepressionMapFree(dm);
+    CPLFree(filled);
+    CPLFree(sorted);
+    CPLFree(acc);
+    return NULL;
+  }
+
+  // contributing cells, children before parents
+  for (int64_t k = dm->nOrder - 1; k >= 0; k--) {
+    int64_t c = dm->order[k];
+    acc[c]++;
+    int d = dm->parent[c];
+    if (d >= 0)
+      acc[c + dx4[d] + (int64_t)dy4[d] * nX] += acc[c];
+  }
+
+  int64_t m = 0;
+  for (int64_t k = 0; k < dm->nOrder; k++) {
+    int64_t c = dm->order[k];
+    int32_t l = dm->label[c];
+    if (!l)
+      continue;
+    Depression *dep = &dm->dep[l];
+    if (dep->count++ == 0) {
+      dep->entry = c;
+      dep->level = filled[c];
+    }
+    // every branch of the tree that enters it, the entry's included
+    int d = dm->parent[c];
+    if (dm->label[c + dx4[d] + (int64_t)dy4[d] * nX] != l)
+      dep->contributing += acc[c];
+    dep->capacity += (double)filled[c] - (double)elev[c];
+    DepCell dc = {l, elev[c], c};
+    sorted[m++] = dc;
+  }
+  qsort(sorted, (size_t)nCells, sizeof(DepCell), CompareDepCell);
+  for (int64_t i = 0; i < nCells; i++) {
+    dm->cells[i] = sorted[i].cell;
+    if (i == 0 || sorted[i].label != sorted[i - 1].label)
+      dm->dep[sorted[i].label].first = i;
+  }
+  for (int64_t l = 1; l <= nDep; l++)
+    dm->capacity += dm->dep[l].capacity;
+  CPLFree(filled);
+  CPLFree(sorted);
+  CPLFree(acc);
+  return dm;
+}
+
+int DepressionMapValid(const DepressionMap *dm) {
+  int nX = dm->nXSize, nY = dm->nYSize;
+  int64_t npix = (int64_t)nX * nY;
+  for (int64_t k = 0; k < dm->nOrder; k++)
+    if (dm->order[k] < 0 || dm->order[k] >= npix)
+      return 0;
+  for (int64_t c = 0; c < npix; c++) {
+    int d = dm->parent[c];
+    if (d < -1 || d > 3 || dm->label[c] < 0 || dm->label[c] > dm->nDepressions)
+      return 0;
+    if (d < 0)
+      continue;
+    int x = (int)(c % nX) + dx4[d], y = (int)(c / nX) + dy4[d];
+    if (x < 0 || x >= nX || y < 0 || y >= nY)
+      return 0;
+  }
+  for (int64_t l = 1; l <= dm->nDepressions; l++) {
+    const Depression *dep = &dm->dep[l];
+    if (dep->entry < 0 || dep->entry >= npix || dep->first < 0 ||
+        dep->count < 0 || dep->count > dm->nCells - dep->first)
+      return 0;
+  }
+  for (int64_t i = 0; i < dm->nCells; i++)
+    if (dm->cells[i] < 0 || dm->cells[i] >= npix)
+      return 0;
+  return 1;
+}
+
+static int DemStamp(const char *demFile, int64_t *bytes, int64_t *mtime) {
+  struct stat st;
+  if (stat(demFile, &st) != 0)
+    return -1;
+  *bytes = (int64_t)st.st_size;
+  *mtime = (int64_t)st.st_mtime;
+  return 0;
+}
+
+static DepressionMap *ReadCache(const char *cachePath, const char *demFile,
+                                const FlowGrid *grid) {
+  int64_t demBytes, demMtime;
+  if (DemStamp(demFile, &demBytes, &demMtime) != 0)
+    return NULL;
+  FILE *fp = fopen(cachePath, "rb");
+  if (!fp)
+    return NULL;
+  size_t npix = (size_t)grid->nXSize * (size_t)grid->nYSize;
+  DepressionHeader hdr;
+  DepressionMap *dm = NULL;
+  if (fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+      memcmp(hdr.magic, DEPRESSION_MAGIC, 8) == 0 &&
+      hdr.nXSize == grid->nXSize && hdr.nYSize == grid->nYSize &&
+      hdr.demBytes == demBytes && hdr.demMtime == demMtime &&
+      hdr.nOrder >= 0 && (uint64_t)hdr.nOrder <= npix &&
+      hdr.nCells >= 0 && hdr.nCells <= hdr.nOrder &&
+      hdr.nDepressions >= 0 && hdr.nDepressions <= hdr.nCells)
+    dm = MapAlloc(grid->nXSize, grid->nYSize);
+  if (dm) {
+    dm->nOrder = hdr.nOrder;
+    dm->nDepressions = hdr.nDepressions;
+    dm->nCells = hdr.nCells;
+    size_t nDep = (size_t)hdr.nDepressions + 1;
+    size_t nCells = (size_t)hdr.nCells;
+    dm->dep = (Depression *)CPLMalloc(nDep * sizeof(Depression));
+    dm->cells = (int64_t *)CPLMalloc(
+        (nCells > 0 ? nCells : 1) * sizeof(int64_t));
+    if (!dm->dep || !dm->cells ||
+        fread(dm->order, sizeof(int64_t), (size_t)dm->nOrder, fp) !=
+            (size_t)dm->nOrder ||
+        fread(dm->parent, 1, npix, fp) != npix ||
+        fread(dm->label, sizeof(int32_t), npix, fp) != npix ||
+        fread(dm->dep, sizeof(Depression), nDep, fp) != nDep ||
+        fread(dm->cells, sizeof(int64_t), nCells, fp) != nCells ||
+        !DepressionMapValid(dm)) {
+      DepressionMapFree(dm);
+      dm = NULL;
+    }
+  }
+  fclose(fp);
+  if (dm)
+    for (int64_t l = 1; l <= dm->nDepressions; l++)
+      dm->capacity += dm->dep[l].capacity;
+  return dm;
+}
+
+// written to a temporary file and renamed, so runs sharing the DEM never
+// read a half-written cache
+static int WriteCache(const DepressionMap *dm, const char *cachePath,
+                      const char *demFile) {
+  DepressionHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  if (DemStamp(demFile, &hdr.demBytes, &hdr.demMtime) != 0)
+    return -1;
+  memcpy(hdr.magic, DEPRESSION_MAGIC, 8);
+  hdr.nXSize = dm->nXSize;
+  hdr.nYSize = dm->nYSize;
+  hdr.nOrder = dm->nOrder;
+  hdr.nDepressions = dm->nDepressions;
+  hdr.nCells = dm->nCells;
+
+  char *tmpPath = (char *)malloc(strlen(cachePath) + 8);
+  if (!tmpPath)
+    return -1;
+  sprintf(tmpPath, "%s.XXXXXX", cachePath);
+  int fd = mkstemp(tmpPath);
+  FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmpPath);
+    }
+    free(tmpPath);
+    return -1;
+  }
+  size_t npix = (size_t)dm->nXSize * (size_t)dm->nYSize;
+  size_t nDep = (size_t)dm->nDepressions + 1;
+  int failed = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  failed |= fwrite(dm->order, sizeof(int64_t), (size_t)dm->nOrder, fp) !=
+            (size_t)dm->nOrder;
+  failed |= fwrite(dm->parent, 1, npix, fp) != npix;
+  failed |= fwrite(dm->label, sizeof(int32_t), npix, fp) != npix;
+  failed |= fwrite(dm->dep, sizeof(Depression), nDep, fp) != nDep;
+  failed |= fwrite(dm->cells, sizeof(int64_t), (size_t)dm->nCells, fp) !=
+            (size_t)dm->nCells;
+  failed |= fclose(fp) != 0;
+  // mkstemp creates it 0600; the cache is as readable as the DEM
+  if (!failed)
+    chmod(tmpPath, 0644);
+  if (!failed)
+    failed = rename(tmpPath, cachePath) != 0;
+  if (failed)
+    remove(tmpPath);
+  free(tmpPath);
+  return failed ? -1 : 0;
+}
+
+DepressionMap *DepressionMapLoad(const char *cachePath, const char *demFile,
+                                 const FlowGrid *grid) {
+  double t0 = Seconds();
+  DepressionMap *dm = ReadCache(cachePath, demFile, grid);
+  if (dm) {
+    dm->fromCache = 1;
+  } else {
+    dm = Analyse(grid);
+    if (dm && WriteCache(dm, cachePath, demFile) != 0)
+      printf("# Warning: could not write the depression cache %s\n",
+             cachePath);
+  }
+  if (dm) {
+    dm->elev = grid->elev;
+    dm->seconds = Seconds() - t0;
+  }
+  return dm;
+}
+
+DepressionMap *DepressionMapAnalyse(const FlowGrid *grid) {
+  double t0 = Seconds();
+  DepressionMap *dm = Analyse(grid);
+  if (dm) {
+    dm->elev = grid->elev;
+    dm->seconds = Seconds() - t0;
+  }
+  return dm;
+}
+
+// water in flow (per cell, m) down the drainage tree; pool gets what each
+// depression holds, flow what passed each cell outside the depressions.
+// Returns what left through the outlets.
+static double Route(const DepressionMap *dm, double *flow, double *pool) {
+  int nX = dm->nXSize;
+  double out = 0.0;
+  memset(pool, 0, sizeof(double) * ((size_t)dm->nDepressions + 1));
+  for (int64_t k = dm->nOrder - 1; k >= 0; k--) {
+    int64_t c = dm->order[k];
+    double v = flow[c];
+    int32_t l = dm->label[c];
+    if (l) {
+      // the entry comes after every cell draining into the depression
+      const Depression *dep = &dm->dep[l];
+      pool[l] += v;
+      if (c != dep->entry)
+        continue;
+      if (pool[l] < 0.0)
+        pool[l] = 0.0;
+      v = pool[l] > dep->capacity ? pool[l] - dep->capacity : 0.0;
+      pool[l] -= v;
+    }
+    int d = dm->parent[c];
+    if (d >= 0)
+      flow[c + dx4[d] + (int64_t)dy4[d] * nX] += v;
+    else
+      out += v;
+  }
+  return out;
+}
+
+double DepressionEstimate(const DepressionMap *dm, float *water, int nPumps,
+                          const size_t *intake, const size_t *outlet,
+                          const double *limit, double *pumped) {
+  size_t npix = (size_t)dm->nXSize * (size_t)dm->nYSize;
+  double *flow = (double *)CPLMalloc(npix * sizeof(double));
+  double *pool = (double *)CPLMalloc(
+      ((size_t)dm->nDepressions + 1) * sizeof(double));
+  if (!flow || !pool) {
+    CPLFree(flow);
+    CPLFree(pool);
+    return -1.0;
+  }
+  for (int64_t k = 0; k < dm->nOrder; k++)
+    flow[dm->order[k]] = water[dm->order[k]];
+
+  // without pumps first, to see how much reaches each intake; pumps in pid
+  // order share what is there
+  double out = 0.0;
+  int anyPump = 0;
+  for (int p = 0; p < nPumps; p++)
+    anyPump |= limit[p] > 0.0;
+  if (anyPump) {
+    Route(dm, flow, pool);
+    for (int p = 0; p < nPumps; p++) {
+      pumped[p] = 0.0;
+      if (!(limit[p] > 0.0))
+        continue;
+      int32_t l = dm->label[intake[p]];
+      double *there = l ? &pool[l] : &flow[intake[p]];
+      pumped[p] = *there < limit[p] ? (*there > 0.0 ? *there : 0.0) : limit[p];
+      *there -= pumped[p];
+    }
+    for (int64_t k = 0; k < dm->nOrder; k++)
+      flow[dm->order[k]] = water[dm->order[k]];
+    for (int p = 0; p < nPumps; p++)
+      if (pumped[p] > 0.0) {
+        flow[intake[p]] -= pumped[p];
+        flow[outlet[p]] += pumped[p];
+      }
+  } else {
+    for (int p = 0; p < nPumps; p++)
+      pumped[p] = 0.0;
+  }
+  out = Route(dm, flow, pool);
+  CPLFree(flow);
+
+  // each depression fills its lowest cells to the level that holds its
+  // pool: m cells under water at level h hold m * h - (their elevations)
+  memset(water, 0, npix * sizeof(float));
+  for (int64_t l = 1; l <= dm->nDepressions; l++) {
+    const Depression *dep = &dm->dep[l];
+    if (!(pool[l] > 0.0))
+      continue;
+    const int64_t *cells = dm->cells + dep->first;
+    double sum = 0.0, h = dep->level;
+    int64_t m = 0;
+    while (m < dep->count) {
+      sum += dm->elev[cells[m]];
+      m++;
+      h = (pool[l] + sum) / (double)m;
+      if (m == dep->count || h <= dm->elev[cells[m]])
+        break;
+    }
+    if (h > dep->level)
+      h = dep->level;
+    for (int64_t i = 0; i < m; i++) {
+      double depth = h - dm->elev[cells[i]];
+      water[cells[i]] = depth > 0.0 ? (float)depth : 0.0f;
+    }
+  }
+  CPLFree(pool);
+  return out;
+}
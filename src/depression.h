@@ -0,0 +1,79 @@
+#ifndef depression
+#define depression
+
+#include "flowKernel.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Terrain analysis for the bathtub estimate (--estimate). A priority-flood
+// from the outlets (valid cells on the raster border or next to no-data)
+// raises every pit to the elevation it spills at and links each cell to
+// the D4 neighbour it was reached from, which gives a drainage tree on the
+// filled surface. Raised cells connected at one filled level form a
+// depression; water reaching any of them is pooled, and its overflow
+// leaves through the parent of its entry, the first of them flooded. The
+// analysis only depends on the DEM, so it is run once and
+// cached next to it:
+//
+//   char    magic[8]            "FSDEPRv2"
+//   int32   nXSize, nYSize
+//   int64   demBytes, demMtime  the DEM it was made from
+//   int64   nOrder, nDepressions, nCells
+//   int64   order[nOrder]       valid cells in flood order, outlets first
+//   int8    parent[nX * nY]     direction to the downstream cell, -1 none
+//   int32   label[nX * nY]      depression of the cell, 0 = none
+//   Depression dep[nDepressions + 1]
+//   int64   cells[nCells]       depression cells, see Depression
+#define DEPRESSION_MAGIC "FSDEPRv2"
+
+typedef struct {
+  int64_t entry;        // first cell flooded; overflow goes to its parent
+  int64_t first, count; // cells[first .. first + count), lowest first
+  int64_t contributing; // cells draining into it, its own included
+  double capacity;      // depth summed over its cells when full (m)
+  float level;          // spill elevation (m)
+  int32_t pad;
+} Depression;
+
+typedef struct {
+  int nXSize, nYSize;
+  const float *elev; // the grid's, not owned
+  int64_t nOrder, nDepressions, nCells;
+  int64_t *order;
+  signed char *parent;
+  int32_t *label;
+  Depression *dep; // dep[1 .. nDepressions]
+  int64_t *cells;
+  int fromCache;       // loaded instead of analysed
+  int mapped;          // arrays point into a compiled terrain, not owned
+  double seconds;      // time to load or analyse
+  double capacity;     // all depressions full (m summed over cells)
+} DepressionMap;
+
+// The analysis of grid from cachePath when it was made from demFile as it
+// is now; otherwise it is run and the cache (re)written. A cache that
+// cannot be written is only reported, a damaged one is analysed again.
+// NULL on allocation failure.
+DepressionMap *DepressionMapLoad(const char *cachePath, const char *demFile,
+                                 const FlowGrid *grid);
+// The analysis of grid alone, no cache read or written (the terrain
+// compiler stores it itself). NULL on allocation failure.
+DepressionMap *DepressionMapAnalyse(const FlowGrid *grid);
+void DepressionMapFree(DepressionMap *dm);
+// 1 if every index in a map read from disk stays in its grid and arrays
+// (cells, parents, labels, depression records), 0 if it is damaged
+int DepressionMapValid(const DepressionMap *dm);
+
+// Bathtub estimate. water holds the depth each cell contributes (rain less
+// infiltration, m) and gets the ponded depth back: the water is routed
+// down the drainage tree into the depressions, each fills from its lowest
+// cell to the level that holds its inflow, and the overflow spills on
+// towards the outlets. Pump p takes up to limit[p] (m summed over cells)
+// from the water reaching cell intake[p] (its depression's when the intake
+// is in one) and releases it at cell outlet[p]; pumped[p] gets what it
+// moved (limit < 0 = disabled). Returns the water that left the DEM (m
+// summed over cells); -1 on allocation failure.
+double DepressionEstimate(const DepressionMap *dm, float *water, int nPumps,
+                          const size_t *intake, const size_t *outlet,
+                          const double *limit, double *pumped);
+#endif
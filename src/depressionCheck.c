@@ -0,0 +1,63 @@
+// depressionCheck.c - regression cases for the depression map (--estimate)
+#include "depression.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// A U-shaped pit at 1 m under a flat 5 m rim, spilling through a 5 m
+// border cell; the flood reaches the pit over three rim cells, once
+// splitting it into several depressions that filled on their own.
+static int UShapedPit(void) {
+  enum { NX = 5, NY = 5 };
+  static const float elev[NX * NY] = {
+      9, 9, 5, 9, 9, //
+      9, 5, 5, 5, 9, //
+      9, 1, 5, 1, 9, //
+      9, 1, 1, 1, 9, //
+      9, 9, 9, 9, 9};
+  unsigned char mask[NX * NY], lahan[NX * NY] = {0};
+  memset(mask, FLOW_VALID, sizeof(mask));
+  FlowGrid grid = {NX, NY, elev, lahan, mask};
+  DepressionMap *dm = DepressionMapAnalyse(&grid);
+  if (!dm) {
+    fprintf(stderr, "Failed: Memory allocation failed\n");
+    return 1;
+  }
+
+  // 16 m on the left arm: all five cells rise to 1 + 16 / 5 = 4.2 m, under
+  // the spill level, so nothing leaves
+  float water[NX * NY] = {0};
+  water[2 * NX + 1] = 16.0f;
+  double out = DepressionEstimate(dm, water, 0, NULL, NULL, NULL, NULL);
+  int failed = 0;
+  if (dm->nDepressions != 1 || dm->nCells != 5 ||
+      fabs(dm->capacity - 20.0) > 1e-9) {
+    fprintf(stderr,
+            "Failed: u-shaped pit: %lld depressions, %lld cells, capacity "
+            "%g (expected 1, 5, 20)\n",
+            (long long)dm->nDepressions, (long long)dm->nCells, dm->capacity);
+    failed = 1;
+  }
+  if (fabs(out) > 1e-6) {
+    fprintf(stderr, "Failed: u-shaped pit: %g m left the DEM (expected 0)\n",
+            out);
+    failed = 1;
+  }
+  for (int c = 0; c < NX * NY; c++) {
+    float expect = elev[c] < 5.0f ? 3.2f : 0.0f;
+    if (fabsf(water[c] - expect) > 1e-5f) {
+      fprintf(stderr,
+              "Failed: u-shaped pit: cell %d,%d holds %g m (expected %g)\n",
+              c % NX, c / NX, water[c], expect);
+      failed = 1;
+    }
+  }
+  DepressionMapFree(dm);
+  return failed;
+}
+
+int main(void) {
+  int failed = UShapedPit();
+  printf("# depression checks: %s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,406 @@
+// domain.c - row bands of one run spread over processes sharing the grids
+#define _GNU_SOURCE
+#include "domain.h"
+#include "terrainFile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// one cache line per counter, so ranks publishing do not contend
+typedef struct {
+  _Atomic long long value;
+  char pad[64 - sizeof(long long)];
+} DomainCounter;
+
+// a pump's state after DomainPumpStep, written by the rank running it
+typedef struct {
+  int32_t state, cooldown;
+  float pumped, level;
+} DomainPump;
+
+// start of the shared segment
+typedef struct {
+  DomainCounter sweeps[DOMAIN_MAX]; // sweeps each rank has finished
+  DomainCounter arrived, generation; // barrier
+  _Atomic int abort;
+  // reductions alternate between the two rows: by the time a rank writes
+  // a row again, the barrier in between guarantees all have read it
+  double reduce[2][DOMAIN_MAX];
+} DomainControl;
+
+struct Domain {
+  int rank, n;
+  int nXSize, nYSize;
+  int y0, y1;
+  int threads;
+  long long sweeps; // this rank's, as published in its counter
+  long long reductions;
+  DomainControl *ctl;
+  DomainPump *pumps;
+  int nPumps;
+  float *elev, *water[2];
+  unsigned char *lahan, *mask;
+  void *base;
+  size_t bytes;
+  // rank 0: the other ranks, and those already reaped
+  pid_t pid[DOMAIN_MAX];
+  int reaped[DOMAIN_MAX], status[DOMAIN_MAX];
+};
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+static size_t PageAlign(size_t bytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+// The name only exists until the segment is mapped; the ranks inherit the
+// mapping, and nothing is left in /dev/shm if the run is killed. Pages
+// are allocated where they are first written.
+static void *SharedAlloc(size_t bytes) {
+  char name[64];
+  snprintf(name, sizeof(name), "/floodsim-%d", (int)getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return NULL;
+  shm_unlink(name);
+  if (ftruncate(fd, (off_t)bytes) != 0) {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Pins the rank to its share of the CPUs it may run on, in CPU order, which
+// keeps a rank's cores on one socket when the ranks divide the sockets.
+// Returns the number of CPUs it got; with fewer CPUs than ranks nothing is
+// pinned and each rank runs one thread.
+static int PinRank(int rank, int n) {
+  cpu_set_t all, mine;
+  if (sched_getaffinity(0, sizeof(all), &all) != 0)
+    return 1;
+  int count = CPU_COUNT(&all);
+  if (count < n)
+    return 1;
+  int first = (int)((long long)count * rank / n);
+  int last = (int)((long long)count * (rank + 1) / n);
+  CPU_ZERO(&mine);
+  for (int cpu = 0, k = 0; cpu < CPU_SETSIZE && k < last; cpu++) {
+    if (!CPU_ISSET(cpu, &all))
+      continue;
+    if (k >= first)
+      CPU_SET(cpu, &mine);
+    k++;
+  }
+  sched_setaffinity(0, sizeof(mine), &mine);
+  return last - first;
+}
+
+Domain *DomainStart(int nDomains, const char *demFile, int nPumps,
+                    char *err, size_t errSize) {
+  if (nDomains < 2 || nDomains > DOMAIN_MAX) {
+    Fail(err, errSize, "Failed: --domains must be 2 .. %d", DOMAIN_MAX);
+    return NULL;
+  }
+  int nXSize, nYSize;
+  // a compiled terrain is mapped by every rank itself: its pages are
+  // shared through the page cache already
+  int compiled = TerrainFileIs(demFile);
+  if (compiled) {
+    TerrainFile *tf = TerrainFileOpen(demFile, err, errSize);
+    if (!tf)
+      return NULL;
+    nXSize = tf->nXSize;
+    nYSize = tf->nYSize;
+    TerrainFileClose(tf);
+  } else {
+    GDALAllRegister();
+    Raster hdr = OpenTiffHeader((char *)demFile, -32767);
+    if (!hdr.dataset) {
+      Fail(err, errSize, "Failed: to open DEM: %s", demFile);
+      return NULL;
+    }
+    nXSize = hdr.nXSize;
+    nYSize = hdr.nYSize;
+    GDALClose(hdr.dataset);
+  }
+  // a band must be at least as tall as the 2-row halo of the stencil
+  if (nYSize / nDomains < 4) {
+    Fail(err, errSize,
+         "Failed: %d rows cannot be split into %d domains of 4 rows or more",
+         nYSize, nDomains);
+    return NULL;
+  }
+
+  Domain *d = (Domain *)calloc(1, sizeof(Domain));
+  if (!d) {
+    Fail(err, errSize, "Failed: Memory allocation failed");
+    return NULL;
+  }
+  d->n = nDomains;
+  d->nXSize = nXSize;
+  d->nYSize = nYSize;
+  d->nPumps = nPumps > 0 ? nPumps : 0;
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  size_t terrain = compiled ? 0 : npix;
+  size_t offPumps = PageAlign(sizeof(DomainControl));
+  size_t offElev = offPumps + PageAlign(sizeof(DomainPump) * d->nPumps);
+  size_t offWater0 = offElev + PageAlign(terrain * sizeof(float));
+  size_t offWater1 = offWater0 + PageAlign(npix * sizeof(float));
+  size_t offLanduse = offWater1 + PageAlign(npix * sizeof(float));
+  size_t offMask = offLanduse + PageAlign(terrain);
+  d->bytes = offMask + PageAlign(terrain);
+  d->base = SharedAlloc(d->bytes);
+  if (!d->base) {
+    Fail(err, errSize, "Failed: shared memory for %d domains (%.1f MB): %s",
+         nDomains, d->bytes / 1048576.0, strerror(errno));
+    free(d);
+    return NULL;
+  }
+  char *base = (char *)d->base;
+  d->ctl = (DomainControl *)base;
+  d->pumps = (DomainPump *)(base + offPumps);
+  d->water[0] = (float *)(base + offWater0);
+  d->water[1] = (float *)(base + offWater1);
+  if (!compiled) {
+    d->elev = (float *)(base + offElev);
+    d->lahan = (unsigned char *)(base + offLanduse);
+    d->mask = (unsigned char *)(base + offMask);
+  }
+
+  // buffered output would be written once more by every rank
+  fflush(stdout);
+  fflush(stderr);
+  pid_t parent = getpid();
+  for (int r = 1; r < nDomains; r++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      Fail(err, errSize, "Failed: to start domain %d: %s", r,
+           strerror(errno));
+      // the ranks already started give up at their first barrier
+      atomic_store(&d->ctl->abort, 1);
+      for (int k = 1; k < r; k++)
+        waitpid(d->pid[k], NULL, 0);
+      munmap(d->base, d->bytes);
+      free(d);
+      return NULL;
+    }
+    if (pid == 0) {
+      d->rank = r;
+      // no rank outlives the run it belongs to
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent)
+        _exit(1);
+      if (!freopen("/dev/null", "w", stdout))
+        _exit(1);
+      break;
+    }
+    d->pid[r] = pid;
+  }
+  d->y0 = (int)((long long)nYSize * d->rank / nDomains);
+  d->y1 = (int)((long long)nYSize * (d->rank + 1) / nDomains);
+  d->threads = PinRank(d->rank, nDomains);
+  return d;
+}
+
+int DomainRank(const Domain *d) { return d->rank; }
+
+int DomainCount(const Domain *d) { return d->n; }
+
+void DomainRows(const Domain *d, int *y0, int *y1) {
+  *y0 = d->y0;
+  *y1 = d->y1;
+}
+
+int DomainThreads(const Domain *d) { return d->threads; }
+
+float *DomainElevation(Domain *d) { return d->elev; }
+
+unsigned char *DomainLanduse(Domain *d) { return d->lahan; }
+
+unsigned char *DomainMask(Domain *d) { return d->mask; }
+
+float *DomainWater(Domain *d, int k) { return d->water[k]; }
+
+// rank 0: reaps ranks that have exited, 1 if there were any
+static int ReapRanks(Domain *d) {
+  int any = 0;
+  for (int r = 1; r < d->n; r++) {
+    if (!d->reaped[r] && waitpid(d->pid[r], &d->status[r], WNOHANG) > 0) {
+      d->reaped[r] = 1;
+      any = 1;
+    }
+  }
+  return any;
+}
+
+// Spins briefly, then yields: ranks mostly wait for each other for a
+// fraction of a sweep, far less than a sleep would take.
+static int WaitFor(Domain *d, _Atomic long long *v, long long target) {
+  for (unsigned spins = 0;; spins++) {
+    if (atomic_load_explicit(v, memory_order_acquire) >= target)
+      return 0;
+    if (atomic_load_explicit(&d->ctl->abort, memory_order_relaxed))
+      return -1;
+    if (spins < 256)
+      continue;
+    // a rank may exit right after passing the last barrier; one that
+    // exits before it has died
+    if (d->rank == 0 && spins % 4096 == 0 && ReapRanks(d)) {
+      if (atomic_load_explicit(v, memory_order_acquire) >= target)
+        return 0;
+      atomic_store(&d->ctl->abort, 1);
+      return -1;
+    }
+    sched_yield();
+  }
+}
+
+int DomainBarrier(Domain *d) {
+  DomainControl *c = d->ctl;
+  long long gen =
+      atomic_load_explicit(&c->generation.value, memory_order_acquire);
+  if (atomic_fetch_add_explicit(&c->arrived.value, 1, memory_order_acq_rel) ==
+      d->n - 1) {
+    atomic_store_explicit(&c->arrived.value, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->generation.value, gen + 1,
+                          memory_order_release);
+    return atomic_load(&c->abort) ? -1 : 0;
+  }
+  return WaitFor(d, &c->generation.value, gen + 1);
+}
+
+int DomainLoadTerrain(Domain *d, Raster *dem, Raster *lahan, int hasNoData,
+                      float noDataValue) {
+  size_t w = (size_t)d->nXSize;
+  size_t first = (size_t)d->y0 * w, n = (size_t)(d->y1 - d->y0) * w;
+  int rc = 0;
+  if (dem->nXSize != d->nXSize || dem->nYSize != d->nYSize ||
+      ReadTiffRows(dem, 0, d->y0, d->y1 - d->y0, d->elev + first) != 0 ||
+      ReadTiffRows(lahan, 2, d->y0, d->y1 - d->y0, d->lahan + first) != 0) {
+    rc = -1;
+    atomic_store(&d->ctl->abort, 1);
+  } else {
+    FlowLanduseClasses(d->lahan + first, n);
+    FlowFillMask(d->mask, d->nXSize, d->nYSize, d->elev, hasNoData,
+                 noDataValue, d->y0, d->y1);
+  }
+  return DomainBarrier(d) != 0 || rc != 0 ? -1 : 0;
+}
+
+int DomainSweep(Domain *d, FlowContext *ctx, float **water, float **tmp,
+                const float infil_m[4]) {
+  long long j = d->sweeps;
+  DomainCounter *done = d->ctl->sweeps;
+  if ((d->rank > 0 && WaitFor(d, &done[d->rank - 1].value, j) != 0) ||
+      (d->rank < d->n - 1 && WaitFor(d, &done[d->rank + 1].value, j) != 0))
+    return -1;
+  FlowSweepRows(ctx, *water, *tmp, infil_m, d->y0, d->y1);
+  float *swap = *water;
+  *water = *tmp;
+  *tmp = swap;
+  d->sweeps = j + 1;
+  atomic_store_explicit(&done[d->rank].value, j + 1, memory_order_release);
+  return 0;
+}
+
+static int Reduce(Domain *d, double *value, int sum) {
+  double *slot = d->ctl->reduce[d->reductions++ & 1];
+  slot[d->rank] = *value;
+  if (DomainBarrier(d) != 0)
+    return -1;
+  double r = slot[0];
+  for (int k = 1; k < d->n; k++)
+    r = sum ? r + slot[k] : (slot[k] > r ? slot[k] : r);
+  *value = r;
+  return 0;
+}
+
+int DomainMax(Domain *d, double *value) { return Reduce(d, value, 0); }
+
+int DomainSum(Domain *d, double *value) { return Reduce(d, value, 1); }
+
+int DomainPumpStep(Domain *d, PumpSet *ps, float *water, float dtHours,
+                   float pixelArea, int cooldownReset, int nThreads) {
+  if (ps->nActive == 0)
+    return 0;
+  size_t in0 = (size_t)d->y0 * d->nXSize, in1 = (size_t)d->y1 * d->nXSize;
+  // footprints and outlets reach into other bands: every sweep is done
+  // before the first batch, and each batch before the next
+  if (DomainBarrier(d) != 0)
+    return -1;
+  for (int b = 0; b < ps->nBatches; b++) {
+    PumpBatch(ps, b, water, dtHours, pixelArea, cooldownReset, nThreads, in0,
+              in1);
+    for (int k = ps->batchFirst[b]; k < ps->batchFirst[b + 1]; k++) {
+      int pid = ps->batchPumps[k];
+      if (ps->intake[pid] < in0 || ps->intake[pid] >= in1)
+        continue;
+      DomainPump *p = &d->pumps[pid];
+      p->state = ps->state[pid];
+      p->cooldown = ps->cooldown[pid];
+      p->pumped = ps->pumped[pid];
+      p->level = ps->level[pid];
+    }
+    if (DomainBarrier(d) != 0)
+      return -1;
+  }
+  // every rank keeps the whole set, for the log and PumpsIdle
+  for (int pid = 0; pid < ps->nPumps && pid < d->nPumps; pid++) {
+    if (!PumpEnabled(ps, pid))
+      continue;
+    const DomainPump *p = &d->pumps[pid];
+    ps->state[pid] = (unsigned char)p->state;
+    ps->cooldown[pid] = p->cooldown;
+    ps->pumped[pid] = p->pumped;
+    ps->level[pid] = p->level;
+  }
+  return 0;
+}
+
+int DomainFinish(Domain *d, int rc, char *err, size_t errSize) {
+  if (rc != 0)
+    atomic_store(&d->ctl->abort, 1);
+  if (d->rank != 0)
+    return rc;
+  int failed = 0;
+  for (int r = 1; r < d->n; r++) {
+    if (!d->reaped[r] && waitpid(d->pid[r], &d->status[r], 0) > 0)
+      d->reaped[r] = 1;
+    if (!d->reaped[r] || !WIFEXITED(d->status[r]) ||
+        WEXITSTATUS(d->status[r]) != 0) {
+      if (!failed && rc == 0)
+        Fail(err, errSize, "Failed: domain %d of %d did not finish", r,
+             d->n);
+      failed = 1;
+    }
+  }
+  return rc != 0 || failed ? 1 : 0;
+}
+
+void DomainFree(Domain *d) {
+  if (!d)
+    return;
+  munmap(d->base, d->bytes);
+  free(d);
+}
@@ -0,0 +1,81 @@
+#ifndef domain
+#define domain
+
+#include "flowKernel.h"
+#include "gdalShortcut.h"
+#include "pumping.h"
+#include <stddef.h>
+
+// Multi-process runs (--domains N): the raster is split into N bands of
+// rows, each owned by one process (rank) on this machine. Terrain, water
+// and the sweep's second grid live in POSIX shared memory that every rank
+// maps; a rank only writes its own rows (and the pump cells below) and
+// reads its neighbours' boundary rows in place, so the halo exchange is a
+// matter of ordering, not copying:
+//
+// - a sweep of rows [y0, y1) reads rows y0-2 .. y1+1 of the previous grid
+//   (see FlowSweepRows). Each rank publishes how many sweeps it finished
+//   in a lock-free sequence counter; sweep j starts once both neighbours
+//   have finished sweep j-1, which is also when they are done reading the
+//   rows it overwrites.
+// - pumps can reach any cell, so they run between barriers. A pump is run
+//   by the rank owning its intake cell, batch by batch (see PumpSetCreate),
+//   and writes its footprint and outlet directly, in whatever band they
+//   are. Every rank then gets the state of all pumps.
+// - rank 0 does everything that looks at the whole grid (pump log, stats,
+//   gauges, the output) while the others wait at a barrier.
+//
+// The result is bit-identical to a single-process run. Ranks are forked
+// before anything else runs (libgomp does not survive a fork after its
+// threads exist); each gets its own slice of the CPUs and first touches
+// its own rows, so its pages stay on its NUMA node.
+#define DOMAIN_MAX 64
+
+typedef struct Domain Domain;
+
+// Maps the shared grids for the DEM's size and forks nDomains - 1 ranks.
+// Returns in every process, with its own rank; stdout of ranks > 0 is
+// discarded. NULL with err set on failure (before forking).
+Domain *DomainStart(int nDomains, const char *demFile, int nPumps,
+                    char *err, size_t errSize);
+int DomainRank(const Domain *d);
+int DomainCount(const Domain *d);
+// rows [y0, y1) owned by this rank
+void DomainRows(const Domain *d, int *y0, int *y1);
+// CPUs this rank is pinned to: its thread count
+int DomainThreads(const Domain *d);
+
+// shared grids, indexed like the full raster. Without terrain (NULL) when
+// the DEM is a compiled terrain, which every rank maps instead.
+float *DomainElevation(Domain *d);
+unsigned char *DomainLanduse(Domain *d);
+unsigned char *DomainMask(Domain *d);
+float *DomainWater(Domain *d, int k); // k = 0, 1: the sweep's two grids
+
+// Every rank reads its rows of DEM and landuse (headers opened with
+// OpenTiffHeader), converts the classes and fills the mask, then waits
+// for the others. -1 if this rank or another failed.
+int DomainLoadTerrain(Domain *d, Raster *dem, Raster *lahan, int hasNoData,
+                      float noDataValue);
+
+// The calls below are collective: every rank makes them in the same order,
+// and they return -1 once any rank has given up (DomainFinish with an
+// error, or a rank that died), so none of them is left waiting.
+int DomainBarrier(Domain *d);
+// sweep of this rank's rows from *water into *tmp, then the two trade
+// places; FlowMaxFlux / FlowInfiltrated cover this rank's rows
+int DomainSweep(Domain *d, FlowContext *ctx, float **water, float **tmp,
+                const float infil_m[4]);
+// *value of every rank combined, in rank order: largest or sum
+int DomainMax(Domain *d, double *value);
+int DomainSum(Domain *d, double *value);
+// PumpStep across the ranks; ps ends up the same in all of them
+int DomainPumpStep(Domain *d, PumpSet *ps, float *water, float dtHours,
+                   float pixelArea, int cooldownReset, int nThreads);
+
+// End of the run. rc != 0 makes the other ranks give up; rank 0 then waits
+// for all of them and returns 1 (err set if it had not failed itself) if
+// any failed. Ranks > 0 get their own rc back.
+int DomainFinish(Domain *d, int rc, char *err, size_t errSize);
+void DomainFree(Domain *d);
+#endif
@@ -0,0 +1,279 @@
+// ensemble.c - batch of scenarios sharing one terrain load
+#include "ensemble.h"
+#include "json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// whole file as a NUL-terminated string
+static char *ReadTextFile(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+  char *text = NULL;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long size = ftell(fp);
+    if (size >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+      text = (char *)malloc((size_t)size + 1);
+      if (text && fread(text, 1, (size_t)size, fp) != (size_t)size) {
+        free(text);
+        text = NULL;
+      } else if (text) {
+        text[size] = '\0';
+      }
+    }
+  }
+  fclose(fp);
+  return text;
+}
+
+// every file or directory a scenario writes; the pump log also has the
+// .bin it is recorded to before the CSV conversion
+#define WRITTEN_MAX 8
+
+typedef struct {
+  Scenario sc;
+  const char *name;
+  char *written[WRITTEN_MAX + 1]; // canonical paths, NULL-terminated
+  char *resume;                   // canonical, NULL without one
+  int rc;
+  SimTimings timings;
+  char err[1024];
+} EnsembleItem;
+
+// path with its directory resolved, so "a.tif", "./a.tif" and a symlinked
+// directory compare equal; the file itself need not exist yet
+static char *CanonicalPath(const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *base = slash ? slash + 1 : path;
+  char *dir = slash ? strndup(path, (size_t)(slash - path + 1)) : strdup(".");
+  char *real = dir ? realpath(dir, NULL) : NULL;
+  free(dir);
+  if (!real)
+    return strdup(path);
+  char *out = (char *)malloc(strlen(real) + strlen(base) + 2);
+  if (out)
+    sprintf(out, "%s/%s", real, base);
+  free(real);
+  return out;
+}
+
+static int CollectWritten(EnsembleItem *it) {
+  const Scenario *sc = &it->sc;
+  const char *paths[WRITTEN_MAX - 1] = {
+      sc->output,         sc->pumpLog,      NULL,
+      sc->checkpointFile, sc->snapshotPath, sc->tilesDir,
+      sc->statsFile};
+  char *bin = (char *)malloc(strlen(sc->pumpLog) + 5);
+  if (!bin)
+    return -1;
+  sprintf(bin, "%s.bin", sc->pumpLog);
+  paths[2] = bin;
+  int n = 0, rc = 0;
+  for (int k = 0; k < WRITTEN_MAX - 1 && rc == 0; k++) {
+    if (!paths[k])
+      continue;
+    if (!(it->written[n++] = CanonicalPath(paths[k])))
+      rc = -1;
+  }
+  if (rc == 0 && sc->gaugeOutput &&
+      !(it->written[n++] = CanonicalPath(sc->gaugeOutput)))
+    rc = -1;
+  if (rc == 0 && sc->resumeFile && !(it->resume = CanonicalPath(sc->resumeFile)))
+    rc = -1;
+  free(bin);
+  return rc;
+}
+
+// 1 if another scenario writes the file resume reads: which version it
+// would read depends on how the two runs interleave
+static int ResumeClash(const EnsembleItem *reader, const EnsembleItem *writer) {
+  if (!reader->resume)
+    return 0;
+  for (int k = 0; writer->written[k]; k++)
+    if (strcmp(reader->resume, writer->written[k]) == 0)
+      return 1;
+  return 0;
+}
+
+static void ItemsFree(EnsembleItem *items, int n) {
+  for (int i = 0; i < n; i++) {
+    ScenarioFree(&items[i].sc);
+    for (int k = 0; k < WRITTEN_MAX && items[i].written[k]; k++)
+      free(items[i].written[k]);
+    free(items[i].resume);
+  }
+  free(items);
+}
+
+// parses every scenario up front so a bad manifest fails before the
+// terrain is loaded
+static int ParseManifest(const JsonValue *doc, EnsembleItem **itemsOut,
+                         int *nOut) {
+  const JsonValue *list = doc;
+  if (doc->type == JSON_OBJECT)
+    list = JsonGet(doc, "scenarios");
+  if (!list || list->type != JSON_ARRAY || list->count == 0) {
+    fprintf(stderr, "Failed: manifest must hold a non-empty scenario array\n");
+    return -1;
+  }
+  int n = list->count;
+  EnsembleItem *items = (EnsembleItem *)calloc((size_t)n, sizeof(EnsembleItem));
+  if (!items) {
+    fprintf(stderr, "Failed: Memory allocation failed\n");
+    return -1;
+  }
+  *itemsOut = items;
+  *nOut = n;
+  for (int i = 0; i < n; i++) {
+    EnsembleItem *it = &items[i];
+    char err[1024];
+    if (ScenarioFromJson(&list->items[i], &it->sc, err, sizeof(err)) != 0) {
+      fprintf(stderr, "%s (scenario %d)\n", err, i);
+      return -1;
+    }
+    it->name = JsonString(JsonGet(&list->items[i], "name"));
+    if (CollectWritten(it) != 0) {
+      fprintf(stderr, "Failed: Memory allocation failed\n");
+      return -1;
+    }
+    // scenarios run concurrently: two writers on one file would corrupt it
+    for (int j = 0; j <= i; j++) {
+      for (int a = 0; it->written[a]; a++) {
+        // within one scenario only against the paths after this one
+        for (int b = j == i ? a + 1 : 0; items[j].written[b]; b++) {
+          if (strcmp(it->written[a], items[j].written[b]) != 0)
+            continue;
+          if (j == i)
+            fprintf(stderr, "Failed: scenario %d writes %s twice\n", i,
+                    it->written[a]);
+          else
+            fprintf(stderr, "Failed: scenarios %d and %d both write %s\n",
+                    j, i, it->written[a]);
+          return -1;
+        }
+      }
+      if (j < i && (ResumeClash(it, &items[j]) || ResumeClash(&items[j], it))) {
+        fprintf(stderr,
+                "Failed: scenarios %d and %d: one resumes from a file the "
+                "other writes\n",
+                j, i);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int EnsembleRun(const char *demFile, const char *lahanFile,
+                const SimOptions *opt, const char *manifestFile, int nJobs) {
+  char *text = ReadTextFile(manifestFile);
+  if (!text) {
+    fprintf(stderr, "Failed: to read manifest %s\n", manifestFile);
+    return 1;
+  }
+  char err[1024] = "";
+  JsonValue *doc = JsonParse(text, err, sizeof(err));
+  free(text);
+  if (!doc) {
+    fprintf(stderr, "Failed: invalid manifest JSON (%s)\n", err);
+    return 1;
+  }
+
+  EnsembleItem *items = NULL;
+  int nItems = 0;
+  int rc = ParseManifest(doc, &items, &nItems);
+
+  Terrain terrain;
+  if (rc == 0 &&
+      TerrainLoad(&terrain, demFile, lahanFile, opt, err, sizeof(err)) != 0) {
+    fprintf(stderr, "%s\n", err);
+    rc = -1;
+  }
+  if (rc != 0) {
+    ItemsFree(items, nItems);
+    JsonFree(doc);
+    return 1;
+  }
+
+  int nThreads = opt->nThreads;
+#ifdef _OPENMP
+  if (nThreads <= 0)
+    nThreads = omp_get_max_threads();
+#else
+  nThreads = 1;
+  nJobs = 1;
+#endif
+  if (nJobs <= 0)
+    nJobs = nThreads;
+  if (nJobs > nItems)
+    nJobs = nItems;
+  // out-of-core water lives in the terrain's scratch files: one at a time
+  if (opt->scratchDir)
+    nJobs = 1;
+  int threadsPerJob = nThreads / nJobs > 1 ? nThreads / nJobs : 1;
+#ifdef _OPENMP
+  // each scenario's sweeps get their own thread team inside the batch team
+  if (nJobs > 1 && threadsPerJob > 1)
+    omp_set_max_active_levels(2);
+#endif
+
+  // one state per concurrent slot, reused by the scenarios run in it
+  SimState *states = (SimState *)calloc((size_t)nJobs, sizeof(SimState));
+  int nStates = 0;
+  while (states && nStates < nJobs &&
+         SimStateCreate(&states[nStates], &terrain, opt, threadsPerJob) == 0)
+    nStates++;
+  if (nStates < nJobs) {
+    fprintf(stderr, "Failed: Memory allocation failed\n");
+    rc = 1;
+  } else {
+    printf("# Batch: %d scenarios, %d at a time x %d threads, SIMD: %s\n",
+           nItems, nJobs, threadsPerJob, FlowSimdName());
+    fflush(stdout);
+    double t0 = NowSeconds();
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nJobs)
+    for (int i = 0; i < nItems; i++) {
+      int slot = 0;
+#ifdef _OPENMP
+      slot = omp_get_thread_num();
+#endif
+      EnsembleItem *it = &items[i];
+      SimOptions jobOpt = *opt;
+      jobOpt.nThreads = threadsPerJob;
+      it->sc.binaryLog |= opt->binaryLog;
+      jobOpt.binaryLog = it->sc.binaryLog;
+      it->rc = RunScenario(&terrain, &states[slot], &jobOpt, &it->sc,
+                           &it->timings, it->err, sizeof(it->err));
+      if (it->rc == 0)
+        printf("# Scenario %d%s%s: %s done in %.3f s\n", i,
+               it->name ? " " : "", it->name ? it->name : "", it->sc.output,
+               it->timings.total);
+      else
+        fprintf(stderr, "%s (scenario %d)\n", it->err, i);
+      fflush(stdout);
+    }
+
+    double elapsed = NowSeconds() - t0;
+    int failed = 0;
+    for (int i = 0; i < nItems; i++)
+      failed += items[i].rc != 0;
+    printf("# Batch done: %d ok, %d failed in %.3f s (%.2f scenarios/s)\n",
+           nItems - failed, failed, elapsed,
+           elapsed > 0 ? nItems / elapsed : 0.0);
+    rc = failed > 0;
+  }
+
+  for (int s = 0; s < nStates; s++)
+    SimStateFree(&states[s]);
+  free(states);
+  TerrainFree(&terrain, opt);
+  ItemsFree(items, nItems);
+  JsonFree(doc);
+  return rc;
+}
@@ -0,0 +1,21 @@
+#ifndef ensemble
+#define ensemble
+
+#include "simulation.h"
+
+// Batch mode: many rainfall / pump scenarios against one terrain load. The
+// manifest is a JSON array of scenarios (or {"scenarios": [...]}), each
+// with the fields of a worker job (see worker.h) plus an optional "name":
+//
+//   [{"name": "T5-pumps-on", "output_tif": "result/t5.tif",
+//     "pump_log": "result/t5.csv", "rain_timeseries": [...],
+//     "pumps": [...]}, ...]
+//
+// Up to nJobs scenarios run at the same time (0 = one per thread, capped by
+// the number of scenarios), splitting opt->nThreads between them. Only
+// the water state is per scenario; elevation, landuse and the validity
+// mask are loaded once and shared. Returns 0 when every scenario
+// succeeded.
+int EnsembleRun(const char *demFile, const char *lahanFile,
+                const SimOptions *opt, const char *manifestFile, int nJobs);
+#endif
@@ -0,0 +1,967 @@
+// flowKernel.c - parallel 4- or 8-directional flow + infiltration sweep
+//
+// The original loop scattered each cell's outflow into tmp[nidx], which
+// makes row bands race on their boundary rows. Here every cell gathers
+// instead: the outflows of a row are computed into a small ring of row
+// buffers (one halo row above and below each band), then each output cell
+// adds its inflows and subtracts its outflows in exactly the order the
+// serial scatter loop applied them (up, left, self + infiltration, right,
+// down). Each thread writes only its own rows, so no atomics are needed and
+// the float results do not depend on the thread count.
+//
+// D8 adds the diagonals, gathered in the same raster order (the three
+// cells above, left, self, right, the three below). Each neighbourhood has
+// its own kernels, generated from one body with the neighbourhood fixed at
+// compile time, and FlowSetNeighbours picks them once per context.
+//
+// FlowSweepInPlace needs no output grid: a row's outflows are taken before
+// the row is rewritten, and the flows that read rows of a neighbouring band
+// are taken by every thread before any thread writes.
+#include "flowKernel.h"
+#include "cpl_conv.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+// one SSE/AVX2/AVX-512 clone per row kernel, picked at load time by the
+// CPU (ifunc); "default" is the plain x86-64 build
+#define FLOW_SIMD_CLONES                                                       \
+  __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#define FLOW_INLINE inline __attribute__((always_inline))
+#else
+#define FLOW_SIMD_CLONES
+#define FLOW_INLINE inline
+#endif
+
+// direction order matches the original dx/dy arrays: W, E, N, S, then the
+// D8 diagonals
+enum {
+  DIR_W,
+  DIR_E,
+  DIR_N,
+  DIR_S,
+  DIR_NW,
+  DIR_NE,
+  DIR_SW,
+  DIR_SE,
+  NDIRS_MAX
+};
+
+// diagonal head differences are taken over sqrt(2) cells
+#define FLOW_DIAG_WEIGHT 0.70710678f
+
+// kernels of one neighbourhood, see FlowSetNeighbours; the row flows
+// also per state storage (FlowSetCompact), elev and water are float or
+// 16-bit to match
+typedef void (*RowFlowsFn)(const void *elev, const void *water,
+                           const unsigned char *mask, int nXSize, int x0,
+                           int x1, float *slot, size_t stride, float elevStep,
+                           float depthStep);
+typedef float (*GatherRowFn)(const float *water, const unsigned char *mask,
+                             const unsigned char *lahan, int x0, int x1,
+                             const float *up, const float *cur,
+                             const float *down, size_t stride, float i0,
+                             float i1, float i2, float i3, float *out,
+                             double *taken);
+
+// Row slot: NDIRS_MAX outflow rows of nXSize floats, each padded by one zero
+// on both ends so the gather can read x-1 / x+1 without edge branches.
+// Cells without outflow in a direction hold +0, which leaves the sum
+// unchanged, so no direction bitmask is needed.
+// edge[] holds the in-place sweep's band edge rows y0-1, y0, y1-1, y1.
+// depth is the row a compact sweep gathers, decoded to float.
+typedef struct {
+  float *flow[3];
+  float *edge[4];
+  float *depth;
+} RowRing;
+
+struct FlowContext {
+  FlowGrid grid;
+  int nThreads;
+  int nDirs; // 4 or 8
+  RowFlowsFn rowFlows[2]; // float state, the compact one
+  GatherRowFn gather[2];  // plain, with infiltration tracking
+  int compactType; // FLOW_STATE_FLOAT16 / FIXED16 for FlowSweepCompact
+  const uint16_t *elev16;
+  float elevStep, depthStep;
+  size_t rowStride;
+  RowRing *rings;
+  // sparse mode: tiles changed since their last sweep
+  int tilesX, tilesY;
+  unsigned char *dirty;
+  int *activeTiles;
+  float flux; // largest net flux of the last sweep
+  int trackInfil;
+  double infiltrated; // depth infiltrated in the last sweep (m over cells)
+};
+
+static FLOW_INLINE void FillMaskRow(unsigned char *mask, int nXSize,
+                                    int interiorRow, const float *elev,
+                                    int hasNoData, float noDataValue) {
+  for (int x = 0; x < nXSize; x++) {
+    float e = elev[x];
+    unsigned char m = 0;
+    if (!(hasNoData && e == noDataValue) && !isnan(e)) {
+      m = FLOW_VALID;
+      if (interiorRow && x >= 1 && x < nXSize - 1)
+        m |= FLOW_ACTIVE;
+    }
+    mask[x] = m;
+  }
+}
+
+void FlowFillMask(unsigned char *mask, int nXSize, int nYSize,
+                  const float *elev, int hasNoData, float noDataValue, int y0,
+                  int y1) {
+#pragma omp parallel for schedule(static)
+  for (int y = y0; y < y1; y++) {
+    size_t row = (size_t)y * nXSize;
+    int interiorRow = (y >= 1 && y < nYSize - 1);
+    // the no-data test is decided per call, not per cell
+    if (hasNoData)
+      FillMaskRow(mask + row, nXSize, interiorRow, elev + row, 1, noDataValue);
+    else
+      FillMaskRow(mask + row, nXSize, interiorRow, elev + row, 0, 0.0f);
+  }
+}
+
+unsigned char *FlowBuildMask(int nXSize, int nYSize, const float *elev,
+                             int hasNoData, float noDataValue) {
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  unsigned char *mask = (unsigned char *)CPLMalloc(npix);
+  if (!mask)
+    return NULL;
+  FlowFillMask(mask, nXSize, nYSize, elev, hasNoData, noDataValue, 0, nYSize);
+  return mask;
+}
+
+FlowContext *FlowCreate(const FlowGrid *grid, int nThreads) {
+#ifdef _OPENMP
+  if (nThreads <= 0)
+    nThreads = omp_get_max_threads();
+#else
+  nThreads = 1;
+#endif
+  if (nThreads < 1)
+    nThreads = 1;
+
+  FlowContext *ctx = (FlowContext *)calloc(1, sizeof(FlowContext));
+  if (!ctx)
+    return NULL;
+  ctx->grid = *grid;
+  ctx->nThreads = nThreads;
+  ctx->rowStride = (size_t)grid->nXSize + 2;
+  ctx->rings = (RowRing *)calloc((size_t)nThreads, sizeof(RowRing));
+  if (!ctx->rings) {
+    free(ctx);
+    return NULL;
+  }
+  for (int t = 0; t < nThreads; t++) {
+    for (int s = 0; s < 3; s++)
+      ctx->rings[t].flow[s] =
+          (float *)CPLCalloc(NDIRS_MAX * ctx->rowStride, sizeof(float));
+    for (int s = 0; s < 4; s++)
+      ctx->rings[t].edge[s] =
+          (float *)CPLCalloc(NDIRS_MAX * ctx->rowStride, sizeof(float));
+    ctx->rings[t].depth = (float *)CPLCalloc(ctx->rowStride, sizeof(float));
+  }
+  ctx->depthStep = 1.0f;
+  FlowSetNeighbours(ctx, 4);
+  ctx->tilesX = (grid->nXSize + FLOW_TILE_X - 1) / FLOW_TILE_X;
+  ctx->tilesY = (grid->nYSize + FLOW_TILE_Y - 1) / FLOW_TILE_Y;
+  size_t nTiles = (size_t)ctx->tilesX * ctx->tilesY;
+  ctx->dirty = (unsigned char *)CPLMalloc(nTiles);
+  ctx->activeTiles = (int *)CPLMalloc(nTiles * sizeof(int));
+  FlowMarkAllDirty(ctx);
+  return ctx;
+}
+
+void FlowDestroy(FlowContext *ctx) {
+  if (!ctx)
+    return;
+  for (int t = 0; t < ctx->nThreads; t++) {
+    for (int s = 0; s < 3; s++)
+      CPLFree(ctx->rings[t].flow[s]);
+    for (int s = 0; s < 4; s++)
+      CPLFree(ctx->rings[t].edge[s]);
+    CPLFree(ctx->rings[t].depth);
+  }
+  free(ctx->rings);
+  CPLFree(ctx->dirty);
+  CPLFree(ctx->activeTiles);
+  free(ctx);
+}
+
+int FlowThreadCount(const FlowContext *ctx) { return ctx->nThreads; }
+
+float FlowMaxFlux(const FlowContext *ctx) { return ctx->flux; }
+
+void FlowTrackInfiltration(FlowContext *ctx, int on) {
+  ctx->trackInfil = on;
+  ctx->infiltrated = 0.0;
+}
+
+double FlowInfiltrated(const FlowContext *ctx) { return ctx->infiltrated; }
+
+const char *FlowSimdName(void) {
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return "avx512f";
+  if (__builtin_cpu_supports("avx2"))
+    return "avx2";
+  if (__builtin_cpu_supports("sse4.1"))
+    return "sse4.1";
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// ---- state storage ----
+// FLOW_STATE_FLOAT32 is the plain float grid. The compact states hold
+// depth in 16 bits, as an IEEE half (depth is never negative, values above
+// 65504 m saturate) or as fixed point of depthStep m, and elevation as
+// elevStep steps above the lowest cell. Only head differences matter, so
+// the missing base does not change the flows. The conversions use integer
+// selects, which keeps the row kernels vectorized.
+static FLOW_INLINE float HalfToFloat(uint16_t h) {
+  union {
+    uint32_t u;
+    float f;
+  } v;
+  // rebias the exponent of normal halves; denormals (mantissa * 2^-24) go
+  // through an int conversion, as float denormals would stall the FPU
+  v.u = ((uint32_t)(h & 0x7fff) << 13) + ((127u - 15u) << 23);
+  float denorm = (float)(h & 0x3ff) * 0x1p-24f;
+  return (h & 0x7c00) ? v.f : denorm;
+}
+
+// round to nearest even, like a hardware conversion. Clamped with selects:
+// fminf / fmaxf are libm calls here and would keep the loops scalar.
+static FLOW_INLINE uint16_t FloatToHalf(float f) {
+  f = (f > 0.0f) ? f : 0.0f;
+  f = (f < 65504.0f) ? f : 65504.0f;
+  union {
+    uint32_t u;
+    float f;
+  } v, d;
+  v.f = f;
+  // below 2^-14 the half is denormal: adding 0.5 lines the mantissa up
+  d.f = f + 0.5f;
+  uint32_t denorm = d.u - 0x3f000000u;
+  uint32_t norm = (v.u + 0xc8000fffu + ((v.u >> 13) & 1)) >> 13;
+  return (uint16_t)(v.u < 0x38800000u ? denorm : norm);
+}
+
+static FLOW_INLINE float LoadDepth(const void *water, ptrdiff_t i, int fmt,
+                                   float step) {
+  if (fmt == FLOW_STATE_FLOAT16)
+    return HalfToFloat(((const uint16_t *)water)[i]);
+  if (fmt == FLOW_STATE_FIXED16)
+    return (float)((const uint16_t *)water)[i] * step;
+  return ((const float *)water)[i];
+}
+
+static FLOW_INLINE void StoreDepth(void *water, ptrdiff_t i, float v, int fmt,
+                                   float invStep) {
+  if (fmt == FLOW_STATE_FLOAT16)
+    ((uint16_t *)water)[i] = FloatToHalf(v);
+  else if (fmt == FLOW_STATE_FIXED16) {
+    float q = v * invStep + 0.5f;
+    q = (q > 0.0f) ? q : 0.0f;
+    ((uint16_t *)water)[i] = (uint16_t)((q < 65535.0f) ? q : 65535.0f);
+  } else
+    ((float *)water)[i] = v;
+}
+
+static FLOW_INLINE float LoadElev(const void *elev, ptrdiff_t i, int fmt,
+                                  float step) {
+  if (fmt == FLOW_STATE_FLOAT32)
+    return ((const float *)elev)[i];
+  return (float)((const uint16_t *)elev)[i] * step;
+}
+
+// Outflows of the interior cells x0 <= x < x1 of a row into the direction
+// rows of slot, branch-free so each clone vectorizes. Same arithmetic as
+// the original loop: invalid neighbours and non-positive differences
+// contribute +0 to `total`, which does not change the sum, and
+// (pot / total) * water is evaluated per direction. d8 and fmt are
+// constants in every instantiation, so the D4 kernels carry no trace of
+// the diagonals and the float ones none of the conversions.
+static FLOW_INLINE void
+RowFlowsBody(const void *restrict elev, const void *restrict water,
+             const unsigned char *restrict mask, int nXSize, int x0, int x1,
+             float *restrict slot, size_t stride, int d8, int fmt,
+             float elevStep, float depthStep) {
+  const ptrdiff_t up = -(ptrdiff_t)nXSize, dn = nXSize;
+  const unsigned char *mU = mask - nXSize, *mD = mask + nXSize;
+  float *fW = slot + DIR_W * stride, *fE = slot + DIR_E * stride;
+  float *fN = slot + DIR_N * stride, *fS = slot + DIR_S * stride;
+  float *fNW = slot + DIR_NW * stride, *fNE = slot + DIR_NE * stride;
+  float *fSW = slot + DIR_SW * stride, *fSE = slot + DIR_SE * stride;
+// water surface of cell i of the row
+#define FLOW_SURFACE(i)                                                        \
+  (LoadElev(elev, (i), fmt, elevStep) + LoadDepth(water, (i), fmt, depthStep))
+
+#pragma omp simd
+  for (int x = x0; x < x1; x++) {
+    float w = LoadDepth(water, x, fmt, depthStep);
+    float z = LoadElev(elev, x, fmt, elevStep) + w;
+    float dW = z - FLOW_SURFACE(x - 1);
+    float dE = z - FLOW_SURFACE(x + 1);
+    float dN = z - FLOW_SURFACE(up + x);
+    float dS = z - FLOW_SURFACE(dn + x);
+    // only selects, no branches: invalid neighbours and inactive cells
+    // turn into zero potentials, and inactive lanes divide by 1
+    float pW = (mask[x - 1] & FLOW_VALID) ? (dW > 0.0f ? dW : 0.0f) : 0.0f;
+    float pE = (mask[x + 1] & FLOW_VALID) ? (dE > 0.0f ? dE : 0.0f) : 0.0f;
+    float pN = (mU[x] & FLOW_VALID) ? (dN > 0.0f ? dN : 0.0f) : 0.0f;
+    float pS = (mD[x] & FLOW_VALID) ? (dS > 0.0f ? dS : 0.0f) : 0.0f;
+    float pNW = 0.0f, pNE = 0.0f, pSW = 0.0f, pSE = 0.0f;
+    if (d8) {
+      float dNW = z - FLOW_SURFACE(up + x - 1);
+      float dNE = z - FLOW_SURFACE(up + x + 1);
+      float dSW = z - FLOW_SURFACE(dn + x - 1);
+      float dSE = z - FLOW_SURFACE(dn + x + 1);
+      pNW = (mU[x - 1] & FLOW_VALID) ? (dNW > 0.0f ? dNW : 0.0f) : 0.0f;
+      pNE = (mU[x + 1] & FLOW_VALID) ? (dNE > 0.0f ? dNE : 0.0f) : 0.0f;
+      pSW = (mD[x - 1] & FLOW_VALID) ? (dSW > 0.0f ? dSW : 0.0f) : 0.0f;
+      pSE = (mD[x + 1] & FLOW_VALID) ? (dSE > 0.0f ? dSE : 0.0f) : 0.0f;
+      pNW *= FLOW_DIAG_WEIGHT;
+      pNE *= FLOW_DIAG_WEIGHT;
+      pSW *= FLOW_DIAG_WEIGHT;
+      pSE *= FLOW_DIAG_WEIGHT;
+    }
+    float total = 0.0f;
+    total += pW;
+    total += pE;
+    total += pN;
+    total += pS;
+    if (d8) {
+      total += pNW;
+      total += pNE;
+      total += pSW;
+      total += pSE;
+    }
+    total = (mask[x] & FLOW_ACTIVE) ? total : 0.0f;
+    float div = (total > 0.0f) ? total : 1.0f;
+    float rW = (pW / div) * w;
+    float rE = (pE / div) * w;
+    float rN = (pN / div) * w;
+    float rS = (pS / div) * w;
+    fW[x] = (total > 0.0f) ? rW : 0.0f;
+    fE[x] = (total > 0.0f) ? rE : 0.0f;
+    fN[x] = (total > 0.0f) ? rN : 0.0f;
+    fS[x] = (total > 0.0f) ? rS : 0.0f;
+    if (d8) {
+      float rNW = (pNW / div) * w;
+      float rNE = (pNE / div) * w;
+      float rSW = (pSW / div) * w;
+      float rSE = (pSE / div) * w;
+      fNW[x] = (total > 0.0f) ? rNW : 0.0f;
+      fNE[x] = (total > 0.0f) ? rNE : 0.0f;
+      fSW[x] = (total > 0.0f) ? rSW : 0.0f;
+      fSE[x] = (total > 0.0f) ? rSE : 0.0f;
+    }
+  }
+#undef FLOW_SURFACE
+}
+
+// out = water + inflows from the row above and the left, then outflows and
+// infiltration for active cells, then + inflows from the right and the
+// row below: the serial scatter order. up, cur and down are the ring slots
+// of rows y-1, y, y+1. Covers x0 <= x < x1; flows of x0-1 .. x1 must be
+// current in the ring. out may alias water: cell x reads and writes only
+// index x. Returns the largest |inflow - outflow| of the row, computed on
+// the side so it does not touch the result; with track set the depth
+// infiltration took is added to *taken the same way.
+static FLOW_INLINE float
+GatherRowBody(const float *water, const unsigned char *restrict mask,
+              const unsigned char *restrict lahan, int x0, int x1,
+              const float *up, const float *cur, const float *down,
+              size_t stride, float i0, float i1, float i2, float i3,
+              float *out, int d8, int track, double *taken) {
+  const float *upS = up + DIR_S * stride, *downN = down + DIR_N * stride;
+  const float *curW = cur + DIR_W * stride, *curE = cur + DIR_E * stride;
+  const float *curN = cur + DIR_N * stride, *curS = cur + DIR_S * stride;
+  const float *upSW = up + DIR_SW * stride, *upSE = up + DIR_SE * stride;
+  const float *downNW = down + DIR_NW * stride;
+  const float *downNE = down + DIR_NE * stride;
+  const float *curNW = cur + DIR_NW * stride, *curNE = cur + DIR_NE * stride;
+  const float *curSW = cur + DIR_SW * stride, *curSE = cur + DIR_SE * stride;
+  float flux = 0.0f, sum = 0.0f;
+#pragma omp simd reduction(max : flux) reduction(+ : sum)
+  for (int x = x0; x < x1; x++) {
+    float net = (upS[x] + curE[x - 1] + curW[x + 1] + downN[x]) -
+                (curW[x] + curE[x] + curN[x] + curS[x]);
+    if (d8)
+      net += (upSE[x - 1] + upSW[x + 1] + downNE[x - 1] + downNW[x + 1]) -
+             (curNW[x] + curNE[x] + curSW[x] + curSE[x]);
+    flux = fmaxf(flux, fabsf(net));
+    float v = water[x];
+    if (d8)
+      v += upSE[x - 1];
+    v += upS[x];
+    if (d8)
+      v += upSW[x + 1];
+    v += curE[x - 1];
+    float s = v;
+    s -= curW[x];
+    s -= curE[x];
+    s -= curN[x];
+    s -= curS[x];
+    if (d8) {
+      s -= curNW[x];
+      s -= curNE[x];
+      s -= curSW[x];
+      s -= curSE[x];
+    }
+    int k = lahan[x];
+    float infil = (k == 1) ? i1 : (k == 2) ? i2 : (k == 3) ? i3 : i0;
+    if (track)
+      sum += (mask[x] & FLOW_ACTIVE) ? fminf(fmaxf(s, 0.0f), infil) : 0.0f;
+    s = s - infil;
+    s = (s > 0.0f) ? s : 0.0f;
+    v = (mask[x] & FLOW_ACTIVE) ? s : v;
+    v += curW[x + 1];
+    if (d8)
+      v += downNE[x - 1];
+    v += downN[x];
+    if (d8)
+      v += downNW[x + 1];
+    out[x] = v;
+  }
+  if (track)
+    *taken += sum;
+  return flux;
+}
+
+// One SIMD-cloned kernel per neighbourhood and state storage, and for the
+// gather also with and without infiltration tracking; the inlined bodies
+// see the variant as constants, so each one is unrolled and vectorized on
+// its own.
+#define FLOW_ROW_FLOWS(NAME, D8, FMT)                                          \
+  FLOW_SIMD_CLONES                                                             \
+  static void NAME(const void *elev, const void *water,                        \
+                   const unsigned char *mask, int nXSize, int x0, int x1,      \
+                   float *slot, size_t stride, float elevStep,                 \
+                   float depthStep) {                                          \
+    RowFlowsBody(elev, water, mask, nXSize, x0, x1, slot, stride, D8, FMT,     \
+                 elevStep, depthStep);                                         \
+  }
+#define FLOW_GATHER_ROW(NAME, D8, TRACK)                                       \
+  FLOW_SIMD_CLONES                                                             \
+  static float NAME(const float *water, const unsigned char *mask,             \
+                    const unsigned char *lahan, int x0, int x1,                \
+                    const float *up, const float *cur, const float *down,      \
+                    size_t stride, float i0, float i1, float i2, float i3,     \
+                    float *out, double *taken) {                               \
+    return GatherRowBody(water, mask, lahan, x0, x1, up, cur, down, stride,    \
+                         i0, i1, i2, i3, out, D8, TRACK, taken);               \
+  }
+
+FLOW_ROW_FLOWS(RowFlowsD4, 0, FLOW_STATE_FLOAT32)
+FLOW_ROW_FLOWS(RowFlowsD8, 1, FLOW_STATE_FLOAT32)
+FLOW_ROW_FLOWS(RowFlowsD4Half, 0, FLOW_STATE_FLOAT16)
+FLOW_ROW_FLOWS(RowFlowsD8Half, 1, FLOW_STATE_FLOAT16)
+FLOW_ROW_FLOWS(RowFlowsD4Fixed, 0, FLOW_STATE_FIXED16)
+FLOW_ROW_FLOWS(RowFlowsD8Fixed, 1, FLOW_STATE_FIXED16)
+FLOW_GATHER_ROW(GatherRowD4, 0, 0)
+FLOW_GATHER_ROW(GatherRowD4Tracked, 0, 1)
+FLOW_GATHER_ROW(GatherRowD8, 1, 0)
+FLOW_GATHER_ROW(GatherRowD8Tracked, 1, 1)
+
+// [storage][d8]
+static const RowFlowsFn rowFlowsFns[3][2] = {
+    {RowFlowsD4, RowFlowsD8},
+    {RowFlowsD4Half, RowFlowsD8Half},
+    {RowFlowsD4Fixed, RowFlowsD8Fixed}};
+
+// Compact rows are gathered through ring->depth with the float kernels:
+// mixing 16-bit and float lanes in the gather loop keeps GCC from
+// vectorizing it, while these plain conversions vectorize on their own.
+FLOW_SIMD_CLONES
+static void DecodeRow(const uint16_t *in, float *out, int n, int fmt,
+                      float step) {
+  if (fmt == FLOW_STATE_FLOAT16) {
+#pragma omp simd
+    for (int x = 0; x < n; x++)
+      out[x] = HalfToFloat(in[x]);
+  } else {
+#pragma omp simd
+    for (int x = 0; x < n; x++)
+      out[x] = (float)in[x] * step;
+  }
+}
+
+FLOW_SIMD_CLONES
+static void EncodeRow(const float *in, uint16_t *out, int n, int fmt,
+                      float step) {
+  float invStep = 1.0f / step;
+  if (fmt == FLOW_STATE_FLOAT16) {
+#pragma omp simd
+    for (int x = 0; x < n; x++)
+      StoreDepth(out, x, in[x], FLOW_STATE_FLOAT16, invStep);
+  } else {
+#pragma omp simd
+    for (int x = 0; x < n; x++)
+      StoreDepth(out, x, in[x], FLOW_STATE_FIXED16, invStep);
+  }
+}
+
+static void PickKernels(FlowContext *ctx) {
+  int d8 = ctx->nDirs == 8;
+  ctx->rowFlows[0] = rowFlowsFns[FLOW_STATE_FLOAT32][d8];
+  ctx->rowFlows[1] = rowFlowsFns[ctx->compactType][d8];
+  ctx->gather[0] = d8 ? GatherRowD8 : GatherRowD4;
+  ctx->gather[1] = d8 ? GatherRowD8Tracked : GatherRowD4Tracked;
+}
+
+int FlowSetNeighbours(FlowContext *ctx, int nDirs) {
+  if (nDirs != 4 && nDirs != 8)
+    return -1;
+  ctx->nDirs = nDirs;
+  PickKernels(ctx);
+  return 0;
+}
+
+int FlowNeighbours(const FlowContext *ctx) { return ctx->nDirs; }
+
+int FlowSetCompact(FlowContext *ctx, int type, const uint16_t *elev16,
+                   float elevStep, float depthStep) {
+  if (type != FLOW_STATE_FLOAT16 && type != FLOW_STATE_FIXED16)
+    return -1;
+  ctx->compactType = type;
+  ctx->elev16 = elev16;
+  ctx->elevStep = elevStep;
+  ctx->depthStep = depthStep > 0.0f ? depthStep : 1.0f;
+  PickKernels(ctx);
+  return 0;
+}
+
+// the plain kernel unless infiltration is being counted (taken != NULL)
+static float GatherRow(const FlowContext *ctx, const float *water,
+                       const unsigned char *mask, const unsigned char *lahan,
+                       int x0, int x1, const float *up, const float *cur,
+                       const float *down, const float infil_m[4], float *out,
+                       double *taken) {
+  return ctx->gather[taken != NULL](water, mask, lahan, x0, x1, up, cur, down,
+                                    ctx->rowStride, infil_m[0], infil_m[1],
+                                    infil_m[2], infil_m[3], out, taken);
+}
+
+// flows of row y for columns [x0, x1) into a ring slot; border rows and
+// columns never flow, and their slot entries stay zero
+static void ComputeRow(const FlowContext *ctx, int compact, const void *water,
+                       int y, float *slot, int x0, int x1) {
+  const FlowGrid *g = &ctx->grid;
+  size_t stride = ctx->rowStride;
+  if (y < 1 || y >= g->nYSize - 1) {
+    memset(slot, 0, (size_t)ctx->nDirs * stride * sizeof(float));
+    return;
+  }
+  if (x0 < 1)
+    x0 = 1;
+  if (x1 > g->nXSize - 1)
+    x1 = g->nXSize - 1;
+  size_t row = (size_t)y * g->nXSize;
+  if (compact)
+    ctx->rowFlows[1](ctx->elev16 + row, (const uint16_t *)water + row,
+                     g->mask + row, g->nXSize, x0, x1, slot + 1, stride,
+                     ctx->elevStep, ctx->depthStep);
+  else
+    ctx->rowFlows[0](g->elev + row, (const float *)water + row, g->mask + row,
+                     g->nXSize, x0, x1, slot + 1, stride, 0.0f, 0.0f);
+}
+
+// sweep the block [x0, x1) x [y0, y1) using one thread's ring; the halo
+// rows and columns around the block are computed here as well. Returns
+// the block's largest net flux; taken (optional) as in GatherRow.
+static float SweepBlock(const FlowContext *ctx, const float *water,
+                        float *out, const float infil_m[4],
+                        const RowRing *ring, int x0, int x1, int y0, int y1,
+                        double *taken) {
+  const FlowGrid *g = &ctx->grid;
+  float flux = 0.0f;
+  if (y0 >= y1 || x0 >= x1)
+    return flux;
+  int first = (y0 > 0) ? y0 - 1 : 0;
+  for (int r = first; r <= y0; r++)
+    ComputeRow(ctx, 0, water, r, ring->flow[r % 3], x0 - 1, x1 + 1);
+
+  for (int y = y0; y < y1; y++) {
+    if (y + 1 < g->nYSize)
+      ComputeRow(ctx, 0, water, y + 1, ring->flow[(y + 1) % 3], x0 - 1,
+                 x1 + 1);
+    const float *cur = ring->flow[y % 3] + 1;
+    // row 0 has no row above and row H-1 none below; their own outflows
+    // are all zero, so the current slot doubles as the zero row there
+    const float *up = (y > 0) ? ring->flow[(y - 1) % 3] + 1 : cur;
+    const float *down = (y < g->nYSize - 1) ? ring->flow[(y + 1) % 3] + 1 : cur;
+    size_t row = (size_t)y * g->nXSize;
+    flux = fmaxf(flux, GatherRow(ctx, water + row, g->mask + row,
+                                 g->lahan + row, x0, x1, up, cur, down,
+                                 infil_m, out + row, taken));
+  }
+  return flux;
+}
+
+void FlowSweepRows(FlowContext *ctx, const float *water, float *out,
+                   const float infil_m[4], int y0, int y1) {
+  const FlowGrid *g = &ctx->grid;
+  int nRows = y1 - y0;
+  int nThreads = ctx->nThreads;
+  float flux = 0.0f;
+  double taken = 0.0;
+  ctx->flux = flux;
+  ctx->infiltrated = taken;
+  if (nRows <= 0)
+    return;
+  if (nThreads > nRows)
+    nThreads = nRows;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nThreads) reduction(max : flux)              \
+    reduction(+ : taken)
+  {
+    int t = omp_get_thread_num();
+    int nt = omp_get_num_threads();
+#else
+  {
+    int t = 0;
+    int nt = 1;
+#endif
+    int b0 = y0 + (int)((long long)nRows * t / nt);
+    int b1 = y0 + (int)((long long)nRows * (t + 1) / nt);
+    flux = fmaxf(flux, SweepBlock(ctx, water, out, infil_m, &ctx->rings[t], 0,
+                                  g->nXSize, b0, b1,
+                                  ctx->trackInfil ? &taken : NULL));
+  }
+  ctx->flux = flux;
+  ctx->infiltrated = taken;
+}
+
+void FlowSweep(FlowContext *ctx, const float *water, float *out,
+               const float infil_m[4]) {
+  FlowSweepRows(ctx, water, out, infil_m, 0, ctx->grid.nYSize);
+}
+
+// slot of row r inside band [y0, y1): the four edge rows have their own
+// slots, filled before the barrier; interior rows rotate through the ring
+static const float *EdgeOrRingSlot(const RowRing *ring, int r, int y0,
+                                   int y1) {
+  if (r == y0 - 1)
+    return ring->edge[0];
+  if (r == y0)
+    return ring->edge[1];
+  if (r == y1 - 1)
+    return ring->edge[2];
+  if (r == y1)
+    return ring->edge[3];
+  return ring->flow[r % 3];
+}
+
+// The flows of row r read water rows r-1..r+1, and the gather of row y
+// reads only row y. Going down a band, the flows of row y+1 are computed
+// before row y is overwritten, so every read sees the old values. The
+// exceptions are rows y0-1, y0 (which read the band above) and y1-1, y1
+// (which read the band below): those four are computed by every thread
+// before the barrier.
+// compact selects the 16-bit state set with FlowSetCompact.
+static void SweepInPlace(FlowContext *ctx, int compact, void *water,
+                         const float infil_m[4]) {
+  const FlowGrid *g = &ctx->grid;
+  int nRows = g->nYSize;
+  int nThreads = ctx->nThreads;
+  // bands of at least 4 rows keep the edge rows of a band distinct
+  if (nThreads > nRows / 4)
+    nThreads = nRows / 4;
+  if (nThreads < 1)
+    nThreads = 1;
+  float flux = 0.0f;
+  double taken = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nThreads) reduction(max : flux)              \
+    reduction(+ : taken)
+  {
+    int t = omp_get_thread_num();
+    int nt = omp_get_num_threads();
+#else
+  {
+    int t = 0;
+    int nt = 1;
+#endif
+    const RowRing *ring = &ctx->rings[t];
+    int y0 = (int)((long long)nRows * t / nt);
+    int y1 = (int)((long long)nRows * (t + 1) / nt);
+    ComputeRow(ctx, compact, water, y0 - 1, ring->edge[0], 0, g->nXSize);
+    ComputeRow(ctx, compact, water, y0, ring->edge[1], 0, g->nXSize);
+    ComputeRow(ctx, compact, water, y1 - 1, ring->edge[2], 0, g->nXSize);
+    ComputeRow(ctx, compact, water, y1, ring->edge[3], 0, g->nXSize);
+#pragma omp barrier
+
+    for (int y = y0; y < y1; y++) {
+      if (y + 1 < y1 - 1)
+        ComputeRow(ctx, compact, water, y + 1, ring->flow[(y + 1) % 3], 0,
+                   g->nXSize);
+      const float *cur = EdgeOrRingSlot(ring, y, y0, y1) + 1;
+      const float *up = (y > 0) ? EdgeOrRingSlot(ring, y - 1, y0, y1) + 1 : cur;
+      const float *down =
+          (y < nRows - 1) ? EdgeOrRingSlot(ring, y + 1, y0, y1) + 1 : cur;
+      size_t row = (size_t)y * g->nXSize;
+      double *track = ctx->trackInfil ? &taken : NULL;
+      if (compact) {
+        uint16_t *w16 = (uint16_t *)water + row;
+        DecodeRow(w16, ring->depth, g->nXSize, ctx->compactType,
+                  ctx->depthStep);
+        flux = fmaxf(flux, GatherRow(ctx, ring->depth, g->mask + row,
+                                     g->lahan + row, 0, g->nXSize, up, cur,
+                                     down, infil_m, ring->depth, track));
+        EncodeRow(ring->depth, w16, g->nXSize, ctx->compactType,
+                  ctx->depthStep);
+      } else {
+        float *w = (float *)water + row;
+        flux = fmaxf(flux, GatherRow(ctx, w, g->mask + row, g->lahan + row, 0,
+                                     g->nXSize, up, cur, down, infil_m, w, track));
+      }
+    }
+  }
+  ctx->flux = flux;
+  ctx->infiltrated = taken;
+}
+
+void FlowSweepInPlace(FlowContext *ctx, float *water, const float infil_m[4]) {
+  SweepInPlace(ctx, 0, water, infil_m);
+}
+
+void FlowSweepCompact(FlowContext *ctx, uint16_t *water,
+                      const float infil_m[4]) {
+  SweepInPlace(ctx, 1, water, infil_m);
+}
+
+uint16_t *FlowCompactElevation(const FlowGrid *grid, float *base,
+                               float *step) {
+  size_t n = (size_t)grid->nXSize * grid->nYSize;
+  float lo = 0.0f, hi = 0.0f;
+  int any = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!(grid->mask[i] & FLOW_VALID))
+      continue;
+    float e = grid->elev[i];
+    lo = (!any || e < lo) ? e : lo;
+    hi = (!any || e > hi) ? e : hi;
+    any = 1;
+  }
+  uint16_t *e16 = (uint16_t *)CPLMalloc(n * sizeof(uint16_t));
+  float s = (hi > lo) ? (hi - lo) / 65535.0f : 1e-3f;
+  float inv = 1.0f / s;
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; i++) {
+    // invalid cells never take part in a flow; 0 keeps them harmless
+    float v = (grid->mask[i] & FLOW_VALID) ? (grid->elev[i] - lo) * inv : 0.0f;
+    v = (v + 0.5f < 65535.0f) ? v + 0.5f : 65535.0f;
+    e16[i] = (uint16_t)v;
+  }
+  *base = lo;
+  *step = s;
+  return e16;
+}
+
+void FlowEncodeDepth(const FlowContext *ctx, const float *water,
+                     uint16_t *water16, size_t i0, size_t i1) {
+  float invStep = 1.0f / ctx->depthStep;
+  if (ctx->compactType == FLOW_STATE_FLOAT16) {
+#pragma omp parallel for schedule(static) num_threads(ctx->nThreads)          \
+    if (i1 - i0 > 65536)
+    for (size_t i = i0; i < i1; i++)
+      StoreDepth(water16, (ptrdiff_t)i, water[i], FLOW_STATE_FLOAT16, invStep);
+  } else {
+#pragma omp parallel for schedule(static) num_threads(ctx->nThreads)          \
+    if (i1 - i0 > 65536)
+    for (size_t i = i0; i < i1; i++)
+      StoreDepth(water16, (ptrdiff_t)i, water[i], FLOW_STATE_FIXED16, invStep);
+  }
+}
+
+void FlowDecodeDepth(const FlowContext *ctx, const uint16_t *water16,
+                     float *water, size_t i0, size_t i1) {
+  float step = ctx->depthStep;
+  if (ctx->compactType == FLOW_STATE_FLOAT16) {
+#pragma omp parallel for schedule(static) num_threads(ctx->nThreads)          \
+    if (i1 - i0 > 65536)
+    for (size_t i = i0; i < i1; i++)
+      water[i] = LoadDepth(water16, (ptrdiff_t)i, FLOW_STATE_FLOAT16, step);
+  } else {
+#pragma omp parallel for schedule(static) num_threads(ctx->nThreads)          \
+    if (i1 - i0 > 65536)
+    for (size_t i = i0; i < i1; i++)
+      water[i] = LoadDepth(water16, (ptrdiff_t)i, FLOW_STATE_FIXED16, step);
+  }
+}
+
+// the gather of a sweep without any flow, repeated per cell: the same
+// subtractions and clamps, so it matches sweeps over a still surface
+void FlowInfiltrateRows(FlowContext *ctx, float *water,
+                        const float infil_m[4], int nSweeps, int y0, int y1) {
+  const FlowGrid *g = &ctx->grid;
+  double taken = 0.0;
+#pragma omp parallel for schedule(static) num_threads(ctx->nThreads)          \
+    reduction(+ : taken)
+  for (int y = y0; y < y1; y++) {
+    size_t row = (size_t)y * g->nXSize;
+    for (int x = 0; x < g->nXSize; x++) {
+      if (!(g->mask[row + x] & FLOW_ACTIVE))
+        continue;
+      float infil = infil_m[g->lahan[row + x]];
+      float s = water[row + x];
+      for (int k = 0; k < nSweeps && s > 0.0f; k++) {
+        s = s - infil;
+        s = (s > 0.0f) ? s : 0.0f;
+      }
+      taken += water[row + x] - s;
+      water[row + x] = s;
+    }
+  }
+  ctx->infiltrated = taken;
+}
+
+void FlowLanduseClasses(unsigned char *lahan, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    lahan[i] = (lahan[i] <= 3) ? lahan[i] : 0;
+}
+
+// ---- sparse (active tile) mode ----
+
+void FlowMarkAllDirty(FlowContext *ctx) {
+  memset(ctx->dirty, 1, (size_t)ctx->tilesX * ctx->tilesY);
+}
+
+void FlowMarkDirty(FlowContext *ctx, int x0, int y0, int x1, int y1) {
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 >= ctx->grid.nXSize)
+    x1 = ctx->grid.nXSize - 1;
+  if (y1 >= ctx->grid.nYSize)
+    y1 = ctx->grid.nYSize - 1;
+  if (x0 > x1 || y0 > y1)
+    return;
+  for (int ty = y0 / FLOW_TILE_Y; ty <= y1 / FLOW_TILE_Y; ty++)
+    for (int tx = x0 / FLOW_TILE_X; tx <= x1 / FLOW_TILE_X; tx++)
+      ctx->dirty[(size_t)ty * ctx->tilesX + tx] = 1;
+}
+
+void FlowMarkWet(FlowContext *ctx, const float *water) {
+  const FlowGrid *g = &ctx->grid;
+  int tilesX = ctx->tilesX;
+#pragma omp parallel for schedule(dynamic, 4) num_threads(ctx->nThreads)
+  for (int t = 0; t < tilesX * ctx->tilesY; t++) {
+    if (ctx->dirty[t])
+      continue;
+    int x0 = (t % tilesX) * FLOW_TILE_X, y0 = (t / tilesX) * FLOW_TILE_Y;
+    int x1 = x0 + FLOW_TILE_X < g->nXSize ? x0 + FLOW_TILE_X : g->nXSize;
+    int y1 = y0 + FLOW_TILE_Y < g->nYSize ? y0 + FLOW_TILE_Y : g->nYSize;
+    int wet = 0;
+    for (int y = y0; y < y1 && !wet; y++) {
+      const float *row = water + (size_t)y * g->nXSize;
+      for (int x = x0; x < x1; x++)
+        wet |= row[x] > 0.0f;
+    }
+    ctx->dirty[t] = (unsigned char)wet;
+  }
+}
+
+// A tile's next values depend on cells up to two steps away (a neighbour's
+// outflow depends on that neighbour's neighbours), so a tile is swept when
+// it or any of its 8 neighbour tiles changed since its last sweep. Tiles
+// that are skipped would reproduce their current values exactly, which
+// keeps the sparse result bit-for-bit equal to the dense sweep.
+int FlowSweepSparse(FlowContext *ctx, float *water, float *tmp,
+                    const float infil_m[4]) {
+  const FlowGrid *g = &ctx->grid;
+  int tilesX = ctx->tilesX, tilesY = ctx->tilesY;
+  int nActive = 0;
+
+  for (int ty = 0; ty < tilesY; ty++) {
+    for (int tx = 0; tx < tilesX; tx++) {
+      int on = 0;
+      for (int ny = ty - 1; ny <= ty + 1 && !on; ny++) {
+        if (ny < 0 || ny >= tilesY)
+          continue;
+        for (int nx = tx - 1; nx <= tx + 1; nx++) {
+          if (nx >= 0 && nx < tilesX && ctx->dirty[(size_t)ny * tilesX + nx]) {
+            on = 1;
+            break;
+          }
+        }
+      }
+      if (on)
+        ctx->activeTiles[nActive++] = ty * tilesX + tx;
+    }
+  }
+  memset(ctx->dirty, 0, (size_t)tilesX * tilesY);
+  float flux = 0.0f;
+  double taken = 0.0;
+  ctx->flux = flux;
+  ctx->infiltrated = taken;
+  if (nActive == 0)
+    return 0;
+
+#pragma omp parallel num_threads(ctx->nThreads)
+  {
+#ifdef _OPENMP
+    const RowRing *ring = &ctx->rings[omp_get_thread_num()];
+#else
+    const RowRing *ring = &ctx->rings[0];
+#endif
+#pragma omp for schedule(dynamic, 4) reduction(max : flux) reduction(+ : taken)
+    for (int i = 0; i < nActive; i++) {
+      int t = ctx->activeTiles[i];
+      int x0 = (t % tilesX) * FLOW_TILE_X, y0 = (t / tilesX) * FLOW_TILE_Y;
+      int x1 = x0 + FLOW_TILE_X < g->nXSize ? x0 + FLOW_TILE_X : g->nXSize;
+      int y1 = y0 + FLOW_TILE_Y < g->nYSize ? y0 + FLOW_TILE_Y : g->nYSize;
+      flux = fmaxf(flux, SweepBlock(ctx, water, tmp, infil_m, ring, x0, x1,
+                                    y0, y1, ctx->trackInfil ? &taken : NULL));
+
+      int changed = 0;
+      for (int y = y0; y < y1 && !changed; y++) {
+        size_t row = (size_t)y * g->nXSize;
+        changed = memcmp(water + row + x0, tmp + row + x0,
+                         sizeof(float) * (size_t)(x1 - x0)) != 0;
+      }
+      ctx->dirty[t] = (unsigned char)changed;
+    }
+
+    // every swept tile read its neighbours' old values above, so the new
+    // values are copied back only after all tiles are done
+#pragma omp for schedule(dynamic, 4)
+    for (int i = 0; i < nActive; i++) {
+      int t = ctx->activeTiles[i];
+      if (!ctx->dirty[t])
+        continue;
+      int x0 = (t % tilesX) * FLOW_TILE_X, y0 = (t / tilesX) * FLOW_TILE_Y;
+      int x1 = x0 + FLOW_TILE_X < g->nXSize ? x0 + FLOW_TILE_X : g->nXSize;
+      int y1 = y0 + FLOW_TILE_Y < g->nYSize ? y0 + FLOW_TILE_Y : g->nYSize;
+      for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * g->nXSize;
+        memcpy(water + row + x0, tmp + row + x0,
+               sizeof(float) * (size_t)(x1 - x0));
+      }
+    }
+  }
+  ctx->flux = flux;
+  ctx->infiltrated = taken;
+  return nActive;
+}
+
+int FlowTileCount(const FlowContext *ctx) {
+  return ctx->tilesX * ctx->tilesY;
+}
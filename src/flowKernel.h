@@ -0,0 +1,112 @@
+#ifndef flowKernel
+#define flowKernel
+
+#include <stddef.h>
+#include <stdint.h>
+
+// validity mask bits, built once per DEM by FlowBuildMask
+#define FLOW_VALID 1  // elevation is not no-data / NaN
+#define FLOW_ACTIVE 2 // valid and not on the raster border: flows/infiltrates
+
+// Grid read-only terrain view used by the flow/infiltration sweep.
+typedef struct {
+  int nXSize;
+  int nYSize;
+  const float *elev;
+  const unsigned char *lahan; // landuse class codes 0..3
+  const unsigned char *mask;
+} FlowGrid;
+
+typedef struct FlowContext FlowContext;
+
+unsigned char *FlowBuildMask(int nXSize, int nYSize, const float *elev,
+                             int hasNoData, float noDataValue);
+// fill mask rows [y0, y1) in a caller-owned buffer (elev indexed globally)
+void FlowFillMask(unsigned char *mask, int nXSize, int nYSize,
+                  const float *elev, int hasNoData, float noDataValue, int y0,
+                  int y1);
+// landuse values outside 1..3 fall back to class 0, like the original lookup
+void FlowLanduseClasses(unsigned char *lahan, size_t n);
+// instruction set the SIMD row kernels dispatch to on this CPU
+const char *FlowSimdName(void);
+
+// nThreads <= 0 means use all available cores
+FlowContext *FlowCreate(const FlowGrid *grid, int nThreads);
+void FlowDestroy(FlowContext *ctx);
+int FlowThreadCount(const FlowContext *ctx);
+
+// Flow neighbourhood of the sweeps: 4 (D4, the default) or 8 (D8, adds the
+// diagonals with their head difference weighted by 1/sqrt(2)). Each has
+// its own compile-time specialized kernels; -1 for any other value.
+int FlowSetNeighbours(FlowContext *ctx, int nDirs);
+int FlowNeighbours(const FlowContext *ctx);
+
+// One flow + infiltration sweep: reads `water`, writes every cell of `out`.
+// infil_m holds the infiltration depth (m) per landuse class 0..3 for this
+// sweep. With D4 the result is bit-for-bit identical to the original
+// serial scatter loop for any thread count; D8 keeps the same raster
+// order and is just as independent of the thread count.
+void FlowSweep(FlowContext *ctx, const float *water, float *out,
+               const float infil_m[4]);
+// the same sweep updating `water` in place; no output grid is needed
+void FlowSweepInPlace(FlowContext *ctx, float *water, const float infil_m[4]);
+
+// Compact state (--compact): the in-place sweep on 16-bit depths and
+// elevations, which halves the bytes each sweep streams. Arithmetic stays
+// in float; only the stored values are rounded, so the result is no longer
+// bit-identical to the float sweep and mass is conserved only to the
+// rounding of each stored depth.
+#define FLOW_STATE_FLOAT32 0
+#define FLOW_STATE_FLOAT16 1 // IEEE half: ~3 significant digits at any depth
+#define FLOW_STATE_FIXED16 2 // multiples of depthStep, up to 65535 steps
+// elevation as uint16 steps above the lowest valid cell (*base); *step is
+// the range / 65535. Caller frees with CPLFree.
+uint16_t *FlowCompactElevation(const FlowGrid *grid, float *base,
+                               float *step);
+// select the compact storage for FlowSweepCompact and the converters;
+// elev16 stays owned by the caller. -1 for an unknown type.
+int FlowSetCompact(FlowContext *ctx, int type, const uint16_t *elev16,
+                   float elevStep, float depthStep);
+void FlowSweepCompact(FlowContext *ctx, uint16_t *water,
+                      const float infil_m[4]);
+// convert cells [i0, i1) between the float grid and the compact one
+void FlowEncodeDepth(const FlowContext *ctx, const float *water,
+                     uint16_t *water16, size_t i0, size_t i1);
+void FlowDecodeDepth(const FlowContext *ctx, const uint16_t *water16,
+                     float *water, size_t i0, size_t i1);
+
+// same sweep restricted to output rows [y0, y1); reads water rows y0-2..y1+1
+void FlowSweepRows(FlowContext *ctx, const float *water, float *out,
+                   const float infil_m[4], int y0, int y1);
+// largest |inflow - outflow| (m) of any cell in the last sweep (or, for
+// FlowSweepRows, the last row range): how far the surface still moves
+// sideways. Rain, infiltration and pumps are not part of it; tiles the
+// sparse sweep skipped did not move.
+float FlowMaxFlux(const FlowContext *ctx);
+// what `nSweeps` more sweeps would take from active cells by infiltration
+// alone: water = max(0, water - nSweeps * infil) on rows [y0, y1)
+void FlowInfiltrateRows(FlowContext *ctx, float *water,
+                        const float infil_m[4], int nSweeps, int y0, int y1);
+// Infiltration accounting for the run statistics, off by default. While on,
+// sweeps (and FlowInfiltrateRows) also sum the depth infiltration took from
+// active cells, m summed over cells, read back like FlowMaxFlux. The water
+// grid comes out the same either way.
+void FlowTrackInfiltration(FlowContext *ctx, int on);
+double FlowInfiltrated(const FlowContext *ctx);
+
+// Sparse mode: only FLOW_TILE_X x FLOW_TILE_Y tiles that changed since their
+// last sweep (or border such a tile) are swept; dry or settled terrain is
+// skipped. Updates `water` in place (tmp is scratch) and returns the number
+// of tiles swept. Anything that modifies water outside the sweep (rain,
+// pumps) must mark the touched cells dirty.
+// tiles are wide so the vectorized row kernels run on long spans
+#define FLOW_TILE_X 256
+#define FLOW_TILE_Y 32
+int FlowSweepSparse(FlowContext *ctx, float *water, float *tmp,
+                    const float infil_m[4]);
+void FlowMarkAllDirty(FlowContext *ctx);
+// marks tiles holding any water; dry tiles cannot change under new rates
+void FlowMarkWet(FlowContext *ctx, const float *water);
+void FlowMarkDirty(FlowContext *ctx, int x0, int y0, int x1, int y1);
+int FlowTileCount(const FlowContext *ctx);
+#endif
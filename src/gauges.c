@@ -0,0 +1,201 @@
+// gauges.c - depth time series at lat/lon points
+#include "gauges.h"
+#include "flowKernel.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct GaugeLog {
+  FILE *fp;
+  int n;
+  long long *cell; // y * nXSize + x, -1 outside the DEM / on no-data
+  int failed;
+};
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+static int GaugeAdd(GaugeSet *g, const char *name, double lat, double lon) {
+  char **names = (char **)realloc(g->names, sizeof(char *) * (g->n + 1));
+  if (names)
+    g->names = names;
+  double *glat = (double *)realloc(g->lat, sizeof(double) * (g->n + 1));
+  if (glat)
+    g->lat = glat;
+  double *glon = (double *)realloc(g->lon, sizeof(double) * (g->n + 1));
+  if (glon)
+    g->lon = glon;
+  char *copy = strdup(name);
+  if (!names || !glat || !glon || !copy) {
+    free(copy);
+    return -1;
+  }
+  g->names[g->n] = copy;
+  g->lat[g->n] = lat;
+  g->lon[g->n] = lon;
+  g->n++;
+  return 0;
+}
+
+int GaugesLoadCsv(GaugeSet *g, const char *path, char *err, size_t errSize) {
+  memset(g, 0, sizeof(*g));
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return Fail(err, errSize, "Failed: to open gauges %s: %s", path,
+                strerror(errno));
+  char line[1024];
+  int lineNo = 0, rc = 0;
+  while (rc == 0 && fgets(line, sizeof(line), fp)) {
+    lineNo++;
+    line[strcspn(line, "\r\n")] = '\0';
+    char *s = line + strspn(line, " \t");
+    if (*s == '\0' || *s == '#')
+      continue;
+    char *c1 = strchr(s, ',');
+    char *c2 = c1 ? strchr(c1 + 1, ',') : NULL;
+    char *end1 = NULL, *end2 = NULL;
+    double lat = c2 ? strtod(c1 + 1, &end1) : 0.0;
+    double lon = c2 ? strtod(c2 + 1, &end2) : 0.0;
+    if (!c2 || end1 == c1 + 1 || end2 == c2 + 1) {
+      // "name,lat,lon" header
+      if (g->n == 0 && lineNo == 1 && c2)
+        continue;
+      rc = Fail(err, errSize, "Failed: gauges %s line %d: expected name,lat,lon",
+                path, lineNo);
+      break;
+    }
+    *c1 = '\0';
+    if (GaugeAdd(g, s, lat, lon) != 0)
+      rc = Fail(err, errSize, "Failed: Memory allocation failed");
+  }
+  fclose(fp);
+  if (rc == 0 && g->n == 0)
+    rc = Fail(err, errSize, "Failed: no gauges in %s", path);
+  if (rc != 0)
+    GaugesFree(g);
+  return rc;
+}
+
+int GaugesFromJson(GaugeSet *g, const JsonValue *arr, char *err,
+                   size_t errSize) {
+  memset(g, 0, sizeof(*g));
+  if (!arr || arr->type != JSON_ARRAY || arr->count == 0)
+    return Fail(err, errSize, "Failed: gauges must be a non-empty array");
+  for (int i = 0; i < arr->count; i++) {
+    const JsonValue *lat = JsonGet(&arr->items[i], "lat");
+    const JsonValue *lon = JsonGet(&arr->items[i], "lon");
+    if (!lat || lat->type != JSON_NUMBER || !lon || lon->type != JSON_NUMBER) {
+      GaugesFree(g);
+      return Fail(err, errSize, "Failed: gauges entries need numeric lat, lon");
+    }
+    char fallback[32];
+    const char *name = JsonString(JsonGet(&arr->items[i], "name"));
+    if (!name) {
+      snprintf(fallback, sizeof(fallback), "g%d", i);
+      name = fallback;
+    }
+    if (GaugeAdd(g, name, lat->number, lon->number) != 0) {
+      GaugesFree(g);
+      return Fail(err, errSize, "Failed: Memory allocation failed");
+    }
+  }
+  return 0;
+}
+
+void GaugesFree(GaugeSet *g) {
+  for (int i = 0; i < g->n; i++)
+    free(g->names[i]);
+  free(g->names);
+  free(g->lat);
+  free(g->lon);
+  memset(g, 0, sizeof(*g));
+}
+
+// a JSON gauge name may hold commas, quotes or line breaks: quoted as in
+// RFC 4180 then, with inner quotes doubled
+static void WriteCsvField(FILE *fp, const char *s) {
+  if (!s[strcspn(s, ",\"\r\n")]) {
+    fputs(s, fp);
+    return;
+  }
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"')
+      fputc('"', fp);
+    fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+GaugeLog *GaugeLogOpen(const char *path, const GaugeSet *g,
+                       const GeoLocator *loc, int nXSize, int nYSize,
+                       const unsigned char *mask, int *located) {
+  GaugeLog *gl = (GaugeLog *)calloc(1, sizeof(GaugeLog));
+  int *col = (int *)malloc(sizeof(int) * 2 * (size_t)(g->n > 0 ? g->n : 1));
+  if (gl)
+    gl->cell = (long long *)malloc(sizeof(long long) *
+                                   (size_t)(g->n > 0 ? g->n : 1));
+  if (!gl || !col || !gl->cell) {
+    free(col);
+    if (gl)
+      free(gl->cell);
+    free(gl);
+    return NULL;
+  }
+  gl->n = g->n;
+  int *row = col + g->n;
+  LatLonToPixels(loc, g->n, g->lat, g->lon, col, row);
+  *located = 0;
+  for (int i = 0; i < g->n; i++) {
+    long long c = (long long)row[i] * nXSize + col[i];
+    int inside = col[i] >= 0 && col[i] < nXSize && row[i] >= 0 &&
+                 row[i] < nYSize && (mask[c] & FLOW_VALID);
+    gl->cell[i] = inside ? c : -1;
+    *located += inside;
+  }
+  free(col);
+
+  gl->fp = fopen(path, "w");
+  if (!gl->fp) {
+    free(gl->cell);
+    free(gl);
+    return NULL;
+  }
+  fputs("step,minutes", gl->fp);
+  for (int i = 0; i < g->n; i++) {
+    fputc(',', gl->fp);
+    WriteCsvField(gl->fp, g->names[i]);
+  }
+  fputc('\n', gl->fp);
+  return gl;
+}
+
+void GaugeLogStep(GaugeLog *gl, int step, double minutes, const float *water) {
+  fprintf(gl->fp, "%d,%g", step, minutes);
+  for (int i = 0; i < gl->n; i++) {
+    if (gl->cell[i] < 0)
+      fputc(',', gl->fp);
+    else
+      fprintf(gl->fp, ",%.4f", water[gl->cell[i]]);
+  }
+  fputc('\n', gl->fp);
+  // one row per step: the file can be read while the run goes on
+  if (fflush(gl->fp) != 0)
+    gl->failed = 1;
+}
+
+int GaugeLogClose(GaugeLog *gl) {
+  if (!gl)
+    return 0;
+  int rc = (fclose(gl->fp) != 0 || gl->failed) ? -1 : 0;
+  free(gl->cell);
+  free(gl);
+  return rc;
+}
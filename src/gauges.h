@@ -0,0 +1,43 @@
+#ifndef gauges
+#define gauges
+
+#include "json.h"
+#include "transformation.h"
+#include <stddef.h>
+
+// Virtual gauges: lat/lon points whose water depth is sampled after every
+// step, so point hydrographs do not need the full rasters.
+typedef struct {
+  int n;
+  char **names;
+  double *lat, *lon;
+} GaugeSet;
+
+// "name,lat,lon" per line; '#' comments and a header line are skipped.
+// Errors are reported as "Failed: ..." in err.
+int GaugesLoadCsv(GaugeSet *g, const char *path, char *err, size_t errSize);
+// [{"name": "G1", "lat": ..., "lon": ...}, ...]; name defaults to "g<i>"
+int GaugesFromJson(GaugeSet *g, const JsonValue *arr, char *err,
+                   size_t errSize);
+void GaugesFree(GaugeSet *g);
+
+// Gauge output, one CSV row per step and one column per gauge:
+//
+//   step,minutes,G1,G2,...
+//   0,15,0.0123,,...
+//
+// depth in m of the raw (unsmoothed) water grid at the gauge's cell;
+// gauges outside the DEM or on no-data cells stay empty. minutes is the
+// time at the end of the step.
+typedef struct GaugeLog GaugeLog;
+
+// locates all gauges with one LatLonToPixels call and writes the header;
+// located gets the number of gauges on valid cells. NULL if the file
+// cannot be created.
+GaugeLog *GaugeLogOpen(const char *path, const GaugeSet *g,
+                       const GeoLocator *loc, int nXSize, int nYSize,
+                       const unsigned char *mask, int *located);
+void GaugeLogStep(GaugeLog *gl, int step, double minutes, const float *water);
+// -1 if anything failed to write
+int GaugeLogClose(GaugeLog *gl);
+#endif
@@ -1,20 +1,18 @@
 #include "gdal.h"
 #include "cpl_conv.h"
+#include "cpl_string.h"
+#include "gdalShortcut.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
 
-typedef struct
-{
-    GDALDatasetH dataset;
-    GDALRasterBandH band;
-    int nXSize;
-    int nYSize;
-    void *pixelArray;
-} Raster;
-
-void WriteTiff(GDALDatasetH hDataset, float *pixelArray, int nXSize, int nYSize, char *output)
+GDALDatasetH CreateTiff(GDALDatasetH hDataset, int nXSize, int nYSize, char *output)
 {
     GDALDriverH driver = GDALGetDriverByName("GTiff");
 
     GDALDatasetH outputDataset = GDALCreate(driver, output, nXSize, nYSize, 1, GDT_Float32, NULL);
+    if (!outputDataset)
+        return NULL;
 
     // Optional: Copy GeoTransform and Projection from original
     double geoTransform[6];
@@ -24,27 +22,140 @@ void WriteTiff(GDALDatasetH hDataset, float *pixelArray, int nXSize, int nYSize,
     const char *proj = GDALGetProjectionRef(hDataset);
     GDALSetProjection(outputDataset, proj);
 
-    // Step 5: Write modified data to the new file
     GDALRasterBandH outputBand = GDALGetRasterBand(outputDataset, 1);
     GDALSetRasterNoDataValue(outputBand, -32767);
     // GDALSetRasterNoDataValue(outputBand, 0);
-    if (GDALRasterIO(outputBand, GF_Write, 0, 0, nXSize, nYSize, pixelArray, nXSize, nYSize, GDT_Float32, 0, 0))
+    return outputDataset;
+}
+
+int OutputTypeFromName(const char *name)
+{
+    if (strcasecmp(name, "float32") == 0)
+        return OUTPUT_FLOAT32;
+    if (strcasecmp(name, "float16") == 0)
+        return OUTPUT_FLOAT16;
+    if (strcasecmp(name, "uint16") == 0)
+        return OUTPUT_UINT16;
+    return -1;
+}
+
+double OutputNoData(const OutputFormat *format)
+{
+    // -32767 tidak bisa disimpan sebagai half, nilai terdekatnya -32768
+    if (format->type == OUTPUT_UINT16)
+        return 65535;
+    if (format->type == OUTPUT_FLOAT16)
+        return -32768;
+    return -32767;
+}
+
+double OutputScale(const OutputFormat *format)
+{
+    return format->scale > 0 ? format->scale : 0.001;
+}
+
+GDALDatasetH CreateTiffFormat(GDALDatasetH hDataset, int nXSize, int nYSize, char *output, const OutputFormat *format, int nThreads)
+{
+    GDALDriverH driver = GDALGetDriverByName("GTiff");
+    const char *compress = format->compress ? format->compress : "DEFLATE";
+    GDALDataType type = format->type == OUTPUT_UINT16 ? GDT_UInt16 : GDT_Float32;
+
+    // tile 256x256 supaya hasil bisa dibaca per bagian (tiles, COG)
+    char **options = NULL;
+    options = CSLSetNameValue(options, "TILED", "YES");
+    options = CSLSetNameValue(options, "BLOCKXSIZE", "256");
+    options = CSLSetNameValue(options, "BLOCKYSIZE", "256");
+    options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+    if (strcasecmp(compress, "NONE") != 0)
     {
-        CPLFree(pixelArray);
-        GDALClose(hDataset);
-        GDALClose(outputDataset);
+        char threads[16];
+        snprintf(threads, sizeof(threads), "%d", nThreads > 0 ? nThreads : 1);
+        options = CSLSetNameValue(options, "COMPRESS", compress);
+        options = CSLSetNameValue(options, "NUM_THREADS", threads);
+        // predictor 3 (floating point) tidak dipakai untuk half
+        if (format->type == OUTPUT_FLOAT32)
+            options = CSLSetNameValue(options, "PREDICTOR", "3");
+        else if (format->type == OUTPUT_UINT16)
+            options = CSLSetNameValue(options, "PREDICTOR", "2");
     }
+    if (format->type == OUTPUT_FLOAT16)
+        options = CSLSetNameValue(options, "NBITS", "16");
+
+    GDALDatasetH outputDataset = GDALCreate(driver, output, nXSize, nYSize, 1, type, options);
+    CSLDestroy(options);
+    if (!outputDataset)
+        return NULL;
+
+    double geoTransform[6];
+    GDALGetGeoTransform(hDataset, geoTransform);
+    GDALSetGeoTransform(outputDataset, geoTransform);
+    GDALSetProjection(outputDataset, GDALGetProjectionRef(hDataset));
+
+    GDALRasterBandH outputBand = GDALGetRasterBand(outputDataset, 1);
+    GDALSetRasterNoDataValue(outputBand, OutputNoData(format));
+    if (format->type == OUTPUT_UINT16)
+    {
+        // pembaca GDAL mendapat meter lewat -unscale / scale band
+        GDALSetRasterScale(outputBand, OutputScale(format));
+        GDALSetRasterOffset(outputBand, 0.0);
+    }
+    return outputDataset;
+}
+
+// Tulis baris [y0, y0 + nRows) ke output; rows menunjuk ke baris y0
+int WriteTiffRowsType(GDALDatasetH outputDataset, void *rows, GDALDataType type, int nXSize, int y0, int nRows)
+{
+    GDALRasterBandH outputBand = GDALGetRasterBand(outputDataset, 1);
+    if (GDALRasterIO(outputBand, GF_Write, 0, y0, nXSize, nRows, rows, nXSize, nRows, type, 0, 0) != CE_None)
+    {
+        fprintf(stderr, "Error: GDALRasterIO failed (write rows %d..%d)\n", y0, y0 + nRows - 1);
+        return -1;
+    }
+    return 0;
+}
+
+int WriteTiffRows(GDALDatasetH outputDataset, float *rows, int nXSize, int y0, int nRows)
+{
+    return WriteTiffRowsType(outputDataset, rows, GDT_Float32, nXSize, y0, nRows);
+}
+
+void WriteTiff(GDALDatasetH hDataset, float *pixelArray, int nXSize, int nYSize, char *output)
+{
+    GDALDatasetH outputDataset = CreateTiff(hDataset, nXSize, nYSize, output);
+    if (!outputDataset)
+        return;
+
+    // Step 5: Write modified data to the new file
+    WriteTiffRows(outputDataset, pixelArray, nXSize, 0, nYSize);
     GDALClose(outputDataset);
 }
 
-Raster OpenTiff(char *filename, int type, int noDataVal)
+GDALDatasetH CreateGeoreference(const double geoTransform[6], const char *wkt)
+{
+    GDALDriverH driver = GDALGetDriverByName("MEM");
+    if (!driver)
+        return NULL;
+    GDALDatasetH dataset = GDALCreate(driver, "", 1, 1, 1, GDT_Byte, NULL);
+    if (!dataset)
+        return NULL;
+    double gt[6];
+    memcpy(gt, geoTransform, sizeof(gt));
+    GDALSetGeoTransform(dataset, gt);
+    GDALSetProjection(dataset, wkt ? wkt : "");
+    return dataset;
+}
+
+// Buka raster tanpa membaca piksel (pixelArray = NULL)
+Raster OpenTiffHeader(char *filename, int noDataVal)
 {
-    // type
-    // 0 = float
-    // 1 = int
     Raster result;
     result.pixelArray = NULL;
+    result.band = NULL;
+    result.nXSize = 0;
+    result.nYSize = 0;
     result.dataset = GDALOpen(filename, GA_ReadOnly);
+    if (!result.dataset)
+        return result;
     // Get the first band
     result.band = GDALGetRasterBand(result.dataset, 1);
 
@@ -72,33 +183,44 @@ Raster OpenTiff(char *filename, int type, int noDataVal)
     {
         printf("Warning: GeoTransform not available, resolution unknown.\n");
     }
+    return result;
+}
 
-    // Load raster sesuai type
-    if (type == 0)
+// Baca baris [y0, y0 + nRows) ke dst; type 0 = float, 1 = int, 2 = byte
+int ReadTiffRows(Raster *raster, int type, int y0, int nRows, void *dst)
+{
+    GDALDataType dataType = (type == 0) ? GDT_Float32 : (type == 1) ? GDT_Int32 : GDT_Byte;
+    if (GDALRasterIO(raster->band, GF_Read, 0, y0,
+                     raster->nXSize, nRows,
+                     dst, raster->nXSize, nRows,
+                     dataType, 0, 0) != CE_None)
     {
-        result.pixelArray = CPLMalloc(result.nXSize * result.nYSize * sizeof(float));
-        if (GDALRasterIO(result.band, GF_Read, 0, 0,
-                         result.nXSize, result.nYSize,
-                         result.pixelArray, result.nXSize, result.nYSize,
-                         GDT_Float32, 0, 0) != CE_None)
-        {
-            fprintf(stderr, "Error: GDALRasterIO failed (float)\n");
-            CPLFree(result.pixelArray);
-            result.pixelArray = NULL;
-        }
+        fprintf(stderr, "Error: GDALRasterIO failed (%s)\n", GDALGetDataTypeName(dataType));
+        return -1;
     }
-    else if (type == 1)
+    return 0;
+}
+
+Raster OpenTiff(char *filename, int type, int noDataVal)
+{
+    // type
+    // 0 = float
+    // 1 = int
+    // 2 = byte (nilai di luar 0..255 dijepit oleh GDAL)
+    Raster result = OpenTiffHeader(filename, noDataVal);
+    if (!result.dataset)
+        return result;
+
+    // Load raster sesuai type
+    if (type >= 0 && type <= 2)
     {
-        result.pixelArray = CPLMalloc(result.nXSize * result.nYSize * sizeof(int));
-        if (GDALRasterIO(result.band, GF_Read, 0, 0,
-                         result.nXSize, result.nYSize,
-                         result.pixelArray, result.nXSize, result.nYSize,
-                         GDT_Int32, 0, 0) != CE_None)
+        size_t elemSize = (type == 0) ? sizeof(float) : (type == 1) ? sizeof(int) : 1;
+        result.pixelArray = CPLMalloc((size_t)result.nXSize * result.nYSize * elemSize);
+        if (ReadTiffRows(&result, type, 0, result.nYSize, result.pixelArray) != 0)
         {
-            fprintf(stderr, "Error: GDALRasterIO failed (int)\n");
             CPLFree(result.pixelArray);
             result.pixelArray = NULL;
         }
     }
     return result;
-}
\ No newline at end of file
+}
@@ -10,6 +10,37 @@ typedef struct
     int nYSize;
     void *pixelArray;
 } Raster;
+
+// Tipe piksel GeoTIFF hasil simulasi
+enum
+{
+    OUTPUT_FLOAT32, // default
+    OUTPUT_FLOAT16, // Float32 dengan NBITS=16 (half), GDAL yang membulatkan
+    OUTPUT_UINT16   // kedalaman / scale dibulatkan, scale disimpan di band
+};
+
+typedef struct
+{
+    int type;             // OUTPUT_*
+    const char *compress; // COMPRESS GTiff; NULL = DEFLATE, "NONE" = tanpa
+    double scale;         // meter per nilai OUTPUT_UINT16; 0 = 0.001
+} OutputFormat;
+
+// "float32" / "float16" / "uint16" -> OUTPUT_*, -1 bila tidak dikenal
+int OutputTypeFromName(const char *name);
+double OutputNoData(const OutputFormat *format);
+double OutputScale(const OutputFormat *format);
 void WriteTiff(GDALDatasetH hDataset, float *pixelArray, int nXSize, int nYSize, char *output);
+GDALDatasetH CreateTiff(GDALDatasetH hDataset, int nXSize, int nYSize, char *output);
+// GeoTIFF ber-tile 256x256 dan terkompresi; nThreads dipakai GDAL untuk kompresi
+GDALDatasetH CreateTiffFormat(GDALDatasetH hDataset, int nXSize, int nYSize, char *output, const OutputFormat *format, int nThreads);
+int WriteTiffRows(GDALDatasetH outputDataset, float *rows, int nXSize, int y0, int nRows);
+// sama dengan WriteTiffRows, rows bertipe type
+int WriteTiffRowsType(GDALDatasetH outputDataset, void *rows, GDALDataType type, int nXSize, int y0, int nRows);
+// Dataset MEM 1x1 yang hanya membawa geotransform + proyeksi, pengganti
+// handle DEM (CreateTiffFormat, snapshot) kalau DEM tidak dibuka lewat GDAL
+GDALDatasetH CreateGeoreference(const double geoTransform[6], const char *wkt);
 Raster OpenTiff(char *filename, int type, int noDataVal);
+Raster OpenTiffHeader(char *filename, int noDataVal);
+int ReadTiffRows(Raster *raster, int type, int y0, int nRows, void *dst);
 #endif
@@ -0,0 +1,301 @@
+// json.c - small recursive-descent JSON parser (RFC 8259 subset: no
+// surrogate pairs in \u escapes beyond the BMP)
+#include "json.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *p;
+  char *err;
+  size_t errSize;
+  int depth;
+} Parser;
+
+static int ParseValue(Parser *ps, JsonValue *out);
+
+static int Fail(Parser *ps, const char *what) {
+  if (ps->err && ps->errSize > 0 && ps->err[0] == '\0')
+    snprintf(ps->err, ps->errSize, "%s", what);
+  return -1;
+}
+
+static void SkipSpace(Parser *ps) {
+  while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r')
+    ps->p++;
+}
+
+static int HexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static int ParseString(Parser *ps, char **out) {
+  ps->p++; // opening quote
+  size_t cap = 16, len = 0;
+  char *s = (char *)malloc(cap);
+  if (!s)
+    return Fail(ps, "out of memory");
+  for (;;) {
+    unsigned char c = (unsigned char)*ps->p;
+    if (c == '\0' || c < 0x20) {
+      free(s);
+      return Fail(ps, "unterminated string");
+    }
+    ps->p++;
+    if (c == '"')
+      break;
+    char buf[4];
+    int n = 1;
+    buf[0] = (char)c;
+    if (c == '\\') {
+      char e = *ps->p++;
+      switch (e) {
+      case '"':
+      case '\\':
+      case '/':
+        buf[0] = e;
+        break;
+      case 'b':
+        buf[0] = '\b';
+        break;
+      case 'f':
+        buf[0] = '\f';
+        break;
+      case 'n':
+        buf[0] = '\n';
+        break;
+      case 'r':
+        buf[0] = '\r';
+        break;
+      case 't':
+        buf[0] = '\t';
+        break;
+      case 'u': {
+        unsigned cp = 0;
+        for (int i = 0; i < 4; i++) {
+          int h = HexDigit(ps->p[i]);
+          if (h < 0) {
+            free(s);
+            return Fail(ps, "bad \\u escape");
+          }
+          cp = cp * 16 + (unsigned)h;
+        }
+        ps->p += 4;
+        // UTF-8 encode
+        if (cp < 0x80) {
+          buf[0] = (char)cp;
+        } else if (cp < 0x800) {
+          buf[0] = (char)(0xC0 | (cp >> 6));
+          buf[1] = (char)(0x80 | (cp & 0x3F));
+          n = 2;
+        } else {
+          buf[0] = (char)(0xE0 | (cp >> 12));
+          buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+          buf[2] = (char)(0x80 | (cp & 0x3F));
+          n = 3;
+        }
+        break;
+      }
+      default:
+        free(s);
+        return Fail(ps, "bad escape");
+      }
+    }
+    if (len + (size_t)n + 1 > cap) {
+      cap *= 2;
+      char *grown = (char *)realloc(s, cap);
+      if (!grown) {
+        free(s);
+        return Fail(ps, "out of memory");
+      }
+      s = grown;
+    }
+    memcpy(s + len, buf, (size_t)n);
+    len += (size_t)n;
+  }
+  s[len] = '\0';
+  *out = s;
+  return 0;
+}
+
+// appends one entry to an array/object, growing items (and keys)
+static JsonValue *AddItem(JsonValue *v, int *cap, char *key) {
+  if (v->count == *cap) {
+    int n = *cap ? *cap * 2 : 4;
+    JsonValue *items = (JsonValue *)realloc(v->items, sizeof(JsonValue) * n);
+    if (!items)
+      return NULL;
+    v->items = items;
+    if (v->type == JSON_OBJECT) {
+      char **keys = (char **)realloc(v->keys, sizeof(char *) * n);
+      if (!keys)
+        return NULL;
+      v->keys = keys;
+    }
+    *cap = n;
+  }
+  if (v->type == JSON_OBJECT)
+    v->keys[v->count] = key;
+  JsonValue *item = &v->items[v->count++];
+  memset(item, 0, sizeof(*item));
+  return item;
+}
+
+static int ParseContainer(Parser *ps, JsonValue *out, int isObject) {
+  char close = isObject ? '}' : ']';
+  out->type = isObject ? JSON_OBJECT : JSON_ARRAY;
+  if (++ps->depth > 64)
+    return Fail(ps, "nesting too deep");
+  ps->p++;
+  SkipSpace(ps);
+  int cap = 0;
+  if (*ps->p == close) {
+    ps->p++;
+    ps->depth--;
+    return 0;
+  }
+  for (;;) {
+    char *key = NULL;
+    SkipSpace(ps);
+    if (isObject) {
+      if (*ps->p != '"' || ParseString(ps, &key) != 0)
+        return Fail(ps, "expected member name");
+      SkipSpace(ps);
+      if (*ps->p != ':') {
+        free(key);
+        return Fail(ps, "expected ':'");
+      }
+      ps->p++;
+    }
+    JsonValue *item = AddItem(out, &cap, key);
+    if (!item) {
+      free(key);
+      return Fail(ps, "out of memory");
+    }
+    if (ParseValue(ps, item) != 0)
+      return -1;
+    SkipSpace(ps);
+    if (*ps->p == ',') {
+      ps->p++;
+      continue;
+    }
+    if (*ps->p == close) {
+      ps->p++;
+      ps->depth--;
+      return 0;
+    }
+    return Fail(ps, isObject ? "expected ',' or '}'" : "expected ',' or ']'");
+  }
+}
+
+static int ParseValue(Parser *ps, JsonValue *out) {
+  SkipSpace(ps);
+  char c = *ps->p;
+  if (c == '{' || c == '[')
+    return ParseContainer(ps, out, c == '{');
+  if (c == '"') {
+    out->type = JSON_STRING;
+    return ParseString(ps, &out->string);
+  }
+  if (strncmp(ps->p, "true", 4) == 0 || strncmp(ps->p, "false", 5) == 0) {
+    out->type = JSON_BOOL;
+    out->number = (c == 't');
+    ps->p += (c == 't') ? 4 : 5;
+    return 0;
+  }
+  if (strncmp(ps->p, "null", 4) == 0) {
+    out->type = JSON_NULL;
+    ps->p += 4;
+    return 0;
+  }
+  if (c == '-' || isdigit((unsigned char)c)) {
+    char *end;
+    out->type = JSON_NUMBER;
+    out->number = strtod(ps->p, &end);
+    if (end == ps->p)
+      return Fail(ps, "bad number");
+    ps->p = end;
+    return 0;
+  }
+  return Fail(ps, "unexpected character");
+}
+
+static void FreeMembers(JsonValue *v) {
+  for (int i = 0; i < v->count; i++) {
+    FreeMembers(&v->items[i]);
+    if (v->keys)
+      free(v->keys[i]);
+  }
+  free(v->items);
+  free(v->keys);
+  free(v->string);
+}
+
+JsonValue *JsonParse(const char *text, char *err, size_t errSize) {
+  if (err && errSize > 0)
+    err[0] = '\0';
+  JsonValue *v = (JsonValue *)calloc(1, sizeof(JsonValue));
+  if (!v)
+    return NULL;
+  Parser ps = {text, err, errSize, 0};
+  int rc = ParseValue(&ps, v);
+  if (rc == 0) {
+    SkipSpace(&ps);
+    if (*ps.p != '\0')
+      rc = Fail(&ps, "trailing characters");
+  }
+  if (rc != 0) {
+    FreeMembers(v);
+    free(v);
+    return NULL;
+  }
+  return v;
+}
+
+void JsonFree(JsonValue *v) {
+  if (!v)
+    return;
+  FreeMembers(v);
+  free(v);
+}
+
+const JsonValue *JsonGet(const JsonValue *v, const char *key) {
+  if (!v || v->type != JSON_OBJECT)
+    return NULL;
+  for (int i = 0; i < v->count; i++)
+    if (strcmp(v->keys[i], key) == 0)
+      return &v->items[i];
+  return NULL;
+}
+
+double JsonNumber(const JsonValue *v, double fallback) {
+  if (v && (v->type == JSON_NUMBER || v->type == JSON_BOOL))
+    return v->number;
+  return fallback;
+}
+
+const char *JsonString(const JsonValue *v) {
+  return (v && v->type == JSON_STRING) ? v->string : NULL;
+}
+
+void JsonWriteString(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; s && *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c == '\n')
+      fputs("\\n", fp);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
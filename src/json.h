@@ -0,0 +1,37 @@
+#ifndef json
+#define json
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Minimal JSON reader for worker jobs: one parsed tree per document.
+typedef enum {
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT
+} JsonType;
+
+typedef struct JsonValue {
+  JsonType type;
+  double number;             // JSON_NUMBER, and 0/1 for JSON_BOOL
+  char *string;              // JSON_STRING
+  int count;                 // JSON_ARRAY / JSON_OBJECT entries
+  struct JsonValue *items;   // entries
+  char **keys;               // JSON_OBJECT member names
+} JsonValue;
+
+// NULL on a syntax error, with a message in err
+JsonValue *JsonParse(const char *text, char *err, size_t errSize);
+void JsonFree(JsonValue *v);
+// member of an object, NULL if missing or v is not an object
+const JsonValue *JsonGet(const JsonValue *v, const char *key);
+// number / bool value, fallback for anything else
+double JsonNumber(const JsonValue *v, double fallback);
+// string value, NULL for anything else
+const char *JsonString(const JsonValue *v);
+// writes s as a quoted, escaped JSON string
+void JsonWriteString(FILE *fp, const char *s);
+#endif
@@ -1,24 +1,11 @@
 // main.c (modified for time-series rainfall)
-#include "cpl_conv.h"
-#include "gdal.h"
-#include "gdalShortcut.h"
-#include "smoothing.h"
-#include "transformation.h"
-#include <math.h>
+#include "ensemble.h"
+#include "simulation.h"
+#include "worker.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-typedef struct {
-  double inLat, inLon, outLat, outLon;
-  int px, py;
-  int ox, oy;
-  float capacity_m3hr;
-  float threshold;
-  int radius_px;
-  int state;
-  int cooldown;
-} Pump;
+#include <sys/resource.h>
 
 int parseFloatArray(const char *str, float **out, int *n) {
   if (!str)
@@ -46,41 +33,451 @@ int parseFloatArray(const char *str, float **out, int *n) {
   return 0;
 }
 
+typedef struct {
+  SimOptions sim;
+  int workerMode;         // serve JSON jobs instead of a single run
+  const char *socketPath; // worker jobs from a Unix socket instead of stdin
+  const char *batchFile;  // scenario manifest for batch mode
+  int nJobs;              // batch scenarios run at the same time (0 = auto)
+  const char *checkpointFile;
+  int checkpointEvery;
+  const char *resumeFile;
+  int decaySteps;
+  const char *snapshotPath;
+  int snapshotEvery;
+  int snapshotSubiters;
+  float adaptiveTol;
+  int d8;
+  int estimate;
+  int multigridLevels;
+  int multigridSweeps;
+  int multigridValidate; // also run single-resolution and compare
+  const char *tilesDir;
+  int tileMinZoom, tileMaxZoom;
+  const char *colormap;
+  const char *statsFile;
+  OutputFormat format;
+  const char *gaugeFile; // name,lat,lon CSV
+  const char *gaugeOutput;
+  const char *rainRasters; // per-step rain grids, see rainGrid.h
+  int domains;             // processes sharing one run, see domain.h
+  const char *compileTerrain; // write a compiled terrain, see terrainFile.h
+  int depressions;            // ... with the estimate's depression map
+} CliOptions;
+
+// "result/a.tif" -> "result/a.single.tif"
+static char *WithSuffix(const char *path, const char *suffix) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(path, '.');
+  if (!dot || (slash && dot < slash))
+    dot = path + strlen(path);
+  size_t stem = (size_t)(dot - path);
+  char *out = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+  if (out)
+    sprintf(out, "%.*s%s%s", (int)stem, path, suffix, dot);
+  return out;
+}
+
+// Runs the scenario single-resolution first (outputs next to the real
+// ones as *.single.*; no tiles, snapshots or checkpoint), then with
+// multigrid, and compares the final water grids.
+static int ValidateMultigrid(Terrain *t, SimState *st, const SimOptions *opt,
+                             const Scenario *sc, char *err, size_t errSize) {
+  const float floodDepth = 0.05f; // m, what counts as flooded
+  Scenario single = *sc;
+  single.multigridLevels = 0;
+  single.output = WithSuffix(sc->output, ".single");
+  single.pumpLog = WithSuffix(sc->pumpLog, ".single");
+  single.tilesDir = NULL;
+  single.statsFile = NULL;
+  single.gaugeOutput = NULL;
+  single.snapshotPath = NULL;
+  single.checkpointFile = NULL;
+  size_t npix = (size_t)t->nXSize * (size_t)t->nYSize;
+  float *ref = (float *)malloc(npix * sizeof(float));
+  SimTimings tmSingle = {0}, tmMulti = {0};
+  int rc = 0;
+  if (!single.output || !single.pumpLog || !ref) {
+    snprintf(err, errSize, "Failed: Memory allocation failed");
+    rc = 1;
+  }
+  if (rc == 0) {
+    printf("# Validation: single-resolution run\n");
+    rc = RunScenario(t, st, opt, &single, &tmSingle, err, errSize);
+  }
+  if (rc == 0) {
+    // the multigrid run starts from a dry grid again
+    memcpy(ref, st->water, npix * sizeof(float));
+    printf("# Validation: multigrid run\n");
+    rc = RunScenario(t, st, opt, sc, &tmMulti, err, errSize);
+  }
+  if (rc == 0) {
+    MultigridComparison cmp;
+    MultigridCompare(ref, st->water, t->mask, npix, floodDepth, &cmp);
+    printf("# Validation: flooded (> %.2f m) single %lld cells, multigrid "
+           "%lld cells, IoU %.4f\n",
+           floodDepth, cmp.wetA, cmp.wetB, cmp.iou);
+    printf("# Validation: max |depth diff| %.4f m, water volume %+.3f%%\n",
+           cmp.maxDiff,
+           cmp.volumeA > 0.0
+               ? 100.0 * (cmp.volumeB - cmp.volumeA) / cmp.volumeA
+               : 0.0);
+    printf("# Validation: fine sweeps single %lld, multigrid %lld; simulate "
+           "%.3f s vs %.3f s\n",
+           tmSingle.sweeps, tmMulti.sweeps, tmSingle.simulate,
+           tmMulti.simulate);
+  }
+  free((char *)single.output);
+  free((char *)single.pumpLog);
+  free(ref);
+  return rc;
+}
+
+static int optionIs(const char *arg, size_t nameLen, const char *name) {
+  return nameLen == strlen(name) && strncmp(arg, name, nameLen) == 0;
+}
+
+// Strip "--flag", "--name value" and "--name=value" options out of argv so
+// the positional arguments keep their original indexes.
+int parseOptions(int *argc, const char *argv[], CliOptions *cli) {
+  SimOptions *opt = &cli->sim;
+  int out = 1;
+  for (int i = 1; i < *argc; i++) {
+    const char *a = argv[i];
+    if (strncmp(a, "--", 2) != 0) {
+      argv[out++] = a;
+      continue;
+    }
+    const char *eq = strchr(a, '=');
+    size_t nameLen = eq ? (size_t)(eq - a) : strlen(a);
+
+    // flags without a value
+    if (optionIs(a, nameLen, "--sparse")) {
+      opt->sparse = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--binary-log")) {
+      opt->binaryLog = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--worker")) {
+      cli->workerMode = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--snapshot-subiters")) {
+      cli->snapshotSubiters = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--d8")) {
+      cli->d8 = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--estimate")) {
+      cli->estimate = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--multigrid-validate")) {
+      cli->multigridValidate = 1;
+      continue;
+    }
+    if (optionIs(a, nameLen, "--depressions")) {
+      cli->depressions = 1;
+      continue;
+    }
+
+    const char *val = eq ? eq + 1 : (i + 1 < *argc ? argv[++i] : NULL);
+    if (!val) {
+      fprintf(stderr, "Failed: option %.*s needs a value\n", (int)nameLen, a);
+      return -1;
+    }
+    if (optionIs(a, nameLen, "--threads")) {
+      opt->nThreads = atoi(val);
+      if (opt->nThreads < 0) {
+        fprintf(stderr, "Failed: --threads must be >= 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--socket")) {
+      cli->socketPath = val;
+    } else if (optionIs(a, nameLen, "--batch")) {
+      cli->batchFile = val;
+    } else if (optionIs(a, nameLen, "--compile-terrain")) {
+      cli->compileTerrain = val;
+    } else if (optionIs(a, nameLen, "--domains")) {
+      cli->domains = atoi(val);
+      if (cli->domains < 1 || cli->domains > DOMAIN_MAX) {
+        fprintf(stderr, "Failed: --domains must be 1 .. %d\n", DOMAIN_MAX);
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--jobs")) {
+      cli->nJobs = atoi(val);
+      if (cli->nJobs < 0) {
+        fprintf(stderr, "Failed: --jobs must be >= 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--checkpoint")) {
+      cli->checkpointFile = val;
+    } else if (optionIs(a, nameLen, "--checkpoint-every")) {
+      cli->checkpointEvery = atoi(val);
+      if (cli->checkpointEvery < 0) {
+        fprintf(stderr, "Failed: --checkpoint-every must be >= 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--resume")) {
+      cli->resumeFile = val;
+    } else if (optionIs(a, nameLen, "--decay-steps")) {
+      cli->decaySteps = atoi(val);
+      if (cli->decaySteps < 0) {
+        fprintf(stderr, "Failed: --decay-steps must be >= 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--snapshots")) {
+      cli->snapshotPath = val;
+    } else if (optionIs(a, nameLen, "--snapshot-every")) {
+      cli->snapshotEvery = atoi(val);
+      if (cli->snapshotEvery < 1) {
+        fprintf(stderr, "Failed: --snapshot-every must be >= 1\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--adaptive")) {
+      cli->adaptiveTol = (float)atof(val);
+      if (!(cli->adaptiveTol > 0.0f)) {
+        fprintf(stderr, "Failed: --adaptive must be > 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--multigrid")) {
+      cli->multigridLevels = atoi(val);
+      if (cli->multigridLevels < 1) {
+        fprintf(stderr, "Failed: --multigrid must be >= 1\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--multigrid-sweeps")) {
+      cli->multigridSweeps = atoi(val);
+      if (cli->multigridSweeps < 1) {
+        fprintf(stderr, "Failed: --multigrid-sweeps must be >= 1\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--tiles")) {
+      cli->tilesDir = val;
+    } else if (optionIs(a, nameLen, "--tile-zoom")) {
+      if (sscanf(val, "%d-%d", &cli->tileMinZoom, &cli->tileMaxZoom) != 2 ||
+          cli->tileMinZoom < 0 || cli->tileMaxZoom > 24 ||
+          cli->tileMinZoom > cli->tileMaxZoom) {
+        fprintf(stderr, "Failed: --tile-zoom must be MIN-MAX within 0-24\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--colormap")) {
+      cli->colormap = val;
+    } else if (optionIs(a, nameLen, "--stats")) {
+      cli->statsFile = val;
+    } else if (optionIs(a, nameLen, "--gauges")) {
+      cli->gaugeFile = val;
+    } else if (optionIs(a, nameLen, "--gauge-output")) {
+      cli->gaugeOutput = val;
+    } else if (optionIs(a, nameLen, "--rain-rasters")) {
+      cli->rainRasters = val;
+    } else if (optionIs(a, nameLen, "--output-type")) {
+      cli->format.type = OutputTypeFromName(val);
+      if (cli->format.type < 0) {
+        fprintf(stderr,
+                "Failed: --output-type must be float32, float16 or uint16\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--compress")) {
+      cli->format.compress = val;
+    } else if (optionIs(a, nameLen, "--depth-scale")) {
+      cli->format.scale = atof(val);
+      if (!(cli->format.scale > 0.0)) {
+        fprintf(stderr, "Failed: --depth-scale must be > 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--compact")) {
+      if (strcmp(val, "fp16") == 0) {
+        opt->compact = FLOW_STATE_FLOAT16;
+      } else if (strcmp(val, "fixed") == 0) {
+        opt->compact = FLOW_STATE_FIXED16;
+      } else {
+        fprintf(stderr, "Failed: --compact must be fp16 or fixed\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--compact-step")) {
+      opt->compactStep = (float)atof(val);
+      if (!(opt->compactStep > 0.0f)) {
+        fprintf(stderr, "Failed: --compact-step must be > 0\n");
+        return -1;
+      }
+    } else if (optionIs(a, nameLen, "--scratch")) {
+      opt->scratchDir = val;
+    } else if (optionIs(a, nameLen, "--band-rows")) {
+      opt->bandRows = atoi(val);
+      if (opt->bandRows < 4) {
+        fprintf(stderr, "Failed: --band-rows must be >= 4\n");
+        return -1;
+      }
+    } else {
+      fprintf(stderr, "Failed: unknown option %.*s\n", (int)nameLen, a);
+      return -1;
+    }
+  }
+  argv[out] = NULL;
+  *argc = out;
+  return 0;
+}
+
 int main(int argc, const char *argv[]) {
-  float infil_capacity_mm_per_hr[4] = {0.0f, 10.0f, 5.0f, 30.0f};
+  CliOptions cli = {0};
+  SimOptions *opt = &cli.sim;
+  opt->bandRows = 256;
+  opt->compactStep = 1e-3f; // 1 mm steps, up to 65.5 m deep
+  cli.snapshotEvery = 1;
+  cli.tileMinZoom = 12;
+  cli.tileMaxZoom = 17;
+  if (parseOptions(&argc, argv, &cli) != 0)
+    return 1;
+  if (cli.multigridValidate && !cli.multigridLevels) {
+    fprintf(stderr, "Failed: --multigrid-validate needs --multigrid\n");
+    return 1;
+  }
+  if (cli.depressions && !cli.compileTerrain) {
+    fprintf(stderr, "Failed: --depressions needs --compile-terrain\n");
+    return 1;
+  }
+  if (!cli.gaugeFile != !cli.gaugeOutput) {
+    fprintf(stderr, "Failed: --gauges and --gauge-output go together\n");
+    return 1;
+  }
+  if (opt->scratchDir && opt->sparse) {
+    fprintf(stderr, "Failed: --sparse cannot be combined with --scratch\n");
+    return 1;
+  }
+  if (opt->compact && (opt->sparse || opt->scratchDir)) {
+    fprintf(stderr, "Failed: --compact needs the dense in-memory sweep, "
+                    "without --sparse or --scratch\n");
+    return 1;
+  }
+  // domains only run the plain dense time steps; everything that keeps
+  // state outside the shared grids stays single-process for now
+  if (cli.domains > 1 &&
+      (cli.workerMode || cli.batchFile || opt->sparse || opt->scratchDir ||
+       opt->compact || cli.checkpointFile || cli.resumeFile ||
+       cli.snapshotPath || cli.estimate || cli.multigridLevels ||
+       cli.rainRasters)) {
+    fprintf(stderr,
+            "Failed: --domains cannot be combined with --worker, --batch, "
+            "--sparse, --scratch, --compact, --checkpoint, --resume, "
+            "--snapshots, --estimate, --multigrid or --rain-rasters\n");
+    return 1;
+  }
+  char err[1024] = "";
+
+  if (cli.compileTerrain) {
+    if (argc < 3) {
+      fprintf(stderr,
+              "Usage: %s --compile-terrain <terrain.fst> [--depressions] "
+              "<dem.tif> <landuse.tif>\n",
+              argv[0]);
+      return 1;
+    }
+    if (TerrainCompile(argv[1], argv[2], cli.compileTerrain,
+                       cli.depressions, err, sizeof(err)) != 0) {
+      fprintf(stderr, "%s\n", err);
+      return 1;
+    }
+    return 0;
+  }
+  if (cli.workerMode) {
+    if (argc < 3) {
+      fprintf(stderr,
+              "Usage: %s --worker [--socket PATH] [--threads N] [--sparse] "
+              "[--scratch DIR [--band-rows N]] <dem.tif> <landuse.tif>\n",
+              argv[0]);
+      return 1;
+    }
+    return WorkerServe(argv[1], argv[2], opt, cli.socketPath);
+  }
+  if (cli.batchFile) {
+    if (argc < 3) {
+      fprintf(stderr,
+              "Usage: %s --batch <manifest.json> [--jobs N] [--threads N] "
+              "[--sparse] [--scratch DIR [--band-rows N]] <dem.tif> "
+              "<landuse.tif>\n",
+              argv[0]);
+      return 1;
+    }
+    return EnsembleRun(argv[1], argv[2], opt, cli.batchFile, cli.nJobs);
+  }
 
   if (argc < 14) {
     fprintf(
         stderr,
-        "Usage: %s <dem.tif> <landuse.tif> <output.tif> <output_pump_log.csv> "
+        "Usage: %s [--threads N] [--sparse] [--scratch DIR [--band-rows N]] "
+        "[--compact fp16|fixed [--compact-step M]] "
+        "[--binary-log] [--checkpoint FILE [--checkpoint-every N]] "
+        "[--resume FILE] [--decay-steps N] [--adaptive TOL] [--d8] "
+        "[--estimate] "
+        "[--multigrid LEVELS [--multigrid-sweeps N] [--multigrid-validate]] "
+        "[--snapshots PATH [--snapshot-every N] [--snapshot-subiters]] "
+        "[--tiles DIR "
+        "[--tile-zoom MIN-MAX] [--colormap FILE]] [--stats FILE] "
+        "[--output-type float32|float16|uint16 [--depth-scale M]] "
+        "[--compress NAME] [--gauges FILE --gauge-output FILE] "
+        "[--rain-rasters STACK.tif|A.tif,B.tif,...|@LIST] [--domains N] "
+        "<dem.tif> <landuse.tif> "
+        "<output.tif> "
+        "<output_pump_log.csv> "
         "<rain_mm1,mm2,...> <interval_min1,interval_min2,...> "
         "<iter1,iter2,...> <pumpInLat,...> <pumpInLon,...> "
         "<pumpOutLat,...> <pumpOutLon,...> <pumpCapacity_m3_per_hr,...> "
-        "<pumpThreshold_m,...> [<pumpRadius_m,...>]\n",
-        argv[0]);
+        "<pumpThreshold_m,...> [<pumpRadius_m,...>]\n"
+        "       %s --worker [--socket PATH] [options] <dem.tif> "
+        "<landuse.tif>\n"
+        "       %s --batch <manifest.json> [--jobs N] [options] <dem.tif> "
+        "<landuse.tif>\n"
+        "       %s --compile-terrain <terrain.fst> [--depressions] "
+        "<dem.tif> <landuse.tif>\n"
+        "<dem.tif> may be a compiled terrain; <landuse.tif> is not used "
+        "then (pass -)\n",
+        argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
 
   const char *demFile = argv[1];
   const char *lahanFile = argv[2];
-  const char *output = argv[3];
-  const char *pumpLogFile = argv[4];
+  Scenario sc = {0};
+  sc.output = argv[3];
+  sc.pumpLog = argv[4];
+  sc.binaryLog = opt->binaryLog;
+  sc.checkpointFile = cli.checkpointFile;
+  sc.checkpointEvery = cli.checkpointEvery;
+  sc.resumeFile = cli.resumeFile;
+  sc.decaySteps = cli.decaySteps;
+  sc.snapshotPath = cli.snapshotPath;
+  sc.snapshotEvery = cli.snapshotEvery;
+  sc.snapshotSubiters = cli.snapshotSubiters;
+  sc.adaptiveTol = cli.adaptiveTol;
+  sc.d8 = cli.d8;
+  sc.estimate = cli.estimate;
+  sc.multigridLevels = cli.multigridLevels;
+  sc.multigridSweeps = cli.multigridSweeps;
+  sc.tilesDir = cli.tilesDir;
+  sc.tileMinZoom = cli.tileMinZoom;
+  sc.tileMaxZoom = cli.tileMaxZoom;
+  sc.colormap = cli.colormap;
+  sc.statsFile = cli.statsFile;
+  sc.rainRasters = cli.rainRasters;
+  sc.format = cli.format;
 
   // parse rainfall time-series arrays
-  float *rain_mm_array = NULL;
-  float *rain_interval_min_array = NULL;
-  float *rain_iter_f_array = NULL;
   int nRain1 = 0, nRain2 = 0, nRain3 = 0;
 
-  if (parseFloatArray(argv[5], &rain_mm_array, &nRain1) != 0) {
+  if (parseFloatArray(argv[5], &sc.rain_mm, &nRain1) != 0) {
     fprintf(stderr, "Failed: parse rain_mm array\n");
     return 1;
   }
-  if (parseFloatArray(argv[6], &rain_interval_min_array, &nRain2) != 0) {
+  if (parseFloatArray(argv[6], &sc.interval_min, &nRain2) != 0) {
     fprintf(stderr, "Failed: parse rain_interval_min array\n");
     return 1;
   }
-  if (parseFloatArray(argv[7], &rain_iter_f_array, &nRain3) != 0) {
+  if (parseFloatArray(argv[7], &sc.iter, &nRain3) != 0) {
     fprintf(stderr, "Failed: parse rain_iter array\n");
     return 1;
   }
@@ -89,11 +486,9 @@ int main(int argc, const char *argv[]) {
     fprintf(stderr, "Failed: Rain arrays must have same length\n");
     return 1;
   }
-  int nSteps = nRain1;
+  sc.nSteps = nRain1;
 
   // pump args start at argv[8]...
-  float *inLat = NULL, *inLon = NULL, *outLat = NULL, *outLon = NULL;
-  float *capacities = NULL, *thresholds = NULL, *radii = NULL;
   int nPumps1 = 0, nPumps2 = 0, nPumps3 = 0, nPumps4 = 0, nPumps5 = 0,
       nPumps6 = 0, nPumps7 = 0;
   int pumpArgBase = 8;
@@ -106,33 +501,33 @@ int main(int argc, const char *argv[]) {
   // argv[pumpArgBase + 0] = pumpInLat
   // +1 = pumpInLon, +2 = pumpOutLat, +3 = pumpOutLon, +4 = capacities, +5 =
   // thresholds, +6 optional radii
-  if (parseFloatArray(argv[pumpArgBase + 0], &inLat, &nPumps1) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 0], &sc.inLat, &nPumps1) != 0)
     return 1;
-  if (parseFloatArray(argv[pumpArgBase + 1], &inLon, &nPumps2) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 1], &sc.inLon, &nPumps2) != 0)
     return 1;
-  if (parseFloatArray(argv[pumpArgBase + 2], &outLat, &nPumps3) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 2], &sc.outLat, &nPumps3) != 0)
     return 1;
-  if (parseFloatArray(argv[pumpArgBase + 3], &outLon, &nPumps4) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 3], &sc.outLon, &nPumps4) != 0)
     return 1;
-  if (parseFloatArray(argv[pumpArgBase + 4], &capacities, &nPumps5) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 4], &sc.capacity, &nPumps5) != 0)
     return 1;
-  if (parseFloatArray(argv[pumpArgBase + 5], &thresholds, &nPumps6) != 0)
+  if (parseFloatArray(argv[pumpArgBase + 5], &sc.threshold, &nPumps6) != 0)
     return 1;
 
   int nPumps = nPumps1;
   if (argc >= pumpArgBase + 7 && argv[pumpArgBase + 6]) {
-    if (parseFloatArray(argv[pumpArgBase + 6], &radii, &nPumps7) != 0) {
+    if (parseFloatArray(argv[pumpArgBase + 6], &sc.radius, &nPumps7) != 0) {
       // fallback default
       nPumps7 = nPumps;
-      radii = (float *)malloc(sizeof(float) * nPumps);
+      sc.radius = (float *)malloc(sizeof(float) * nPumps);
       for (int i = 0; i < nPumps; i++)
-        radii[i] = 2.0f;
+        sc.radius[i] = 2.0f;
     }
   } else {
     nPumps7 = nPumps;
-    radii = (float *)malloc(sizeof(float) * nPumps);
+    sc.radius = (float *)malloc(sizeof(float) * nPumps);
     for (int i = 0; i < nPumps; i++)
-      radii[i] = 2.0f;
+      sc.radius[i] = 2.0f;
   }
 
   if (!(nPumps1 == nPumps2 && nPumps1 == nPumps3 && nPumps1 == nPumps4 &&
@@ -140,321 +535,73 @@ int main(int argc, const char *argv[]) {
     fprintf(stderr, "Failed: All pump arrays must have same length\n");
     return 1;
   }
-
-  GDALAllRegister();
-
-  Raster dem = OpenTiff((char *)demFile, 0, -32767);
-  if (!dem.dataset) {
-    fprintf(stderr, "Failed: to open DEM: %s\n", demFile);
+  sc.nPumps = nPumps;
+  sc.gaugeOutput = cli.gaugeOutput;
+  if (cli.gaugeFile &&
+      GaugesLoadCsv(&sc.gaugePoints, cli.gaugeFile, err, sizeof(err)) != 0) {
+    fprintf(stderr, "%s\n", err);
+    ScenarioFree(&sc);
     return 1;
   }
-  float *elevArray = (float *)dem.pixelArray;
-
-  Raster lahanData = OpenTiff((char *)lahanFile, 1, -1);
-  if (!lahanData.dataset) {
-    fprintf(stderr, "Failed: to open landuse: %s\n", lahanFile);
-    GDALClose(dem.dataset);
-    return 1;
-  }
-  int *lahan = (int *)lahanData.pixelArray;
-
-  int nXSize = dem.nXSize;
-  int nYSize = dem.nYSize;
-  if (nXSize <= 0 || nYSize <= 0) {
-    fprintf(stderr, "Failed: Invalid raster size\n");
-    GDALClose(dem.dataset);
-    GDALClose(lahanData.dataset);
-    return 1;
-  }
-
-  int hasNoData = 0;
-  double noDataValue = GDALGetRasterNoDataValue(dem.band, &hasNoData);
 
-  // defaults (can be tuned)
-  float gsd = 0.5f;
-  float pixelArea = gsd * gsd;
-
-  // allocate pumps
-  Pump *pumps = (Pump *)calloc((size_t)nPumps, sizeof(Pump));
-  if (!pumps) {
-    fprintf(stderr, "Failed: to alloc pumps\n");
-    return 1;
-  }
-  for (int i = 0; i < nPumps; i++) {
-    // set all coords to -1 initially (safety)
-    pumps[i].px = -1;
-    pumps[i].py = -1;
-    pumps[i].ox = -1;
-    pumps[i].oy = -1;
-
-    // if lat == 0, then we will skip it
-    if (inLat[i] == 0 && outLat[i] == 0 && inLon[i] == 0 && outLon[i] == 0) {
-      continue;
-    }
-    int px = -1, py = -1, ox = -1, oy = -1;
-    LatLonToPixel(dem.dataset, inLat[i], inLon[i], &px, &py);
-    LatLonToPixel(dem.dataset, outLat[i], outLon[i], &ox, &oy);
-    if (px < 0 || px >= nXSize || py < 0 || py >= nYSize || ox < 0 ||
-        ox >= nXSize || oy < 0 || oy >= nYSize) {
-      fprintf(
-          stderr,
-          "Failed: Pump %d outside DEM bounds, ignored (in:%f,%f,out:%f,%f -> "
-          "px=%d,py=%d,ox=%d,oy=%d)\n",
-          i, inLat[i], inLon[i], outLat[i], outLon[i], px, py, ox, oy);
+  // the other ranks are forked here, before any OpenMP thread exists;
+  // from now on every process runs the rest of main for its own rows
+  Domain *subdomain = NULL;
+  if (cli.domains > 1) {
+    subdomain = DomainStart(cli.domains, demFile, sc.nPumps, err, sizeof(err));
+    if (!subdomain) {
+      fprintf(stderr, "%s\n", err);
+      ScenarioFree(&sc);
       return 1;
     }
-    pumps[i].inLat = inLat[i];
-    pumps[i].inLon = inLon[i];
-    pumps[i].outLat = outLat[i];
-    pumps[i].outLon = outLon[i];
-    pumps[i].px = px;
-    pumps[i].py = py;
-    pumps[i].ox = ox;
-    pumps[i].oy = oy;
-    pumps[i].capacity_m3hr = capacities[i];
-    pumps[i].threshold = thresholds[i];
-    pumps[i].radius_px = (int)ceil(radii[i] / gsd);
-    if (pumps[i].radius_px < 1)
-      pumps[i].radius_px = 1;
-    pumps[i].state = 0;
-    pumps[i].cooldown = 0;
-  }
-
-  size_t npix = (size_t)nXSize * (size_t)nYSize;
-  float *water = (float *)CPLCalloc(npix, sizeof(float));
-  float *tmp = (float *)CPLCalloc(npix, sizeof(float));
-  if (!water || !tmp) {
-    fprintf(stderr, "Failed: Memory allocation failed\n");
-    CPLFree(water);
-    CPLFree(tmp);
-    GDALClose(dem.dataset);
-    GDALClose(lahanData.dataset);
-    return 1;
+    opt->subdomain = subdomain;
+    if (opt->nThreads <= 0)
+      opt->nThreads = DomainThreads(subdomain);
   }
 
-  FILE *pumpLog = fopen(pumpLogFile, "w");
-  if (!pumpLog) {
-    perror("Failed: to open pump_log.csv");
-    CPLFree(water);
-    CPLFree(tmp);
-    GDALClose(dem.dataset);
-    GDALClose(lahanData.dataset);
+  Terrain terrain;
+  if (TerrainLoad(&terrain, demFile, lahanFile, opt, err, sizeof(err)) != 0) {
+    fprintf(stderr, "%s\n", err);
+    if (subdomain) {
+      DomainFinish(subdomain, 1, err, sizeof(err));
+      DomainFree(subdomain);
+    }
+    ScenarioFree(&sc);
     return 1;
   }
-  fprintf(pumpLog, "step,subiter,pump_id,inLat,inLon,outLat,outLon,water_level_"
-                   "m,threshold_on_m,threshold_off_m,pumped_m,active\n");
-  fflush(pumpLog);
-
-  int dx[4] = {-1, 1, 0, 0};
-  int dy[4] = {0, 0, -1, 1};
-  int nDirs = 4;
-
-  const int pumpCooldownEpochs = 1;
-  const float pumpHysteresisFrac = 0.1f;
-
-  // MAIN loop over time-steps (time-series)
-  for (int step = 0; step < nSteps; step++) {
-    float rain_mm = rain_mm_array[step];
-    float interval_min = rain_interval_min_array[step];
-    int iter = (int)roundf(rain_iter_f_array[step]);
-    if (iter < 1)
-      iter = 1;
-
-    float rain_m = rain_mm / 1000.0f;
-    // distribute rain for this timestep: add to all valid pixels
-    for (size_t i = 0; i < npix; i++) {
-      if (hasNoData && elevArray[i] == (float)noDataValue)
-        continue;
-      if (isnan(elevArray[i]))
-        continue;
-      water[i] += rain_m;
+  SimState state;
+  if (SimStateCreate(&state, &terrain, opt, opt->nThreads) != 0) {
+    fprintf(stderr, "Failed: Memory allocation failed\n");
+    TerrainFree(&terrain, opt);
+    if (subdomain) {
+      DomainFinish(subdomain, 1, err, sizeof(err));
+      DomainFree(subdomain);
     }
-
-    // decay factor optionally (same as previous logic)
-    float t = (float)step / (float)((nSteps > 1) ? (nSteps - 1) : 1);
-    float decayFactor = fmaxf(0.1f, 1.0f - t * 0.9f);
-
-    // per-timestep sub-iterations
-    for (int it = 0; it < iter; it++) {
-      memcpy(tmp, water, sizeof(float) * npix);
-
-      // water flow + infiltration (4-directional)
-      for (int y = 1; y < nYSize - 1; y++) {
-        for (int x = 1; x < nXSize - 1; x++) {
-          int idx = y * nXSize + x;
-          if (hasNoData && elevArray[idx] == (float)noDataValue)
-            continue;
-          if (isnan(elevArray[idx]))
-            continue;
-
-          float z = elevArray[idx] + water[idx];
-          float total = 0.0f;
-          float pot[4] = {0, 0, 0, 0};
-
-          for (int d = 0; d < nDirs; d++) {
-            int nx = x + dx[d];
-            int ny = y + dy[d];
-            if (nx < 0 || ny < 0 || nx >= nXSize || ny >= nYSize)
-              continue;
-            int nidx = ny * nXSize + nx;
-            if (hasNoData && elevArray[nidx] == (float)noDataValue)
-              continue;
-            if (isnan(elevArray[nidx]))
-              continue;
-            float zn = elevArray[nidx] + water[nidx];
-            float diff = z - zn;
-            if (diff > 0.0f) {
-              pot[d] = diff;
-              total += diff;
-            }
-          }
-
-          if (total > 0.0f) {
-            for (int d = 0; d < nDirs; d++) {
-              if (pot[d] <= 0.0f)
-                continue;
-              int nx = x + dx[d];
-              int ny = y + dy[d];
-              int nidx = ny * nXSize + nx;
-              float flow = (pot[d] / total) * water[idx];
-              tmp[idx] -= flow;
-              tmp[nidx] += flow;
-            }
-          }
-
-          // infiltration
-          int kelas = lahan[idx];
-          if (kelas < 0 || kelas > 3)
-            kelas = 0;
-          float infil_mmhr = (kelas >= 0 && kelas < 4)
-                                 ? infil_capacity_mm_per_hr[kelas] * decayFactor
-                                 : 0.0f;
-          float infil_m = infil_mmhr / 1000.0f;
-          tmp[idx] = fmaxf(0.0f, tmp[idx] - infil_m);
-        }
-      } // end flow
-
-      memcpy(water, tmp, sizeof(float) * npix);
-
-      // pumps loop
-      // compute dt_hours for pump volume on this sub-iter: (interval_min / 60)
-      // / iter
-      float timestep_hours = interval_min / 60.0f;
-      float dt_hours = timestep_hours / (float)iter;
-
-      for (int pid = 0; pid < nPumps; pid++) {
-        Pump *p = &pumps[pid];
-        if (p->px < 0 || p->py < 0 || p->ox < 0 || p->oy < 0)
-          continue; // skip invalid pump
-
-        int pidx = p->py * nXSize + p->px;
-        int oidx = p->oy * nXSize + p->ox;
-        if (pidx < 0 || pidx >= (int)npix)
-          continue;
-        if (oidx < 0 || oidx >= (int)npix)
-          continue;
-
-        float thresh_on = p->threshold;
-        float thresh_off = p->threshold * (1.0f - pumpHysteresisFrac);
-        if (thresh_off < 0.0f)
-          thresh_off = 0.0f;
-
-        if (p->cooldown > 0)
-          p->cooldown--;
-        if (!p->state) {
-          if (water[pidx] > thresh_on && p->cooldown == 0) {
-            p->state = 1;
-            p->cooldown = pumpCooldownEpochs * iter;
-          }
-        } else {
-          if (water[pidx] < thresh_off && p->cooldown == 0) {
-            p->state = 0;
-            p->cooldown = pumpCooldownEpochs * iter;
-          }
-        }
-
-        float pumped_this_iter = 0.0f;
-
-        if (p->state) {
-          int countPix = 0;
-          // count valid pixels inside radius
-          for (int dyR = -p->radius_px; dyR <= p->radius_px; dyR++) {
-            for (int dxR = -p->radius_px; dxR <= p->radius_px; dxR++) {
-              int nx = p->px + dxR;
-              int ny = p->py + dyR;
-              if (nx < 0 || ny < 0 || nx >= nXSize || ny >= nYSize)
-                continue;
-              if (dxR * dxR + dyR * dyR > p->radius_px * p->radius_px)
-                continue;
-              countPix++;
-            }
-          }
-
-          if (countPix > 0) {
-            float pumpVolIter = p->capacity_m3hr * dt_hours;
-            float pumped_depth_m = pumpVolIter / (pixelArea * (float)countPix);
-
-            for (int dyR = -p->radius_px; dyR <= p->radius_px; dyR++) {
-              for (int dxR = -p->radius_px; dxR <= p->radius_px; dxR++) {
-                int nx = p->px + dxR;
-                int ny = p->py + dyR;
-                if (nx < 0 || ny < 0 || nx >= nXSize || ny >= nYSize)
-                  continue;
-                if (dxR * dxR + dyR * dyR > p->radius_px * p->radius_px)
-                  continue;
-                int nidx = ny * nXSize + nx;
-                if (nidx < 0 || nidx >= (int)npix)
-                  continue;
-                float remove = fminf(water[nidx], pumped_depth_m);
-                water[nidx] -= remove;
-                if (oidx >= 0 && oidx < (int)npix)
-                  water[oidx] += remove;
-                pumped_this_iter += remove;
-              }
-            }
-          }
-        } // end if state
-
-        fprintf(pumpLog,
-                "%d,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f,%.6f,%d\n", step,
-                it, pid, p->inLat, p->inLon, p->outLat, p->outLon, water[pidx],
-                thresh_on, thresh_off, pumped_this_iter, p->state);
-      } // end pump loop
-
-      fflush(pumpLog);
-    } // end iter
-  } // end steps
-
-  // smoothing & write
-  float *res = (float *)CPLMalloc(sizeof(float) * npix);
-  if (!res) {
-    fprintf(stderr, "Failed: alloc res\n");
-  } else {
-    Smoothing(nYSize, nXSize, dx, dy, nDirs, elevArray, water, res,
-              noDataValue);
-    WriteTiff(dem.dataset, res, nXSize, nYSize, (char *)output);
-    CPLFree(res);
+    ScenarioFree(&sc);
+    return 1;
   }
-
-  // cleanup
-  CPLFree(tmp);
-  CPLFree(water);
-  CPLFree(lahanData.pixelArray);
-  GDALClose(dem.dataset);
-  GDALClose(lahanData.dataset);
-
-  fclose(pumpLog);
-  free(inLat);
-  free(inLon);
-  free(outLat);
-  free(outLon);
-  free(capacities);
-  free(thresholds);
-  free(radii);
-  free(pumps);
-  free(rain_mm_array);
-  free(rain_interval_min_array);
-  free(rain_iter_f_array);
-
-  return 0;
+  printf("# Threads: %d, SIMD: %s\n", FlowThreadCount(state.flow),
+         FlowSimdName());
+  int rc = cli.multigridValidate
+               ? ValidateMultigrid(&terrain, &state, opt, &sc, err,
+                                   sizeof(err))
+               : RunScenario(&terrain, &state, opt, &sc, NULL, err,
+                             sizeof(err));
+  if (subdomain)
+    rc = DomainFinish(subdomain, rc, err, sizeof(err));
+  if (rc != 0)
+    fprintf(stderr, "%s\n", err);
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    printf("# Peak RSS: %.1f MB (%.1f bytes/cell)\n",
+           usage.ru_maxrss / 1024.0,
+           usage.ru_maxrss * 1024.0 /
+               ((double)terrain.nXSize * (double)terrain.nYSize));
+
+  SimStateFree(&state);
+  TerrainFree(&terrain, opt);
+  DomainFree(subdomain);
+  ScenarioFree(&sc);
+  return rc;
 }
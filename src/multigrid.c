@@ -0,0 +1,306 @@
+// multigrid.c - coarse-to-fine water spreading over a DEM pyramid
+#include "multigrid.h"
+#include "cpl_conv.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef struct {
+  int nXSize, nYSize;
+  float *elev;
+  unsigned char *lahan; // all class 0: coarse sweeps do not infiltrate
+  unsigned char *mask;
+  float *water;  // depth in this level's cells
+  float *before; // water before this level's sweeps
+  FlowContext *flow;
+} Level;
+
+struct Multigrid {
+  int nLevels;
+  Level level[1 + 16]; // level[0] is the fine grid (water set per call)
+  int nThreads;
+};
+
+static void FreeLevel(Level *l) {
+  FlowDestroy(l->flow);
+  CPLFree(l->elev);
+  CPLFree(l->lahan);
+  CPLFree(l->mask);
+  CPLFree(l->water);
+  CPLFree(l->before);
+}
+
+// coarse cells from the 2 x 2 blocks of the level below
+static int BuildLevel(const Level *fine, Level *l, int nThreads) {
+  l->nXSize = (fine->nXSize + 1) / 2;
+  l->nYSize = (fine->nYSize + 1) / 2;
+  size_t n = (size_t)l->nXSize * (size_t)l->nYSize;
+  l->elev = (float *)CPLMalloc(n * sizeof(float));
+  l->lahan = (unsigned char *)CPLCalloc(n, 1);
+  l->mask = (unsigned char *)CPLMalloc(n);
+  l->water = (float *)CPLMalloc(n * sizeof(float));
+  l->before = (float *)CPLMalloc(n * sizeof(float));
+
+#pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int y = 0; y < l->nYSize; y++) {
+    for (int x = 0; x < l->nXSize; x++) {
+      float sum = 0.0f;
+      int nValid = 0;
+      for (int k = 0; k < 4; k++) {
+        int fx = 2 * x + (k & 1), fy = 2 * y + (k >> 1);
+        if (fx >= fine->nXSize || fy >= fine->nYSize)
+          continue;
+        size_t i = (size_t)fy * fine->nXSize + fx;
+        if (fine->mask[i] & FLOW_VALID) {
+          sum += fine->elev[i];
+          nValid++;
+        }
+      }
+      size_t c = (size_t)y * l->nXSize + x;
+      unsigned char m = 0;
+      if (nValid > 0) {
+        m = FLOW_VALID;
+        // the raster border only collects water, as on the fine grid
+        if (y >= 1 && y < l->nYSize - 1 && x >= 1 && x < l->nXSize - 1)
+          m |= FLOW_ACTIVE;
+      }
+      l->elev[c] = nValid > 0 ? sum / (float)nValid : 0.0f;
+      l->mask[c] = m;
+    }
+  }
+  FlowGrid grid = {l->nXSize, l->nYSize, l->elev, l->lahan, l->mask};
+  l->flow = FlowCreate(&grid, nThreads);
+  return l->flow ? 0 : -1;
+}
+
+Multigrid *MultigridCreate(const FlowGrid *fine, int nLevels, int nThreads) {
+  Multigrid *mg = (Multigrid *)calloc(1, sizeof(Multigrid));
+  if (!mg)
+    return NULL;
+  if (nLevels > 16)
+    nLevels = 16;
+#ifdef _OPENMP
+  mg->nThreads = nThreads > 0 ? nThreads : omp_get_max_threads();
+#else
+  mg->nThreads = 1;
+#endif
+  Level *l0 = &mg->level[0];
+  l0->nXSize = fine->nXSize;
+  l0->nYSize = fine->nYSize;
+  l0->elev = (float *)fine->elev;
+  l0->mask = (unsigned char *)fine->mask;
+  for (int k = 1; k <= nLevels; k++) {
+    const Level *below = &mg->level[k - 1];
+    // stop while the level can still be swept in bands
+    if (below->nXSize < 16 || below->nYSize < 16)
+      break;
+    if (BuildLevel(below, &mg->level[k], mg->nThreads) != 0) {
+      mg->nLevels = k;
+      MultigridDestroy(mg);
+      return NULL;
+    }
+    mg->nLevels = k;
+  }
+  return mg;
+}
+
+void MultigridDestroy(Multigrid *mg) {
+  if (!mg)
+    return;
+  for (int k = 1; k <= mg->nLevels; k++)
+    FreeLevel(&mg->level[k]);
+  free(mg);
+}
+
+int MultigridLevels(const Multigrid *mg) { return mg->nLevels; }
+
+// fine -> coarse: a coarse cell holds a quarter of its block's summed
+// depth, which keeps the volume of equal-area coarse cells
+static void Restrict(const Level *fine, Level *l, int nThreads) {
+#pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int y = 0; y < l->nYSize; y++) {
+    for (int x = 0; x < l->nXSize; x++) {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; k++) {
+        int fx = 2 * x + (k & 1), fy = 2 * y + (k >> 1);
+        if (fx < fine->nXSize && fy < fine->nYSize)
+          sum += fine->water[(size_t)fy * fine->nXSize + fx];
+      }
+      l->water[(size_t)y * l->nXSize + x] = 0.25f * sum;
+    }
+  }
+}
+
+// volume (in cell depths) that moves into (add) or out of (!add) the cells
+// when their water surfaces are brought to `level`
+static float Moved(const float *z, const float *w, int n, float level,
+                   int add) {
+  float v = 0.0f;
+  for (int i = 0; i < n; i++)
+    v += add ? fmaxf(0.0f, level - z[i])
+             : fminf(w[i], fmaxf(0.0f, z[i] - level));
+  return v;
+}
+
+// water level at which `v` more (add) or less (!add) water sits in the
+// cells: filling raises the lowest surfaces, draining lowers the highest
+// ones down to their ground. Piecewise linear between breakpoints.
+static float BlockLevel(const float *z, const float *w, int n, float v,
+                        int add) {
+  float bp[8];
+  int nb = 0;
+  for (int i = 0; i < n; i++) {
+    bp[nb++] = z[i];
+    if (!add)
+      bp[nb++] = z[i] - w[i];
+  }
+  // insertion sort, at most 8 values
+  for (int i = 1; i < nb; i++) {
+    float key = bp[i];
+    int j = i - 1;
+    while (j >= 0 && bp[j] > key) {
+      bp[j + 1] = bp[j];
+      j--;
+    }
+    bp[j + 1] = key;
+  }
+  if (add) {
+    // above the highest surface every cell rises with the level
+    float prev = bp[0], prevV = 0.0f;
+    for (int i = 1; i < nb; i++) {
+      float m = Moved(z, w, n, bp[i], add);
+      if (m >= v)
+        return prev + (bp[i] - prev) * (v - prevV) / (m - prevV);
+      prev = bp[i];
+      prevV = m;
+    }
+    return prev + (v - prevV) / (float)n;
+  }
+  // draining: the moved volume grows as the level goes down
+  float prev = bp[nb - 1], prevV = 0.0f;
+  for (int i = nb - 2; i >= 0; i--) {
+    float m = Moved(z, w, n, bp[i], add);
+    if (m >= v)
+      return m > prevV ? prev + (bp[i] - prev) * (v - prevV) / (m - prevV)
+                       : bp[i];
+    prev = bp[i];
+    prevV = m;
+  }
+  return bp[0];
+}
+
+// coarse change -> the 2 x 2 blocks of the level below; returns the
+// number of blocks changed
+static long long Prolong(const Level *l, Level *fine, FlowContext *fineCtx,
+                         int nThreads) {
+  long long changed = 0;
+#pragma omp parallel for schedule(static) num_threads(nThreads)              \
+    reduction(+ : changed)
+  for (int y = 0; y < l->nYSize; y++) {
+    for (int x = 0; x < l->nXSize; x++) {
+      size_t c = (size_t)y * l->nXSize + x;
+      float delta = l->water[c] - l->before[c];
+      if (fabsf(delta) < MULTIGRID_MIN_CHANGE || !(l->mask[c] & FLOW_VALID))
+        continue;
+      size_t idx[4];
+      float z[4], w[4];
+      int n = 0;
+      for (int k = 0; k < 4; k++) {
+        int fx = 2 * x + (k & 1), fy = 2 * y + (k >> 1);
+        if (fx >= fine->nXSize || fy >= fine->nYSize)
+          continue;
+        size_t i = (size_t)fy * fine->nXSize + fx;
+        if (!(fine->mask[i] & FLOW_VALID))
+          continue;
+        idx[n] = i;
+        w[n] = fine->water[i];
+        z[n] = fine->elev[i] + w[n];
+        n++;
+      }
+      // a quarter of the block's volume per coarse depth unit
+      float v = 4.0f * fabsf(delta);
+      int add = delta > 0.0f;
+      float level = BlockLevel(z, w, n, v, add);
+      for (int i = 0; i < n; i++) {
+        float d = add ? fmaxf(0.0f, level - z[i])
+                      : -fminf(w[i], fmaxf(0.0f, z[i] - level));
+        fine->water[idx[i]] = w[i] + d;
+      }
+      changed++;
+    }
+  }
+  if (fineCtx && changed > 0) {
+    // rows of blocks are marked serially, the tile map is shared
+    for (int y = 0; y < l->nYSize; y++) {
+      int x0 = -1;
+      for (int x = 0; x <= l->nXSize; x++) {
+        int on = 0;
+        if (x < l->nXSize) {
+          size_t c = (size_t)y * l->nXSize + x;
+          on = fabsf(l->water[c] - l->before[c]) >= MULTIGRID_MIN_CHANGE;
+        }
+        if (on && x0 < 0)
+          x0 = x;
+        if (!on && x0 >= 0) {
+          FlowMarkDirty(fineCtx, 2 * x0, 2 * y, 2 * x - 1, 2 * y + 1);
+          x0 = -1;
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+void MultigridSpread(Multigrid *mg, float *water, int nSweeps,
+                     FlowContext *fineCtx) {
+  static const float noInfil[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  mg->level[0].water = water;
+  for (int k = 1; k <= mg->nLevels; k++) {
+    Level *l = &mg->level[k];
+    Restrict(&mg->level[k - 1], l, mg->nThreads);
+    memcpy(l->before, l->water,
+           sizeof(float) * (size_t)l->nXSize * (size_t)l->nYSize);
+  }
+
+  // coarsest first; a finer level is swept after the correction from the
+  // level above has been pushed into it. Its change is taken against the
+  // restricted water, so it carries the corrections of all levels above.
+  for (int k = mg->nLevels; k >= 1; k--) {
+    Level *l = &mg->level[k];
+    for (int s = 0; s < nSweeps; s++)
+      FlowSweepInPlace(l->flow, l->water, noInfil);
+    Prolong(l, &mg->level[k - 1], k == 1 ? fineCtx : NULL, mg->nThreads);
+  }
+}
+
+void MultigridCompare(const float *a, const float *b,
+                      const unsigned char *mask, size_t n, float floodDepth,
+                      MultigridComparison *cmp) {
+  long long wetA = 0, wetB = 0, wetBoth = 0;
+  double maxDiff = 0.0, volA = 0.0, volB = 0.0;
+#pragma omp parallel for schedule(static)                                    \
+    reduction(+ : wetA, wetB, wetBoth, volA, volB) reduction(max : maxDiff)
+  for (size_t i = 0; i < n; i++) {
+    if (!(mask[i] & FLOW_VALID))
+      continue;
+    int inA = a[i] > floodDepth, inB = b[i] > floodDepth;
+    wetA += inA;
+    wetB += inB;
+    wetBoth += inA && inB;
+    volA += a[i];
+    volB += b[i];
+    double d = fabs((double)a[i] - (double)b[i]);
+    maxDiff = d > maxDiff ? d : maxDiff;
+  }
+  cmp->wetA = wetA;
+  cmp->wetB = wetB;
+  cmp->wetBoth = wetBoth;
+  long long either = wetA + wetB - wetBoth;
+  cmp->iou = either > 0 ? (double)wetBoth / (double)either : 1.0;
+  cmp->maxDiff = maxDiff;
+  cmp->volumeA = volA;
+  cmp->volumeB = volB;
+}
@@ -0,0 +1,50 @@
+#ifndef multigrid
+#define multigrid
+
+#include "flowKernel.h"
+#include <stddef.h>
+
+// Coarse-to-fine water spreading for large flat basins. The fine sweep
+// moves water one pixel per sweep; level k of the pyramid has cells of
+// 2^k x 2^k fine pixels, so a sweep there moves it 2^k pixels for 1/4^k of
+// the cost. At the start of a step the water is summed up the pyramid,
+// swept on the coarsest level, and each level's change is pushed down into
+// the next finer one, then into the fine grid:
+//
+//   - coarse elevation is the mean of the valid cells below, a coarse cell
+//     is valid when any cell below is; coarse sweeps do not infiltrate
+//   - depth added to a 2 x 2 block fills its lowest water surfaces first,
+//     depth taken away drains the highest ones first, so volume is kept
+//     and a block fills like a small basin
+//   - blocks whose change is below MULTIGRID_MIN_CHANGE are left alone:
+//     settled areas keep their fine-grid detail, and in sparse mode only
+//     the tiles a correction touched are swept again
+//
+// The fine sweeps, pumps and infiltration then run as usual; the coarse
+// pass only gets the water to the basins sooner.
+#define MULTIGRID_MIN_CHANGE 1e-6f // m of coarse depth
+
+typedef struct Multigrid Multigrid;
+
+// nLevels coarse levels below the fine grid (fewer when the grid gets
+// smaller than 16 x 16). NULL on allocation failure.
+Multigrid *MultigridCreate(const FlowGrid *fine, int nLevels, int nThreads);
+void MultigridDestroy(Multigrid *mg);
+int MultigridLevels(const Multigrid *mg);
+// spread `water` (the fine grid) with nSweeps sweeps per coarse level;
+// fineCtx (optional) gets the changed fine cells marked dirty
+void MultigridSpread(Multigrid *mg, float *water, int nSweeps,
+                     FlowContext *fineCtx);
+
+// agreement of two fine water grids (valid cells only)
+typedef struct {
+  long long wetA, wetB, wetBoth; // cells deeper than the flood depth
+  double iou;                    // wetBoth / cells wet in either
+  double maxDiff;                // largest |a - b| (m)
+  double volumeA, volumeB;       // summed depth (m)
+} MultigridComparison;
+
+void MultigridCompare(const float *a, const float *b,
+                      const unsigned char *mask, size_t n, float floodDepth,
+                      MultigridComparison *cmp);
+#endif
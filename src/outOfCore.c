@@ -0,0 +1,299 @@
+// outOfCore.c - scratch-file backed state for DEMs larger than RAM
+#include "outOfCore.h"
+#include "smoothing.h"
+#include "tileRenderer.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static double Seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void *ScratchAlloc(const char *dir, size_t bytes, ScratchArray *arr) {
+  char path[4096];
+  arr->ptr = NULL;
+  arr->bytes = bytes;
+  arr->fd = -1;
+  arr->view = 0;
+  snprintf(path, sizeof(path), "%s/floodsim-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("Failed: scratch file");
+    return NULL;
+  }
+  unlink(path); // removed automatically when the run ends
+  if (bytes == 0 || ftruncate(fd, (off_t)bytes) != 0) {
+    perror("Failed: scratch file size");
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("Failed: scratch mmap");
+    close(fd);
+    return NULL;
+  }
+  madvise(p, bytes, MADV_SEQUENTIAL);
+  arr->ptr = p;
+  arr->fd = fd;
+  return p;
+}
+
+void ScratchFree(ScratchArray *arr) {
+  if (arr->ptr && !arr->view)
+    munmap(arr->ptr, arr->bytes);
+  if (arr->fd >= 0)
+    close(arr->fd);
+  arr->ptr = NULL;
+  arr->fd = -1;
+}
+
+void ScratchDrop(ScratchArray *arr, size_t from, size_t to) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if (to > arr->bytes)
+    to = arr->bytes;
+  from = (from + page - 1) / page * page;
+  to = to / page * page;
+  if (to > from)
+    madvise((char *)arr->ptr + from, to - from, MADV_DONTNEED);
+}
+
+static void OocInit(OutOfCore *ooc, int nXSize, int nYSize, int bandRows) {
+  memset(ooc, 0, sizeof(*ooc));
+  ooc->elev.fd = ooc->lahan.fd = ooc->mask.fd = -1;
+  ooc->water.fd = ooc->tmp.fd = -1;
+  ooc->nXSize = nXSize;
+  ooc->nYSize = nYSize;
+  // a band must be at least as tall as the 2-row halo of the stencil
+  ooc->bandRows = bandRows < 4 ? 4 : bandRows;
+}
+
+static void ScratchView(ScratchArray *arr, void *ptr, size_t bytes) {
+  arr->ptr = ptr;
+  arr->bytes = bytes;
+  arr->view = 1;
+}
+
+int OocCreate(OutOfCore *ooc, const char *dir, int nXSize, int nYSize,
+              int bandRows) {
+  OocInit(ooc, nXSize, nYSize, bandRows);
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  if (!ScratchAlloc(dir, npix * sizeof(float), &ooc->elev) ||
+      !ScratchAlloc(dir, npix, &ooc->lahan) ||
+      !ScratchAlloc(dir, npix, &ooc->mask) ||
+      !ScratchAlloc(dir, npix * sizeof(float), &ooc->water) ||
+      !ScratchAlloc(dir, npix * sizeof(float), &ooc->tmp)) {
+    OocDestroy(ooc);
+    return -1;
+  }
+  return 0;
+}
+
+int OocCreateMapped(OutOfCore *ooc, const char *dir, int nXSize, int nYSize,
+                    int bandRows, float *elev, unsigned char *lahan,
+                    unsigned char *mask) {
+  OocInit(ooc, nXSize, nYSize, bandRows);
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  ScratchView(&ooc->elev, elev, npix * sizeof(float));
+  ScratchView(&ooc->lahan, lahan, npix);
+  ScratchView(&ooc->mask, mask, npix);
+  if (!ScratchAlloc(dir, npix * sizeof(float), &ooc->water) ||
+      !ScratchAlloc(dir, npix * sizeof(float), &ooc->tmp)) {
+    OocDestroy(ooc);
+    return -1;
+  }
+  return 0;
+}
+
+void OocDestroy(OutOfCore *ooc) {
+  ScratchFree(&ooc->elev);
+  ScratchFree(&ooc->lahan);
+  ScratchFree(&ooc->mask);
+  ScratchFree(&ooc->water);
+  ScratchFree(&ooc->tmp);
+}
+
+// release rows [y0, y1) of every state array
+static void DropRows(OutOfCore *ooc, int y0, int y1) {
+  size_t w = (size_t)ooc->nXSize;
+  size_t a = (size_t)y0 * w, b = (size_t)y1 * w;
+  ScratchDrop(&ooc->elev, a * sizeof(float), b * sizeof(float));
+  ScratchDrop(&ooc->lahan, a, b);
+  ScratchDrop(&ooc->mask, a, b);
+  ScratchDrop(&ooc->water, a * sizeof(float), b * sizeof(float));
+  ScratchDrop(&ooc->tmp, a * sizeof(float), b * sizeof(float));
+}
+
+int OocLoad(OutOfCore *ooc, Raster *dem, Raster *lahan, int hasNoData,
+            float noDataValue) {
+  size_t w = (size_t)ooc->nXSize;
+  float *elev = (float *)ooc->elev.ptr;
+  unsigned char *lu = (unsigned char *)ooc->lahan.ptr;
+  for (int b0 = 0; b0 < ooc->nYSize; b0 += ooc->bandRows) {
+    int n = ooc->bandRows;
+    if (b0 + n > ooc->nYSize)
+      n = ooc->nYSize - b0;
+    if (ReadTiffRows(dem, 0, b0, n, elev + (size_t)b0 * w) != 0 ||
+        ReadTiffRows(lahan, 2, b0, n, lu + (size_t)b0 * w) != 0)
+      return -1;
+    FlowLanduseClasses(lu + (size_t)b0 * w, (size_t)n * w);
+    FlowFillMask((unsigned char *)ooc->mask.ptr, ooc->nXSize, ooc->nYSize,
+                 elev, hasNoData, noDataValue, b0, b0 + n);
+    DropRows(ooc, b0, b0 + n);
+  }
+  return 0;
+}
+
+void OocAddRain(OutOfCore *ooc, float rain_m) {
+  size_t w = (size_t)ooc->nXSize;
+  float *water = (float *)ooc->water.ptr;
+  const unsigned char *mask = (const unsigned char *)ooc->mask.ptr;
+  for (int b0 = 0; b0 < ooc->nYSize; b0 += ooc->bandRows) {
+    int b1 = b0 + ooc->bandRows < ooc->nYSize ? b0 + ooc->bandRows
+                                               : ooc->nYSize;
+    for (size_t i = (size_t)b0 * w; i < (size_t)b1 * w; i++) {
+      if (mask[i] & FLOW_VALID)
+        water[i] += rain_m;
+    }
+    DropRows(ooc, b0, b1);
+  }
+}
+
+void OocClearWater(OutOfCore *ooc) {
+  size_t w = (size_t)ooc->nXSize;
+  float *water = (float *)ooc->water.ptr;
+  for (int b0 = 0; b0 < ooc->nYSize; b0 += ooc->bandRows) {
+    int b1 = b0 + ooc->bandRows < ooc->nYSize ? b0 + ooc->bandRows
+                                               : ooc->nYSize;
+    memset(water + (size_t)b0 * w, 0, sizeof(float) * (size_t)(b1 - b0) * w);
+    DropRows(ooc, b0, b1);
+  }
+}
+
+// Band k reads water rows down to its first row - 2, so band k-1 is
+// released only once band k is done.
+float OocSweep(OutOfCore *ooc, FlowContext *ctx, const float infil_m[4]) {
+  float *water = (float *)ooc->water.ptr;
+  float *tmp = (float *)ooc->tmp.ptr;
+  float flux = 0.0f;
+  int p0 = -1, p1 = -1;
+  ooc->infiltrated = 0.0;
+  for (int b0 = 0; b0 < ooc->nYSize; b0 += ooc->bandRows) {
+    int b1 = b0 + ooc->bandRows < ooc->nYSize ? b0 + ooc->bandRows
+                                               : ooc->nYSize;
+    FlowSweepRows(ctx, water, tmp, infil_m, b0, b1);
+    flux = fmaxf(flux, FlowMaxFlux(ctx));
+    ooc->infiltrated += FlowInfiltrated(ctx);
+    if (p0 >= 0)
+      DropRows(ooc, p0, p1);
+    p0 = b0;
+    p1 = b1;
+  }
+  if (p0 >= 0)
+    DropRows(ooc, p0, p1);
+  ScratchArray swap = ooc->water;
+  ooc->water = ooc->tmp;
+  ooc->tmp = swap;
+  return flux;
+}
+
+void OocInfiltrate(OutOfCore *ooc, FlowContext *ctx, const float infil_m[4],
+                   int nSweeps) {
+  float *water = (float *)ooc->water.ptr;
+  ooc->infiltrated = 0.0;
+  for (int b0 = 0; b0 < ooc->nYSize; b0 += ooc->bandRows) {
+    int b1 = b0 + ooc->bandRows < ooc->nYSize ? b0 + ooc->bandRows
+                                               : ooc->nYSize;
+    FlowInfiltrateRows(ctx, water, infil_m, nSweeps, b0, b1);
+    ooc->infiltrated += FlowInfiltrated(ctx);
+    DropRows(ooc, b0, b1);
+  }
+}
+
+int WriteSmoothedBands(GDALDatasetH hDataset, char *output,
+                       const OutputFormat *format, int nXSize, int nYSize,
+                       int bandRows, const float *elev, const float *water,
+                       int neighbours, int hasNoData, double noDataValue,
+                       unsigned char *level, OutOfCore *ooc, int nThreads,
+                       double seconds[2]) {
+  size_t w = (size_t)nXSize;
+  double t0 = Seconds(), smoothSeconds = 0.0;
+  if (bandRows < 1)
+    bandRows = 1;
+  size_t bandCells = (size_t)bandRows * w;
+  float *res = (float *)CPLMalloc(sizeof(float) * bandCells);
+  int counts = format->type == OUTPUT_UINT16;
+  unsigned short *quant =
+      counts ? (unsigned short *)CPLMalloc(sizeof(unsigned short) * bandCells)
+             : NULL;
+  const float noData = (float)OutputNoData(format);
+  const float perCount = (float)(1.0 / OutputScale(format));
+  GDALDatasetH out;
+  // georeferencing is read from the shared DEM handle
+#pragma omp critical(demDataset)
+  out = CreateTiffFormat(hDataset, nXSize, nYSize, output, format, nThreads);
+  if (!out) {
+    CPLFree(quant);
+    CPLFree(res);
+    return -1;
+  }
+
+  int rc = 0;
+  for (int b0 = 0; b0 < nYSize && rc == 0; b0 += bandRows) {
+    int b1 = b0 + bandRows < nYSize ? b0 + bandRows : nYSize;
+    double ts = Seconds();
+    // rows are independent: smooth, mask and quantize each in one pass.
+    // Cells Smoothing() does not write (grid border) stay 0.
+#pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int y = b0; y < b1; y++) {
+      float *row = res + (size_t)(y - b0) * w;
+      const float *e = elev + (size_t)y * w;
+      memset(row, 0, sizeof(float) * w);
+      SmoothingRows(nYSize, nXSize, neighbours, hasNoData, elev, water, row,
+                    noDataValue, y, y + 1);
+      if (level)
+        TileQuantizeRows(row, level + (size_t)y * w, w);
+      if (counts) {
+        unsigned short *q = quant + (size_t)(y - b0) * w;
+        for (size_t x = 0; x < w; x++) {
+          float v = row[x] * perCount;
+          if (isnan(e[x]) || (hasNoData && e[x] == noDataValue))
+            q[x] = (unsigned short)noData;
+          else
+            q[x] = !(v > 0.0f)      ? 0
+                   : v >= 65534.0f ? 65534
+                                   : (unsigned short)(v + 0.5f);
+        }
+      } else {
+        for (size_t x = 0; x < w; x++)
+          if (isnan(e[x]) || (hasNoData && e[x] == noDataValue))
+            row[x] = noData;
+      }
+    }
+    smoothSeconds += Seconds() - ts;
+    rc = counts ? WriteTiffRowsType(out, quant, GDT_UInt16, nXSize, b0,
+                                    b1 - b0)
+                : WriteTiffRows(out, res, nXSize, b0, b1 - b0);
+    // the band read rows b0 - 1 .. b1; the next one starts at b1 - 1
+    if (ooc)
+      DropRows(ooc, b0 > 0 ? b0 - 1 : 0, b1 < nYSize ? b1 - 1 : b1);
+  }
+  GDALClose(out);
+  CPLFree(quant);
+  CPLFree(res);
+  // everything but the smoothing is GeoTIFF creation, compression and
+  // writing
+  if (seconds) {
+    seconds[0] += smoothSeconds;
+    seconds[1] += Seconds() - t0 - smoothSeconds;
+  }
+  return rc;
+}
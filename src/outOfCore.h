@@ -0,0 +1,70 @@
+#ifndef outOfCore
+#define outOfCore
+#include "flowKernel.h"
+#include "gdal.h"
+#include "gdalShortcut.h"
+#include <stddef.h>
+
+// Array backed by an unlinked file in a scratch directory and mapped
+// MAP_SHARED: pages the kernel evicts are spilled to that file instead of
+// occupying RAM, so the resident set is what the sweep currently touches.
+typedef struct {
+  void *ptr;
+  size_t bytes;
+  int fd;
+  int view; // points into a mapping owned elsewhere, only dropped
+} ScratchArray;
+
+void *ScratchAlloc(const char *dir, size_t bytes, ScratchArray *arr);
+void ScratchFree(ScratchArray *arr);
+// drop the resident pages fully inside [from, to) bytes of the array
+void ScratchDrop(ScratchArray *arr, size_t from, size_t to);
+
+// Simulation state for out-of-core runs. All full-size grids live in
+// scratch files and are streamed band by band (bandRows rows at a time);
+// each band's pages are released once no later band needs them.
+typedef struct {
+  int nXSize;
+  int nYSize;
+  int bandRows;
+  ScratchArray elev, lahan, mask, water, tmp;
+  double infiltrated; // FlowInfiltrated over all bands of the last call
+} OutOfCore;
+
+int OocCreate(OutOfCore *ooc, const char *dir, int nXSize, int nYSize,
+              int bandRows);
+// OocCreate over grids that are already file-backed (a compiled terrain,
+// see terrainFile.h): elev, lahan and mask are views of them and only the
+// water grids get scratch files. Nothing to OocLoad.
+int OocCreateMapped(OutOfCore *ooc, const char *dir, int nXSize, int nYSize,
+                    int bandRows, float *elev, unsigned char *lahan,
+                    unsigned char *mask);
+void OocDestroy(OutOfCore *ooc);
+// block-wise read of DEM + landuse class codes and the validity mask
+int OocLoad(OutOfCore *ooc, Raster *dem, Raster *lahan, int hasNoData,
+            float noDataValue);
+void OocAddRain(OutOfCore *ooc, float rain_m);
+// zero the water grid band by band (start of a new scenario)
+void OocClearWater(OutOfCore *ooc);
+// one flow sweep over all bands into tmp, then water and tmp trade places:
+// re-read ooc->water.ptr afterwards. Returns the sweep's FlowMaxFlux.
+float OocSweep(OutOfCore *ooc, FlowContext *ctx, const float infil_m[4]);
+// FlowInfiltrateRows band by band
+void OocInfiltrate(OutOfCore *ooc, FlowContext *ctx, const float infil_m[4],
+                   int nSweeps);
+// Output stage: smoothing (D4 or D8, see SmoothingRows), no-data masking
+// and the GeoTIFF write in one pass over bands of bandRows rows. The rows of a band are smoothed in
+// parallel (nThreads) into a band-sized buffer, no-data cells get the
+// format's no-data value, and the band is written to a tiled, compressed
+// GeoTIFF (see CreateTiffFormat), converted to UInt16 counts if asked.
+// With ooc set, each band's pages are released after it is written. level
+// (optional, nXSize x nYSize) receives the smoothed depth quantized for
+// the tile renderer. seconds (optional) gets the time spent smoothing
+// added to [0] and the time spent writing to [1].
+int WriteSmoothedBands(GDALDatasetH hDataset, char *output,
+                       const OutputFormat *format, int nXSize, int nYSize,
+                       int bandRows, const float *elev, const float *water,
+                       int neighbours, int hasNoData, double noDataValue,
+                       unsigned char *level, OutOfCore *ooc, int nThreads,
+                       double seconds[2]);
+#endif
@@ -0,0 +1,15 @@
+// pumpLogToCsv.c - converts a binary pump log (--binary-log) to CSV
+#include "telemetry.h"
+#include <stdio.h>
+
+int main(int argc, const char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <pump_log.bin> <pump_log.csv>\n", argv[0]);
+    return 1;
+  }
+  if (TelemetryToCsv(argv[1], argv[2]) != 0) {
+    fprintf(stderr, "Failed: to convert %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,225 @@
+// pumping.c - pump footprints, batching and the per-sub-iteration update
+#include "pumping.h"
+#include "cpl_conv.h"
+#include "flowKernel.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int Overlaps(const int *a, const int *b) {
+  return a[0] <= b[2] && b[0] <= a[2] && a[1] <= b[3] && b[1] <= a[3];
+}
+
+// Two pumps conflict when one can read or write a cell the other writes:
+// footprints (which hold the intakes) and outlets are compared through
+// bounding boxes, which is conservative but exact enough to batch.
+static int Conflict(const PumpSet *ps, const Pump *pl, int a, int b) {
+  int outA[4] = {pl[a].ox, pl[a].oy, pl[a].ox, pl[a].oy};
+  int outB[4] = {pl[b].ox, pl[b].oy, pl[b].ox, pl[b].oy};
+  const int *boxA = ps->box + 4 * a, *boxB = ps->box + 4 * b;
+  return Overlaps(boxA, boxB) || Overlaps(outA, boxB) ||
+         Overlaps(outB, boxA) || ps->outlet[a] == ps->outlet[b];
+}
+
+int PumpEnabled(const PumpSet *ps, int pid) {
+  return ps->spanFirst[pid] >= 0;
+}
+
+int PumpSetCreate(PumpSet *ps, const Pump *pumpList, int nPumps, int nXSize,
+                  int nYSize, const unsigned char *mask,
+                  float hysteresisFrac) {
+  memset(ps, 0, sizeof(*ps));
+  ps->nPumps = nPumps;
+  size_t n = nPumps > 0 ? (size_t)nPumps : 1;
+  ps->state = (unsigned char *)CPLCalloc(n, 1);
+  ps->cooldown = (int *)CPLCalloc(n, sizeof(int));
+  ps->intake = (size_t *)CPLCalloc(n, sizeof(size_t));
+  ps->outlet = (size_t *)CPLCalloc(n, sizeof(size_t));
+  ps->capacity = (float *)CPLCalloc(n, sizeof(float));
+  ps->threshOn = (float *)CPLCalloc(n, sizeof(float));
+  ps->threshOff = (float *)CPLCalloc(n, sizeof(float));
+  ps->nCells = (int *)CPLCalloc(n, sizeof(int));
+  ps->spanFirst = (int *)CPLCalloc(n + 1, sizeof(int));
+  ps->box = (int *)CPLCalloc(4 * n, sizeof(int));
+  ps->pumped = (float *)CPLCalloc(n, sizeof(float));
+  ps->level = (float *)CPLCalloc(n, sizeof(float));
+  ps->batchFirst = (int *)CPLCalloc(n + 1, sizeof(int));
+  ps->batchPumps = (int *)CPLCalloc(n, sizeof(int));
+
+  // footprint spans: one pass to size, one to fill
+  size_t nSpans = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    nSpans = 0;
+    for (int pid = 0; pid < nPumps; pid++) {
+      const Pump *p = &pumpList[pid];
+      int r = p->radius_px;
+      if (p->px < 0 || p->py < 0 || p->ox < 0 || p->oy < 0) {
+        ps->spanFirst[pid] = -1;
+        continue;
+      }
+      ps->spanFirst[pid] = (int)nSpans;
+      int cells = 0;
+      for (int dyR = -r; dyR <= r; dyR++) {
+        int ny = p->py + dyR;
+        if (ny < 0 || ny >= nYSize)
+          continue;
+        size_t row = (size_t)ny * nXSize;
+        int run = 0;
+        for (int dxR = -r; dxR <= r + 1; dxR++) {
+          int nx = p->px + dxR;
+          int in = dxR <= r && nx >= 0 && nx < nXSize &&
+                   dxR * dxR + dyR * dyR <= r * r &&
+                   (mask[row + nx] & FLOW_VALID);
+          if (in) {
+            run++;
+            continue;
+          }
+          if (run > 0) {
+            if (pass == 1) {
+              ps->spanStart[nSpans] = row + (size_t)(nx - run);
+              ps->spanLen[nSpans] = run;
+            }
+            nSpans++;
+            cells += run;
+            run = 0;
+          }
+        }
+      }
+      if (pass == 0)
+        continue;
+      ps->nCells[pid] = cells;
+      ps->intake[pid] = (size_t)p->py * nXSize + p->px;
+      ps->outlet[pid] = (size_t)p->oy * nXSize + p->ox;
+      ps->capacity[pid] = p->capacity_m3hr;
+      ps->threshOn[pid] = p->threshold;
+      ps->threshOff[pid] = p->threshold * (1.0f - hysteresisFrac);
+      if (ps->threshOff[pid] < 0.0f)
+        ps->threshOff[pid] = 0.0f;
+      int *b = ps->box + 4 * pid;
+      b[0] = p->px - r > 0 ? p->px - r : 0;
+      b[1] = p->py - r > 0 ? p->py - r : 0;
+      b[2] = p->px + r < nXSize - 1 ? p->px + r : nXSize - 1;
+      b[3] = p->py + r < nYSize - 1 ? p->py + r : nYSize - 1;
+    }
+    if (pass == 0) {
+      ps->spanStart =
+          (size_t *)CPLMalloc((nSpans > 0 ? nSpans : 1) * sizeof(size_t));
+      ps->spanLen = (int *)CPLMalloc((nSpans > 0 ? nSpans : 1) * sizeof(int));
+    }
+  }
+  ps->spanFirst[nPumps] = (int)nSpans;
+
+  // batch = 1 + highest batch of an earlier pump it conflicts with. The
+  // pairwise test is quadratic, but runs once and is cheap for thousands
+  // of pumps.
+  int *batchOf = (int *)CPLCalloc(n, sizeof(int));
+  ps->nBatches = 0;
+  for (int a = 0; a < nPumps; a++) {
+    if (!PumpEnabled(ps, a))
+      continue;
+    int level = 0;
+    for (int b = 0; b < a; b++) {
+      if (PumpEnabled(ps, b) && batchOf[b] >= level &&
+          Conflict(ps, pumpList, a, b))
+        level = batchOf[b] + 1;
+    }
+    batchOf[a] = level;
+    if (level + 1 > ps->nBatches)
+      ps->nBatches = level + 1;
+    ps->nActive++;
+  }
+  // counting sort by batch, pid order inside a batch
+  memset(ps->batchFirst, 0, (n + 1) * sizeof(int));
+  for (int a = 0; a < nPumps; a++)
+    if (PumpEnabled(ps, a))
+      ps->batchFirst[batchOf[a] + 1]++;
+  for (int b = 0; b < ps->nBatches; b++)
+    ps->batchFirst[b + 1] += ps->batchFirst[b];
+  int *fill = (int *)CPLCalloc(n + 1, sizeof(int));
+  memcpy(fill, ps->batchFirst, (n + 1) * sizeof(int));
+  for (int a = 0; a < nPumps; a++)
+    if (PumpEnabled(ps, a))
+      ps->batchPumps[fill[batchOf[a]]++] = a;
+  CPLFree(fill);
+  CPLFree(batchOf);
+  return 0;
+}
+
+void PumpSetDestroy(PumpSet *ps) {
+  CPLFree(ps->state);
+  CPLFree(ps->cooldown);
+  CPLFree(ps->intake);
+  CPLFree(ps->outlet);
+  CPLFree(ps->capacity);
+  CPLFree(ps->threshOn);
+  CPLFree(ps->threshOff);
+  CPLFree(ps->nCells);
+  CPLFree(ps->spanFirst);
+  CPLFree(ps->box);
+  CPLFree(ps->pumped);
+  CPLFree(ps->level);
+  CPLFree(ps->spanStart);
+  CPLFree(ps->spanLen);
+  CPLFree(ps->batchFirst);
+  CPLFree(ps->batchPumps);
+  memset(ps, 0, sizeof(*ps));
+}
+
+static void RunPump(PumpSet *ps, int pid, float *water, float dtHours,
+                    float pixelArea, int cooldownReset) {
+  size_t in = ps->intake[pid];
+  if (ps->cooldown[pid] > 0)
+    ps->cooldown[pid]--;
+  if (!ps->state[pid]) {
+    if (water[in] > ps->threshOn[pid] && ps->cooldown[pid] == 0) {
+      ps->state[pid] = 1;
+      ps->cooldown[pid] = cooldownReset;
+    }
+  } else {
+    if (water[in] < ps->threshOff[pid] && ps->cooldown[pid] == 0) {
+      ps->state[pid] = 0;
+      ps->cooldown[pid] = cooldownReset;
+    }
+  }
+
+  float pumped = 0.0f;
+  if (ps->state[pid] && ps->nCells[pid] > 0) {
+    float pumpVolIter = ps->capacity[pid] * dtHours;
+    float depth = pumpVolIter / (pixelArea * (float)ps->nCells[pid]);
+    float *out = water + ps->outlet[pid];
+    // the outlet may sit inside the footprint, so cells are visited one by
+    // one in the original row-major order
+    for (int s = ps->spanFirst[pid]; s < ps->spanFirst[pid + 1]; s++) {
+      float *w = water + ps->spanStart[s];
+      for (int i = 0; i < ps->spanLen[s]; i++) {
+        float remove = fminf(w[i], depth);
+        w[i] -= remove;
+        *out += remove;
+        pumped += remove;
+      }
+    }
+  }
+  ps->pumped[pid] = pumped;
+  ps->level[pid] = water[in];
+}
+
+void PumpBatch(PumpSet *ps, int b, float *water, float dtHours,
+               float pixelArea, int cooldownReset, int nThreads, size_t in0,
+               size_t in1) {
+  int first = ps->batchFirst[b], count = ps->batchFirst[b + 1] - first;
+  // only worth a thread team when the batch holds several pumps
+#pragma omp parallel for schedule(dynamic, 8) num_threads(nThreads) if (count > 16)
+  for (int i = 0; i < count; i++) {
+    int pid = ps->batchPumps[first + i];
+    if (ps->intake[pid] >= in0 && ps->intake[pid] < in1)
+      RunPump(ps, pid, water, dtHours, pixelArea, cooldownReset);
+  }
+}
+
+void PumpStep(PumpSet *ps, float *water, float dtHours, float pixelArea,
+              int cooldownReset, int nThreads) {
+  for (int b = 0; b < ps->nBatches; b++)
+    PumpBatch(ps, b, water, dtHours, pixelArea, cooldownReset, nThreads, 0,
+              SIZE_MAX);
+}
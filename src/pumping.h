@@ -0,0 +1,62 @@
+#ifndef pumping
+#define pumping
+
+#include <stddef.h>
+
+// Pump as given on the command line (cold data: coordinates for the log,
+// configuration). Pumps with px < 0 are disabled.
+typedef struct {
+  double inLat, inLon, outLat, outLon;
+  int px, py;
+  int ox, oy;
+  float capacity_m3hr;
+  float threshold;
+  int radius_px;
+} Pump;
+
+// Hot per-pump state in structure-of-arrays form plus each pump's
+// footprint, precomputed once as row spans of valid cells inside the
+// raster. Pumps whose footprints, intakes and outlets cannot touch are
+// grouped into batches that run in parallel; batches run in order, and a
+// pump always runs after every lower-numbered pump it conflicts with, so
+// results match the serial pid-order loop exactly.
+typedef struct {
+  int nPumps;
+  int nActive; // enabled pumps, listed in batch order in batchPumps
+  // per pump, indexed by pid
+  unsigned char *state;
+  int *cooldown;
+  size_t *intake, *outlet; // cell indices
+  float *capacity, *threshOn, *threshOff;
+  int *nCells;    // valid cells in the footprint
+  int *spanFirst; // spans spanFirst[pid] .. spanFirst[pid + 1] - 1
+  int *box;       // footprint bounding box x0, y0, x1, y1 (inclusive)
+  // results of the last PumpStep, indexed by pid
+  float *pumped; // depth removed from the footprint (m summed over cells)
+  float *level;  // water at the intake right after the pump ran
+  // footprint spans, row-major like the original radius walk
+  size_t *spanStart;
+  int *spanLen;
+  int nBatches;
+  int *batchFirst; // batch b is batchPumps[batchFirst[b] .. batchFirst[b+1])
+  int *batchPumps;
+} PumpSet;
+
+// mask: FlowBuildMask() validity bits; cells without FLOW_VALID are left
+// out of footprints
+int PumpSetCreate(PumpSet *ps, const Pump *pumpList, int nPumps, int nXSize,
+                  int nYSize, const unsigned char *mask,
+                  float hysteresisFrac);
+void PumpSetDestroy(PumpSet *ps);
+int PumpEnabled(const PumpSet *ps, int pid);
+// one sub-iteration of every enabled pump: on/off switching with
+// hysteresis and cooldown, then removal of up to capacity * dtHours from
+// the footprint into the outlet cell. Fills pumped[] and level[].
+void PumpStep(PumpSet *ps, float *water, float dtHours, float pixelArea,
+              int cooldownReset, int nThreads);
+// batch b of PumpStep, only the pumps whose intake cell is in [in0, in1):
+// multi-process runs split the pumps by the band holding the intake
+void PumpBatch(PumpSet *ps, int b, float *water, float dtHours,
+               float pixelArea, int cooldownReset, int nThreads, size_t in0,
+               size_t in1);
+#endif
@@ -0,0 +1,304 @@
+// rainGrid.c - per-step rain rasters resampled onto the DEM, read ahead
+#include "rainGrid.h"
+#include "cpl_conv.h"
+#include "flowKernel.h"
+#include "gdal.h"
+#include "gdalwarper.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct RainGrid {
+  // slices: bands of stack, or one file per step
+  GDALDatasetH stack;
+  char **files;
+  int nSlices;
+  int nXSize, nYSize;
+  double geoTransform[6];
+  char *wkt;
+  const unsigned char *mask;
+  // step s goes to grid[s % 2]
+  float *grid[2];
+  double volume[2];
+  int lastStep;  // the reader stops after this one
+  int loaded;    // newest slice in the buffer
+  int requested; // step the simulation is on; step + 1 may be read
+  int done;
+  int failed;
+  char err[512];
+  double waitSeconds, readSeconds;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static double Seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+static int AddFile(RainGrid *rg, const char *path, size_t len) {
+  while (len > 0 && (path[len - 1] == ' ' || path[len - 1] == '\t'))
+    len--;
+  while (len > 0 && (*path == ' ' || *path == '\t')) {
+    path++;
+    len--;
+  }
+  if (len == 0)
+    return 0;
+  char **files =
+      (char **)realloc(rg->files, sizeof(char *) * (size_t)(rg->nSlices + 1));
+  if (!files)
+    return -1;
+  rg->files = files;
+  rg->files[rg->nSlices] = (char *)malloc(len + 1);
+  if (!rg->files[rg->nSlices])
+    return -1;
+  memcpy(rg->files[rg->nSlices], path, len);
+  rg->files[rg->nSlices++][len] = '\0';
+  return 0;
+}
+
+// the slices named by spec, see RainGridOpen
+static int OpenSlices(RainGrid *rg, const char *spec, char *err,
+                      size_t errSize) {
+  if (spec[0] == '@') {
+    FILE *fp = fopen(spec + 1, "r");
+    if (!fp)
+      return Fail(err, errSize, "Failed: to open rain raster list %s",
+                  spec + 1);
+    char line[4096];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] != '#' && AddFile(rg, line, strlen(line)) != 0)
+        rc = Fail(err, errSize, "Failed: Memory allocation failed");
+    }
+    fclose(fp);
+    return rc;
+  }
+  if (strchr(spec, ',')) {
+    for (const char *s = spec; *s;) {
+      size_t len = strcspn(s, ",");
+      if (AddFile(rg, s, len) != 0)
+        return Fail(err, errSize, "Failed: Memory allocation failed");
+      s += len + (s[len] == ',');
+    }
+    return 0;
+  }
+  rg->stack = GDALOpen(spec, GA_ReadOnly);
+  if (!rg->stack)
+    return Fail(err, errSize, "Failed: to open rain raster %s", spec);
+  rg->nSlices = GDALGetRasterCount(rg->stack);
+  return 0;
+}
+
+// Slice s resampled onto the DEM grid into out (m), returns its volume.
+// Runs on the reader thread, the only user of the rain datasets.
+static int ReadSlice(RainGrid *rg, int s, float *out, double *volume) {
+  GDALDatasetH src =
+      rg->stack ? rg->stack : GDALOpen(rg->files[s], GA_ReadOnly);
+  if (!src)
+    return Fail(rg->err, sizeof(rg->err), "Failed: to open rain raster %s",
+                rg->files[s]);
+  GDALRasterBandH band = GDALGetRasterBand(src, rg->stack ? s + 1 : 1);
+  int w = GDALGetRasterBandXSize(band), h = GDALGetRasterBandYSize(band);
+  double gt[6];
+  GDALGetGeoTransform(src, gt);
+  // rasters without a CRS are taken to be in the DEM's
+  const char *srcWkt = GDALGetProjectionRef(src);
+  if (!srcWkt || !srcWkt[0])
+    srcWkt = rg->wkt;
+  int hasNoData;
+  double noData = GDALGetRasterNoDataValue(band, &hasNoData);
+
+  // The band is copied into a dataset of its own: warping the stack would
+  // resample every band for every step. Rain grids are coarse, so this is
+  // a small copy.
+  GDALDriverH mem = GDALGetDriverByName("MEM");
+  GDALDatasetH one = GDALCreate(mem, "", w, h, 1, GDT_Float32, NULL);
+  GDALDatasetH dst =
+      GDALCreate(mem, "", rg->nXSize, rg->nYSize, 1, GDT_Float32, NULL);
+  float *buf = (float *)CPLMalloc((size_t)w * (size_t)h * sizeof(float));
+  int rc = 0;
+  if (!one || !dst ||
+      GDALRasterIO(band, GF_Read, 0, 0, w, h, buf, w, h, GDT_Float32, 0, 0) !=
+          CE_None) {
+    rc = Fail(rg->err, sizeof(rg->err), "Failed: to read rain slice %d", s);
+  } else {
+    GDALRasterBandH oneBand = GDALGetRasterBand(one, 1);
+    GDALRasterIO(oneBand, GF_Write, 0, 0, w, h, buf, w, h, GDT_Float32, 0, 0);
+    GDALSetGeoTransform(one, gt);
+    GDALSetProjection(one, srcWkt);
+    if (hasNoData)
+      GDALSetRasterNoDataValue(oneBand, noData);
+    GDALSetGeoTransform(dst, rg->geoTransform);
+    GDALSetProjection(dst, rg->wkt);
+    // the new MEM dataset is zeroed: cells the slice does not cover and
+    // no-data get no rain
+    if (GDALReprojectImage(one, srcWkt, dst, rg->wkt, GRA_Bilinear, 0.0,
+                           0.125, NULL, NULL, NULL) != CE_None ||
+        GDALRasterIO(GDALGetRasterBand(dst, 1), GF_Read, 0, 0, rg->nXSize,
+                     rg->nYSize, out, rg->nXSize, rg->nYSize, GDT_Float32, 0,
+                     0) != CE_None)
+      rc = Fail(rg->err, sizeof(rg->err),
+                "Failed: to resample rain slice %d onto the DEM", s);
+  }
+  CPLFree(buf);
+  if (dst)
+    GDALClose(dst);
+  if (one)
+    GDALClose(one);
+  if (!rg->stack)
+    GDALClose(src);
+  if (rc != 0)
+    return rc;
+
+  size_t npix = (size_t)rg->nXSize * (size_t)rg->nYSize;
+  // serial: this thread should not take cores from the sweeps
+  double sum = 0.0;
+  for (size_t i = 0; i < npix; i++) {
+    float v = out[i];
+    // negative and NaN values are no rain as well
+    v = (rg->mask[i] & FLOW_VALID) && v > 0.0f ? v / 1000.0f : 0.0f;
+    out[i] = v;
+    sum += v;
+  }
+  *volume = sum;
+  return 0;
+}
+
+static void *ReaderMain(void *arg) {
+  RainGrid *rg = (RainGrid *)arg;
+  pthread_mutex_lock(&rg->lock);
+  for (int s = rg->loaded + 1; s <= rg->lastStep; s++) {
+    // slice s overwrites s - 2, which the simulation holds until it moves
+    // on to s - 1
+    while (s > rg->requested + 1 && !rg->done)
+      pthread_cond_wait(&rg->cond, &rg->lock);
+    if (rg->done)
+      break;
+    pthread_mutex_unlock(&rg->lock);
+
+    double t0 = Seconds();
+    double volume = 0.0;
+    int failed = ReadSlice(rg, s, rg->grid[s % 2], &volume) != 0;
+
+    pthread_mutex_lock(&rg->lock);
+    rg->readSeconds += Seconds() - t0;
+    rg->volume[s % 2] = volume;
+    rg->failed = failed;
+    if (!failed)
+      rg->loaded = s;
+    pthread_cond_broadcast(&rg->cond);
+    if (failed)
+      break;
+  }
+  pthread_mutex_unlock(&rg->lock);
+  return NULL;
+}
+
+static void FreeSlices(RainGrid *rg) {
+  if (rg->stack)
+    GDALClose(rg->stack);
+  for (int i = 0; i < rg->nSlices && rg->files; i++)
+    free(rg->files[i]);
+  free(rg->files);
+  CPLFree(rg->grid[0]);
+  CPLFree(rg->grid[1]);
+  CPLFree(rg->wkt);
+  free(rg);
+}
+
+RainGrid *RainGridOpen(const char *spec, int nXSize, int nYSize,
+                       const double geoTransform[6], const char *wkt,
+                       const unsigned char *mask, int firstStep, int nSteps,
+                       char *err, size_t errSize) {
+  RainGrid *rg = (RainGrid *)calloc(1, sizeof(RainGrid));
+  if (!rg) {
+    Fail(err, errSize, "Failed: Memory allocation failed");
+    return NULL;
+  }
+  if (OpenSlices(rg, spec, err, errSize) != 0) {
+    FreeSlices(rg);
+    return NULL;
+  }
+  if (rg->nSlices < nSteps) {
+    Fail(err, errSize, "Failed: %s has %d rain slices for %d steps", spec,
+         rg->nSlices, nSteps);
+    FreeSlices(rg);
+    return NULL;
+  }
+  rg->nXSize = nXSize;
+  rg->nYSize = nYSize;
+  memcpy(rg->geoTransform, geoTransform, sizeof(rg->geoTransform));
+  rg->wkt = CPLStrdup(wkt);
+  rg->mask = mask;
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  rg->grid[0] = (float *)CPLMalloc(npix * sizeof(float));
+  rg->grid[1] = (float *)CPLMalloc(npix * sizeof(float));
+  rg->lastStep = nSteps - 1;
+  rg->loaded = firstStep - 1;
+  rg->requested = firstStep - 1;
+
+  pthread_mutex_init(&rg->lock, NULL);
+  pthread_cond_init(&rg->cond, NULL);
+  if (pthread_create(&rg->thread, NULL, ReaderMain, rg) != 0) {
+    Fail(err, errSize, "Failed: to start the rain reader");
+    pthread_mutex_destroy(&rg->lock);
+    pthread_cond_destroy(&rg->cond);
+    FreeSlices(rg);
+    return NULL;
+  }
+  return rg;
+}
+
+const float *RainGridStep(RainGrid *rg, int step, double *volume, char *err,
+                          size_t errSize) {
+  double t0 = Seconds();
+  pthread_mutex_lock(&rg->lock);
+  rg->requested = step;
+  pthread_cond_broadcast(&rg->cond);
+  while (rg->loaded < step && !rg->failed)
+    pthread_cond_wait(&rg->cond, &rg->lock);
+  int ready = rg->loaded >= step;
+  if (!ready)
+    Fail(err, errSize, "%s", rg->err);
+  pthread_mutex_unlock(&rg->lock);
+  rg->waitSeconds += Seconds() - t0;
+  if (!ready)
+    return NULL;
+  *volume = rg->volume[step % 2];
+  return rg->grid[step % 2];
+}
+
+double RainGridWaitSeconds(const RainGrid *rg) { return rg->waitSeconds; }
+
+double RainGridReadSeconds(const RainGrid *rg) { return rg->readSeconds; }
+
+int RainGridSlices(const RainGrid *rg) { return rg->nSlices; }
+
+void RainGridClose(RainGrid *rg) {
+  if (!rg)
+    return;
+  pthread_mutex_lock(&rg->lock);
+  rg->done = 1;
+  pthread_cond_broadcast(&rg->cond);
+  pthread_mutex_unlock(&rg->lock);
+  pthread_join(rg->thread, NULL);
+  pthread_mutex_destroy(&rg->lock);
+  pthread_cond_destroy(&rg->cond);
+  FreeSlices(rg);
+}
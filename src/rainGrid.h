@@ -0,0 +1,38 @@
+#ifndef rainGrid
+#define rainGrid
+
+#include <stddef.h>
+
+// Spatially varying rain (--rain-rasters): one raster of rain depth (mm)
+// per time step instead of the scalar series. spec is either one raster
+// whose bands are the steps, a comma-separated list of rasters (band 1 of
+// each), or "@file" naming a text file with one raster path per line.
+// Every slice is resampled (bilinear) onto the DEM grid; no-data and cells
+// it does not cover get no rain.
+//
+// Slices are read and resampled on a background thread, one step ahead of
+// the simulation into the other half of a double buffer, so a step only
+// waits when reading its rain takes longer than simulating the previous
+// one.
+typedef struct RainGrid RainGrid;
+
+// opens the series and starts reading firstStep; needs a slice for every
+// step up to nSteps. mask: validity bits of the DEM, kept. NULL with err
+// set on failure.
+RainGrid *RainGridOpen(const char *spec, int nXSize, int nYSize,
+                       const double geoTransform[6], const char *wkt,
+                       const unsigned char *mask, int firstStep, int nSteps,
+                       char *err, size_t errSize);
+// rain of `step` in m per cell (0 off the valid cells), valid until the
+// next call; steps are taken in order. *volume gets its sum over the grid
+// (m summed over cells). NULL with err set if the slice could not be read.
+const float *RainGridStep(RainGrid *rg, int step, double *volume, char *err,
+                          size_t errSize);
+// after the last step: seconds the simulation spent waiting for slices,
+// and the reader spent reading them
+double RainGridWaitSeconds(const RainGrid *rg);
+double RainGridReadSeconds(const RainGrid *rg);
+int RainGridSlices(const RainGrid *rg);
+// stops the reader after the slice it is working on
+void RainGridClose(RainGrid *rg);
+#endif
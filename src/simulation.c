@@ -0,0 +1,1348 @@
+// simulation.c - terrain loading and the time-series flood simulation
+#include "simulation.h"
+#include "checkpoint.h"
+#include "cpl_conv.h"
+#include "depression.h"
+#include "gdal.h"
+#include "pumping.h"
+#include "rainGrid.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "tileRenderer.h"
+#include "transformation.h"
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const float infil_capacity_mm_per_hr[4] = {0.0f, 10.0f, 5.0f, 30.0f};
+// largest water balance drift of a compact run, as a fraction of its rain,
+// before it is reported as unreliable
+#define COMPACT_MASS_TOLERANCE 0.001
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+double NowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void CompactTerrain(Terrain *t, const SimOptions *opt) {
+  FlowGrid grid = {t->nXSize, t->nYSize, t->elev, t->lahan, t->mask};
+  t->elev16 = FlowCompactElevation(&grid, &t->elevBase, &t->elevStep);
+  printf("# Compact state: %s depth, elevation %.4g m + %.3g m steps\n",
+         opt->compact == FLOW_STATE_FLOAT16 ? "half float" : "fixed point",
+         t->elevBase, t->elevStep);
+}
+
+// A compiled terrain: the grids are the file's read-only mapping, nothing
+// is decoded or converted. Out-of-core runs and domains use the mapping
+// as it is; only the water grids are their own.
+static int LoadCompiled(Terrain *t, const char *path, const SimOptions *opt,
+                        char *err, size_t errSize) {
+  TerrainFile *tf = TerrainFileOpen(path, err, errSize);
+  if (!tf)
+    return 1;
+  // the output and snapshots copy their georeferencing from a dataset
+  GDALDatasetH georef = CreateGeoreference(tf->geoTransform, tf->wkt);
+  if (!georef) {
+    TerrainFileClose(tf);
+    return Fail(err, errSize, "Failed: to create the georeference of %s",
+                path);
+  }
+  t->compiled = tf;
+  t->dem.dataset = georef;
+  t->nXSize = tf->nXSize;
+  t->nYSize = tf->nYSize;
+  t->hasNoData = tf->hasNoData;
+  t->noDataValue = tf->noDataValue;
+  t->elev = tf->elev;
+  t->lahan = tf->lahan;
+  t->mask = tf->mask;
+  t->validCells = tf->validCells;
+  memcpy(t->geoTransform, tf->geoTransform, sizeof(t->geoTransform));
+  t->wkt = CPLStrdup(tf->wkt);
+  t->demFile = CPLStrdup(path);
+  printf("# Terrain: compiled %s, %d cols x %d rows%s\n", path, t->nXSize,
+         t->nYSize, tf->hasDepressions ? ", depressions included" : "");
+  if (opt->subdomain) {
+    printf("# Domains: %d processes, %d threads each\n",
+           DomainCount(opt->subdomain), DomainThreads(opt->subdomain));
+  } else if (opt->scratchDir) {
+    if (OocCreateMapped(&t->ooc, opt->scratchDir, t->nXSize, t->nYSize,
+                        opt->bandRows, t->elev, t->lahan, t->mask) != 0) {
+      TerrainFree(t, opt);
+      return Fail(err, errSize, "Failed: to create scratch files in %s",
+                  opt->scratchDir);
+    }
+    printf("# Out-of-core: scratch %s, %d rows per band\n", opt->scratchDir,
+           t->ooc.bandRows);
+  } else if (opt->compact) {
+    CompactTerrain(t, opt);
+  }
+  return 0;
+}
+
+int TerrainLoad(Terrain *t, const char *demFile, const char *lahanFile,
+                const SimOptions *opt, char *err, size_t errSize) {
+  memset(t, 0, sizeof(*t));
+  double t0 = NowSeconds();
+  GDALAllRegister();
+  if (TerrainFileIs(demFile)) {
+    int rc = LoadCompiled(t, demFile, opt, err, errSize);
+    t->loadSeconds = NowSeconds() - t0;
+    return rc;
+  }
+
+  // out-of-core and multi-process: only open the rasters here, pixels are
+  // read in later (a band at a time, or each rank its own rows)
+  int streamed = opt->scratchDir || opt->subdomain;
+  t->dem = streamed ? OpenTiffHeader((char *)demFile, -32767)
+                    : OpenTiff((char *)demFile, 0, -32767);
+  if (!t->dem.dataset)
+    return Fail(err, errSize, "Failed: to open DEM: %s", demFile);
+  t->elev = (float *)t->dem.pixelArray;
+
+  t->lahanData = streamed ? OpenTiffHeader((char *)lahanFile, -1)
+                          : OpenTiff((char *)lahanFile, 2, -1);
+  if (!t->lahanData.dataset) {
+    GDALClose(t->dem.dataset);
+    return Fail(err, errSize, "Failed: to open landuse: %s", lahanFile);
+  }
+  // landuse as one class code byte per cell instead of an int
+  t->lahan = (unsigned char *)t->lahanData.pixelArray;
+
+  t->nXSize = t->dem.nXSize;
+  t->nYSize = t->dem.nYSize;
+  if (t->nXSize <= 0 || t->nYSize <= 0) {
+    GDALClose(t->dem.dataset);
+    GDALClose(t->lahanData.dataset);
+    return Fail(err, errSize, "Failed: Invalid raster size");
+  }
+  t->noDataValue = GDALGetRasterNoDataValue(t->dem.band, &t->hasNoData);
+
+  size_t npix = (size_t)t->nXSize * (size_t)t->nYSize;
+  if (streamed &&
+      (t->lahanData.nXSize != t->nXSize || t->lahanData.nYSize != t->nYSize)) {
+    GDALClose(t->dem.dataset);
+    GDALClose(t->lahanData.dataset);
+    return Fail(err, errSize, "Failed: landuse size differs from DEM");
+  }
+  if (opt->subdomain) {
+    if (DomainLoadTerrain(opt->subdomain, &t->dem, &t->lahanData, t->hasNoData,
+                          (float)t->noDataValue) != 0) {
+      GDALClose(t->dem.dataset);
+      GDALClose(t->lahanData.dataset);
+      return Fail(err, errSize, "Failed: to read the rows of domain %d",
+                  DomainRank(opt->subdomain));
+    }
+    t->elev = DomainElevation(opt->subdomain);
+    t->lahan = DomainLanduse(opt->subdomain);
+    t->mask = DomainMask(opt->subdomain);
+    printf("# Domains: %d processes, %d threads each\n",
+           DomainCount(opt->subdomain), DomainThreads(opt->subdomain));
+  } else if (opt->scratchDir) {
+    if (OocCreate(&t->ooc, opt->scratchDir, t->nXSize, t->nYSize,
+                  opt->bandRows) != 0 ||
+        OocLoad(&t->ooc, &t->dem, &t->lahanData, t->hasNoData,
+                (float)t->noDataValue) != 0) {
+      GDALClose(t->dem.dataset);
+      GDALClose(t->lahanData.dataset);
+      return Fail(err, errSize, "Failed: to stream rasters into %s",
+                  opt->scratchDir);
+    }
+    t->elev = (float *)t->ooc.elev.ptr;
+    t->lahan = (unsigned char *)t->ooc.lahan.ptr;
+    t->mask = (unsigned char *)t->ooc.mask.ptr;
+    printf("# Out-of-core: scratch %s, %d rows per band\n", opt->scratchDir,
+           t->ooc.bandRows);
+  } else {
+    FlowLanduseClasses(t->lahan, npix);
+    // validity mask: no-data/NaN checks done once here instead of per sweep
+    t->mask = FlowBuildMask(t->nXSize, t->nYSize, t->elev, t->hasNoData,
+                            (float)t->noDataValue);
+    if (!t->mask) {
+      TerrainFree(t, opt);
+      return Fail(err, errSize, "Failed: Memory allocation failed");
+    }
+    if (opt->compact)
+      CompactTerrain(t, opt);
+  }
+  GDALGetGeoTransform(t->dem.dataset, t->geoTransform);
+  t->wkt = CPLStrdup(GDALGetProjectionRef(t->dem.dataset));
+  t->demFile = CPLStrdup(demFile);
+  for (size_t i = 0; i < npix; i++)
+    t->validCells += t->mask[i] & FLOW_VALID;
+  t->loadSeconds = NowSeconds() - t0;
+  return 0;
+}
+
+void TerrainFree(Terrain *t, const SimOptions *opt) {
+  if (opt->scratchDir) {
+    OocDestroy(&t->ooc);
+  } else if (!opt->subdomain && !t->compiled) {
+    CPLFree(t->mask);
+    CPLFree(t->lahanData.pixelArray);
+    CPLFree(t->dem.pixelArray);
+  }
+  CPLFree(t->elev16);
+  TerrainFileClose(t->compiled);
+  if (t->dem.dataset)
+    GDALClose(t->dem.dataset);
+  if (t->lahanData.dataset)
+    GDALClose(t->lahanData.dataset);
+  CPLFree(t->wkt);
+  CPLFree(t->demFile);
+  memset(t, 0, sizeof(*t));
+}
+
+int TerrainCompile(const char *demFile, const char *lahanFile,
+                   const char *path, int depressions, char *err,
+                   size_t errSize) {
+  SimOptions opt;
+  memset(&opt, 0, sizeof(opt));
+  Terrain t;
+  if (TerrainLoad(&t, demFile, lahanFile, &opt, err, errSize) != 0)
+    return 1;
+  DepressionMap *dm = NULL;
+  if (depressions) {
+    FlowGrid grid = {t.nXSize, t.nYSize, t.elev, t.lahan, t.mask};
+    dm = DepressionMapAnalyse(&grid);
+    if (!dm) {
+      TerrainFree(&t, &opt);
+      return Fail(err, errSize, "Failed: Memory allocation failed");
+    }
+    printf("# Depressions: %lld, analysed in %.3f s\n",
+           (long long)dm->nDepressions, dm->seconds);
+  }
+  TerrainFile tf;
+  memset(&tf, 0, sizeof(tf));
+  tf.nXSize = t.nXSize;
+  tf.nYSize = t.nYSize;
+  tf.hasNoData = t.hasNoData;
+  tf.noDataValue = t.noDataValue;
+  memcpy(tf.geoTransform, t.geoTransform, sizeof(tf.geoTransform));
+  tf.wkt = t.wkt;
+  tf.elev = t.elev;
+  tf.lahan = t.lahan;
+  tf.mask = t.mask;
+  tf.validCells = t.validCells;
+  double t0 = NowSeconds();
+  int rc = TerrainFileWrite(path, &tf, dm, err, errSize);
+  if (rc == 0)
+    printf("# Compiled terrain: %s, %lld valid cells (load %.3f s, write "
+           "%.3f s)\n",
+           path, t.validCells, t.loadSeconds, NowSeconds() - t0);
+  DepressionMapFree(dm);
+  TerrainFree(&t, &opt);
+  return rc;
+}
+
+int SimStateCreate(SimState *st, const Terrain *t, const SimOptions *opt,
+                   int nThreads) {
+  memset(st, 0, sizeof(*st));
+  size_t npix = (size_t)t->nXSize * (size_t)t->nYSize;
+  // the dense sweep updates water in place; only sparse mode needs a
+  // second grid (out-of-core keeps its own in the scratch directory, and
+  // domains sweep between the two shared ones)
+  if (opt->subdomain) {
+    st->water = DomainWater(opt->subdomain, 0);
+    st->tmp = DomainWater(opt->subdomain, 1);
+    st->sharedWater = 1;
+  } else if (!opt->scratchDir) {
+    st->water = (float *)CPLCalloc(npix, sizeof(float));
+    if (opt->sparse)
+      st->tmp = (float *)CPLCalloc(npix, sizeof(float));
+    if (t->elev16)
+      st->water16 = (uint16_t *)CPLCalloc(npix, sizeof(uint16_t));
+  }
+  FlowGrid grid = {t->nXSize, t->nYSize, t->elev, t->lahan, t->mask};
+  if ((opt->scratchDir || st->water) && (!opt->sparse || st->tmp) &&
+      (!t->elev16 || st->water16))
+    st->flow = FlowCreate(&grid, nThreads);
+  if (!st->flow) {
+    SimStateFree(st);
+    return -1;
+  }
+  if (st->water16)
+    FlowSetCompact(st->flow, opt->compact, t->elev16, t->elevStep,
+                   opt->compactStep);
+  return 0;
+}
+
+void SimStateFree(SimState *st) {
+  DepressionMapFree(st->dep);
+  MultigridDestroy(st->mg);
+  FlowDestroy(st->flow);
+  if (!st->sharedWater) {
+    CPLFree(st->tmp);
+    CPLFree(st->water);
+  }
+  CPLFree(st->water16);
+  memset(st, 0, sizeof(*st));
+}
+
+// numeric field of every element of a JSON array into a new float array
+static float *FieldArray(const JsonValue *arr, const char *key,
+                         float fallback, int *missing) {
+  size_t n = arr->count > 0 ? (size_t)arr->count : 1;
+  float *out = (float *)malloc(sizeof(float) * n);
+  if (!out)
+    return NULL;
+  for (int i = 0; i < arr->count; i++) {
+    const JsonValue *v = JsonGet(&arr->items[i], key);
+    if (!v || v->type != JSON_NUMBER) {
+      if (missing)
+        *missing = 1;
+      out[i] = fallback;
+    } else {
+      out[i] = (float)v->number;
+    }
+  }
+  return out;
+}
+
+int ScenarioFromJson(const JsonValue *job, Scenario *sc, char *err,
+                     size_t errSize) {
+  memset(sc, 0, sizeof(*sc));
+  if (!job || job->type != JSON_OBJECT)
+    return Fail(err, errSize, "Failed: a scenario must be a JSON object");
+  sc->output = JsonString(JsonGet(job, "output_tif"));
+  sc->pumpLog = JsonString(JsonGet(job, "pump_log"));
+  sc->binaryLog = JsonNumber(JsonGet(job, "binary_log"), 0) != 0;
+  sc->decaySteps = (int)JsonNumber(JsonGet(job, "decay_steps"), 0);
+  sc->checkpointFile = JsonString(JsonGet(job, "checkpoint"));
+  sc->checkpointEvery = (int)JsonNumber(JsonGet(job, "checkpoint_every"), 0);
+  sc->resumeFile = JsonString(JsonGet(job, "resume"));
+  sc->snapshotPath = JsonString(JsonGet(job, "snapshots"));
+  sc->snapshotEvery = (int)JsonNumber(JsonGet(job, "snapshot_every"), 1);
+  sc->snapshotSubiters =
+      JsonNumber(JsonGet(job, "snapshot_subiters"), 0) != 0;
+  sc->adaptiveTol = (float)JsonNumber(JsonGet(job, "adaptive_tol"), 0);
+  sc->d8 = JsonNumber(JsonGet(job, "d8"), 0) != 0;
+  sc->estimate = JsonNumber(JsonGet(job, "estimate"), 0) != 0;
+  sc->multigridLevels = (int)JsonNumber(JsonGet(job, "multigrid_levels"), 0);
+  sc->multigridSweeps = (int)JsonNumber(JsonGet(job, "multigrid_sweeps"), 0);
+  sc->tilesDir = JsonString(JsonGet(job, "tiles_dir"));
+  sc->tileMinZoom = (int)JsonNumber(JsonGet(job, "tile_min_zoom"), 12);
+  sc->tileMaxZoom = (int)JsonNumber(JsonGet(job, "tile_max_zoom"), 17);
+  sc->colormap = JsonString(JsonGet(job, "colormap"));
+  sc->statsFile = JsonString(JsonGet(job, "stats"));
+  sc->rainRasters = JsonString(JsonGet(job, "rain_rasters"));
+  const char *outputType = JsonString(JsonGet(job, "output_type"));
+  if (outputType) {
+    sc->format.type = OutputTypeFromName(outputType);
+    if (sc->format.type < 0)
+      return Fail(err, errSize,
+                  "Failed: output_type must be float32, float16 or uint16");
+  }
+  sc->format.compress = JsonString(JsonGet(job, "compress"));
+  sc->format.scale = JsonNumber(JsonGet(job, "depth_scale"), 0);
+  if (!sc->output || !sc->pumpLog)
+    return Fail(err, errSize, "Failed: output_tif and pump_log are required");
+
+  const JsonValue *rain = JsonGet(job, "rain_timeseries");
+  if (!rain || rain->type != JSON_ARRAY || rain->count == 0)
+    return Fail(err, errSize,
+                "Failed: rain_timeseries must be a non-empty array");
+  int missing = 0;
+  sc->nSteps = rain->count;
+  sc->rain_mm = FieldArray(rain, "mm", 0.0f, &missing);
+  sc->interval_min = FieldArray(rain, "interval", 0.0f, &missing);
+  sc->iter = FieldArray(rain, "iter", 0.0f, &missing);
+  if (missing)
+    return Fail(err, errSize,
+                "Failed: rain_timeseries entries need numeric mm, interval "
+                "and iter");
+
+  const JsonValue *pumpList = JsonGet(job, "pumps");
+  JsonValue none = {JSON_ARRAY, 0, NULL, 0, NULL, NULL};
+  if (!pumpList || pumpList->type == JSON_NULL)
+    pumpList = &none;
+  if (pumpList->type != JSON_ARRAY)
+    return Fail(err, errSize, "Failed: pumps must be an array");
+  sc->nPumps = pumpList->count;
+  sc->inLat = FieldArray(pumpList, "in_lat", 0.0f, &missing);
+  sc->inLon = FieldArray(pumpList, "in_lon", 0.0f, &missing);
+  sc->outLat = FieldArray(pumpList, "out_lat", 0.0f, &missing);
+  sc->outLon = FieldArray(pumpList, "out_lon", 0.0f, &missing);
+  sc->capacity = FieldArray(pumpList, "capacity", 0.0f, &missing);
+  sc->threshold = FieldArray(pumpList, "threshold", 0.0f, &missing);
+  // radius is optional, 2 m like the command line default
+  sc->radius = FieldArray(pumpList, "radius", 2.0f, NULL);
+  if (missing)
+    return Fail(err, errSize,
+                "Failed: pumps need in_lat, in_lon, out_lat, out_lon, "
+                "capacity and threshold");
+  if (!sc->rain_mm || !sc->interval_min || !sc->iter || !sc->inLat ||
+      !sc->inLon || !sc->outLat || !sc->outLon || !sc->capacity ||
+      !sc->threshold || !sc->radius)
+    return Fail(err, errSize, "Failed: Memory allocation failed");
+
+  // gauges: a list of points or the path of a name,lat,lon CSV
+  const JsonValue *gaugeList = JsonGet(job, "gauges");
+  sc->gaugeOutput = JsonString(JsonGet(job, "gauge_output"));
+  if (gaugeList && gaugeList->type != JSON_NULL) {
+    if (!sc->gaugeOutput)
+      return Fail(err, errSize, "Failed: gauges need gauge_output");
+    if (gaugeList->type == JSON_STRING)
+      return GaugesLoadCsv(&sc->gaugePoints, gaugeList->string, err, errSize);
+    return GaugesFromJson(&sc->gaugePoints, gaugeList, err, errSize);
+  }
+  return 0;
+}
+
+void ScenarioFree(Scenario *sc) {
+  free(sc->rain_mm);
+  free(sc->interval_min);
+  free(sc->iter);
+  free(sc->inLat);
+  free(sc->inLon);
+  free(sc->outLat);
+  free(sc->outLon);
+  free(sc->capacity);
+  free(sc->threshold);
+  free(sc->radius);
+  GaugesFree(&sc->gaugePoints);
+  memset(sc, 0, sizeof(*sc));
+}
+
+static int StepIterations(const Scenario *sc, int step) {
+  int iter = (int)roundf(sc->iter[step]);
+  return iter < 1 ? 1 : iter;
+}
+
+// a run that fails before its first step leaves the stats without a run
+// object; the flow context is shared with later scenarios
+static void StopStats(RunStats *rs, FlowContext *flowCtx) {
+  FlowTrackInfiltration(flowCtx, 0);
+  if (rs)
+    StatsAbandon(rs);
+}
+
+// every pump is off and out of its cooldown: with water that only goes
+// down, none of them can switch on again
+static int PumpsIdle(const PumpSet *ps) {
+  for (int pid = 0; pid < ps->nPumps; pid++)
+    if (PumpEnabled(ps, pid) && (ps->state[pid] || ps->cooldown[pid] > 0))
+      return 0;
+  return 1;
+}
+
+// infiltration per sweep (m) of each landuse class in a step
+static void StepInfiltration(int step, int decaySteps, float infil_m[4]) {
+  // decay factor optionally (same as previous logic)
+  float tt = (float)step / (float)((decaySteps > 1) ? (decaySteps - 1) : 1);
+  float decayFactor = fmaxf(0.1f, 1.0f - tt * 0.9f);
+  for (int k = 0; k < 4; k++)
+    infil_m[k] = (infil_capacity_mm_per_hr[k] * decayFactor) / 1000.0f;
+}
+
+// binary records during the run; converted to the CSV at the end unless
+// a binary log was asked for. NULL on allocation failure.
+static char *PumpLogBinPath(const Scenario *sc) {
+  char *path = (char *)malloc(strlen(sc->pumpLog) + 5);
+  if (!path)
+    return NULL;
+  strcpy(path, sc->pumpLog);
+  if (!sc->binaryLog)
+    strcat(path, ".bin");
+  return path;
+}
+
+// closes the log opened on PumpLogBinPath and frees the path; rc is the
+// run's result so far
+static int ClosePumpLog(PumpTelemetry *pumpLog, char *pumpBinFile,
+                        const Scenario *sc, int rc, char *err,
+                        size_t errSize) {
+  if (TelemetryClose(pumpLog) != 0) {
+    if (rc == 0)
+      rc = Fail(err, errSize, "Failed: to write pump log %s", pumpBinFile);
+  } else if (!sc->binaryLog) {
+    if (TelemetryToCsv(pumpBinFile, sc->pumpLog) != 0 && rc == 0)
+      rc = Fail(err, errSize, "Failed: to convert pump log to %s",
+                sc->pumpLog);
+    remove(pumpBinFile);
+  }
+  free(pumpBinFile);
+  return rc;
+}
+
+// smoothed GeoTIFF of the final water and the optional tiles; rc is the
+// run's result so far, tiles are only rendered while it is 0
+static int WriteResult(Terrain *t, const SimOptions *opt, const Scenario *sc,
+                       FlowContext *flowCtx, float *water,
+                       double phase[STATS_PHASES], int rc, char *err,
+                       size_t errSize) {
+  int nXSize = t->nXSize, nYSize = t->nYSize;
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  OutOfCore *ooc = opt->scratchDir ? &t->ooc : NULL;
+
+  // tiles are rendered from the smoothed depth, quantized while it is
+  // written
+  unsigned char *level = NULL;
+  ScratchArray levelScratch;
+  if (sc->tilesDir) {
+    level = opt->scratchDir
+                ? (unsigned char *)ScratchAlloc(opt->scratchDir, npix,
+                                                &levelScratch)
+                : (unsigned char *)CPLMalloc(npix);
+    if (!level && rc == 0)
+      rc = Fail(err, errSize, "Failed: Memory allocation failed");
+  }
+
+  // smoothing, masking & write, a band of rows at a time
+  if (WriteSmoothedBands(t->dem.dataset, (char *)sc->output, &sc->format,
+                         nXSize, nYSize, opt->bandRows, t->elev, water,
+                         FlowNeighbours(flowCtx), t->hasNoData,
+                         t->noDataValue, level, ooc,
+                         FlowThreadCount(flowCtx),
+                         phase + STATS_SMOOTHING) != 0 &&
+      rc == 0)
+    rc = Fail(err, errSize, "Failed: to write %s", sc->output);
+  double tTiles = NowSeconds();
+
+  if (level) {
+    char tileErr[256];
+    if (rc == 0 &&
+        RenderTiles(sc->tilesDir, level, nXSize, nYSize, t->geoTransform,
+                    t->wkt, sc->tileMinZoom, sc->tileMaxZoom,
+                    sc->colormap ? sc->colormap : "colormap/jet.clr",
+                    FlowThreadCount(flowCtx), tileErr, sizeof(tileErr)) != 0)
+      rc = Fail(err, errSize, "%s", tileErr);
+    if (opt->scratchDir)
+      ScratchFree(&levelScratch);
+    else
+      CPLFree(level);
+  }
+  if (level)
+    phase[STATS_TILES] = NowSeconds() - tTiles;
+  return rc;
+}
+
+// snapshots are taken after every snapshotEvery-th step, or sub-iteration
+// counted from the first one this run simulates
+static int SnapshotCount(const Scenario *sc, int firstStep) {
+  if (!sc->snapshotPath || sc->snapshotEvery < 1)
+    return 0;
+  long long units = 0;
+  for (int step = firstStep; step < sc->nSteps; step++)
+    units += sc->snapshotSubiters ? StepIterations(sc, step) : 1;
+  return (int)(units / sc->snapshotEvery);
+}
+
+// --estimate: the depressions take the whole event's rain at once instead
+// of it being swept step by step (see depression.h); pumps run at full
+// capacity while there is water at their intake
+static int RunEstimate(Terrain *t, SimState *st, const SimOptions *opt,
+                       const Scenario *sc, const Pump *pumps,
+                       GaugeLog *gaugeLog, float pixelArea, double t0,
+                       SimTimings *timings, char *err, size_t errSize) {
+  int nXSize = t->nXSize, nYSize = t->nYSize;
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  int nSteps = sc->nSteps, nPumps = sc->nPumps;
+  FlowContext *flowCtx = st->flow;
+  if (opt->scratchDir || sc->checkpointFile || sc->resumeFile ||
+      sc->snapshotPath || sc->statsFile || sc->multigridLevels > 0 ||
+      sc->rainRasters) {
+    GaugeLogClose(gaugeLog);
+    return Fail(err, errSize,
+                opt->scratchDir
+                    ? "Failed: the estimate needs the grids in memory, it "
+                      "cannot be combined with --scratch"
+                    : "Failed: the estimate has no time steps; checkpoints, "
+                      "snapshots, stats, multigrid and rain rasters need "
+                      "the full run");
+  }
+
+  // the analysis is kept by the state for later scenarios
+  if (!st->dep) {
+    // a compiled terrain may carry it; otherwise the cache next to the DEM
+    if (t->compiled &&
+        TerrainFileDepressions(t->compiled, &st->dep, err, errSize) != 0) {
+      GaugeLogClose(gaugeLog);
+      return 1;
+    }
+    char *cachePath =
+        st->dep ? NULL : (char *)malloc(strlen(t->demFile) + 5);
+    if (cachePath) {
+      sprintf(cachePath, "%s.dep", t->demFile);
+      FlowGrid grid = {nXSize, nYSize, t->elev, t->lahan, t->mask};
+      st->dep = DepressionMapLoad(cachePath, t->demFile, &grid);
+    }
+    free(cachePath);
+    if (!st->dep) {
+      GaugeLogClose(gaugeLog);
+      return Fail(err, errSize, "Failed: Memory allocation failed");
+    }
+    printf("# Depressions: %lld, %.1f m3 when full (%s in %.3f s)\n",
+           (long long)st->dep->nDepressions, st->dep->capacity * pixelArea,
+           st->dep->mapped      ? "compiled"
+           : st->dep->fromCache ? "cached"
+                                : "analysed",
+           st->dep->seconds);
+  }
+
+  PumpSet pumpSet;
+  PumpSetCreate(&pumpSet, pumps, nPumps, nXSize, nYSize, t->mask, 0.1f);
+  char *pumpBinFile = PumpLogBinPath(sc);
+  if (!pumpBinFile) {
+    PumpSetDestroy(&pumpSet);
+    GaugeLogClose(gaugeLog);
+    return Fail(err, errSize, "Failed: Memory allocation failed");
+  }
+  PumpTelemetry *pumpLog = TelemetryOpen(pumpBinFile, pumps, &pumpSet);
+  size_t nPump = nPumps > 0 ? (size_t)nPumps : 1;
+  double *limit = (double *)malloc(sizeof(double) * 2 * nPump);
+  if (!pumpLog || !limit) {
+    Fail(err, errSize, "Failed: to open pump log: %s", strerror(errno));
+    if (pumpLog) {
+      TelemetryClose(pumpLog);
+      remove(pumpBinFile);
+    }
+    free(limit);
+    free(pumpBinFile);
+    PumpSetDestroy(&pumpSet);
+    GaugeLogClose(gaugeLog);
+    return 1;
+  }
+  double *pumped = limit + nPump;
+  double t1 = NowSeconds();
+
+  // the whole series: rain, and the infiltration its sweeps would apply
+  int decaySteps = sc->decaySteps > 0 ? sc->decaySteps : nSteps;
+  double rain = 0.0, minutes = 0.0, infil[4] = {0.0};
+  for (int step = 0; step < nSteps; step++) {
+    float infil_m[4];
+    StepInfiltration(step, decaySteps, infil_m);
+    for (int k = 0; k < 4; k++)
+      infil[k] += (double)infil_m[k] * StepIterations(sc, step);
+    rain += sc->rain_mm[step] / 1000.0;
+    minutes += sc->interval_min[step];
+  }
+  float *water = st->water;
+  double infiltrated = 0.0;
+  for (size_t i = 0; i < npix; i++) {
+    double take = rain < infil[t->lahan[i]] ? rain : infil[t->lahan[i]];
+    int valid = t->mask[i] & FLOW_VALID;
+    water[i] = valid ? (float)(rain - take) : 0.0f;
+    infiltrated += valid ? take : 0.0;
+  }
+  for (int pid = 0; pid < nPumps; pid++)
+    limit[pid] = PumpEnabled(&pumpSet, pid)
+                     ? pumps[pid].capacity_m3hr * (minutes / 60.0) / pixelArea
+                     : -1.0;
+  double out = DepressionEstimate(st->dep, water, nPumps, pumpSet.intake,
+                                  pumpSet.outlet, limit, pumped);
+  int rc = 0;
+  if (out < 0.0)
+    rc = Fail(err, errSize, "Failed: Memory allocation failed");
+
+  long long wet;
+  double depth, moved = 0.0;
+  StatsCountWater(water, npix, FlowThreadCount(flowCtx), &wet, &depth);
+  for (int pid = 0; pid < nPumps; pid++) {
+    if (!PumpEnabled(&pumpSet, pid))
+      continue;
+    pumpSet.pumped[pid] = (float)pumped[pid];
+    pumpSet.level[pid] = water[pumpSet.intake[pid]];
+    pumpSet.state[pid] = pumped[pid] > 0.0;
+    moved += pumped[pid];
+  }
+  free(limit);
+  double t2 = NowSeconds();
+  if (rc == 0) {
+    printf("# Estimate: %.1f m3 rain, %.1f m3 infiltrated, %.1f m3 ponded "
+           "(%lld cells over %.2f m), %.1f m3 left the DEM, pumps moved "
+           "%.1f m3\n",
+           rain * (double)t->validCells * pixelArea, infiltrated * pixelArea,
+           depth * pixelArea, wet, STATS_WET_DEPTH, out * pixelArea,
+           moved * pixelArea);
+    // one record per pump and one gauge row, at the end of the series
+    TelemetryRecordStep(pumpLog, &pumpSet, nSteps - 1, 0);
+    if (gaugeLog)
+      GaugeLogStep(gaugeLog, nSteps - 1, minutes, water);
+  }
+  if (GaugeLogClose(gaugeLog) != 0 && rc == 0)
+    rc = Fail(err, errSize, "Failed: to write gauge output %s",
+              sc->gaugeOutput);
+  rc = ClosePumpLog(pumpLog, pumpBinFile, sc, rc, err, errSize);
+  PumpSetDestroy(&pumpSet);
+
+  double phase[STATS_PHASES] = {0};
+  phase[STATS_LOAD] = t->loadSeconds;
+  phase[STATS_SETUP] = t1 - t0;
+  phase[STATS_FLOW] = t2 - t1;
+  if (rc == 0)
+    rc = WriteResult(t, opt, sc, flowCtx, water, phase, rc, err, errSize);
+  double t3 = NowSeconds();
+  if (timings) {
+    timings->setup = t1 - t0;
+    timings->simulate = t2 - t1;
+    timings->output = t3 - t2;
+    timings->total = t3 - t0;
+    timings->sweeps = 0;
+    memcpy(timings->phase, phase, sizeof(phase));
+  }
+  return rc;
+}
+
+// Compact mode: the pumps work on the float grid, so the cells they read
+// and write (footprints, intakes, outlets) are decoded before PumpStep and
+// encoded again after it.
+static void PumpCells(const FlowContext *flowCtx, const PumpSet *ps,
+                      int encode, float *water, uint16_t *water16) {
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    if (!PumpEnabled(ps, pid))
+      continue;
+    size_t cells[2] = {ps->intake[pid], ps->outlet[pid]};
+    for (int k = 0; k < 2; k++) {
+      if (encode)
+        FlowEncodeDepth(flowCtx, water, water16, cells[k], cells[k] + 1);
+      else
+        FlowDecodeDepth(flowCtx, water16, water, cells[k], cells[k] + 1);
+    }
+    for (int s = ps->spanFirst[pid]; s < ps->spanFirst[pid + 1]; s++) {
+      size_t i0 = ps->spanStart[s], i1 = i0 + (size_t)ps->spanLen[s];
+      if (encode)
+        FlowEncodeDepth(flowCtx, water, water16, i0, i1);
+      else
+        FlowDecodeDepth(flowCtx, water16, water, i0, i1);
+    }
+  }
+}
+
+int RunScenario(Terrain *t, SimState *st, const SimOptions *opt,
+                const Scenario *sc, SimTimings *timings, char *err,
+                size_t errSize) {
+  double t0 = NowSeconds();
+  int nXSize = t->nXSize, nYSize = t->nYSize;
+  size_t npix = (size_t)nXSize * (size_t)nYSize;
+  int nSteps = sc->nSteps, nPumps = sc->nPumps;
+  FlowContext *flowCtx = st->flow;
+  // the state may have run a scenario with the other neighbourhood
+  FlowSetNeighbours(flowCtx, sc->d8 ? 8 : 4);
+  // multi-process runs: this rank sweeps, rains on and clears rows
+  // [ownY0, ownY1); rank 0 also does everything that needs the whole grid
+  Domain *dom = opt->subdomain;
+  int rank0 = !dom || DomainRank(dom) == 0;
+  int ownY0 = 0, ownY1 = nYSize;
+  if (dom)
+    DomainRows(dom, &ownY0, &ownY1);
+  size_t own0 = (size_t)ownY0 * nXSize, own1 = (size_t)ownY1 * nXSize;
+
+  // defaults (can be tuned)
+  float gsd = 0.5f;
+  float pixelArea = gsd * gsd;
+
+  // pumps and gauges are located with one transform built per scenario
+  GeoLocator locator;
+  if (GeoLocatorCreate(&locator, t->geoTransform, t->wkt) != 0)
+    return Fail(err, errSize, "Failed: DEM geotransform is not invertible");
+
+  // allocate pumps; intakes then outlets converted in one call
+  size_t nPump = nPumps > 0 ? (size_t)nPumps : 1;
+  Pump *pumps = (Pump *)calloc(nPump, sizeof(Pump));
+  double *pumpLat = (double *)malloc(sizeof(double) * 4 * nPump);
+  int *pumpCol = (int *)malloc(sizeof(int) * 4 * nPump);
+  if (!pumps || !pumpLat || !pumpCol) {
+    free(pumpCol);
+    free(pumpLat);
+    free(pumps);
+    GeoLocatorDestroy(&locator);
+    return Fail(err, errSize, "Failed: to alloc pumps");
+  }
+  double *pumpLon = pumpLat + 2 * nPump;
+  int *pumpRow = pumpCol + 2 * nPump;
+  for (int i = 0; i < nPumps; i++) {
+    pumpLat[i] = sc->inLat[i];
+    pumpLon[i] = sc->inLon[i];
+    pumpLat[nPumps + i] = sc->outLat[i];
+    pumpLon[nPumps + i] = sc->outLon[i];
+  }
+  LatLonToPixels(&locator, 2 * nPumps, pumpLat, pumpLon, pumpCol, pumpRow);
+  free(pumpLat);
+
+  int failed = 0;
+  for (int i = 0; i < nPumps && !failed; i++) {
+    // set all coords to -1 initially (safety)
+    pumps[i].px = -1;
+    pumps[i].py = -1;
+    pumps[i].ox = -1;
+    pumps[i].oy = -1;
+
+    // if lat == 0, then we will skip it
+    if (sc->inLat[i] == 0 && sc->outLat[i] == 0 && sc->inLon[i] == 0 &&
+        sc->outLon[i] == 0) {
+      continue;
+    }
+    int px = pumpCol[i], py = pumpRow[i];
+    int ox = pumpCol[nPumps + i], oy = pumpRow[nPumps + i];
+    if (px < 0 || px >= nXSize || py < 0 || py >= nYSize || ox < 0 ||
+        ox >= nXSize || oy < 0 || oy >= nYSize) {
+      Fail(err, errSize,
+           "Failed: Pump %d outside DEM bounds, ignored (in:%f,%f,out:%f,%f -> "
+           "px=%d,py=%d,ox=%d,oy=%d)",
+           i, sc->inLat[i], sc->inLon[i], sc->outLat[i], sc->outLon[i], px,
+           py, ox, oy);
+      failed = 1;
+      break;
+    }
+    pumps[i].inLat = sc->inLat[i];
+    pumps[i].inLon = sc->inLon[i];
+    pumps[i].outLat = sc->outLat[i];
+    pumps[i].outLon = sc->outLon[i];
+    pumps[i].px = px;
+    pumps[i].py = py;
+    pumps[i].ox = ox;
+    pumps[i].oy = oy;
+    pumps[i].capacity_m3hr = sc->capacity[i];
+    pumps[i].threshold = sc->threshold[i];
+    pumps[i].radius_px = (int)ceil(sc->radius[i] / gsd);
+    if (pumps[i].radius_px < 1)
+      pumps[i].radius_px = 1;
+  }
+  free(pumpCol);
+
+  GaugeLog *gaugeLog = NULL;
+  int hasGauges = sc->gaugeOutput && sc->gaugePoints.n > 0;
+  if (!failed && hasGauges && rank0) {
+    int located;
+    gaugeLog = GaugeLogOpen(sc->gaugeOutput, &sc->gaugePoints, &locator, nXSize,
+                            nYSize, t->mask, &located);
+    if (!gaugeLog) {
+      Fail(err, errSize, "Failed: to open gauge output %s: %s",
+           sc->gaugeOutput, strerror(errno));
+      failed = 1;
+    } else {
+      printf("# Gauges: %d of %d on the DEM\n", located, sc->gaugePoints.n);
+    }
+  }
+  GeoLocatorDestroy(&locator);
+  if (failed) {
+    free(pumps);
+    return 1;
+  }
+  if (sc->estimate) {
+    int rc = RunEstimate(t, st, opt, sc, pumps, gaugeLog, pixelArea, t0,
+                         timings, err, errSize);
+    free(pumps);
+    return rc;
+  }
+
+  // compact mode: set when water16 has moved on from water
+  uint16_t *water16 = st->water16;
+  int water16Ahead = 0;
+  if (water16 && sc->multigridLevels > 0) {
+    GaugeLogClose(gaugeLog);
+    free(pumps);
+    return Fail(err, errSize,
+                "Failed: multigrid cannot be combined with --compact");
+  }
+  if (sc->rainRasters && opt->scratchDir) {
+    GaugeLogClose(gaugeLog);
+    free(pumps);
+    return Fail(err, errSize,
+                "Failed: rain rasters need the water grid in memory, they "
+                "cannot be combined with --scratch");
+  }
+  // a checkpoint keeps only the rain_mm series, not the rasters it ran on
+  if (sc->rainRasters && (sc->checkpointFile || sc->resumeFile)) {
+    GaugeLogClose(gaugeLog);
+    free(pumps);
+    return Fail(err, errSize,
+                "Failed: rain rasters cannot be combined with --checkpoint "
+                "or --resume");
+  }
+
+  // the pyramid is built once per state and kept for later scenarios
+  if (sc->multigridLevels > 0) {
+    if (opt->scratchDir) {
+      GaugeLogClose(gaugeLog);
+      free(pumps);
+      return Fail(err, errSize,
+                  "Failed: multigrid needs the water grid in memory, it "
+                  "cannot be combined with --scratch");
+    }
+    if (!st->mg || st->mgLevels != sc->multigridLevels) {
+      MultigridDestroy(st->mg);
+      FlowGrid grid = {nXSize, nYSize, t->elev, t->lahan, t->mask};
+      st->mg = MultigridCreate(&grid, sc->multigridLevels,
+                               FlowThreadCount(flowCtx));
+      st->mgLevels = st->mg ? sc->multigridLevels : 0;
+      if (!st->mg) {
+        GaugeLogClose(gaugeLog);
+        free(pumps);
+        return Fail(err, errSize, "Failed: Memory allocation failed");
+      }
+    }
+    printf("# Multigrid: %d coarse levels\n", MultigridLevels(st->mg));
+  }
+  int mgSweeps = sc->multigridSweeps > 0 ? sc->multigridSweeps : 16;
+
+  // a terrain can be reused: start every scenario dry
+  float *water = st->water;
+  float *tmp = st->tmp;
+  if (opt->scratchDir) {
+    OocClearWater(&t->ooc);
+    water = (float *)t->ooc.water.ptr;
+  } else {
+    // a domain clears only its own rows, which also puts their pages on
+    // its NUMA node
+    memset(water + own0, 0, sizeof(float) * (own1 - own0));
+  }
+  // rank 0 counts the water it starts from below
+  if (dom && DomainBarrier(dom) != 0) {
+    GaugeLogClose(gaugeLog);
+    free(pumps);
+    return Fail(err, errSize, "Failed: another domain process stopped");
+  }
+  FlowMarkAllDirty(flowCtx);
+  const unsigned char *validMask = t->mask;
+
+  const int pumpCooldownEpochs = 1;
+  const float pumpHysteresisFrac = 0.1f;
+
+  // footprints, hot state and conflict-free batches, built once
+  PumpSet pumpSet;
+  PumpSetCreate(&pumpSet, pumps, nPumps, nXSize, nYSize, validMask,
+                pumpHysteresisFrac);
+  printf("# Pumps: %d in %d batches\n", pumpSet.nActive, pumpSet.nBatches);
+
+  int decaySteps = sc->decaySteps > 0 ? sc->decaySteps : nSteps;
+  OutOfCore *ooc = opt->scratchDir ? &t->ooc : NULL;
+  int firstStep = 0;
+  if (sc->resumeFile) {
+    if (CheckpointRead(sc->resumeFile, nXSize, nYSize, nSteps, sc->rain_mm,
+                       sc->interval_min, sc->iter, decaySteps, &pumpSet,
+                       water, ooc, &firstStep, err, errSize) != 0) {
+      PumpSetDestroy(&pumpSet);
+      GaugeLogClose(gaugeLog);
+      free(pumps);
+      return 1;
+    }
+    printf("# Resumed from %s at step %d of %d\n", sc->resumeFile, firstStep,
+           nSteps);
+  }
+
+  // run statistics; the balance needs infiltration summed in the sweep
+  RunStats runStats;
+  RunStats *rs = NULL;
+  if (sc->statsFile && rank0) {
+    long long wet;
+    double depth;
+    StatsCountWater(water, npix, FlowThreadCount(flowCtx), &wet, &depth);
+    if (StatsOpen(&runStats, sc->statsFile, pixelArea, depth) != 0) {
+      Fail(err, errSize, "Failed: to open stats %s: %s", sc->statsFile,
+           strerror(errno));
+      PumpSetDestroy(&pumpSet);
+      GaugeLogClose(gaugeLog);
+      free(pumps);
+      return 1;
+    }
+    rs = &runStats;
+  }
+  // compact mode checks its rounding against the same balance
+  double massExpected = 0.0, rainTotal = 0.0;
+  if (water16) {
+    long long wet;
+    StatsCountWater(water, npix, FlowThreadCount(flowCtx), &wet,
+                    &massExpected);
+  }
+  // every domain sums what its own rows infiltrated, for rank 0's stats
+  int trackInfil = sc->statsFile || water16;
+  if (trackInfil)
+    FlowTrackInfiltration(flowCtx, 1);
+  const char *checkpointFailed = NULL;
+
+  // the reader starts on the first step right away
+  RainGrid *rainSeries = NULL;
+  if (sc->rainRasters && firstStep < nSteps) {
+    rainSeries = RainGridOpen(sc->rainRasters, nXSize, nYSize, t->geoTransform,
+                            t->wkt, validMask, firstStep, nSteps, err,
+                            errSize);
+    if (!rainSeries) {
+      StopStats(rs, flowCtx);
+      PumpSetDestroy(&pumpSet);
+      GaugeLogClose(gaugeLog);
+      free(pumps);
+      return 1;
+    }
+    printf("# Rain rasters: %d slices from %s\n", RainGridSlices(rainSeries),
+           sc->rainRasters);
+  }
+
+  // binary records during the run, see PumpLogBinPath
+  char *pumpBinFile = rank0 ? PumpLogBinPath(sc) : NULL;
+  PumpTelemetry *pumpLog =
+      pumpBinFile ? TelemetryOpen(pumpBinFile, pumps, &pumpSet) : NULL;
+  if (rank0 && !pumpLog) {
+    if (pumpBinFile)
+      Fail(err, errSize, "Failed: to open pump log: %s", strerror(errno));
+    else
+      Fail(err, errSize, "Failed: Memory allocation failed");
+    RainGridClose(rainSeries);
+    StopStats(rs, flowCtx);
+    free(pumpBinFile);
+    PumpSetDestroy(&pumpSet);
+    GaugeLogClose(gaugeLog);
+    free(pumps);
+    return 1;
+  }
+
+  int nSnapshots = SnapshotCount(sc, firstStep);
+  SnapshotWriter *snapshots = NULL;
+  if (nSnapshots > 0) {
+    snapshots = SnapshotOpen(sc->snapshotPath, t->dem.dataset, nXSize, nYSize,
+                             nSnapshots, opt->scratchDir, opt->bandRows);
+    if (!snapshots) {
+      Fail(err, errSize, "Failed: to create snapshots %s", sc->snapshotPath);
+      RainGridClose(rainSeries);
+      StopStats(rs, flowCtx);
+      TelemetryClose(pumpLog);
+      remove(pumpBinFile);
+      free(pumpBinFile);
+      PumpSetDestroy(&pumpSet);
+      GaugeLogClose(gaugeLog);
+      free(pumps);
+      return 1;
+    }
+    printf("# Snapshots: %d to %s\n", nSnapshots, sc->snapshotPath);
+  }
+  long long snapshotUnits = 0;
+  int snapshotFailed = 0;
+
+  long long totalSweeps = 0;
+  int rainFailed = 0;
+  // another rank gave up; none rains before rank 0 has set up
+  int domainFailed = dom && DomainBarrier(dom) != 0;
+  double t1 = NowSeconds();
+  // a few clock reads per sub-iteration; the counters only with rs
+  double phase[STATS_PHASES] = {0};
+  phase[STATS_LOAD] = t->loadSeconds;
+  phase[STATS_SETUP] = t1 - t0;
+  double minutes = 0.0; // simulated time at the end of the step
+  for (int step = 0; step < firstStep; step++)
+    minutes += sc->interval_min[step];
+
+  // MAIN loop over time-steps (time-series)
+  for (int step = firstStep; step < nSteps && !domainFailed; step++) {
+    float rain_mm = sc->rain_mm[step];
+    float interval_min = sc->interval_min[step];
+    int iter = StepIterations(sc, step);
+    double stepStart[STATS_PHASES];
+    memcpy(stepStart, phase, sizeof(phase));
+    double stepInfil = 0.0, stepPumped = 0.0;
+    double tp = NowSeconds(), tq;
+
+    float rain_m = rain_mm / 1000.0f;
+    double rainVolume = (double)rain_m * (double)t->validCells;
+    // per-cell rain, read ahead while the previous step ran
+    const float *rainCells = NULL;
+    if (rainSeries) {
+      rainCells = RainGridStep(rainSeries, step, &rainVolume, err, errSize);
+      if (!rainCells) {
+        rainFailed = 1;
+        break;
+      }
+    }
+    // distribute rain for this timestep: add to all valid pixels
+    if (opt->scratchDir) {
+      OocAddRain(&t->ooc, rain_m);
+    } else if (rainCells) {
+      // zero off the valid cells
+      for (size_t i = 0; i < npix; i++)
+        water[i] += rainCells[i];
+    } else {
+      for (size_t i = own0; i < own1; i++) {
+        if (validMask[i] & FLOW_VALID)
+          water[i] += rain_m;
+      }
+    }
+    // the first sweep reads the rain the neighbours added to their rows
+    if (dom && DomainBarrier(dom) != 0) {
+      domainFailed = 1;
+      break;
+    }
+    if (water16)
+      FlowEncodeDepth(flowCtx, water, water16, 0, npix);
+
+    tq = NowSeconds();
+    phase[STATS_RAIN] += tq - tp;
+    tp = tq;
+
+    float infil_m[4];
+    StepInfiltration(step, decaySteps, infil_m);
+
+    // new rain and infiltration rates: every wet tile has to be swept again
+    if (rainVolume != 0.0)
+      FlowMarkAllDirty(flowCtx);
+    else
+      FlowMarkWet(flowCtx, water);
+    // long-range transport on the coarse levels first
+    if (sc->multigridLevels > 0)
+      MultigridSpread(st->mg, water, mgSweeps, opt->sparse ? flowCtx : NULL);
+    phase[STATS_FLOW] += NowSeconds() - tp;
+    long long tilesSwept = 0;
+    int sweeps = iter; // adaptive steps can end earlier
+    float flux = 0.0f;
+
+    // per-timestep sub-iterations
+    for (int it = 0; it < iter; it++) {
+      tp = NowSeconds();
+      // water flow + infiltration (4-directional)
+      if (opt->sparse) {
+        tilesSwept += FlowSweepSparse(flowCtx, water, tmp, infil_m);
+        flux = FlowMaxFlux(flowCtx);
+      } else if (opt->scratchDir) {
+        flux = OocSweep(&t->ooc, flowCtx, infil_m);
+        water = (float *)t->ooc.water.ptr;
+      } else if (dom) {
+        if (DomainSweep(dom, flowCtx, &water, &tmp, infil_m) != 0) {
+          domainFailed = 1;
+          break;
+        }
+        flux = FlowMaxFlux(flowCtx);
+      } else if (water16) {
+        FlowSweepCompact(flowCtx, water16, infil_m);
+        flux = FlowMaxFlux(flowCtx);
+        water16Ahead = 1;
+      } else {
+        FlowSweepInPlace(flowCtx, water, infil_m);
+        flux = FlowMaxFlux(flowCtx);
+      }
+      if (trackInfil)
+        stepInfil +=
+            opt->scratchDir ? t->ooc.infiltrated : FlowInfiltrated(flowCtx);
+      tq = NowSeconds();
+      phase[STATS_FLOW] += tq - tp;
+      tp = tq;
+
+      // pumps loop
+      // compute dt_hours for pump volume on this sub-iter: (interval_min / 60)
+      // / iter
+      float timestep_hours = interval_min / 60.0f;
+      float dt_hours = timestep_hours / (float)iter;
+
+      if (water16Ahead)
+        PumpCells(flowCtx, &pumpSet, 0, water, water16);
+      if (!dom) {
+        PumpStep(&pumpSet, water, dt_hours, pixelArea,
+                 pumpCooldownEpochs * iter, FlowThreadCount(flowCtx));
+      } else if (DomainPumpStep(dom, &pumpSet, water, dt_hours, pixelArea,
+                                pumpCooldownEpochs * iter,
+                                FlowThreadCount(flowCtx)) != 0) {
+        domainFailed = 1;
+        break;
+      }
+      if (water16Ahead)
+        PumpCells(flowCtx, &pumpSet, 1, water, water16);
+
+      // level[] in the log is the intake water right after each pump ran
+      for (int pid = 0; pid < nPumps; pid++) {
+        const Pump *p = &pumps[pid];
+        if (PumpEnabled(&pumpSet, pid) && pumpSet.pumped[pid] > 0.0f) {
+          const int *box = pumpSet.box + 4 * pid;
+          FlowMarkDirty(flowCtx, box[0], box[1], box[2], box[3]);
+          FlowMarkDirty(flowCtx, p->ox, p->oy, p->ox, p->oy);
+        }
+      }
+      if (pumpLog)
+        TelemetryRecordStep(pumpLog, &pumpSet, step, it);
+      if (rs)
+        for (int pid = 0; pid < nPumps; pid++)
+          if (PumpEnabled(&pumpSet, pid))
+            stepPumped += pumpSet.pumped[pid];
+      tq = NowSeconds();
+      phase[STATS_PUMPS] += tq - tp;
+      tp = tq;
+
+      // all domains take the same decision, on the largest flux of any
+      if (dom && sc->adaptiveTol > 0.0f) {
+        double maxFlux = flux;
+        if (DomainMax(dom, &maxFlux) != 0) {
+          domainFailed = 1;
+          break;
+        }
+        flux = (float)maxFlux;
+      }
+      // adaptive: the surface has settled and the pumps are idle, so the
+      // sweeps left in this step would only infiltrate; those are applied
+      // at once
+      if (sc->adaptiveTol > 0.0f && flux < sc->adaptiveTol &&
+          it < iter - 1 && PumpsIdle(&pumpSet)) {
+        sweeps = it + 1;
+        if (opt->sparse)
+          FlowMarkWet(flowCtx, water);
+        // the rest of the step runs on the float grid
+        if (water16Ahead) {
+          FlowDecodeDepth(flowCtx, water16, water, 0, npix);
+          water16Ahead = 0;
+        }
+        if (opt->scratchDir)
+          OocInfiltrate(&t->ooc, flowCtx, infil_m, iter - sweeps);
+        else
+          FlowInfiltrateRows(flowCtx, water, infil_m, iter - sweeps, ownY0,
+                             ownY1);
+        if (trackInfil)
+          stepInfil +=
+              opt->scratchDir ? t->ooc.infiltrated : FlowInfiltrated(flowCtx);
+        tq = NowSeconds();
+        phase[STATS_FLOW] += tq - tp;
+        tp = tq;
+      }
+
+      // sub-iterations cut off above take their snapshots from the step's
+      // final state, so the number of frames does not change
+      for (int sub = it; sub < (sweeps < iter ? iter : it + 1); sub++)
+        if (snapshots && (sc->snapshotSubiters || sub == iter - 1) &&
+            ++snapshotUnits % sc->snapshotEvery == 0 && !snapshotFailed) {
+          if (water16Ahead) {
+            FlowDecodeDepth(flowCtx, water16, water, 0, npix);
+            water16Ahead = 0;
+          }
+          snapshotFailed = SnapshotAdd(snapshots, water, validMask, step, sub,
+                                       ooc) != 0;
+        }
+      if (sweeps < iter)
+        break;
+    } // end iter
+    if (domainFailed)
+      break;
+    if (pumpLog)
+      TelemetryFlush(pumpLog);
+    totalSweeps += sweeps;
+    if (water16Ahead) {
+      tp = NowSeconds();
+      FlowDecodeDepth(flowCtx, water16, water, 0, npix);
+      water16Ahead = 0;
+      phase[STATS_FLOW] += NowSeconds() - tp;
+    }
+    if (water16) {
+      massExpected += rainVolume - stepInfil;
+      rainTotal += rainVolume;
+    }
+    // rank 0 reads the whole grid for the stats and gauges: every band has
+    // to finish the step first, and waits again until rank 0 is done
+    int shareStep = dom && (sc->statsFile || hasGauges);
+    if (shareStep && (sc->statsFile ? DomainSum(dom, &stepInfil)
+                                    : DomainBarrier(dom)) != 0) {
+      domainFailed = 1;
+      break;
+    }
+    if (rs) {
+      long long wet;
+      double depth;
+      tp = NowSeconds();
+      StatsCountWater(water, npix, FlowThreadCount(flowCtx), &wet, &depth);
+      phase[STATS_COUNTERS] += NowSeconds() - tp;
+      double stepSeconds[STATS_PHASES];
+      for (int k = 0; k < STATS_PHASES; k++)
+        stepSeconds[k] = phase[k] - stepStart[k];
+      StatsStep(rs, step, sweeps, wet, depth, rainVolume, stepInfil,
+                stepPumped, stepSeconds);
+    }
+
+    minutes += interval_min;
+    if (gaugeLog)
+      GaugeLogStep(gaugeLog, step, minutes, water);
+    if (shareStep && DomainBarrier(dom) != 0) {
+      domainFailed = 1;
+      break;
+    }
+
+    if (opt->sparse)
+      printf("# Step %d: swept %.1f%% of tiles\n", step,
+             100.0 * (double)tilesSwept /
+                 ((double)FlowTileCount(flowCtx) * (double)sweeps));
+    if (sc->adaptiveTol > 0.0f)
+      printf("# Step %d: %d of %d sweeps, max flux %.3g m\n", step, sweeps,
+             iter, flux);
+
+    // step boundary: state after the last step, or every N steps
+    if (sc->checkpointFile &&
+        (step + 1 == nSteps ||
+         (sc->checkpointEvery > 0 && (step + 1) % sc->checkpointEvery == 0)) &&
+        CheckpointWrite(sc->checkpointFile, nXSize, nYSize, step + 1,
+                        decaySteps, sc->rain_mm, sc->interval_min, sc->iter,
+                        &pumpSet, water, ooc) != 0)
+      checkpointFailed = sc->checkpointFile;
+  } // end steps
+  // resumed at the end of the series: nothing to simulate, keep the state
+  if (sc->checkpointFile && firstStep == nSteps &&
+      CheckpointWrite(sc->checkpointFile, nXSize, nYSize, nSteps, decaySteps,
+                      sc->rain_mm, sc->interval_min, sc->iter, &pumpSet,
+                      water, ooc) != 0)
+    checkpointFailed = sc->checkpointFile;
+  if (water16 && firstStep < nSteps) {
+    long long wet;
+    double depth;
+    StatsCountWater(water, npix, FlowThreadCount(flowCtx), &wet, &depth);
+    // relative to the rain that fell, the water the run had to account for
+    double massError =
+        rainTotal > 0.0 ? (depth - massExpected) / rainTotal : 0.0;
+    printf("# Compact state: mass error %+.4f%% of the rain (tolerance "
+           "%.2f%%)\n",
+           100.0 * massError, 100.0 * COMPACT_MASS_TOLERANCE);
+    if (fabs(massError) > COMPACT_MASS_TOLERANCE)
+      printf("# Warning: compact state lost track of the water balance, "
+             "rerun without --compact\n");
+  }
+  if (rainSeries) {
+    printf("# Rain rasters: read in %.3f s next to the run, %.3f s waited "
+           "for\n",
+           RainGridReadSeconds(rainSeries), RainGridWaitSeconds(rainSeries));
+    RainGridClose(rainSeries);
+  }
+  // the result is smoothed and written from the whole grid
+  if (dom && !domainFailed && DomainBarrier(dom) != 0)
+    domainFailed = 1;
+  double t2 = NowSeconds();
+
+  // err already holds why the rain could not be read
+  int rc = rainFailed;
+  if (domainFailed)
+    rc = Fail(err, errSize, "Failed: another domain process stopped");
+  if (SnapshotClose(snapshots) != 0 || snapshotFailed)
+    rc = Fail(err, errSize, "Failed: to write snapshots %s", sc->snapshotPath);
+  if (GaugeLogClose(gaugeLog) != 0 && rc == 0)
+    rc = Fail(err, errSize, "Failed: to write gauge output %s",
+              sc->gaugeOutput);
+  if (checkpointFailed && rc == 0)
+    rc = Fail(err, errSize, "Failed: to write checkpoint %s",
+              checkpointFailed);
+  if (pumpLog)
+    rc = ClosePumpLog(pumpLog, pumpBinFile, sc, rc, err, errSize);
+
+  if (rank0)
+    rc = WriteResult(t, opt, sc, flowCtx, water, phase, rc, err, errSize);
+  double t3 = NowSeconds();
+
+  if (rs) {
+    if (StatsClose(rs, nSteps - firstStep, totalSweeps, phase, t3 - t0) != 0 &&
+        rc == 0)
+      rc = Fail(err, errSize, "Failed: to write stats %s", sc->statsFile);
+  }
+  FlowTrackInfiltration(flowCtx, 0);
+  PumpSetDestroy(&pumpSet);
+  free(pumps);
+  if (timings) {
+    timings->setup = t1 - t0;
+    timings->simulate = t2 - t1;
+    timings->output = t3 - t2;
+    timings->total = t3 - t0;
+    timings->sweeps = totalSweeps;
+    memcpy(timings->phase, phase, sizeof(phase));
+  }
+  return rc;
+}
@@ -0,0 +1,147 @@
+#ifndef simulation
+#define simulation
+
+#include "depression.h"
+#include "domain.h"
+#include "flowKernel.h"
+#include "gauges.h"
+#include "gdalShortcut.h"
+#include "json.h"
+#include "multigrid.h"
+#include "outOfCore.h"
+#include "stats.h"
+#include "terrainFile.h"
+#include <stddef.h>
+
+typedef struct {
+  int nThreads; // 0 = all cores
+  int sparse;   // sweep only tiles that are still changing
+  const char *scratchDir; // out-of-core mode: state lives in files here
+  int bandRows;           // out-of-core / output band height
+  int binaryLog;          // keep the pump log as binary records, no CSV
+  // 16-bit sweep state (FLOW_STATE_FLOAT16 / FIXED16), 0 = float; dense
+  // in-memory runs only
+  int compact;
+  float compactStep; // FIXED16 depth step (m)
+  // multi-process run (--domains): this process's rank, grids shared with
+  // the others, see domain.h. NULL = one process.
+  Domain *subdomain;
+} SimOptions;
+
+// DEM + landuse loaded and preprocessed once (validity mask, landuse
+// classes). Read-only while scenarios run, so several SimStates can share
+// it at the same time.
+typedef struct {
+  Raster dem;
+  Raster lahanData;
+  int nXSize, nYSize;
+  int hasNoData;
+  double noDataValue;
+  float *elev;
+  unsigned char *lahan; // class codes 0..3
+  unsigned char *mask;
+  OutOfCore ooc; // used with SimOptions.scratchDir
+  long long validCells;
+  double loadSeconds;
+  // georeferencing of the DEM, copied once so scenarios need no dataset
+  // handle (and no demDataset lock) to locate points
+  double geoTransform[6];
+  char *wkt;
+  char *demFile; // its path, for caches kept next to it
+  // elevation for the compact state, see FlowCompactElevation
+  uint16_t *elev16;
+  float elevBase, elevStep;
+  // demFile was a compiled terrain: elev, lahan and mask are its mapping
+  // and dem.dataset only carries the georeferencing
+  TerrainFile *compiled;
+} Terrain;
+
+// What one running scenario owns: its water grid and a flow context with
+// its own row rings and dirty tiles. Out-of-core runs keep water in the
+// terrain's scratch files, so only one of those can run at a time.
+typedef struct {
+  FlowContext *flow;
+  float *water; // dense state; out-of-core runs use ooc.water
+  float *tmp;   // sparse mode scratch grid
+  // compact mode: the sweeps run on this; water holds the state between
+  // steps and wherever rain, pumps and the outputs need floats
+  uint16_t *water16;
+  Multigrid *mg; // built by the first scenario that asks for it
+  int mgLevels;  // levels mg was built with
+  DepressionMap *dep; // loaded by the first estimate, see depression.h
+  int sharedWater;    // water and tmp are the domain's, not freed here
+} SimState;
+
+// One simulation request: rain time-series and pumps. The arrays are
+// owned by the scenario (malloc) and released by ScenarioFree.
+typedef struct {
+  int nSteps;
+  float *rain_mm, *interval_min, *iter;
+  // per-step rain rasters (mm) replacing rain_mm, see rainGrid.h
+  const char *rainRasters;
+  int nPumps;
+  float *inLat, *inLon, *outLat, *outLon;
+  float *capacity, *threshold, *radius;
+  const char *output;  // smoothed water depth GeoTIFF
+  OutputFormat format; // its pixel type and compression (zeroed: Float32)
+  const char *pumpLog; // pump log CSV (binary with binaryLog)
+  int binaryLog;
+  // infiltration decays from full to 10% over this many steps; 0 = nSteps.
+  // Fix it when a run is continued from a checkpoint with steps appended,
+  // otherwise the longer series changes the decay of the earlier steps.
+  int decaySteps;
+  const char *checkpointFile; // state written here after the last step
+  int checkpointEvery;        // ... and every N steps (0 = only the last)
+  const char *resumeFile;     // continue from this checkpoint
+  const char *snapshotPath;   // depth snapshots, see snapshot.h
+  int snapshotEvery;          // every N steps (or sub-iterations)
+  int snapshotSubiters;       // count snapshotEvery in sub-iterations
+  // > 0: iter is the most sweeps a step may use; a step ends once no cell
+  // gains or loses more than this (m) by flow in a sweep and the pumps are
+  // idle (see FlowMaxFlux)
+  float adaptiveTol;
+  int d8; // 8-directional flow and smoothing instead of 4 (FlowSetNeighbours)
+  // bathtub estimate from the depression map instead of the time steps,
+  // for quick previews of the flood extent
+  int estimate;
+  int multigridLevels;        // > 0: coarse-to-fine spreading, see multigrid.h
+  int multigridSweeps;        // sweeps per coarse level (0 = 16)
+  const char *tilesDir;       // XYZ PNG tiles of the output, see tileRenderer.h
+  int tileMinZoom, tileMaxZoom;
+  const char *colormap;       // gdaldem colour file for the tiles
+  const char *statsFile;      // NDJSON run statistics, see stats.h
+  GaugeSet gaugePoints;       // virtual gauges, owned by the scenario
+  const char *gaugeOutput;    // their depth per step, see gauges.h
+} Scenario;
+
+// wall-clock seconds per phase of RunScenario
+typedef struct {
+  double setup, simulate, output, total;
+  long long sweeps; // flow sweeps run over all steps
+  double phase[STATS_PHASES]; // finer split, see stats.h
+} SimTimings;
+
+double NowSeconds(void);
+// errors are reported as "Failed: ..." in err. demFile may be a compiled
+// terrain (see terrainFile.h); lahanFile is not used then.
+int TerrainLoad(Terrain *t, const char *demFile, const char *lahanFile,
+                const SimOptions *opt, char *err, size_t errSize);
+void TerrainFree(Terrain *t, const SimOptions *opt);
+// --compile-terrain: loads demFile + lahanFile once and writes the result
+// to path, with the estimate's depression map if depressions is set
+int TerrainCompile(const char *demFile, const char *lahanFile,
+                   const char *path, int depressions, char *err,
+                   size_t errSize);
+// nThreads <= 0 means use all available cores
+int SimStateCreate(SimState *st, const Terrain *t, const SimOptions *opt,
+                   int nThreads);
+void SimStateFree(SimState *st);
+int RunScenario(Terrain *t, SimState *st, const SimOptions *opt,
+                const Scenario *sc, SimTimings *timings, char *err,
+                size_t errSize);
+// scenario from a worker job / manifest entry (see worker.h); strings point
+// into job, which must outlive the scenario
+int ScenarioFromJson(const JsonValue *job, Scenario *sc, char *err,
+                     size_t errSize);
+void ScenarioFree(Scenario *sc);
+#endif
@@ -1,27 +1,45 @@
 #include <math.h>
-int Smoothing(int nYSize, int nXSize, int *dx, int *dy, int n, float *pixelArray, float *waterArray, float *res, double noDataValue)
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define SMOOTHING_INLINE inline __attribute__((always_inline))
+#else
+#define SMOOTHING_INLINE inline
+#endif
+
+// Urutan arah sama dengan dx/dy lama: W, E, N, S, lalu diagonal D8
+static const int dx8[8] = {-1, 1, 0, 0, -1, 1, -1, 1};
+static const int dy8[8] = {0, 0, -1, 1, -1, -1, 1, 1};
+
+// Baris [y0, y1) saja, res menunjuk ke baris y0 (res[(y - y0) * nXSize + x]).
+// Tiap baris tidak bergantung pada baris lain, jadi bisa dijalankan paralel.
+// Kolom dimulai dari x0: D4 lama juga menghaluskan kolom 0 (tetangga barat
+// kolom 0 adalah sel terakhir baris sebelumnya), D8 mulai dari kolom 1.
+static SMOOTHING_INLINE void SmoothingRowsBody(int nYSize, int nXSize, const int *dx, const int *dy, int n, int x0, int checkNoData, const float *pixelArray, const float *waterArray, float *res, double noDataValue, int y0, int y1)
 {
-    for (int y = 1; y < nYSize - 1; y++)
+    // baris tepi tidak dihaluskan; offset res tetap dari y0 pemanggil
+    int yStart = y0 < 1 ? 1 : y0;
+    if (y1 > nYSize - 1)
+        y1 = nYSize - 1;
+    for (int y = yStart; y < y1; y++)
     {
-        for (int x = 0; x < nXSize - 1; x++)
+        float *resRow = res + (size_t)(y - y0) * nXSize;
+        for (int x = x0; x < nXSize - 1; x++)
         {
-            int idx = y * nXSize + x;
-            if (x < 0 || y < 0 || x >= nXSize || y >= nYSize)
-            {
-                continue;
-            };
+            size_t idx = (size_t)y * nXSize + x;
 
-            if (isnan(pixelArray[idx]) || pixelArray[idx] == noDataValue)
+            if (isnan(pixelArray[idx]) || (checkNoData && pixelArray[idx] == noDataValue))
                 continue;
 
             float val = 0;
             float count = 0;
+#pragma GCC unroll 8
             for (int d = 0; d < n; d++)
             {
                 int nx = x + dx[d];
                 int ny = y + dy[d];
-                int nIdx = ny * nXSize + nx;
-                if (isnan(pixelArray[nIdx]) || pixelArray[nIdx] == noDataValue)
+                size_t nIdx = (size_t)ny * nXSize + nx;
+                if (isnan(pixelArray[nIdx]) || (checkNoData && pixelArray[nIdx] == noDataValue))
                     break;
                 if (waterArray[idx] <= waterArray[nIdx])
                 {
@@ -31,12 +49,52 @@ int Smoothing(int nYSize, int nXSize, int *dx, int *dy, int n, float *pixelArray
             }
             if (count > 0)
             {
-                res[idx] = val / count;
+                resRow[x] = val / count;
             }
             else
             {
-                res[idx] = waterArray[idx];
+                resRow[x] = waterArray[idx];
             }
         }
     }
-};
\ No newline at end of file
+}
+
+// Varian dengan tetangga (D4/D8) dan cek no-data yang tetap saat kompilasi,
+// supaya loop arah di-unroll dan offset tetangga jadi konstanta
+#define SMOOTHING_ROWS(NAME, N, X0, CHECK_NODATA) \
+    static void NAME(int nYSize, int nXSize, const float *pixelArray, const float *waterArray, float *res, double noDataValue, int y0, int y1) \
+    { \
+        SmoothingRowsBody(nYSize, nXSize, dx8, dy8, N, X0, CHECK_NODATA, pixelArray, waterArray, res, noDataValue, y0, y1); \
+    }
+
+SMOOTHING_ROWS(SmoothingRowsD4, 4, 0, 1)
+SMOOTHING_ROWS(SmoothingRowsD4NaN, 4, 0, 0)
+SMOOTHING_ROWS(SmoothingRowsD8, 8, 1, 1)
+SMOOTHING_ROWS(SmoothingRowsD8NaN, 8, 1, 0)
+
+void SmoothingRows(int nYSize, int nXSize, int neighbours, int hasNoData, const float *pixelArray, const float *waterArray, float *res, double noDataValue, int y0, int y1)
+{
+    if (neighbours == 8)
+    {
+        if (hasNoData)
+            SmoothingRowsD8(nYSize, nXSize, pixelArray, waterArray, res, noDataValue, y0, y1);
+        else
+            SmoothingRowsD8NaN(nYSize, nXSize, pixelArray, waterArray, res, noDataValue, y0, y1);
+    }
+    else
+    {
+        if (hasNoData)
+            SmoothingRowsD4(nYSize, nXSize, pixelArray, waterArray, res, noDataValue, y0, y1);
+        else
+            SmoothingRowsD4NaN(nYSize, nXSize, pixelArray, waterArray, res, noDataValue, y0, y1);
+    }
+}
+
+// Versi lama dengan dx/dy bebas, seluruh grid sekaligus
+int Smoothing(int nYSize, int nXSize, int *dx, int *dy, int n, float *pixelArray, float *waterArray, float *res, double noDataValue)
+{
+    // baris pertama dan terakhir tidak dihaluskan
+    if (nYSize > 2)
+        SmoothingRowsBody(nYSize, nXSize, dx, dy, n, 0, 1, pixelArray, waterArray, res + nXSize, noDataValue, 1, nYSize - 1);
+    return 0;
+}
@@ -1,4 +1,6 @@
 #ifndef smoothing
 #define smoothing
 int Smoothing(int nYSize, int nXSize, int *dx, int *dy, int n, float *pixelArray, float *waterArray, float *res, double noDataValue);
-#endif
\ No newline at end of file
+// neighbours 4 (D4) atau 8 (D8); hasNoData 0 = hanya NaN yang dianggap no-data
+void SmoothingRows(int nYSize, int nXSize, int neighbours, int hasNoData, const float *pixelArray, const float *waterArray, float *res, double noDataValue, int y0, int y1);
+#endif
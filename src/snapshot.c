@@ -0,0 +1,249 @@
+// snapshot.c - per-step water depth snapshots with a background writer
+#include "snapshot.h"
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "flowKernel.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_BUFFERS 2
+#define SNAPSHOT_NODATA -32767.0f
+
+struct SnapshotWriter {
+  char *path;
+  int perFile; // path holds %d: one GeoTIFF per snapshot
+  int nXSize, nYSize;
+  int bandRows;
+  double geoTransform[6];
+  char *projection;
+  GDALDatasetH multi; // the multi-band file
+  int maxBands;
+  float *buf[SNAPSHOT_BUFFERS];
+  ScratchArray scratch[SNAPSHOT_BUFFERS]; // out-of-core buffers
+  int useScratch;
+  int step[SNAPSHOT_BUFFERS], subiter[SNAPSHOT_BUFFERS], seq[SNAPSHOT_BUFFERS];
+  int head;   // buffer the simulation fills next
+  int tail;   // next buffer for the writer
+  int queued; // buffers handed to the writer, not yet written
+  int count;  // snapshots taken
+  int done;
+  int error;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static GDALDatasetH CreateSnapshotTiff(const SnapshotWriter *sw,
+                                       const char *path, int nBands) {
+  char **options = NULL;
+  options = CSLSetNameValue(options, "TILED", "YES");
+  options = CSLSetNameValue(options, "COMPRESS", "DEFLATE");
+  // floating point predictor: depth changes slowly between neighbours
+  options = CSLSetNameValue(options, "PREDICTOR", "3");
+  options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+  // bands are written one after the other: with pixel interleaving every
+  // band would read back and recompress the tiles of the ones before it
+  options = CSLSetNameValue(options, "INTERLEAVE", "BAND");
+  GDALDatasetH ds = GDALCreate(GDALGetDriverByName("GTiff"), path,
+                               sw->nXSize, sw->nYSize, nBands, GDT_Float32,
+                               options);
+  CSLDestroy(options);
+  if (!ds)
+    return NULL;
+  GDALSetGeoTransform(ds, (double *)sw->geoTransform);
+  GDALSetProjection(ds, sw->projection);
+  for (int b = 1; b <= nBands; b++)
+    GDALSetRasterNoDataValue(GDALGetRasterBand(ds, b), SNAPSHOT_NODATA);
+  return ds;
+}
+
+// writes buffer c as the next band / file, a band of rows at a time
+static int WriteSnapshot(SnapshotWriter *sw, int c) {
+  GDALDatasetH ds = sw->multi;
+  int bandIndex = sw->seq[c] + 1;
+  if (sw->perFile) {
+    // the first %d is replaced by hand: the path is the user's, not a
+    // format string
+    const char *at = strstr(sw->path, "%d");
+    size_t len = strlen(sw->path) + 16;
+    char *name = (char *)malloc(len);
+    if (!name)
+      return -1;
+    snprintf(name, len, "%.*s%d%s", (int)(at - sw->path), sw->path,
+             sw->seq[c], at + 2);
+    ds = CreateSnapshotTiff(sw, name, 1);
+    free(name);
+    bandIndex = 1;
+    if (!ds)
+      return -1;
+  }
+  if (!ds || bandIndex > sw->maxBands)
+    return -1;
+
+  GDALRasterBandH band = GDALGetRasterBand(ds, bandIndex);
+  char text[32];
+  snprintf(text, sizeof(text), "step %d subiter %d", sw->step[c],
+           sw->subiter[c]);
+  GDALSetDescription(band, text);
+  snprintf(text, sizeof(text), "%d", sw->step[c]);
+  GDALSetMetadataItem(band, "STEP", text, NULL);
+  snprintf(text, sizeof(text), "%d", sw->subiter[c]);
+  GDALSetMetadataItem(band, "SUBITER", text, NULL);
+
+  size_t w = (size_t)sw->nXSize;
+  int rc = 0;
+  for (int y0 = 0; y0 < sw->nYSize && rc == 0; y0 += sw->bandRows) {
+    int n = y0 + sw->bandRows < sw->nYSize ? sw->bandRows : sw->nYSize - y0;
+    if (GDALRasterIO(band, GF_Write, 0, y0, sw->nXSize, n,
+                     sw->buf[c] + (size_t)y0 * w, sw->nXSize, n, GDT_Float32,
+                     0, 0) != CE_None)
+      rc = -1;
+    if (sw->useScratch)
+      ScratchDrop(&sw->scratch[c], (size_t)y0 * w * sizeof(float),
+                  (size_t)(y0 + n) * w * sizeof(float));
+  }
+  if (sw->perFile)
+    GDALClose(ds);
+  return rc;
+}
+
+static void *WriterMain(void *arg) {
+  SnapshotWriter *sw = (SnapshotWriter *)arg;
+  pthread_mutex_lock(&sw->lock);
+  for (;;) {
+    while (sw->queued == 0 && !sw->done)
+      pthread_cond_wait(&sw->cond, &sw->lock);
+    if (sw->queued == 0)
+      break;
+    int c = sw->tail;
+    pthread_mutex_unlock(&sw->lock);
+
+    int failed = WriteSnapshot(sw, c) != 0;
+
+    pthread_mutex_lock(&sw->lock);
+    sw->error |= failed;
+    sw->tail = (sw->tail + 1) % SNAPSHOT_BUFFERS;
+    sw->queued--;
+    pthread_cond_broadcast(&sw->cond);
+  }
+  pthread_mutex_unlock(&sw->lock);
+  return NULL;
+}
+
+static void FreeWriter(SnapshotWriter *sw) {
+  for (int c = 0; c < SNAPSHOT_BUFFERS && sw->buf[c]; c++) {
+    if (sw->useScratch)
+      ScratchFree(&sw->scratch[c]);
+    else
+      CPLFree(sw->buf[c]);
+  }
+  if (sw->multi)
+    GDALClose(sw->multi);
+  free(sw->projection);
+  free(sw->path);
+  free(sw);
+}
+
+SnapshotWriter *SnapshotOpen(const char *path, GDALDatasetH dem, int nXSize,
+                             int nYSize, int nSnapshots,
+                             const char *scratchDir, int bandRows) {
+  SnapshotWriter *sw = (SnapshotWriter *)calloc(1, sizeof(SnapshotWriter));
+  if (!sw)
+    return NULL;
+  sw->path = strdup(path);
+  sw->perFile = strstr(path, "%d") != NULL;
+  sw->nXSize = nXSize;
+  sw->nYSize = nYSize;
+  sw->bandRows = bandRows > 0 ? bandRows : 256;
+  // one file per snapshot: every file has just band 1
+  sw->maxBands = sw->perFile ? 1 : nSnapshots;
+  // georeferencing is read from the shared DEM handle
+#pragma omp critical(demDataset)
+  {
+    GDALGetGeoTransform(dem, sw->geoTransform);
+    const char *proj = GDALGetProjectionRef(dem);
+    sw->projection = strdup(proj ? proj : "");
+  }
+
+  size_t bytes = sizeof(float) * (size_t)nXSize * (size_t)nYSize;
+  sw->useScratch = scratchDir != NULL;
+  int failed = !sw->path || !sw->projection;
+  for (int c = 0; c < SNAPSHOT_BUFFERS && !failed; c++) {
+    sw->buf[c] = sw->useScratch
+                     ? (float *)ScratchAlloc(scratchDir, bytes, &sw->scratch[c])
+                     : (float *)CPLMalloc(bytes);
+    failed = sw->buf[c] == NULL;
+  }
+  if (!failed && !sw->perFile) {
+    sw->multi = CreateSnapshotTiff(sw, path, nSnapshots > 0 ? nSnapshots : 1);
+    failed = sw->multi == NULL;
+  }
+  if (!failed) {
+    pthread_mutex_init(&sw->lock, NULL);
+    pthread_cond_init(&sw->cond, NULL);
+    if (pthread_create(&sw->thread, NULL, WriterMain, sw) != 0) {
+      pthread_mutex_destroy(&sw->lock);
+      pthread_cond_destroy(&sw->cond);
+      failed = 1;
+    }
+  }
+  if (failed) {
+    FreeWriter(sw);
+    return NULL;
+  }
+  return sw;
+}
+
+int SnapshotAdd(SnapshotWriter *sw, const float *water,
+                const unsigned char *mask, int step, int subiter,
+                OutOfCore *ooc) {
+  // wait for a buffer the writer is done with
+  pthread_mutex_lock(&sw->lock);
+  while (sw->queued == SNAPSHOT_BUFFERS)
+    pthread_cond_wait(&sw->cond, &sw->lock);
+  int failed = sw->error;
+  pthread_mutex_unlock(&sw->lock);
+  if (failed)
+    return -1;
+
+  int c = sw->head;
+  size_t w = (size_t)sw->nXSize;
+  float *dst = sw->buf[c];
+  for (int y0 = 0; y0 < sw->nYSize; y0 += sw->bandRows) {
+    int y1 = y0 + sw->bandRows < sw->nYSize ? y0 + sw->bandRows : sw->nYSize;
+    size_t i0 = (size_t)y0 * w, i1 = (size_t)y1 * w;
+    for (size_t i = i0; i < i1; i++)
+      dst[i] = (mask[i] & FLOW_VALID) ? water[i] : SNAPSHOT_NODATA;
+    if (ooc) {
+      ScratchDrop(&ooc->water, i0 * sizeof(float), i1 * sizeof(float));
+      ScratchDrop(&ooc->mask, i0, i1);
+    }
+  }
+  sw->step[c] = step;
+  sw->subiter[c] = subiter;
+  sw->seq[c] = sw->count++;
+
+  pthread_mutex_lock(&sw->lock);
+  sw->head = (sw->head + 1) % SNAPSHOT_BUFFERS;
+  sw->queued++;
+  pthread_cond_broadcast(&sw->cond);
+  pthread_mutex_unlock(&sw->lock);
+  return 0;
+}
+
+int SnapshotClose(SnapshotWriter *sw) {
+  if (!sw)
+    return 0;
+  pthread_mutex_lock(&sw->lock);
+  sw->done = 1;
+  pthread_cond_broadcast(&sw->cond);
+  pthread_mutex_unlock(&sw->lock);
+  pthread_join(sw->thread, NULL);
+  pthread_mutex_destroy(&sw->lock);
+  pthread_cond_destroy(&sw->cond);
+  int rc = sw->error ? -1 : 0;
+  FreeWriter(sw);
+  return rc;
+}
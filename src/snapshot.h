@@ -0,0 +1,32 @@
+#ifndef snapshot
+#define snapshot
+
+#include "gdal.h"
+#include "outOfCore.h"
+
+// Water depth snapshots taken during the run, written by a background
+// thread. The simulation copies the grid (no-data cells set to -32767)
+// into one of two buffers and continues; the writer compresses and writes
+// the other one meanwhile, so the simulation only waits when both buffers
+// are still queued.
+//
+// path is either one tiled, DEFLATE-compressed GeoTIFF with one band per
+// snapshot, or, when it contains "%d", one such file per snapshot with
+// %d replaced by the snapshot number (0, 1, ...). Every band / file
+// carries STEP and SUBITER metadata items.
+typedef struct SnapshotWriter SnapshotWriter;
+
+// nSnapshots: bands of the multi-band file (ignored for one file per
+// snapshot). scratchDir: out-of-core runs keep the two buffers in scratch
+// files instead of RAM. NULL on failure.
+SnapshotWriter *SnapshotOpen(const char *path, GDALDatasetH dem, int nXSize,
+                             int nYSize, int nSnapshots,
+                             const char *scratchDir, int bandRows);
+// queue the current water grid; ooc: water pages are released after the
+// copy. Returns 0 unless the writer has already failed.
+int SnapshotAdd(SnapshotWriter *sw, const float *water,
+                const unsigned char *mask, int step, int subiter,
+                OutOfCore *ooc);
+// waits for the queued snapshots; returns 0 if every write worked
+int SnapshotClose(SnapshotWriter *sw);
+#endif
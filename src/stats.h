@@ -0,0 +1,68 @@
+#ifndef stats
+#define stats
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Run statistics (--stats FILE, "stats" in worker jobs) as NDJSON: one
+// "step" object after every step and one "run" object at the end.
+//
+//   {"type":"step","step":0,"sweeps":5,"wet_cells":1234,"volume_m3":..,
+//    "rain_m3":..,"infiltrated_m3":..,"pumped_m3":..,"mass_error_m3":..,
+//    "seconds":{"rain":..,"flow":..,"pumps":..,"stats":..}}
+//   {"type":"run","steps":4,"sweeps":23,"seconds":{"load":..,"setup":..,
+//    ...,"total":..},"volume_m3":..,"rain_m3":..,"infiltrated_m3":..,
+//    "pumped_m3":..,"mass_error_m3":..,"mass_error_pct":..}
+//
+// Volumes are depth summed over cells times the pixel area. Pumps move
+// water inside the grid, so pumped_m3 is reported but not balanced:
+// mass_error = volume - (volume before + rain - infiltrated), the water the
+// numerics created or lost; mass_error_pct is relative to all water that
+// entered (initial volume + rain). The counters cost a pass over the grid
+// per step plus an extra sum in the sweep, so they are only collected
+// with a stats file; the phase times are always kept (SimTimings).
+#define STATS_WET_DEPTH 0.01f // m; shallower cells do not count as wet
+
+// wall-clock phases of a run; the sweep phases add up over all steps
+enum {
+  STATS_LOAD,      // TerrainLoad, once per terrain
+  STATS_SETUP,     // pumps, logs, checkpoint restore
+  STATS_RAIN,      // rain distribution
+  STATS_FLOW,      // flow sweeps, multigrid and adaptive infiltration
+  STATS_PUMPS,     // pump updates and the pump log
+  STATS_COUNTERS,  // the per-step counters themselves
+  STATS_SMOOTHING, // output smoothing
+  STATS_WRITE,     // GeoTIFF write
+  STATS_TILES,     // PNG tiles
+  STATS_PHASES
+};
+
+typedef struct {
+  FILE *fp;
+  double pixelArea;
+  double volume; // m3 stored after the last step
+  double volume0;
+  double rain, infiltrated, pumped, error; // m3 over the run
+  int failed;
+} RunStats;
+
+const char *StatsPhaseName(int phase);
+// depth0: depth summed over the grid at the start (a resumed run is not
+// dry). -1 if the file cannot be created.
+int StatsOpen(RunStats *rs, const char *path, double pixelArea,
+              double depth0);
+// counters of one step, all depths summed over cells (m); seconds holds
+// the step's time per phase
+void StatsStep(RunStats *rs, int step, int sweeps, long long wetCells,
+               double depth, double rainDepth, double infilDepth,
+               double pumpedDepth, const double seconds[STATS_PHASES]);
+// writes the run object and closes the file; -1 if anything failed to
+// write
+int StatsClose(RunStats *rs, int nSteps, long long sweeps,
+               const double seconds[STATS_PHASES], double total);
+// closes the file without the run object (the run did not start)
+void StatsAbandon(RunStats *rs);
+// depth summed over water[0, n) and the cells deeper than STATS_WET_DEPTH
+void StatsCountWater(const float *water, size_t n, int nThreads,
+                     long long *wetCells, double *depth);
+#endif
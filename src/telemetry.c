@@ -0,0 +1,199 @@
+// telemetry.c - buffered binary pump log with a background writer thread
+#include "telemetry.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEL_CHUNKS 4
+#define TEL_CHUNK_RECORDS 16384
+
+struct PumpTelemetry {
+  FILE *fp;
+  PumpRecord *chunk[TEL_CHUNKS];
+  int fill[TEL_CHUNKS];
+  int flush[TEL_CHUNKS]; // fflush once this chunk is written
+  int head;              // chunk the simulation is filling
+  int tail;              // next chunk for the writer
+  int queued;            // chunks handed to the writer, not yet written
+  int done;
+  int error;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void *WriterMain(void *arg) {
+  PumpTelemetry *tel = (PumpTelemetry *)arg;
+  pthread_mutex_lock(&tel->lock);
+  for (;;) {
+    while (tel->queued == 0 && !tel->done)
+      pthread_cond_wait(&tel->cond, &tel->lock);
+    if (tel->queued == 0)
+      break;
+    int c = tel->tail;
+    pthread_mutex_unlock(&tel->lock);
+
+    size_t n = (size_t)tel->fill[c];
+    int failed = fwrite(tel->chunk[c], sizeof(PumpRecord), n, tel->fp) != n;
+    if (tel->flush[c])
+      failed |= fflush(tel->fp) != 0;
+
+    pthread_mutex_lock(&tel->lock);
+    tel->error |= failed;
+    tel->tail = (tel->tail + 1) % TEL_CHUNKS;
+    tel->queued--;
+    pthread_cond_broadcast(&tel->cond);
+  }
+  pthread_mutex_unlock(&tel->lock);
+  return NULL;
+}
+
+// hand the head chunk to the writer and wait for a free one if all are
+// still queued
+static void Submit(PumpTelemetry *tel, int flush) {
+  pthread_mutex_lock(&tel->lock);
+  tel->flush[tel->head] = flush;
+  tel->head = (tel->head + 1) % TEL_CHUNKS;
+  tel->queued++;
+  pthread_cond_broadcast(&tel->cond);
+  while (tel->queued == TEL_CHUNKS)
+    pthread_cond_wait(&tel->cond, &tel->lock);
+  pthread_mutex_unlock(&tel->lock);
+  tel->fill[tel->head] = 0;
+}
+
+PumpTelemetry *TelemetryOpen(const char *path, const Pump *pumpList,
+                             const PumpSet *ps) {
+  PumpTelemetry *tel = (PumpTelemetry *)calloc(1, sizeof(PumpTelemetry));
+  if (!tel)
+    return NULL;
+  tel->fp = fopen(path, "wb");
+  if (!tel->fp) {
+    free(tel);
+    return NULL;
+  }
+  for (int c = 0; c < TEL_CHUNKS; c++) {
+    tel->chunk[c] = (PumpRecord *)malloc(sizeof(PumpRecord) * TEL_CHUNK_RECORDS);
+    if (!tel->chunk[c])
+      tel->error = 1;
+  }
+
+  int32_t hdr[2] = {ps->nPumps, (int32_t)sizeof(PumpRecord)};
+  fwrite(TELEMETRY_MAGIC, 1, 8, tel->fp);
+  fwrite(hdr, sizeof(int32_t), 2, tel->fp);
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    const Pump *p = &pumpList[pid];
+    PumpMeta m = {p->inLat,           p->inLon,           p->outLat,
+                  p->outLon,          ps->threshOn[pid],  ps->threshOff[pid],
+                  PumpEnabled(ps, pid), 0};
+    fwrite(&m, sizeof(m), 1, tel->fp);
+  }
+
+  pthread_mutex_init(&tel->lock, NULL);
+  pthread_cond_init(&tel->cond, NULL);
+  if (tel->error || ferror(tel->fp) ||
+      pthread_create(&tel->thread, NULL, WriterMain, tel) != 0) {
+    pthread_mutex_destroy(&tel->lock);
+    pthread_cond_destroy(&tel->cond);
+    for (int c = 0; c < TEL_CHUNKS; c++)
+      free(tel->chunk[c]);
+    fclose(tel->fp);
+    free(tel);
+    return NULL;
+  }
+  return tel;
+}
+
+void TelemetryRecordStep(PumpTelemetry *tel, const PumpSet *ps, int step,
+                         int subiter) {
+  for (int pid = 0; pid < ps->nPumps; pid++) {
+    if (!PumpEnabled(ps, pid))
+      continue;
+    PumpRecord *r = &tel->chunk[tel->head][tel->fill[tel->head]++];
+    r->step = step;
+    r->subiter = subiter;
+    r->pid = pid;
+    r->level = ps->level[pid];
+    r->pumped = ps->pumped[pid];
+    r->active = ps->state[pid];
+    if (tel->fill[tel->head] == TEL_CHUNK_RECORDS)
+      Submit(tel, 0);
+  }
+}
+
+void TelemetryFlush(PumpTelemetry *tel) {
+  if (tel->fill[tel->head] > 0)
+    Submit(tel, 1);
+}
+
+int TelemetryClose(PumpTelemetry *tel) {
+  TelemetryFlush(tel);
+  pthread_mutex_lock(&tel->lock);
+  tel->done = 1;
+  pthread_cond_broadcast(&tel->cond);
+  pthread_mutex_unlock(&tel->lock);
+  pthread_join(tel->thread, NULL);
+
+  int rc = tel->error;
+  if (fclose(tel->fp) != 0)
+    rc = 1;
+  pthread_mutex_destroy(&tel->lock);
+  pthread_cond_destroy(&tel->cond);
+  for (int c = 0; c < TEL_CHUNKS; c++)
+    free(tel->chunk[c]);
+  free(tel);
+  return rc ? -1 : 0;
+}
+
+int TelemetryToCsv(const char *binPath, const char *csvPath) {
+  FILE *in = fopen(binPath, "rb");
+  if (!in)
+    return -1;
+  char magic[8];
+  int32_t hdr[2];
+  if (fread(magic, 1, 8, in) != 8 || memcmp(magic, TELEMETRY_MAGIC, 8) != 0 ||
+      fread(hdr, sizeof(int32_t), 2, in) != 2 || hdr[0] < 0 ||
+      hdr[1] != (int32_t)sizeof(PumpRecord)) {
+    fclose(in);
+    return -1;
+  }
+  int nPumps = hdr[0];
+  PumpMeta *meta = (PumpMeta *)malloc(sizeof(PumpMeta) * (nPumps + 1));
+  if (!meta || fread(meta, sizeof(PumpMeta), nPumps, in) != (size_t)nPumps) {
+    free(meta);
+    fclose(in);
+    return -1;
+  }
+  FILE *out = fopen(csvPath, "w");
+  if (!out) {
+    free(meta);
+    fclose(in);
+    return -1;
+  }
+
+  fprintf(out, "step,subiter,pump_id,inLat,inLon,outLat,outLon,water_level_"
+               "m,threshold_on_m,threshold_off_m,pumped_m,active\n");
+  int rc = 0;
+  PumpRecord buf[1024];
+  size_t n;
+  while ((n = fread(buf, sizeof(PumpRecord), 1024, in)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      const PumpRecord *r = &buf[i];
+      if (r->pid < 0 || r->pid >= nPumps) {
+        rc = -1;
+        continue;
+      }
+      const PumpMeta *m = &meta[r->pid];
+      fprintf(out, "%d,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f,%.6f,%d\n",
+              r->step, r->subiter, r->pid, m->inLat, m->inLon, m->outLat,
+              m->outLon, r->level, m->threshOn, m->threshOff, r->pumped,
+              r->active);
+    }
+  }
+  if (ferror(in) || fclose(out) != 0)
+    rc = -1;
+  fclose(in);
+  free(meta);
+  return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef telemetry
+#define telemetry
+
+#include "pumping.h"
+#include <stdint.h>
+
+// Binary pump log. The file starts with a header holding the static
+// metadata of every pump once, followed by fixed-size records:
+//
+//   char    magic[8]            "FSPUMPv1"
+//   int32   nPumps, recordSize
+//   PumpMeta meta[nPumps]
+//   PumpRecord records[]
+//
+// Records are buffered in a ring of chunks and written by a background
+// thread; the file is flushed only at step boundaries or when a chunk
+// fills up. TelemetryToCsv (or the pumplog2csv tool) turns it back into
+// the CSV the pump log always had.
+#define TELEMETRY_MAGIC "FSPUMPv1"
+
+typedef struct {
+  double inLat, inLon, outLat, outLon;
+  float threshOn, threshOff;
+  int32_t enabled;
+  int32_t pad;
+} PumpMeta;
+
+typedef struct {
+  int32_t step;
+  int32_t subiter;
+  int32_t pid;
+  float level;  // water at the intake (m)
+  float pumped; // pumped depth this sub-iteration (m)
+  int32_t active;
+} PumpRecord;
+
+typedef struct PumpTelemetry PumpTelemetry;
+
+PumpTelemetry *TelemetryOpen(const char *path, const Pump *pumpList,
+                             const PumpSet *ps);
+// appends the records of every enabled pump for one sub-iteration
+void TelemetryRecordStep(PumpTelemetry *tel, const PumpSet *ps, int step,
+                         int subiter);
+// step boundary: hand the partial chunk to the writer and flush the file
+void TelemetryFlush(PumpTelemetry *tel);
+// drains the ring, stops the writer thread; returns 0 if every write worked
+int TelemetryClose(PumpTelemetry *tel);
+int TelemetryToCsv(const char *binPath, const char *csvPath);
+#endif
@@ -0,0 +1,267 @@
+// terrainFile.c - compiled terrain, written once and mapped by every run
+#include "terrainFile.h"
+#include "cpl_conv.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTION_ALIGN 65536
+// reads back as this value only in the byte order it was written in
+#define TERRAIN_BYTE_ORDER 0x01020304u
+
+enum {
+  SEC_WKT,
+  SEC_ELEV,
+  SEC_LANDUSE,
+  SEC_MASK,
+  SEC_ORDER, // the depression sections, empty without --depressions
+  SEC_PARENT,
+  SEC_LABEL,
+  SEC_DEP,
+  SEC_CELLS,
+  SECTIONS
+};
+
+typedef struct {
+  char magic[8];
+  uint32_t byteOrder;
+  int32_t nXSize, nYSize;
+  int32_t hasNoData;
+  double noDataValue;
+  double geoTransform[6];
+  int64_t validCells;
+  int64_t hasDepressions, nOrder, nDepressions, nCells;
+  int64_t offset[SECTIONS], bytes[SECTIONS]; // from the start of the file
+} TerrainFileHeader;
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+static int64_t Align(int64_t bytes) {
+  return (bytes + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+// section sizes a header with these dimensions must have
+static void SectionBytes(const TerrainFileHeader *hdr, int64_t wktBytes,
+                         int64_t bytes[SECTIONS]) {
+  int64_t npix = (int64_t)hdr->nXSize * hdr->nYSize;
+  int dep = hdr->hasDepressions != 0;
+  bytes[SEC_WKT] = wktBytes;
+  bytes[SEC_ELEV] = npix * (int64_t)sizeof(float);
+  bytes[SEC_LANDUSE] = npix;
+  bytes[SEC_MASK] = npix;
+  bytes[SEC_ORDER] = dep ? hdr->nOrder * (int64_t)sizeof(int64_t) : 0;
+  bytes[SEC_PARENT] = dep ? npix : 0;
+  bytes[SEC_LABEL] = dep ? npix * (int64_t)sizeof(int32_t) : 0;
+  bytes[SEC_DEP] =
+      dep ? (hdr->nDepressions + 1) * (int64_t)sizeof(Depression) : 0;
+  bytes[SEC_CELLS] = dep ? hdr->nCells * (int64_t)sizeof(int64_t) : 0;
+}
+
+int TerrainFileIs(const char *path) {
+  char magic[8];
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return 0;
+  // any version, so an old one is refused as such rather than read as a DEM
+  int is = fread(magic, 1, 8, fp) == 8 && memcmp(magic, TERRAIN_MAGIC, 6) == 0;
+  fclose(fp);
+  return is;
+}
+
+int TerrainFileWrite(const char *path, const TerrainFile *tf,
+                     const DepressionMap *dm, char *err, size_t errSize) {
+  TerrainFileHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TERRAIN_MAGIC, 8);
+  hdr.byteOrder = TERRAIN_BYTE_ORDER;
+  hdr.nXSize = tf->nXSize;
+  hdr.nYSize = tf->nYSize;
+  hdr.hasNoData = tf->hasNoData;
+  hdr.noDataValue = tf->noDataValue;
+  memcpy(hdr.geoTransform, tf->geoTransform, sizeof(hdr.geoTransform));
+  hdr.validCells = tf->validCells;
+  if (dm) {
+    hdr.hasDepressions = 1;
+    hdr.nOrder = dm->nOrder;
+    hdr.nDepressions = dm->nDepressions;
+    hdr.nCells = dm->nCells;
+  }
+  const char *wkt = tf->wkt ? tf->wkt : "";
+  const void *data[SECTIONS] = {
+      wkt,
+      tf->elev,
+      tf->lahan,
+      tf->mask,
+      dm ? dm->order : NULL,
+      dm ? dm->parent : NULL,
+      dm ? dm->label : NULL,
+      dm ? dm->dep : NULL,
+      dm ? dm->cells : NULL};
+  SectionBytes(&hdr, (int64_t)strlen(wkt) + 1, hdr.bytes);
+  int64_t at = Align((int64_t)sizeof(hdr));
+  for (int s = 0; s < SECTIONS; s++) {
+    hdr.offset[s] = at;
+    at = Align(at + hdr.bytes[s]);
+  }
+
+  char *tmpPath = (char *)malloc(strlen(path) + 8);
+  if (!tmpPath)
+    return Fail(err, errSize, "Failed: Memory allocation failed");
+  sprintf(tmpPath, "%s.XXXXXX", path);
+  int fd = mkstemp(tmpPath);
+  FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmpPath);
+    }
+    Fail(err, errSize, "Failed: to create %s", tmpPath);
+    free(tmpPath);
+    return 1;
+  }
+  // the gaps between sections are left as holes
+  int failed = fwrite(&hdr, sizeof(hdr), 1, fp) != 1;
+  for (int s = 0; s < SECTIONS && !failed; s++) {
+    if (hdr.bytes[s] == 0)
+      continue;
+    failed = fseeko(fp, (off_t)hdr.offset[s], SEEK_SET) != 0 ||
+             fwrite(data[s], 1, (size_t)hdr.bytes[s], fp) !=
+                 (size_t)hdr.bytes[s];
+  }
+  // the last section may be empty: the file still spans the table
+  failed |= fflush(fp) != 0 || ftruncate(fileno(fp), (off_t)at) != 0;
+  failed |= fclose(fp) != 0;
+  // mkstemp creates it 0600; the terrain is as readable as its sources
+  if (!failed)
+    chmod(tmpPath, 0644);
+  if (!failed)
+    failed = rename(tmpPath, path) != 0;
+  if (failed) {
+    remove(tmpPath);
+    Fail(err, errSize, "Failed: to write compiled terrain %s", path);
+  }
+  free(tmpPath);
+  return failed;
+}
+
+TerrainFile *TerrainFileOpen(const char *path, char *err, size_t errSize) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    Fail(err, errSize, "Failed: to open compiled terrain %s", path);
+    return NULL;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TerrainFileHeader))
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    Fail(err, errSize, "Failed: to map compiled terrain %s", path);
+    return NULL;
+  }
+  size_t bytes = (size_t)st.st_size;
+  const TerrainFileHeader *hdr = (const TerrainFileHeader *)base;
+  const char *problem = NULL;
+  if (memcmp(hdr->magic, TERRAIN_MAGIC, 6) != 0)
+    problem = "is not a compiled terrain";
+  else if (memcmp(hdr->magic, TERRAIN_MAGIC, 8) != 0)
+    problem = "was compiled by another version, compile it again";
+  else if (hdr->byteOrder != TERRAIN_BYTE_ORDER)
+    problem = "was compiled on a machine with another byte order";
+  else if (hdr->nXSize <= 0 || hdr->nYSize <= 0 ||
+           (hdr->hasDepressions &&
+            (hdr->nOrder < 0 ||
+             hdr->nOrder > (int64_t)hdr->nXSize * hdr->nYSize ||
+             hdr->nCells < 0 || hdr->nCells > hdr->nOrder ||
+             hdr->nDepressions < 0 || hdr->nDepressions > hdr->nCells)))
+    problem = "has an invalid header";
+  if (!problem) {
+    int64_t expect[SECTIONS];
+    SectionBytes(hdr, hdr->bytes[SEC_WKT], expect);
+    for (int s = 0; s < SECTIONS && !problem; s++) {
+      if (hdr->bytes[s] != expect[s] || hdr->offset[s] % SECTION_ALIGN ||
+          hdr->offset[s] < (int64_t)sizeof(*hdr) ||
+          hdr->offset[s] + hdr->bytes[s] > (int64_t)bytes)
+        problem = "is truncated or damaged";
+    }
+    const char *wkt = (const char *)base + hdr->offset[SEC_WKT];
+    if (!problem &&
+        (hdr->bytes[SEC_WKT] < 1 || wkt[hdr->bytes[SEC_WKT] - 1] != '\0'))
+      problem = "is truncated or damaged";
+  }
+  if (problem) {
+    Fail(err, errSize, "Failed: %s %s", path, problem);
+    munmap(base, bytes);
+    return NULL;
+  }
+
+  TerrainFile *tf = (TerrainFile *)CPLCalloc(1, sizeof(TerrainFile));
+  char *p = (char *)base;
+  tf->nXSize = hdr->nXSize;
+  tf->nYSize = hdr->nYSize;
+  tf->hasNoData = hdr->hasNoData;
+  tf->noDataValue = hdr->noDataValue;
+  memcpy(tf->geoTransform, hdr->geoTransform, sizeof(tf->geoTransform));
+  tf->wkt = p + hdr->offset[SEC_WKT];
+  tf->elev = (float *)(p + hdr->offset[SEC_ELEV]);
+  tf->lahan = (unsigned char *)(p + hdr->offset[SEC_LANDUSE]);
+  tf->mask = (unsigned char *)(p + hdr->offset[SEC_MASK]);
+  tf->validCells = hdr->validCells;
+  tf->hasDepressions = hdr->hasDepressions != 0;
+  tf->base = base;
+  tf->bytes = bytes;
+  return tf;
+}
+
+int TerrainFileDepressions(const TerrainFile *tf, DepressionMap **dmOut,
+                           char *err, size_t errSize) {
+  *dmOut = NULL;
+  if (!tf->hasDepressions)
+    return 0;
+  const TerrainFileHeader *hdr = (const TerrainFileHeader *)tf->base;
+  char *p = (char *)tf->base;
+  DepressionMap *dm = (DepressionMap *)CPLCalloc(1, sizeof(DepressionMap));
+  dm->nXSize = tf->nXSize;
+  dm->nYSize = tf->nYSize;
+  dm->elev = tf->elev;
+  dm->nOrder = hdr->nOrder;
+  dm->nDepressions = hdr->nDepressions;
+  dm->nCells = hdr->nCells;
+  dm->order = (int64_t *)(p + hdr->offset[SEC_ORDER]);
+  dm->parent = (signed char *)(p + hdr->offset[SEC_PARENT]);
+  dm->label = (int32_t *)(p + hdr->offset[SEC_LABEL]);
+  dm->dep = (Depression *)(p + hdr->offset[SEC_DEP]);
+  dm->cells = (int64_t *)(p + hdr->offset[SEC_CELLS]);
+  dm->fromCache = 1;
+  dm->mapped = 1;
+  // checked here, not at open: runs without --estimate never touch them
+  if (!DepressionMapValid(dm)) {
+    DepressionMapFree(dm);
+    return Fail(err, errSize,
+                "Failed: the compiled terrain has damaged depression "
+                "sections, compile it again");
+  }
+  for (int64_t l = 1; l <= dm->nDepressions; l++)
+    dm->capacity += dm->dep[l].capacity;
+  *dmOut = dm;
+  return 0;
+}
+
+void TerrainFileClose(TerrainFile *tf) {
+  if (!tf)
+    return;
+  if (tf->base)
+    munmap(tf->base, tf->bytes);
+  CPLFree(tf);
+}
@@ -0,0 +1,65 @@
+#ifndef terrainFile
+#define terrainFile
+
+#include "depression.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled terrain (--compile-terrain): the DEM and landuse as TerrainLoad
+// leaves them, in one file the simulator maps read-only instead of
+// decoding two GeoTIFFs every run. Startup only maps the file; pages are
+// read when the first sweep touches them, and concurrent runs on the same
+// file share them in the page cache. Every section starts on a 64 KiB
+// boundary (a multiple of any page size):
+//
+//   TerrainFileHeader               magic "FSTERRv2", byte order, sizes,
+//                                   no-data, geotransform, section table
+//   char    wkt[]                   SRS of the DEM, NUL-terminated
+//   float   elev[nX * nY]           elevation (m)
+//   uint8   lahan[nX * nY]          landuse class codes, FlowLanduseClasses
+//   uint8   mask[nX * nY]           validity bits, FlowBuildMask
+//   and with --depressions the DepressionMap of the estimate:
+//   int64   order[nOrder]
+//   int8    parent[nX * nY]
+//   int32   label[nX * nY]
+//   Depression dep[nDepressions + 1]
+//   int64   cells[nCells]
+//
+// Numbers are in the byte order of the machine that compiled it; another
+// machine refuses the file rather than swapping it.
+#define TERRAIN_MAGIC "FSTERRv2"
+
+typedef struct {
+  int nXSize, nYSize;
+  int hasNoData;
+  double noDataValue;
+  double geoTransform[6];
+  char *wkt;
+  // grids of nXSize x nYSize. In an opened file they point into the
+  // read-only mapping: writing to them faults.
+  float *elev;
+  unsigned char *lahan; // class codes 0..3
+  unsigned char *mask;
+  long long validCells;
+  int hasDepressions;
+  void *base; // the mapping, NULL for one filled in to be written
+  size_t bytes;
+} TerrainFile;
+
+// 1 if path is a compiled terrain of any version (starts with "FSTERR")
+int TerrainFileIs(const char *path);
+// Writes tf (grids in memory) and, when dm is set, its depression map to
+// path: to a temporary file next to it that is then renamed, so runs
+// still mapping the old file keep reading it unchanged.
+int TerrainFileWrite(const char *path, const TerrainFile *tf,
+                     const DepressionMap *dm, char *err, size_t errSize);
+// Maps path read-only and checks its sections; NULL with err set.
+TerrainFile *TerrainFileOpen(const char *path, char *err, size_t errSize);
+// A DepressionMap over the file's depression sections (mapped: no copy) in
+// *dm, NULL if it was compiled without them. Their indices are checked
+// first; 1 with err set if any is out of range. Freed with
+// DepressionMapFree, before the file is closed.
+int TerrainFileDepressions(const TerrainFile *tf, DepressionMap **dm,
+                           char *err, size_t errSize);
+void TerrainFileClose(TerrainFile *tf);
+#endif
@@ -0,0 +1,746 @@
+// tileRenderer.c - XYZ PNG tiles straight from the depth grid
+#define _XOPEN_SOURCE 700
+#include "tileRenderer.h"
+#include "cpl_conv.h"
+#include "gdal.h"
+#include "ogr_srs_api.h"
+#include <errno.h>
+#include <ftw.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MERCATOR_HALF 20037508.342789244 // half the EPSG:3857 world width
+#define MERCATOR_RADIUS 6378137.0
+// tile pixels between exactly transformed points; the rest is interpolated
+#define NODE_STEP 32
+#define NODES (TILE_SIZE / NODE_STEP + 1)
+// granularity of the wet-area summary used to skip dry tiles
+#define WET_BLOCK 16
+// base tiles are rendered in subtrees this many zoom levels deep
+#define SUBTREE_LEVELS 3
+
+typedef struct {
+  const unsigned char *level;
+  int nXSize, nYSize;
+  double inv[6]; // map coordinates -> pixel/line
+  unsigned char lut[256][4];
+  int blocksX, blocksY;
+  int *wetSum; // 2D prefix sums of wet blocks, (blocksX+1) x (blocksY+1)
+  OGRSpatialReferenceH rasterSrs, mercatorSrs;
+  const char *dir;
+  int maxZoom;
+  int failed;
+  int written;
+} TileRender;
+
+static int Fail(char *err, size_t errSize, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(err, errSize, fmt, ap);
+  va_end(ap);
+  return 1;
+}
+
+void TileQuantizeRows(const float *depth, unsigned char *level, size_t n) {
+  // gdal_translate -ot Byte -scale 0 3: linear, rounded, clamped
+  const float scale = 255.0f / TILE_DEPTH_MAX;
+  for (size_t i = 0; i < n; i++) {
+    float v = depth[i] * scale;
+    level[i] = !(v > 0.0f) ? 0 : v >= 255.0f ? 255 : (unsigned char)(v + 0.5f);
+  }
+}
+
+// gdaldem colour file: "value R G B [A]" per line, linear interpolation
+// between entries, clamped outside them; '#' comments and "nv" (no-data)
+// lines are skipped, no-data is transparent anyway
+static int LoadColormap(const char *path, unsigned char lut[256][4]) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  double value[256];
+  int rgba[256][4];
+  int n = 0;
+  char line[512];
+  while (n < 256 && fgets(line, sizeof(line), fp)) {
+    char *s = line;
+    while (*s == ' ' || *s == '\t')
+      s++;
+    if (*s == '#' || strncmp(s, "nv", 2) == 0)
+      continue;
+    int c[4] = {0, 0, 0, 255};
+    double v;
+    if (sscanf(s, "%lf %d %d %d %d", &v, &c[0], &c[1], &c[2], &c[3]) < 4)
+      continue;
+    // keep the entries sorted by value
+    int k = n++;
+    while (k > 0 && value[k - 1] > v) {
+      value[k] = value[k - 1];
+      memcpy(rgba[k], rgba[k - 1], sizeof(rgba[k]));
+      k--;
+    }
+    value[k] = v;
+    memcpy(rgba[k], c, sizeof(c));
+  }
+  fclose(fp);
+  if (n == 0)
+    return -1;
+
+  for (int b = 0; b < 256; b++) {
+    int k = 0;
+    while (k < n - 1 && value[k + 1] <= b)
+      k++;
+    for (int ch = 0; ch < 4; ch++) {
+      double c = rgba[k][ch];
+      if (k < n - 1 && b > value[k]) {
+        double t = (b - value[k]) / (value[k + 1] - value[k]);
+        c += (rgba[k + 1][ch] - rgba[k][ch]) * t;
+      }
+      c = c < 0 ? 0 : c > 255 ? 255 : c;
+      lut[b][ch] = (unsigned char)(c + 0.5);
+    }
+  }
+  return 0;
+}
+
+// wet blocks summed so any source rectangle is checked in O(1)
+static int BuildWetSummary(TileRender *r) {
+  r->blocksX = (r->nXSize + WET_BLOCK - 1) / WET_BLOCK;
+  r->blocksY = (r->nYSize + WET_BLOCK - 1) / WET_BLOCK;
+  size_t stride = (size_t)r->blocksX + 1;
+  unsigned char *wet =
+      (unsigned char *)calloc((size_t)r->blocksX * r->blocksY, 1);
+  r->wetSum = (int *)calloc(stride * ((size_t)r->blocksY + 1), sizeof(int));
+  if (!wet || !r->wetSum) {
+    free(wet);
+    return -1;
+  }
+#pragma omp parallel for schedule(static)
+  for (int by = 0; by < r->blocksY; by++) {
+    int y1 = (by + 1) * WET_BLOCK < r->nYSize ? (by + 1) * WET_BLOCK
+                                              : r->nYSize;
+    for (int y = by * WET_BLOCK; y < y1; y++) {
+      const unsigned char *row = r->level + (size_t)y * r->nXSize;
+      for (int x = 0; x < r->nXSize; x++)
+        if (row[x] && r->lut[row[x]][3])
+          wet[(size_t)by * r->blocksX + x / WET_BLOCK] = 1;
+    }
+  }
+  for (int by = 0; by < r->blocksY; by++)
+    for (int bx = 0; bx < r->blocksX; bx++)
+      r->wetSum[(by + 1) * stride + bx + 1] =
+          wet[(size_t)by * r->blocksX + bx] + r->wetSum[by * stride + bx + 1] +
+          r->wetSum[(by + 1) * stride + bx] - r->wetSum[by * stride + bx];
+  free(wet);
+  return 0;
+}
+
+static double TileSpan(int z) { return 2.0 * MERCATOR_HALF / (double)(1 << z); }
+
+// source pixel coordinates of the NODES x NODES grid over tile z/x/y
+static int TileNodes(const TileRender *r, OGRCoordinateTransformationH ct,
+                     int z, int x, int y, double *sx, double *sy) {
+  double span = TileSpan(z);
+  double minX = -MERCATOR_HALF + x * span, maxY = MERCATOR_HALF - y * span;
+  for (int j = 0; j < NODES; j++)
+    for (int i = 0; i < NODES; i++) {
+      sx[j * NODES + i] = minX + span * i / (NODES - 1);
+      sy[j * NODES + i] = maxY - span * j / (NODES - 1);
+    }
+  if (ct && !OCTTransform(ct, NODES * NODES, sx, sy, NULL))
+    return 0;
+  for (int k = 0; k < NODES * NODES; k++) {
+    double gx = sx[k], gy = sy[k];
+    sx[k] = r->inv[0] + gx * r->inv[1] + gy * r->inv[2];
+    sy[k] = r->inv[3] + gx * r->inv[4] + gy * r->inv[5];
+  }
+  return 1;
+}
+
+// does the source area under the nodes hold any visible cell?
+static int NodesWet(const TileRender *r, const double *sx, const double *sy) {
+  double x0 = sx[0], x1 = sx[0], y0 = sy[0], y1 = sy[0];
+  for (int k = 1; k < NODES * NODES; k++) {
+    x0 = fmin(x0, sx[k]);
+    x1 = fmax(x1, sx[k]);
+    y0 = fmin(y0, sy[k]);
+    y1 = fmax(y1, sy[k]);
+  }
+  // one pixel of margin for the bilinear taps
+  int px0 = (int)floor(x0) - 1, px1 = (int)floor(x1) + 1;
+  int py0 = (int)floor(y0) - 1, py1 = (int)floor(y1) + 1;
+  if (px1 < 0 || py1 < 0 || px0 >= r->nXSize || py0 >= r->nYSize)
+    return 0;
+  px0 = px0 < 0 ? 0 : px0;
+  py0 = py0 < 0 ? 0 : py0;
+  px1 = px1 >= r->nXSize ? r->nXSize - 1 : px1;
+  py1 = py1 >= r->nYSize ? r->nYSize - 1 : py1;
+  int bx0 = px0 / WET_BLOCK, bx1 = px1 / WET_BLOCK + 1;
+  int by0 = py0 / WET_BLOCK, by1 = py1 / WET_BLOCK + 1;
+  size_t stride = (size_t)r->blocksX + 1;
+  return r->wetSum[by1 * stride + bx1] - r->wetSum[by0 * stride + bx1] -
+             r->wetSum[by1 * stride + bx0] + r->wetSum[by0 * stride + bx0] >
+         0;
+}
+
+// alpha-weighted accumulation, like warping an RGBA image with its alpha
+// as the validity mask
+typedef struct {
+  float r, g, b, a;
+} Accum;
+
+static void AccumAdd(Accum *acc, const unsigned char *px, float w) {
+  float wa = w * px[3];
+  acc->r += wa * px[0];
+  acc->g += wa * px[1];
+  acc->b += wa * px[2];
+  acc->a += wa;
+}
+
+static void AccumStore(const Accum *acc, unsigned char *out) {
+  if (acc->a <= 0.0f) {
+    out[0] = out[1] = out[2] = out[3] = 0;
+    return;
+  }
+  out[0] = (unsigned char)(acc->r / acc->a + 0.5f);
+  out[1] = (unsigned char)(acc->g / acc->a + 0.5f);
+  out[2] = (unsigned char)(acc->b / acc->a + 0.5f);
+  out[3] = (unsigned char)(acc->a + 0.5f);
+}
+
+// bilinear sample at source pixel coordinates (pixel centres at k + 0.5)
+static void Sample(const TileRender *r, double sx, double sy,
+                   unsigned char *out) {
+  double fx = sx - 0.5, fy = sy - 0.5;
+  int x0 = (int)floor(fx), y0 = (int)floor(fy);
+  float ax = (float)(fx - x0), ay = (float)(fy - y0);
+  Accum acc = {0, 0, 0, 0};
+  for (int dy = 0; dy < 2; dy++) {
+    int y = y0 + dy;
+    if (y < 0 || y >= r->nYSize)
+      continue;
+    float wy = dy ? ay : 1.0f - ay;
+    for (int dx = 0; dx < 2; dx++) {
+      int x = x0 + dx;
+      if (x < 0 || x >= r->nXSize)
+        continue;
+      float w = wy * (dx ? ax : 1.0f - ax);
+      AccumAdd(&acc, r->lut[r->level[(size_t)y * r->nXSize + x]], w);
+    }
+  }
+  AccumStore(&acc, out);
+}
+
+// returns 0 when the whole tile came out transparent
+static int RenderBase(const TileRender *r, const double *sx, const double *sy,
+                      unsigned char *rgba) {
+  int any = 0;
+  for (int j = 0; j < TILE_SIZE; j++) {
+    double gy = (j + 0.5) / NODE_STEP;
+    int cj = (int)gy;
+    double fy = gy - cj;
+    for (int i = 0; i < TILE_SIZE; i++) {
+      double gx = (i + 0.5) / NODE_STEP;
+      int ci = (int)gx;
+      double fx = gx - ci;
+      int k = cj * NODES + ci;
+      double px = (sx[k] * (1 - fx) + sx[k + 1] * fx) * (1 - fy) +
+                  (sx[k + NODES] * (1 - fx) + sx[k + NODES + 1] * fx) * fy;
+      double py = (sy[k] * (1 - fx) + sy[k + 1] * fx) * (1 - fy) +
+                  (sy[k + NODES] * (1 - fx) + sy[k + NODES + 1] * fx) * fy;
+      unsigned char *out = rgba + ((size_t)j * TILE_SIZE + i) * 4;
+      Sample(r, px, py, out);
+      any |= out[3];
+    }
+  }
+  return any != 0;
+}
+
+// parent tile from its four children (NULL = transparent), 2 x 2 average
+static unsigned char *Downsample(unsigned char *child[4]) {
+  unsigned char *rgba = (unsigned char *)malloc(TILE_SIZE * TILE_SIZE * 4);
+  if (!rgba)
+    return NULL;
+  const int half = TILE_SIZE / 2;
+  for (int j = 0; j < TILE_SIZE; j++) {
+    for (int i = 0; i < TILE_SIZE; i++) {
+      // children in x, y order: 0 = top left, 1 = top right, ...
+      const unsigned char *c = child[(j / half) * 2 + i / half];
+      Accum acc = {0, 0, 0, 0};
+      if (c) {
+        int ci = (i % half) * 2, cj = (j % half) * 2;
+        for (int dy = 0; dy < 2; dy++)
+          for (int dx = 0; dx < 2; dx++)
+            AccumAdd(&acc, c + ((size_t)(cj + dy) * TILE_SIZE + ci + dx) * 4,
+                     0.25f);
+      }
+      AccumStore(&acc, rgba + ((size_t)j * TILE_SIZE + i) * 4);
+    }
+  }
+  return rgba;
+}
+
+// filled once, before any tile is written: tiles are written from several
+// threads, and batch scenarios render at the same time
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void Crc32Init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crcTable[i] = c;
+  }
+}
+
+static uint32_t Crc32(uint32_t crc, const unsigned char *p, size_t n) {
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++)
+    crc = crcTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void PutU32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static int WriteChunk(FILE *fp, const char *type, const unsigned char *data,
+                      size_t n) {
+  unsigned char head[8];
+  PutU32(head, (uint32_t)n);
+  memcpy(head + 4, type, 4);
+  uint32_t crc = Crc32(Crc32(0, head + 4, 4), data, n);
+  unsigned char tail[4];
+  PutU32(tail, crc);
+  return fwrite(head, 1, 8, fp) != 8 || fwrite(data, 1, n, fp) != n ||
+                 fwrite(tail, 1, 4, fp) != 4
+             ? -1
+             : 0;
+}
+
+// 8-bit RGBA PNG; rows use the Sub filter, the zlib stream comes from
+// CPLZLibDeflate
+static int WritePng(const char *path, const unsigned char *rgba) {
+  pthread_once(&crcOnce, Crc32Init);
+  const size_t rowBytes = TILE_SIZE * 4;
+  size_t rawBytes = TILE_SIZE * (rowBytes + 1);
+  unsigned char *raw = (unsigned char *)malloc(rawBytes);
+  if (!raw)
+    return -1;
+  for (int j = 0; j < TILE_SIZE; j++) {
+    const unsigned char *src = rgba + j * rowBytes;
+    unsigned char *dst = raw + j * (rowBytes + 1);
+    dst[0] = 1; // Sub
+    for (size_t i = 0; i < rowBytes; i++)
+      dst[1 + i] = (unsigned char)(src[i] - (i >= 4 ? src[i - 4] : 0));
+  }
+  size_t zBytes = 0;
+  unsigned char *z =
+      (unsigned char *)CPLZLibDeflate(raw, rawBytes, 6, NULL, 0, &zBytes);
+  free(raw);
+  if (!z)
+    return -1;
+
+  FILE *fp = fopen(path, "wb");
+  int rc = fp ? 0 : -1;
+  if (fp) {
+    static const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                               '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13];
+    PutU32(ihdr, TILE_SIZE);
+    PutU32(ihdr + 4, TILE_SIZE);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 6;  // RGBA
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlace
+    rc |= fwrite(signature, 1, 8, fp) != 8 ? -1 : 0;
+    rc |= WriteChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    rc |= WriteChunk(fp, "IDAT", z, zBytes);
+    rc |= WriteChunk(fp, "IEND", NULL, 0);
+    rc |= fclose(fp) != 0 ? -1 : 0;
+  }
+  CPLFree(z);
+  return rc;
+}
+
+static int MakeDir(const char *path) {
+  return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static void SaveTile(TileRender *r, int z, int x, int y,
+                     const unsigned char *rgba) {
+  size_t len = strlen(r->dir) + 48;
+  char *path = (char *)malloc(len);
+  int failed = !path;
+  if (path) {
+    snprintf(path, len, "%s/%d", r->dir, z);
+    failed |= MakeDir(path);
+    snprintf(path, len, "%s/%d/%d", r->dir, z, x);
+    failed |= MakeDir(path);
+    snprintf(path, len, "%s/%d/%d/%d.png", r->dir, z, x, y);
+    failed |= WritePng(path, rgba);
+    free(path);
+  }
+#pragma omp atomic
+  r->failed |= failed;
+#pragma omp atomic
+  r->written++;
+}
+
+// renders tile z/x/y from the base zoom up; NULL if it has nothing to show
+static unsigned char *RenderSubtree(TileRender *r,
+                                    OGRCoordinateTransformationH ct, int z,
+                                    int x, int y) {
+  double sx[NODES * NODES], sy[NODES * NODES];
+  if (!TileNodes(r, ct, z, x, y, sx, sy) || !NodesWet(r, sx, sy))
+    return NULL;
+  unsigned char *rgba = NULL;
+  if (z == r->maxZoom) {
+    rgba = (unsigned char *)malloc(TILE_SIZE * TILE_SIZE * 4);
+    if (rgba && !RenderBase(r, sx, sy, rgba)) {
+      free(rgba);
+      return NULL;
+    }
+  } else {
+    unsigned char *child[4];
+    int any = 0;
+    for (int c = 0; c < 4; c++) {
+      child[c] = RenderSubtree(r, ct, z + 1, 2 * x + c % 2, 2 * y + c / 2);
+      any |= child[c] != NULL;
+    }
+    if (any)
+      rgba = Downsample(child);
+    for (int c = 0; c < 4; c++)
+      free(child[c]);
+  }
+  if (rgba)
+    SaveTile(r, z, x, y, rgba);
+  return rgba;
+}
+
+typedef struct {
+  int x0, y0, x1, y1; // inclusive tile range
+} TileRange;
+
+static TileRange RangeAt(const double merc[4], int z) {
+  double span = TileSpan(z);
+  int last = (1 << z) - 1;
+  TileRange t;
+  t.x0 = (int)floor((merc[0] + MERCATOR_HALF) / span);
+  t.x1 = (int)floor((merc[2] + MERCATOR_HALF) / span);
+  t.y0 = (int)floor((MERCATOR_HALF - merc[3]) / span);
+  t.y1 = (int)floor((MERCATOR_HALF - merc[1]) / span);
+  t.x0 = t.x0 < 0 ? 0 : t.x0;
+  t.y0 = t.y0 < 0 ? 0 : t.y0;
+  t.x1 = t.x1 > last ? last : t.x1;
+  t.y1 = t.y1 > last ? last : t.y1;
+  return t;
+}
+
+static OGRCoordinateTransformationH NewTransform(OGRSpatialReferenceH from,
+                                                 OGRSpatialReferenceH to) {
+  return OCTNewCoordinateTransformation(from, to);
+}
+
+// raster outline sampled along its edges, as a min x, min y, max x, max y
+// box in web mercator
+static int MercatorBounds(const TileRender *r, const double *gt,
+                          double merc[4]) {
+  enum { EDGE = 16 };
+  double x[4 * EDGE], y[4 * EDGE];
+  for (int k = 0; k < EDGE; k++) {
+    double t = (double)k / EDGE;
+    double px[4] = {t * r->nXSize, r->nXSize, (1 - t) * r->nXSize, 0};
+    double py[4] = {0, t * r->nYSize, r->nYSize, (1 - t) * r->nYSize};
+    for (int e = 0; e < 4; e++) {
+      x[e * EDGE + k] = gt[0] + px[e] * gt[1] + py[e] * gt[2];
+      y[e * EDGE + k] = gt[3] + px[e] * gt[4] + py[e] * gt[5];
+    }
+  }
+  OGRCoordinateTransformationH ct = NewTransform(r->rasterSrs, r->mercatorSrs);
+  int ok = ct && OCTTransform(ct, 4 * EDGE, x, y, NULL);
+  if (ct)
+    OCTDestroyCoordinateTransformation(ct);
+  if (!ok)
+    return -1;
+  merc[0] = merc[2] = x[0];
+  merc[1] = merc[3] = y[0];
+  for (int k = 1; k < 4 * EDGE; k++) {
+    merc[0] = fmin(merc[0], x[k]);
+    merc[1] = fmin(merc[1], y[k]);
+    merc[2] = fmax(merc[2], x[k]);
+    merc[3] = fmax(merc[3], y[k]);
+  }
+  return 0;
+}
+
+static void MercatorToLatLon(double mx, double my, double *lat, double *lon) {
+  *lon = mx / MERCATOR_RADIUS * 180.0 / M_PI;
+  *lat = (2.0 * atan(exp(my / MERCATOR_RADIUS)) - M_PI / 2) * 180.0 / M_PI;
+}
+
+static int WriteViewers(const char *dir, const double merc[4], int minZoom,
+                        int maxZoom) {
+  double south, west, north, east;
+  MercatorToLatLon(merc[0], merc[1], &south, &west);
+  MercatorToLatLon(merc[2], merc[3], &north, &east);
+  size_t len = strlen(dir) + 32;
+  char *path = (char *)malloc(len);
+  if (!path)
+    return -1;
+  int rc = 0;
+
+  snprintf(path, len, "%s/leaflet.html", dir);
+  FILE *fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp,
+            "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+            "<title>FloodSim</title>\n"
+            "<link rel=\"stylesheet\" "
+            "href=\"https://unpkg.com/leaflet@1.9.4/dist/leaflet.css\">\n"
+            "<script "
+            "src=\"https://unpkg.com/leaflet@1.9.4/dist/leaflet.js\"></script>\n"
+            "<style>html, body, #map { height: 100%%; margin: 0; }</style>\n"
+            "</head>\n<body>\n<div id=\"map\"></div>\n<script>\n"
+            "var bounds = L.latLngBounds([%.8f, %.8f], [%.8f, %.8f]);\n"
+            "var map = L.map('map').fitBounds(bounds);\n"
+            "L.tileLayer('https://tile.openstreetmap.org/{z}/{x}/{y}.png', {\n"
+            "  maxZoom: 19, attribution: '&copy; OpenStreetMap contributors'\n"
+            "}).addTo(map);\n"
+            "L.tileLayer('./{z}/{x}/{y}.png', {\n"
+            "  minZoom: %d, maxNativeZoom: %d, maxZoom: 19, bounds: bounds\n"
+            "}).addTo(map);\n"
+            "</script>\n</body>\n</html>\n",
+            south, west, north, east, minZoom, maxZoom);
+    rc |= fclose(fp) != 0 ? -1 : 0;
+  } else {
+    rc = -1;
+  }
+
+  snprintf(path, len, "%s/openlayers.html", dir);
+  fp = fopen(path, "w");
+  if (fp) {
+    fprintf(fp,
+            "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+            "<title>FloodSim</title>\n"
+            "<link rel=\"stylesheet\" "
+            "href=\"https://cdn.jsdelivr.net/npm/ol@v7.5.2/ol.css\">\n"
+            "<script "
+            "src=\"https://cdn.jsdelivr.net/npm/ol@v7.5.2/dist/ol.js\">"
+            "</script>\n"
+            "<style>html, body, #map { height: 100%%; margin: 0; }</style>\n"
+            "</head>\n<body>\n<div id=\"map\"></div>\n<script>\n"
+            "var extent = [%.3f, %.3f, %.3f, %.3f];\n"
+            "var map = new ol.Map({\n"
+            "  target: 'map',\n"
+            "  layers: [\n"
+            "    new ol.layer.Tile({ source: new ol.source.OSM() }),\n"
+            "    new ol.layer.Tile({\n"
+            "      extent: extent,\n"
+            "      source: new ol.source.XYZ({ url: './{z}/{x}/{y}.png',\n"
+            "        minZoom: %d, maxZoom: %d })\n"
+            "    })\n"
+            "  ],\n"
+            "  view: new ol.View()\n"
+            "});\n"
+            "map.getView().fit(extent);\n"
+            "</script>\n</body>\n</html>\n",
+            merc[0], merc[1], merc[2], merc[3], minZoom, maxZoom);
+    rc |= fclose(fp) != 0 ? -1 : 0;
+  } else {
+    rc = -1;
+  }
+  free(path);
+  return rc;
+}
+
+static int RemoveEntry(const char *path, const struct stat *sb, int flag,
+                       struct FTW *ftw) {
+  (void)sb;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+static int RemoveTree(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0)
+    return errno == ENOENT ? 0 : -1;
+  return nftw(path, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int RenderLevels(TileRender *r, const double merc[4], int minZoom,
+                        int nThreads) {
+  int split = r->maxZoom - SUBTREE_LEVELS > minZoom
+                  ? r->maxZoom - SUBTREE_LEVELS
+                  : minZoom;
+  TileRange range = RangeAt(merc, split);
+  int nx = range.x1 - range.x0 + 1, ny = range.y1 - range.y0 + 1;
+  unsigned char **level =
+      (unsigned char **)calloc((size_t)nx * ny, sizeof(unsigned char *));
+  if (!level)
+    return -1;
+
+  // base zoom up to `split`, one subtree per task
+#pragma omp parallel num_threads(nThreads)
+  {
+    OGRCoordinateTransformationH ct =
+        NewTransform(r->mercatorSrs, r->rasterSrs);
+    if (!ct) {
+#pragma omp atomic
+      r->failed |= 1;
+    }
+#pragma omp for schedule(dynamic, 1)
+    for (int k = 0; k < nx * ny; k++)
+      if (ct)
+        level[k] = RenderSubtree(r, ct, split, range.x0 + k % nx,
+                                 range.y0 + k / nx);
+    if (ct)
+      OCTDestroyCoordinateTransformation(ct);
+  }
+
+  // the zoom levels above it, each from the level below
+  for (int z = split - 1; z >= minZoom; z--) {
+    TileRange up = RangeAt(merc, z);
+    int ux = up.x1 - up.x0 + 1, uy = up.y1 - up.y0 + 1;
+    unsigned char **parent =
+        (unsigned char **)calloc((size_t)ux * uy, sizeof(unsigned char *));
+    if (!parent) {
+      r->failed = 1;
+      break;
+    }
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nThreads)
+    for (int k = 0; k < ux * uy; k++) {
+      int x = up.x0 + k % ux, y = up.y0 + k / ux;
+      unsigned char *child[4];
+      int any = 0;
+      for (int c = 0; c < 4; c++) {
+        int cx = 2 * x + c % 2 - range.x0, cy = 2 * y + c / 2 - range.y0;
+        child[c] = cx >= 0 && cx < nx && cy >= 0 && cy < ny
+                       ? level[(size_t)cy * nx + cx]
+                       : NULL;
+        any |= child[c] != NULL;
+      }
+      if (any) {
+        parent[k] = Downsample(child);
+        if (parent[k])
+          SaveTile(r, z, x, y, parent[k]);
+      }
+    }
+    for (int k = 0; k < nx * ny; k++)
+      free(level[k]);
+    free(level);
+    level = parent;
+    range = up;
+    nx = ux;
+    ny = uy;
+  }
+  for (int k = 0; k < nx * ny; k++)
+    free(level[k]);
+  free(level);
+  return r->failed ? -1 : 0;
+}
+
+int RenderTiles(const char *dir, const unsigned char *level, int nXSize,
+                int nYSize, const double geoTransform[6],
+                const char *projection, int minZoom, int maxZoom,
+                const char *colormapFile, int nThreads, char *err,
+                size_t errSize) {
+  struct timespec ts0;
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+#ifdef _OPENMP
+  if (nThreads <= 0)
+    nThreads = omp_get_max_threads();
+#else
+  nThreads = 1;
+#endif
+  if (minZoom < 0 || maxZoom > 24 || minZoom > maxZoom)
+    return Fail(err, errSize, "Failed: invalid tile zoom range %d-%d",
+                minZoom, maxZoom);
+  if (!projection || !projection[0])
+    return Fail(err, errSize,
+                "Failed: the DEM has no coordinate system, cannot tile");
+
+  TileRender r;
+  memset(&r, 0, sizeof(r));
+  r.level = level;
+  r.nXSize = nXSize;
+  r.nYSize = nYSize;
+  r.maxZoom = maxZoom;
+  if (!GDALInvGeoTransform((double *)geoTransform, r.inv))
+    return Fail(err, errSize, "Failed: DEM geotransform is not invertible");
+  if (LoadColormap(colormapFile, r.lut) != 0)
+    return Fail(err, errSize, "Failed: to read colour map %s", colormapFile);
+
+  r.rasterSrs = OSRNewSpatialReference(NULL);
+  r.mercatorSrs = OSRNewSpatialReference(NULL);
+  char *wkt = (char *)projection;
+  int rc = 0;
+  if (OSRImportFromWkt(r.rasterSrs, &wkt) != OGRERR_NONE ||
+      OSRImportFromEPSG(r.mercatorSrs, 3857) != OGRERR_NONE) {
+    rc = Fail(err, errSize, "Failed: to read the DEM coordinate system");
+  } else {
+#if GDAL_VERSION_NUM >= 3000000
+    OSRSetAxisMappingStrategy(r.rasterSrs, OAMS_TRADITIONAL_GIS_ORDER);
+    OSRSetAxisMappingStrategy(r.mercatorSrs, OAMS_TRADITIONAL_GIS_ORDER);
+#endif
+  }
+
+  double merc[4];
+  if (rc == 0 && MercatorBounds(&r, geoTransform, merc) != 0)
+    rc = Fail(err, errSize, "Failed: to transform the DEM extent to EPSG:3857");
+  if (rc == 0 && BuildWetSummary(&r) != 0)
+    rc = Fail(err, errSize, "Failed: Memory allocation failed");
+
+  // render next to the target, then swap it in
+  size_t len = strlen(dir) + 16;
+  char *tmpDir = (char *)malloc(len);
+  if (rc == 0 && tmpDir) {
+    snprintf(tmpDir, len, "%s.tmp-XXXXXX", dir);
+    if (!mkdtemp(tmpDir))
+      rc = Fail(err, errSize, "Failed: to create %s: %s", tmpDir,
+                strerror(errno));
+  } else if (rc == 0) {
+    rc = Fail(err, errSize, "Failed: Memory allocation failed");
+  }
+  if (rc == 0) {
+    chmod(tmpDir, 0755);
+    r.dir = tmpDir;
+    if (RenderLevels(&r, merc, minZoom, nThreads) != 0 ||
+        WriteViewers(tmpDir, merc, minZoom, maxZoom) != 0)
+      rc = Fail(err, errSize, "Failed: to write tiles in %s", tmpDir);
+    else if (RemoveTree(dir) != 0 || rename(tmpDir, dir) != 0)
+      rc = Fail(err, errSize, "Failed: to replace %s: %s", dir,
+                strerror(errno));
+    if (rc != 0)
+      RemoveTree(tmpDir);
+  }
+  if (rc == 0) {
+    struct timespec ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    printf("# Tiles: %d written to %s (zoom %d-%d) in %.2f s\n", r.written,
+           dir, minZoom, maxZoom,
+           (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) * 1e-9);
+  }
+
+  free(tmpDir);
+  free(r.wetSum);
+  OSRDestroySpatialReference(r.rasterSrs);
+  OSRDestroySpatialReference(r.mercatorSrs);
+  return rc;
+}
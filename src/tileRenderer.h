@@ -0,0 +1,29 @@
+#ifndef tileRenderer
+#define tileRenderer
+
+#include <stddef.h>
+
+// XYZ PNG tiles ({z}/{x}/{y}.png, 256 x 256, EPSG:3857) rendered straight
+// from the smoothed depth grid, replacing the gdal_translate -scale 0 3 /
+// gdaldem color-relief / gdal2tiles.py pipeline (still available as
+// tiles.sh). Depth is first quantized like gdal_translate -ot Byte
+// -scale 0 3, then coloured with a gdaldem colour file (colormap/jet.clr);
+// base tiles sample it bilinearly, lower zooms are 2 x 2 averages of
+// their children. Tiles without any wet cell are not written. The
+// directory also gets leaflet.html and openlayers.html viewers.
+#define TILE_SIZE 256
+#define TILE_DEPTH_MAX 3.0f // depth (m) that maps to 255
+
+// depth (m) to the 0..255 level the colour ramp is indexed with
+void TileQuantizeRows(const float *depth, unsigned char *level, size_t n);
+
+// level: nXSize x nYSize output of TileQuantizeRows. The directory is
+// built next to dir and swapped in at the end, so stale tiles of an older
+// run never survive. nThreads <= 0 means all cores. Errors are reported as
+// "Failed: ..." in err.
+int RenderTiles(const char *dir, const unsigned char *level, int nXSize,
+                int nYSize, const double geoTransform[6],
+                const char *projection, int minZoom, int maxZoom,
+                const char *colormapFile, int nThreads, char *err,
+                size_t errSize);
+#endif
@@ -2,76 +2,129 @@
 #include "ogr_srs_api.h"
 #include "ogr_api.h"
 #include "cpl_conv.h"
+#include "transformation.h"
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
-// Konversi lat/lon (EPSG:4326) → pixel coordinate (col,row)
-int LatLonToPixel(GDALDatasetH hDataset, double lat, double lon, int *col, int *row)
+int GeoLocatorCreate(GeoLocator *loc, const double geoTransform[6], const char *wkt)
 {
-    if (hDataset == NULL || row == NULL || col == NULL)
+    loc->transform = NULL;
+    if (!GDALInvGeoTransform((double *)geoTransform, loc->invGeoTransform))
     {
+        fprintf(stderr, "GeoTransform raster tidak bisa dibalik.\n");
         return -1;
     }
 
-    // --- Ambil GeoTransform raster ---
-    double geoTransform[6];
-    if (GDALGetGeoTransform(hDataset, geoTransform) != CE_None)
+    if (wkt == NULL || strlen(wkt) == 0)
     {
-        fprintf(stderr, "Tidak bisa ambil GeoTransform.\n");
-        return -1;
+        fprintf(stderr, "Warning: Raster tidak punya sistem koordinat, asumsikan input sudah sesuai raster CRS.\n");
+        return 0;
     }
-    for (int i = 0; i < 6; i++)
+
+    // Raster punya SRS → transformasi dari EPSG:4326, urutan sumbu lon/lat
+    // (x/y) di kedua sisi, apa pun urutan sumbu resmi SRS-nya
+    OGRSpatialReferenceH hRasterSRS = OSRNewSpatialReference(NULL);
+    char *projRef = (char *)wkt;
+    if (OSRImportFromWkt(hRasterSRS, &projRef) == OGRERR_NONE)
     {
-        printf("%f\n", geoTransform[i]);
-    }
+        OGRSpatialReferenceH hLatLonSRS = OSRNewSpatialReference(NULL);
+        OSRImportFromEPSG(hLatLonSRS, 4326);
+#if GDAL_VERSION_NUM >= 3000000
+        OSRSetAxisMappingStrategy(hLatLonSRS, OAMS_TRADITIONAL_GIS_ORDER);
+        OSRSetAxisMappingStrategy(hRasterSRS, OAMS_TRADITIONAL_GIS_ORDER);
+#endif
 
-    // --- Ambil SRS raster ---
-    const char *projRef = GDALGetProjectionRef(hDataset);
-    printf(projRef);
-    double x = lon; // perhatikan: lon = X, lat = Y
-    double y = lat;
+        loc->transform = OCTNewCoordinateTransformation(hLatLonSRS, hRasterSRS);
+        if (loc->transform == NULL)
+        {
+            fprintf(stderr, "Transformasi koordinat gagal dibuat, pakai koordinat apa adanya.\n");
+        }
+        OSRDestroySpatialReference(hLatLonSRS);
+    }
+    else
+    {
+        fprintf(stderr, "Raster punya SRS tapi gagal dibaca, pakai koordinat apa adanya.\n");
+    }
+    OSRDestroySpatialReference(hRasterSRS);
+    return 0;
+}
 
-    if (projRef != NULL && strlen(projRef) > 0)
+void GeoLocatorDestroy(GeoLocator *loc)
+{
+    if (loc->transform != NULL)
     {
-        // Raster punya SRS → transformasi dari EPSG:4326
-        OGRSpatialReferenceH hRasterSRS = OSRNewSpatialReference(NULL);
-        if (OSRImportFromWkt(hRasterSRS, (char **)&projRef) == OGRERR_NONE)
-        {
-            OGRSpatialReferenceH hLatLonSRS = OSRNewSpatialReference(NULL);
-            OSRImportFromEPSG(hLatLonSRS, 4326);
+        OCTDestroyCoordinateTransformation(loc->transform);
+    }
+    loc->transform = NULL;
+}
 
-            OGRCoordinateTransformationH hTransform =
-                OCTNewCoordinateTransformation(hLatLonSRS, hRasterSRS);
-            printf("%f,%f\n", x, y);
-            if (hTransform != NULL)
-            {
-                if (!OCTTransform(hTransform, 1, &y, &x, NULL))
-                {
-                    fprintf(stderr, "Transformasi koordinat gagal.\n");
-                }
-                OCTDestroyCoordinateTransformation(hTransform);
-            }
+int LatLonToPixels(const GeoLocator *loc, int n, const double *lat, const double *lon, int *col, int *row)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+    // perhatikan: lon = X, lat = Y
+    double *x = (double *)CPLMalloc(sizeof(double) * 2 * (size_t)n);
+    double *y = x + n;
+    int *ok = (int *)CPLMalloc(sizeof(int) * (size_t)n);
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = lon[i];
+        y[i] = lat[i];
+        ok[i] = 1;
+    }
+    // satu panggilan untuk semua titik; ok[] per titik
+    if (loc->transform != NULL)
+    {
+        OCTTransformEx(loc->transform, n, x, y, NULL, ok);
+    }
 
-            OSRDestroySpatialReference(hLatLonSRS);
-        }
-        else
+    // --- Hitung pixel/line dari GeoTransform terbalik ---
+    const double *inv = loc->invGeoTransform;
+    int located = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!ok[i] || !isfinite(x[i]) || !isfinite(y[i]))
         {
-            fprintf(stderr, "Raster punya SRS tapi gagal dibaca, pakai koordinat apa adanya.\n");
+            col[i] = -1;
+            row[i] = -1;
+            continue;
         }
-
-        OSRDestroySpatialReference(hRasterSRS);
+        double px = inv[0] + x[i] * inv[1] + y[i] * inv[2];
+        double py = inv[3] + x[i] * inv[4] + y[i] * inv[5];
+        col[i] = (int)floor(px + 0.5);
+        row[i] = (int)floor(py + 0.5);
+        located++;
     }
-    else
+    CPLFree(ok);
+    CPLFree(x);
+    return located;
+}
+
+// Konversi lat/lon (EPSG:4326) → pixel coordinate (col,row)
+int LatLonToPixel(GDALDatasetH hDataset, double lat, double lon, int *col, int *row)
+{
+    if (hDataset == NULL || row == NULL || col == NULL)
     {
-        fprintf(stderr, "Warning: Raster tidak punya sistem koordinat, asumsikan input sudah sesuai raster CRS.\n");
+        return -1;
     }
-    printf("%f,%f\n", x, y);
 
-    // --- Hitung pixel/line dari GeoTransform ---
-    double px = (y - geoTransform[0]) / geoTransform[1];
-    double py = (x - geoTransform[3]) / geoTransform[5];
+    // --- Ambil GeoTransform raster ---
+    double geoTransform[6];
+    if (GDALGetGeoTransform(hDataset, geoTransform) != CE_None)
+    {
+        fprintf(stderr, "Tidak bisa ambil GeoTransform.\n");
+        return -1;
+    }
 
-    *row = (int)floor(py + 0.5);
-    *col = (int)floor(px + 0.5);
-    return 0;
+    GeoLocator loc;
+    if (GeoLocatorCreate(&loc, geoTransform, GDALGetProjectionRef(hDataset)) != 0)
+    {
+        return -1;
+    }
+    int located = LatLonToPixels(&loc, 1, &lat, &lon, col, row);
+    GeoLocatorDestroy(&loc);
+    return located == 1 ? 0 : -1;
 }
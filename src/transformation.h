@@ -1,6 +1,24 @@
 #ifndef transformation
 #define transformation
 #include "gdal.h"
+#include "ogr_srs_api.h"
 
+// Konversi lat/lon (EPSG:4326) -> pixel raster yang dibangun sekali:
+// SRS dan transformasi koordinat dibuat di GeoLocatorCreate, lalu dipakai
+// untuk titik sebanyak apa pun. Satu GeoLocator jangan dipakai dua thread
+// bersamaan (transformasi OGR tidak thread-safe).
+typedef struct
+{
+    double invGeoTransform[6];
+    OGRCoordinateTransformationH transform; // NULL: koordinat dipakai apa adanya
+} GeoLocator;
+
+// geoTransform dan WKT raster (WKT kosong/NULL = raster tanpa SRS)
+int GeoLocatorCreate(GeoLocator *loc, const double geoTransform[6], const char *wkt);
+void GeoLocatorDestroy(GeoLocator *loc);
+// n titik sekaligus; titik yang gagal ditransformasi mendapat col = row = -1.
+// Mengembalikan jumlah titik yang berhasil.
+int LatLonToPixels(const GeoLocator *loc, int n, const double *lat, const double *lon, int *col, int *row);
+// satu titik, transformasi dibangun ulang tiap panggilan
 int LatLonToPixel(GDALDatasetH hDataset, double lat, double lon, int *col, int *row);
-#endif
\ No newline at end of file
+#endif
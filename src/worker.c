@@ -0,0 +1,187 @@
+// worker.c - long-running simulation worker fed with JSON jobs
+#include "worker.h"
+#include "json.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void WriteId(FILE *reply, const JsonValue *id) {
+  if (id && id->type == JSON_NUMBER)
+    fprintf(reply, "%.17g", id->number);
+  else if (id && id->type == JSON_STRING)
+    JsonWriteString(reply, id->string);
+  else
+    fputs("null", reply);
+}
+
+static void HandleJob(Terrain *t, SimState *st, const SimOptions *opt,
+                      const char *line, FILE *reply) {
+  char err[1024] = "";
+  JsonValue *job = JsonParse(line, err, sizeof(err));
+  if (!job) {
+    char msg[1100];
+    snprintf(msg, sizeof(msg), "Failed: invalid job JSON (%s)", err);
+    fputs("{\"id\":null,\"status\":\"error\",\"message\":", reply);
+    JsonWriteString(reply, msg);
+    fputs("}\n", reply);
+    fflush(reply);
+    return;
+  }
+
+  Scenario sc;
+  SimTimings tm = {0};
+  int rc = ScenarioFromJson(job, &sc, err, sizeof(err));
+  if (rc == 0) {
+    SimOptions jobOpt = *opt;
+    jobOpt.binaryLog = sc.binaryLog;
+    rc = RunScenario(t, st, &jobOpt, &sc, &tm, err, sizeof(err));
+  }
+  fflush(stdout);
+
+  fputs("{\"id\":", reply);
+  WriteId(reply, JsonGet(job, "id"));
+  if (rc == 0) {
+    fputs(",\"status\":\"success\",\"output_tif\":", reply);
+    JsonWriteString(reply, sc.output);
+    fputs(",\"pump_log\":", reply);
+    JsonWriteString(reply, sc.pumpLog);
+    if (sc.statsFile) {
+      fputs(",\"stats\":", reply);
+      JsonWriteString(reply, sc.statsFile);
+    }
+    if (sc.gaugeOutput && sc.gaugePoints.n > 0) {
+      fputs(",\"gauge_output\":", reply);
+      JsonWriteString(reply, sc.gaugeOutput);
+    }
+    fprintf(reply,
+            ",\"sweeps\":%lld,\"timings_ms\":{\"setup\":%.3f,"
+            "\"simulate\":%.3f,\"output\":%.3f,\"total\":%.3f",
+            tm.sweeps, tm.setup * 1e3, tm.simulate * 1e3, tm.output * 1e3,
+            tm.total * 1e3);
+    // the finer split; load is the worker's one-off terrain load
+    for (int k = STATS_RAIN; k < STATS_PHASES; k++)
+      fprintf(reply, ",\"%s\":%.3f", StatsPhaseName(k), tm.phase[k] * 1e3);
+    fputs("}}\n", reply);
+  } else {
+    fputs(",\"status\":\"error\",\"message\":", reply);
+    JsonWriteString(reply, err);
+    fputs("}\n", reply);
+  }
+  fflush(reply);
+  ScenarioFree(&sc);
+  JsonFree(job);
+}
+
+// answers every non-empty line of `in` until EOF
+static void ServeStream(Terrain *t, SimState *st, const SimOptions *opt,
+                        FILE *in, FILE *reply) {
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  while ((n = getline(&line, &cap, in)) > 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+    HandleJob(t, st, opt, line, reply);
+  }
+  free(line);
+}
+
+int WorkerServe(const char *demFile, const char *lahanFile,
+                const SimOptions *opt, const char *socketPath) {
+  FILE *reply = NULL;
+  if (!socketPath) {
+    // replies own stdout; the simulation's progress lines go to stderr
+    int replyFd = dup(STDOUT_FILENO);
+    reply = replyFd >= 0 ? fdopen(replyFd, "w") : NULL;
+    if (!reply) {
+      perror("Failed: worker stdout");
+      return 1;
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  char err[1024] = "";
+  double t0 = NowSeconds();
+  Terrain terrain;
+  SimState state;
+  int rc = TerrainLoad(&terrain, demFile, lahanFile, opt, err, sizeof(err));
+  if (rc == 0 && SimStateCreate(&state, &terrain, opt, opt->nThreads) != 0) {
+    TerrainFree(&terrain, opt);
+    snprintf(err, sizeof(err), "Failed: Memory allocation failed");
+    rc = 1;
+  }
+  if (rc != 0) {
+    fprintf(stderr, "%s\n", err);
+    if (reply) {
+      fputs("{\"status\":\"error\",\"message\":", reply);
+      JsonWriteString(reply, err);
+      fputs("}\n", reply);
+      fclose(reply);
+    }
+    return 1;
+  }
+  double loadMs = (NowSeconds() - t0) * 1e3;
+  printf("# Threads: %d, SIMD: %s\n", FlowThreadCount(state.flow),
+         FlowSimdName());
+
+  if (!socketPath) {
+    fprintf(reply, "{\"status\":\"ready\",\"load_ms\":%.3f}\n", loadMs);
+    fflush(reply);
+    ServeStream(&terrain, &state, opt, stdin, reply);
+    fclose(reply);
+    SimStateFree(&state);
+    TerrainFree(&terrain, opt);
+    return 0;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  int fd = -1;
+  if (strlen(socketPath) < sizeof(addr.sun_path)) {
+    strcpy(addr.sun_path, socketPath);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+  unlink(socketPath);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    fprintf(stderr, "Failed: to listen on %s\n", socketPath);
+    if (fd >= 0)
+      close(fd);
+    SimStateFree(&state);
+    TerrainFree(&terrain, opt);
+    return 1;
+  }
+  // a client that hangs up must not take the worker down with it
+  signal(SIGPIPE, SIG_IGN);
+  printf("# Worker ready on %s (terrain loaded in %.0f ms)\n", socketPath,
+         loadMs);
+  fflush(stdout);
+
+  // one connection at a time; each may send any number of jobs
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0)
+      continue;
+    int connOut = dup(conn);
+    FILE *in = fdopen(conn, "r");
+    FILE *out = connOut >= 0 ? fdopen(connOut, "w") : NULL;
+    if (in && out)
+      ServeStream(&terrain, &state, opt, in, out);
+    if (in)
+      fclose(in);
+    else
+      close(conn);
+    if (out)
+      fclose(out);
+    else if (connOut >= 0)
+      close(connOut);
+  }
+}
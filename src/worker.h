@@ -0,0 +1,30 @@
+#ifndef worker
+#define worker
+
+#include "simulation.h"
+
+// Persistent worker: the terrain is loaded once (announced with a
+// {"status":"ready","load_ms":..} line), then scenario jobs arrive
+// as one JSON object per line, with the same fields as the POST /simulate
+// body of server.js:
+//
+//   {"id": 1, "output_tif": "result/a.tif", "pump_log": "result/a.csv",
+//    "rain_timeseries": [{"mm": 2.5, "interval": 15, "iter": 5}, ...],
+//    "pumps": [{"in_lat": .., "in_lon": .., "out_lat": .., "out_lon": ..,
+//               "capacity": .., "threshold": .., "radius": ..}, ...],
+//    "binary_log": false, "stats": "result/a.stats.ndjson",
+//    "gauges": [{"name": "G1", "lat": .., "lon": ..}, ...],
+//    "gauge_output": "result/a.gauges.csv", "estimate": false}
+//
+// Each job is answered by one JSON line with "id", "status" ("success" or
+// "error"), the output paths or a "Failed: ..." message, the number of
+// flow "sweeps" run and per-phase "timings_ms" (setup / simulate / output
+// / total, and the finer split of stats.h). With "stats" the NDJSON run
+// statistics are written to that file and its path is echoed back, and
+// likewise the gauge depths with "gauge_output" (see gauges.h);
+// "estimate" answers with the bathtub estimate of depression.h. Jobs
+// are read from stdin (replies on stdout; progress output is moved to
+// stderr) or, with socketPath, from connections on a Unix socket.
+int WorkerServe(const char *demFile, const char *lahanFile,
+                const SimOptions *opt, const char *socketPath);
+#endif
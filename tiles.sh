@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Membuat XYZ tiles dari GeoTIFF hasil simulasi
+# Contoh: ./tiles.sh result/result.tif result/tiles
+if [ "$#" -lt 2 ]; then
+    echo "Usage: $0 <output.tif> <output_tiles>"
+    exit 1
+fi
+
+OUTPUT_TIF="$1"
+OUTPUT_TILES="$2"
+
+# file sementara per pemanggilan, supaya beberapa worker bisa tiling bersamaan
+TMP_DIR=$(mktemp -d result/tiles-XXXXXX)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+echo "Mulai Tiling"
+
+gdal_translate -of VRT -ot Byte -scale 0 3 "$OUTPUT_TIF" "$TMP_DIR/result.vrt" || exit 1
+gdaldem color-relief "$TMP_DIR/result.vrt" colormap/jet.clr "$TMP_DIR/output.tif" -alpha || exit 1
+
+rm -rf "$OUTPUT_TILES"
+gdal2tiles.py -z 12-17 --resampling=bilinear --xyz "$TMP_DIR/output.tif" "$OUTPUT_TILES" || exit 1
+
+echo "Selesai"
@@ -0,0 +1,170 @@
+import { spawn } from "child_process";
+import { stat } from "fs/promises";
+import readline from "readline";
+
+// Pool of `./main --worker` processes. Each worker loads DEM + landuse once,
+// then takes one job at a time as a JSON line on stdin and answers with one
+// JSON line on stdout (see src/worker.h). Jobs wait in a FIFO queue until a
+// worker is free; a worker that dies is restarted with a growing delay.
+// With maxQueue set, jobs beyond that many waiting are rejected with
+// code "EQUEUEFULL" instead of queueing without bound.
+//
+// inputs are the files a worker reads once at spawn (binary, terrain).
+// Each worker keeps the size + mtime they had when it started; identity()
+// gives the current one and retires workers started from older files, and
+// a job only runs on a worker that loaded the identity it was queued with.
+export class WorkerPool {
+    constructor({ size, command, args, cwd, inputs = [], maxQueue = Infinity }) {
+        this.command = command;
+        this.args = args;
+        this.cwd = cwd;
+        this.inputs = inputs;
+        this.maxQueue = maxQueue;
+        this.workers = [];
+        this.queue = [];
+        this.nextId = 1;
+        this.current = null;
+        for (let slot = 0; slot < size; slot++) {
+            this.start(slot, 0);
+        }
+    }
+
+    async stamp() {
+        const inputs = [];
+        for (const file of this.inputs) {
+            try {
+                const s = await stat(file);
+                inputs.push([file, s.size, s.mtimeMs]);
+            } catch {
+                inputs.push([file, null]);
+            }
+        }
+        return JSON.stringify(inputs);
+    }
+
+    // identity of the inputs as they are now; workers that loaded other
+    // ones are restarted, idle ones at once and busy ones after their job
+    async identity() {
+        const current = await this.stamp();
+        if (current !== this.current) {
+            this.current = current;
+            for (const worker of this.workers) {
+                if (worker && worker.stamp !== current) this.retire(worker);
+            }
+            this.dispatch();
+        }
+        return current;
+    }
+
+    retire(worker) {
+        worker.retiring = true;
+        if (!worker.job) worker.proc.kill();
+    }
+
+    async start(slot, restarts) {
+        const stamp = await this.stamp();
+        const proc = spawn(this.command, this.args, {
+            cwd: this.cwd,
+            stdio: ["pipe", "pipe", "inherit"],
+        });
+        const worker = { slot, proc, stamp, ready: false, job: null, restarts, retiring: false };
+        this.workers[slot] = worker;
+
+        readline.createInterface({ input: proc.stdout })
+            .on("line", (line) => this.onLine(worker, line));
+        proc.on("exit", (code, signal) => this.onExit(worker, signal || code));
+        proc.on("error", (err) => console.error(`Worker ${slot}: ${err.message}`));
+        // stdin error (worker sudah mati) ditangani lewat event exit
+        proc.stdin.on("error", () => {});
+    }
+
+    onLine(worker, line) {
+        let msg;
+        try {
+            msg = JSON.parse(line);
+        } catch {
+            console.error(`Worker ${worker.slot}: invalid reply: ${line}`);
+            return;
+        }
+
+        if (!worker.ready) {
+            if (msg.status === "ready") {
+                // inputs replaced while it was loading: which version it
+                // read is unknown
+                this.stamp().then((stamp) => {
+                    if (stamp !== worker.stamp || worker.retiring) return this.retire(worker);
+                    worker.ready = true;
+                    worker.restarts = 0;
+                    console.log(`Worker ${worker.slot} ready (terrain loaded in ${msg.load_ms} ms)`);
+                    this.dispatch();
+                });
+            } else {
+                console.error(`Worker ${worker.slot}: ${msg.message}`);
+            }
+            return;
+        }
+
+        const job = worker.job;
+        worker.job = null;
+        if (job) {
+            job.resolve(msg);
+        }
+        if (worker.retiring) {
+            worker.ready = false;
+            worker.proc.kill();
+        }
+        this.dispatch();
+    }
+
+    onExit(worker, reason) {
+        worker.ready = false;
+        if (worker.job) {
+            worker.job.reject(new Error(`worker ${worker.slot} exited (${reason})`));
+            worker.job = null;
+        }
+        if (worker.retiring) {
+            console.log(`Worker ${worker.slot} restarting: its inputs changed`);
+            this.start(worker.slot, 0);
+            return;
+        }
+        const delay = Math.min(30000, 1000 * 2 ** worker.restarts);
+        console.error(`Worker ${worker.slot} exited (${reason}), restarting in ${delay} ms`);
+        setTimeout(() => this.start(worker.slot, worker.restarts + 1), delay);
+    }
+
+    // job: { output_tif, pump_log, tiles_dir, rain_timeseries, pumps };
+    // identity: from identity(), the inputs the result is keyed on
+    run(job, identity) {
+        return new Promise((resolve, reject) => {
+            if (this.queue.length >= this.maxQueue) {
+                const err = new Error(`simulation queue is full (${this.queue.length} waiting)`);
+                err.code = "EQUEUEFULL";
+                return reject(err);
+            }
+            this.queue.push({ payload: { ...job, id: this.nextId++ }, identity, resolve, reject });
+            this.dispatch();
+        });
+    }
+
+    dispatch() {
+        // queued under inputs that have since changed: no worker will run
+        // them on what they were keyed on
+        this.queue = this.queue.filter((entry) => {
+            if (entry.identity === this.current) return true;
+            const err = new Error("simulation inputs changed while the job was queued");
+            err.code = "EINPUTSCHANGED";
+            entry.reject(err);
+            return false;
+        });
+        for (const worker of this.workers) {
+            if (this.queue.length === 0) {
+                return;
+            }
+            if (worker && worker.ready && !worker.job && !worker.retiring &&
+                worker.stamp === this.current) {
+                worker.job = this.queue.shift();
+                worker.proc.stdin.write(JSON.stringify(worker.job.payload) + "\n");
+            }
+        }
+    }
+}